@@ -0,0 +1,244 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Fixed pool of packet buffers.
+ *
+ * All the buffers of a pool come from a single allocation made at startup,
+ * optionally on huge pages to spare TLB misses, and are recycled through a
+ * LIFO free list so that the most recently used (cache hot) buffer is
+ * handed out first. A frame is read after N2N_BUF_HEADROOM bytes, so that
+ * the headers can be prepended with n2n_buf_push() instead of copying the
+ * payload behind them. */
+
+#include "n2n.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#define N2N_HUGEPAGE_SIZE       (2 * 1024 * 1024)
+
+/* ************************************** */
+
+static void* buf_pool_mem_alloc(n2n_buf_pool_t *pool, size_t *size, int flags) {
+#ifndef WIN32
+  void *mem;
+
+#ifdef MAP_HUGETLB
+  if(flags & N2N_BUF_POOL_HUGEPAGES) {
+    size_t huge_size = (*size + N2N_HUGEPAGE_SIZE - 1) & ~((size_t)N2N_HUGEPAGE_SIZE - 1);
+
+    mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if(mem != MAP_FAILED) {
+      pool->hugepages = 1;
+      *size = huge_size;
+      return(mem);
+    }
+
+    traceEvent(TRACE_WARNING, "No huge pages available [%d]: %s, using normal pages",
+               errno, strerror(errno));
+  }
+#endif
+
+  mem = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return((mem == MAP_FAILED) ? NULL : mem);
+#else
+  return(calloc(1, *size));
+#endif
+}
+
+/* ************************************** */
+
+/** Allocate num_bufs buffers. With N2N_BUF_POOL_HUGEPAGES the memory is
+ *  rounded up to whole huge pages and all of it is used for buffers. With
+ *  N2N_BUF_POOL_SHARED the buffers can be allocated and released by any
+ *  thread.
+ *
+ *  @return 0 on success, -1 when out of memory
+ */
+int n2n_buf_pool_init(n2n_buf_pool_t *pool, size_t num_bufs, int flags) {
+  size_t size = num_bufs * sizeof(n2n_buf_t), i;
+
+  memset(pool, 0, sizeof(*pool));
+
+  if((pool->bufs = buf_pool_mem_alloc(pool, &size, flags)) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot allocate %u packet buffers", (unsigned int)num_bufs);
+    return(-1);
+  }
+
+  pool->mem_size = size;
+  pool->num_bufs = size / sizeof(n2n_buf_t);
+
+  /* Hand out the lowest addresses first */
+  for(i=pool->num_bufs; i>0; i--) {
+    n2n_buf_t *buf = &pool->bufs[i-1];
+
+    buf->pool = pool;
+    buf->next = pool->free_list;
+    pool->free_list = buf;
+  }
+
+  pool->num_free = pool->num_bufs;
+
+#ifndef WIN32
+  if(flags & N2N_BUF_POOL_SHARED) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->shared = 1;
+  }
+#endif
+
+  return(0);
+}
+
+/* ************************************** */
+
+void n2n_buf_pool_free(n2n_buf_pool_t *pool) {
+  if(pool->bufs == NULL)
+    return;
+
+  if(pool->num_free != pool->num_bufs)
+    traceEvent(TRACE_WARNING, "%u packet buffers still in use",
+               (unsigned int)(pool->num_bufs - pool->num_free));
+
+#ifndef WIN32
+  if(pool->shared)
+    pthread_mutex_destroy(&pool->lock);
+
+  munmap(pool->bufs, pool->mem_size);
+#else
+  free(pool->bufs);
+#endif
+
+  memset(pool, 0, sizeof(*pool));
+}
+
+/* ************************************** */
+
+/** @return an empty buffer, with the whole headroom available, or NULL when
+ *          all of them are in use */
+n2n_buf_t* n2n_buf_alloc(n2n_buf_pool_t *pool) {
+  n2n_buf_t *buf;
+
+#ifndef WIN32
+  if(pool->shared)
+    pthread_mutex_lock(&pool->lock);
+#endif
+
+  if((buf = pool->free_list) != NULL) {
+    pool->free_list = buf->next;
+    pool->num_free--;
+  }
+
+#ifndef WIN32
+  if(pool->shared)
+    pthread_mutex_unlock(&pool->lock);
+#endif
+
+  if(buf == NULL)
+    return(NULL);
+
+  buf->next = NULL;
+  buf->data = &buf->room[N2N_BUF_HEADROOM];
+  buf->len = 0;
+
+  return(buf);
+}
+
+/* ************************************** */
+
+/** Give the buffer back to its pool. NULL is ignored. */
+void n2n_buf_release(n2n_buf_t *buf) {
+  n2n_buf_pool_t *pool;
+
+  if(buf == NULL)
+    return;
+
+  pool = buf->pool;
+
+#ifndef WIN32
+  if(pool->shared)
+    pthread_mutex_lock(&pool->lock);
+#endif
+
+  buf->next = pool->free_list;
+  pool->free_list = buf;
+  pool->num_free++;
+
+#ifndef WIN32
+  if(pool->shared)
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/* ************************************** */
+
+/** Grow the data by len bytes at the front.
+ *
+ *  @return the new start of the data, or NULL when the headroom is too small
+ */
+uint8_t* n2n_buf_push(n2n_buf_t *buf, size_t len) {
+  if(n2n_buf_headroom(buf) < len)
+    return(NULL);
+
+  buf->data -= len;
+  buf->len += len;
+
+  return(buf->data);
+}
+
+/** Drop len bytes from the front of the data.
+ *
+ *  @return the new start of the data, or NULL when it is shorter than len
+ */
+uint8_t* n2n_buf_pull(n2n_buf_t *buf, size_t len) {
+  if(buf->len < len)
+    return(NULL);
+
+  buf->data += len;
+  buf->len -= len;
+
+  return(buf->data);
+}
+
+/** Grow the data by len bytes at the end.
+ *
+ *  @return the start of the added bytes, or NULL when the tailroom is too small
+ */
+uint8_t* n2n_buf_put(n2n_buf_t *buf, size_t len) {
+  uint8_t *tail = buf->data + buf->len;
+
+  if(n2n_buf_tailroom(buf) < len)
+    return(NULL);
+
+  buf->len += len;
+
+  return(tail);
+}
+
+/* ************************************** */
+
+size_t n2n_buf_headroom(const n2n_buf_t *buf) {
+  return(buf->data - buf->room);
+}
+
+size_t n2n_buf_tailroom(const n2n_buf_t *buf) {
+  return(&buf->room[N2N_BUF_ROOM] - (buf->data + buf->len));
+}
@@ -0,0 +1,927 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* ChaCha20-Poly1305 AEAD as specified by RFC 8439.
+ *
+ * The ChaCha20 key stream comes from the widest kernel the CPU supports:
+ * AVX2 computes 8 blocks at a time, SSE2 and NEON 4 blocks, each SIMD lane
+ * holding the same state word of a different block, and the portable code
+ * one block. The x86 kernels are compiled with target attributes and picked
+ * with __builtin_cpu_supports(), so a generic build still uses them;
+ * crypto_dispatch.c rebinds a narrower one if it measures it faster. The
+ * portable code only does byte loads and stores and runs on big endian
+ * routers as well. Poly1305 uses 26-bit limbs (as poly1305-donna-32), which
+ * suits the 32-bit CPUs this transform is meant for. */
+
+#include <string.h>
+#include "chacha20.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHACHA20_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define CHACHA20_NEON 1
+#include <arm_neon.h>
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#define CHACHA20_BLOCK_SIZE     64
+#define CHACHA20_MAX_BLOCKS     8       /* of the widest kernel */
+
+#define ROTL32(v, n)            (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define U8TO32_LE(p)                                                    \
+  (((uint32_t)(p)[0]) | ((uint32_t)(p)[1] << 8) |                       \
+   ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+#define U32TO8_LE(p, v)                                                 \
+  do {                                                                  \
+    (p)[0] = (uint8_t)(v); (p)[1] = (uint8_t)((v) >> 8);                \
+    (p)[2] = (uint8_t)((v) >> 16); (p)[3] = (uint8_t)((v) >> 24);       \
+  } while(0)
+
+#define U8TO64_LE(p)                                                    \
+  ((uint64_t)U8TO32_LE(p) | ((uint64_t)U8TO32_LE((p) + 4) << 32))
+
+#define U64TO8_LE(p, v)                                                 \
+  do {                                                                  \
+    U32TO8_LE(p, (uint32_t)(v)); U32TO8_LE((p) + 4, (uint32_t)((v) >> 32)); \
+  } while(0)
+
+/* Writes the key stream of num_blocks blocks. Without lanes they are
+ * consecutive, the block counter being state[12]; otherwise lanes[i] holds
+ * words 12-15 (counter and nonce) of block i, so that the blocks of several
+ * messages can share a call. */
+typedef void (*chacha20_blocks_f)(const uint32_t state[16], const uint32_t (*lanes)[4], uint8_t *ks);
+
+typedef struct chacha20_impl {
+  const char *          name;
+  unsigned int          num_blocks;
+  chacha20_blocks_f     blocks;
+} chacha20_impl_t;
+
+/* ************************************** */
+
+#define QUARTERROUND(a, b, c, d)                                \
+  a += b; d ^= a; d = ROTL32(d, 16);                            \
+  c += d; b ^= c; b = ROTL32(b, 12);                            \
+  a += b; d ^= a; d = ROTL32(d, 8);                             \
+  c += d; b ^= c; b = ROTL32(b, 7)
+
+static void chacha20_block_portable(const uint32_t state[16], const uint32_t (*lanes)[4], uint8_t *ks) {
+  uint32_t s[16], x[16];
+  int i;
+
+  memcpy(s, state, sizeof(s));
+  if(lanes)
+    memcpy(&s[12], lanes[0], sizeof(lanes[0]));
+
+  memcpy(x, s, sizeof(x));
+
+  for(i=0; i<10; i++) {
+    QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+    QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+    QUARTERROUND(x[2], x[6], x[10], x[14]);
+    QUARTERROUND(x[3], x[7], x[11], x[15]);
+    QUARTERROUND(x[0], x[5], x[10], x[15]);
+    QUARTERROUND(x[1], x[6], x[11], x[12]);
+    QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+    QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+  }
+
+  for(i=0; i<16; i++) {
+    uint32_t v = x[i] + s[i];
+
+    U32TO8_LE(ks + 4*i, v);
+  }
+}
+
+/* ************************************** */
+
+/* The SIMD kernels share this layout: v[i] holds word i of each block and
+ * the rounds are the portable ones on vectors. VADD, VXOR and VROTL are
+ * defined by each kernel, as are VROTL16 and VROTL8, which can mostly be
+ * done with a single byte or halfword shuffle. */
+#define VQUARTERROUND(a, b, c, d)                                       \
+  a = VADD(a, b); d = VXOR(d, a); d = VROTL16(d);                       \
+  c = VADD(c, d); b = VXOR(b, c); b = VROTL(b, 12);                     \
+  a = VADD(a, b); d = VXOR(d, a); d = VROTL8(d);                        \
+  c = VADD(c, d); b = VXOR(b, c); b = VROTL(b, 7)
+
+#define VDOUBLEROUND(v)                                                 \
+  VQUARTERROUND(v[0], v[4], v[ 8], v[12]);                              \
+  VQUARTERROUND(v[1], v[5], v[ 9], v[13]);                              \
+  VQUARTERROUND(v[2], v[6], v[10], v[14]);                              \
+  VQUARTERROUND(v[3], v[7], v[11], v[15]);                              \
+  VQUARTERROUND(v[0], v[5], v[10], v[15]);                              \
+  VQUARTERROUND(v[1], v[6], v[11], v[12]);                              \
+  VQUARTERROUND(v[2], v[7], v[ 8], v[13]);                              \
+  VQUARTERROUND(v[3], v[4], v[ 9], v[14])
+
+#ifdef CHACHA20_X86
+
+#define VADD(a, b)      _mm_add_epi32(a, b)
+#define VXOR(a, b)      _mm_xor_si128(a, b)
+#define VROTL(a, n)     _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+#define VROTL16(a)      _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, 0xb1), 0xb1)
+#define VROTL8(a)       VROTL(a, 8)
+
+__attribute__((target("sse2")))
+static void chacha20_blocks_sse2(const uint32_t state[16], const uint32_t (*lanes)[4], uint8_t *ks) {
+  __m128i v[16], s[16];
+  int i;
+
+  for(i=0; i<12; i++)
+    s[i] = _mm_set1_epi32(state[i]);
+
+  if(lanes) {
+    for(i=0; i<4; i++)
+      s[12+i] = _mm_set_epi32(lanes[3][i], lanes[2][i], lanes[1][i], lanes[0][i]);
+  } else {
+    for(i=12; i<16; i++)
+      s[i] = _mm_set1_epi32(state[i]);
+
+    s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+  }
+  memcpy(v, s, sizeof(v));
+
+  for(i=0; i<10; i++) {
+    VDOUBLEROUND(v);
+  }
+
+  /* Transpose 4 words of the 4 blocks at a time */
+  for(i=0; i<16; i+=4) {
+    __m128i a = _mm_add_epi32(v[i], s[i]), b = _mm_add_epi32(v[i+1], s[i+1]);
+    __m128i c = _mm_add_epi32(v[i+2], s[i+2]), d = _mm_add_epi32(v[i+3], s[i+3]);
+    __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);
+    __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);
+
+    _mm_storeu_si128((__m128i *)(ks + 0*CHACHA20_BLOCK_SIZE + 4*i), _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(ks + 1*CHACHA20_BLOCK_SIZE + 4*i), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(ks + 2*CHACHA20_BLOCK_SIZE + 4*i), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(ks + 3*CHACHA20_BLOCK_SIZE + 4*i), _mm_unpackhi_epi64(t2, t3));
+  }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROTL16
+#undef VROTL8
+
+#define VADD(a, b)      _mm256_add_epi32(a, b)
+#define VXOR(a, b)      _mm256_xor_si256(a, b)
+#define VROTL(a, n)     _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+#define VROTL16(a)      _mm256_shuffle_epi8(a, rot16)
+#define VROTL8(a)       _mm256_shuffle_epi8(a, rot8)
+
+__attribute__((target("avx2")))
+static void chacha20_blocks_avx2(const uint32_t state[16], const uint32_t (*lanes)[4], uint8_t *ks) {
+  const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14,  9,  8, 11, 10,  5,  4,  7,  6,  1,  0,  3,  2,
+                                        13, 12, 15, 14,  9,  8, 11, 10,  5,  4,  7,  6,  1,  0,  3,  2);
+  const __m256i rot8  = _mm256_set_epi8(14, 13, 12, 15, 10,  9,  8, 11,  6,  5,  4,  7,  2,  1,  0,  3,
+                                        14, 13, 12, 15, 10,  9,  8, 11,  6,  5,  4,  7,  2,  1,  0,  3);
+  __m256i v[16], s[16];
+  int i;
+
+  for(i=0; i<12; i++)
+    s[i] = _mm256_set1_epi32(state[i]);
+
+  if(lanes) {
+    for(i=0; i<4; i++)
+      s[12+i] = _mm256_set_epi32(lanes[7][i], lanes[6][i], lanes[5][i], lanes[4][i],
+                                 lanes[3][i], lanes[2][i], lanes[1][i], lanes[0][i]);
+  } else {
+    for(i=12; i<16; i++)
+      s[i] = _mm256_set1_epi32(state[i]);
+
+    s[12] = _mm256_add_epi32(s[12], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+  }
+  memcpy(v, s, sizeof(v));
+
+  for(i=0; i<10; i++) {
+    VDOUBLEROUND(v);
+  }
+
+  /* The unpacks work within each 128-bit half: the low one transposes
+   * blocks 0-3 and the high one blocks 4-7 */
+  for(i=0; i<16; i+=4) {
+    __m256i a = _mm256_add_epi32(v[i], s[i]), b = _mm256_add_epi32(v[i+1], s[i+1]);
+    __m256i c = _mm256_add_epi32(v[i+2], s[i+2]), d = _mm256_add_epi32(v[i+3], s[i+3]);
+    __m256i t0 = _mm256_unpacklo_epi32(a, b), t1 = _mm256_unpacklo_epi32(c, d);
+    __m256i t2 = _mm256_unpackhi_epi32(a, b), t3 = _mm256_unpackhi_epi32(c, d);
+    __m256i r[4];
+    int j;
+
+    r[0] = _mm256_unpacklo_epi64(t0, t1);
+    r[1] = _mm256_unpackhi_epi64(t0, t1);
+    r[2] = _mm256_unpacklo_epi64(t2, t3);
+    r[3] = _mm256_unpackhi_epi64(t2, t3);
+
+    for(j=0; j<4; j++) {
+      _mm_storeu_si128((__m128i *)(ks + j*CHACHA20_BLOCK_SIZE + 4*i), _mm256_castsi256_si128(r[j]));
+      _mm_storeu_si128((__m128i *)(ks + (j+4)*CHACHA20_BLOCK_SIZE + 4*i), _mm256_extracti128_si256(r[j], 1));
+    }
+  }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROTL16
+#undef VROTL8
+
+#endif /* CHACHA20_X86 */
+
+/* ************************************** */
+
+#ifdef CHACHA20_NEON
+
+#define VADD(a, b)      vaddq_u32(a, b)
+#define VXOR(a, b)      veorq_u32(a, b)
+#define VROTL(a, n)     vorrq_u32(vshlq_n_u32(a, n), vshrq_n_u32(a, 32 - (n)))
+#define VROTL16(a)      vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(a)))
+#define VROTL8(a)       VROTL(a, 8)
+
+static void chacha20_blocks_neon(const uint32_t state[16], const uint32_t (*lanes)[4], uint8_t *ks) {
+  static const uint32_t ctr_add[4] = { 0, 1, 2, 3 };
+  uint32x4_t v[16], s[16];
+  int i;
+
+  for(i=0; i<12; i++)
+    s[i] = vdupq_n_u32(state[i]);
+
+  if(lanes) {
+    for(i=0; i<4; i++) {
+      const uint32_t w[4] = { lanes[0][i], lanes[1][i], lanes[2][i], lanes[3][i] };
+
+      s[12+i] = vld1q_u32(w);
+    }
+  } else {
+    for(i=12; i<16; i++)
+      s[i] = vdupq_n_u32(state[i]);
+
+    s[12] = vaddq_u32(s[12], vld1q_u32(ctr_add));
+  }
+  memcpy(v, s, sizeof(v));
+
+  for(i=0; i<10; i++) {
+    VDOUBLEROUND(v);
+  }
+
+  for(i=0; i<16; i+=4) {
+    uint32x4x2_t ab = vzipq_u32(vaddq_u32(v[i], s[i]), vaddq_u32(v[i+1], s[i+1]));
+    uint32x4x2_t cd = vzipq_u32(vaddq_u32(v[i+2], s[i+2]), vaddq_u32(v[i+3], s[i+3]));
+
+    vst1q_u8(ks + 0*CHACHA20_BLOCK_SIZE + 4*i,
+             vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0]))));
+    vst1q_u8(ks + 1*CHACHA20_BLOCK_SIZE + 4*i,
+             vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0]))));
+    vst1q_u8(ks + 2*CHACHA20_BLOCK_SIZE + 4*i,
+             vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1]))));
+    vst1q_u8(ks + 3*CHACHA20_BLOCK_SIZE + 4*i,
+             vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1]))));
+  }
+}
+
+#undef VADD
+#undef VXOR
+#undef VROTL
+#undef VROTL16
+#undef VROTL8
+
+#endif /* CHACHA20_NEON */
+
+/* ************************************** */
+
+/* Widest first, the portable kernel last */
+static const chacha20_impl_t impl_portable = { "portable", 1, chacha20_block_portable };
+#ifdef CHACHA20_X86
+static const chacha20_impl_t impl_avx2 = { "avx2", 8, chacha20_blocks_avx2 };
+static const chacha20_impl_t impl_sse2 = { "sse2", 4, chacha20_blocks_sse2 };
+#endif
+#ifdef CHACHA20_NEON
+static const chacha20_impl_t impl_neon = { "neon", 4, chacha20_blocks_neon };
+#endif
+
+/* The kernels the CPU supports, widest first and the portable one last.
+ * impls points into it at the kernel used for the widest strides, the
+ * narrower ones after it doing the tails. */
+static const chacha20_impl_t *supported[3] = { &impl_portable, NULL, NULL };
+static const chacha20_impl_t * const *impls = supported;
+static unsigned int num_supported = 1;
+static int impls_selected = 0;
+
+void chacha20_select_impl(void) {
+  unsigned int n = 0;
+
+  if(impls_selected)
+    return;
+
+#ifdef CHACHA20_X86
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2"))
+    supported[n++] = &impl_avx2;
+
+  if(__builtin_cpu_supports("sse2"))
+    supported[n++] = &impl_sse2;
+#endif
+
+#ifdef CHACHA20_NEON
+#if defined(__arm__) && defined(__linux__) && defined(HWCAP_NEON)
+  if(getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    supported[n++] = &impl_neon;
+#endif
+
+  supported[n] = &impl_portable;
+  num_supported = n + 1;
+  impls = supported;
+  impls_selected = 1;
+}
+
+const char* chacha20_impl_name(void) {
+  chacha20_select_impl();
+
+  return(impls[0]->name);
+}
+
+unsigned int chacha20_impl_list(const char **names, unsigned int max) {
+  unsigned int i;
+
+  chacha20_select_impl();
+
+  for(i=0; (i<num_supported) && (i<max); i++)
+    names[i] = supported[i]->name;
+
+  return(num_supported);
+}
+
+int chacha20_set_impl(const char *name) {
+  unsigned int i;
+
+  chacha20_select_impl();
+
+  for(i=0; i<num_supported; i++) {
+    if(strcmp(supported[i]->name, name) == 0) {
+      impls = &supported[i];
+      return(0);
+    }
+  }
+
+  return(-1);
+}
+
+/* ************************************** */
+
+void chacha20_set_key(chacha20_key_t *key, const uint8_t raw[CHACHA20_KEY_SIZE]) {
+  int i;
+
+  chacha20_select_impl();
+
+  for(i=0; i<8; i++)
+    key->k[i] = U8TO32_LE(raw + 4*i);
+}
+
+/* ************************************** */
+
+/* out = in ^ ks, a word at a time; memcpy keeps unaligned buffers legal */
+static void xor_bytes(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t len) {
+  size_t i = 0;
+
+  for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+    uint64_t a, b;
+
+    memcpy(&a, in + i, sizeof(a));
+    memcpy(&b, ks + i, sizeof(b));
+    a ^= b;
+    memcpy(out + i, &a, sizeof(a));
+  }
+
+  for(; i<len; i++)
+    out[i] = in[i] ^ ks[i];
+}
+
+static void chacha20_init_state(uint32_t state[16], const chacha20_key_t *key, uint32_t counter,
+                                const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+  state[0] = 0x61707865; state[1] = 0x3320646e; /* "expand 32-byte k" */
+  state[2] = 0x79622d32; state[3] = 0x6b206574;
+  memcpy(&state[4], key->k, sizeof(key->k));
+  state[12] = counter;
+  state[13] = U8TO32_LE(nonce);
+  state[14] = U8TO32_LE(nonce + 4);
+  state[15] = U8TO32_LE(nonce + 8);
+}
+
+/* The widest kernel that does not waste more than a block on len bytes */
+static const chacha20_impl_t* chacha20_pick_impl(size_t len) {
+  const chacha20_impl_t * const *impl = impls;
+
+  while(((*impl)->num_blocks > 1) && (len <= ((*impl)->num_blocks - 1) * CHACHA20_BLOCK_SIZE))
+    impl++;
+
+  return(*impl);
+}
+
+/* XOR the key stream from state[12] on, advancing it */
+static void chacha20_xor_state(uint32_t state[16], const uint8_t *in, uint8_t *out, size_t len) {
+  uint8_t ks[CHACHA20_MAX_BLOCKS * CHACHA20_BLOCK_SIZE];
+
+  while(len > 0) {
+    /* Full strides of the widest kernel, then narrower ones for the tail */
+    const chacha20_impl_t *impl = chacha20_pick_impl(len);
+    size_t n = impl->num_blocks * CHACHA20_BLOCK_SIZE;
+
+    impl->blocks(state, NULL, ks);
+    state[12] += impl->num_blocks;
+
+    if(n > len) n = len;
+
+    xor_bytes(out, in, ks, n);
+
+    in += n, out += n, len -= n;
+  }
+}
+
+void chacha20_xor(const chacha20_key_t *key, uint32_t counter,
+                  const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                  const uint8_t *in, uint8_t *out, size_t len) {
+  uint32_t state[16];
+
+  chacha20_init_state(state, key, counter, nonce);
+  chacha20_xor_state(state, in, out, len);
+}
+
+/* ************************************** */
+
+#ifdef __SIZEOF_INT128__
+
+/* poly1305-donna with 44-bit limbs, for hosts with 64x64->128 multiplies */
+#define POLY1305_HIBIT          ((uint64_t)1 << 40)
+
+typedef unsigned __int128 uint128_t;
+
+typedef struct poly1305 {
+  uint64_t      r[3];
+  uint64_t      h[3];
+  uint64_t      pad[2];
+} poly1305_t;
+
+static void poly1305_init(poly1305_t *st, const uint8_t key[32]) {
+  uint64_t t0 = U8TO64_LE(&key[0]), t1 = U8TO64_LE(&key[8]);
+
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  st->r[0] = (t0                    ) & 0xffc0fffffff;
+  st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+  st->r[2] = ((t1 >> 24)            ) & 0x00ffffffc0f;
+
+  memset(st->h, 0, sizeof(st->h));
+
+  st->pad[0] = U8TO64_LE(&key[16]);
+  st->pad[1] = U8TO64_LE(&key[24]);
+}
+
+/* Absorb whole 16-byte blocks; hibit is the 2^128 bit each of them carries,
+ * always POLY1305_HIBIT as the AEAD zero pads the message */
+static void poly1305_blocks(poly1305_t *st, const uint8_t *m, size_t len, uint64_t hibit) {
+  const uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+  const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+  uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+  while(len >= 16) {
+    uint64_t t0 = U8TO64_LE(m), t1 = U8TO64_LE(m + 8), c;
+    uint128_t d0, d1, d2;
+
+    h0 += (t0                    ) & 0xfffffffffff;
+    h1 += ((t0 >> 44) | (t1 << 20)) & 0xfffffffffff;
+    h2 += (((t1 >> 24)           ) & 0x3ffffffffff) | hibit;
+
+    d0 = ((uint128_t)h0 * r0) + ((uint128_t)h1 * s2) + ((uint128_t)h2 * s1);
+    d1 = ((uint128_t)h0 * r1) + ((uint128_t)h1 * r0) + ((uint128_t)h2 * s2);
+    d2 = ((uint128_t)h0 * r2) + ((uint128_t)h1 * r1) + ((uint128_t)h2 * r0);
+
+    c = (uint64_t)(d0 >> 44); h0 = (uint64_t)d0 & 0xfffffffffff;
+    d1 += c; c = (uint64_t)(d1 >> 44); h1 = (uint64_t)d1 & 0xfffffffffff;
+    d2 += c; c = (uint64_t)(d2 >> 42); h2 = (uint64_t)d2 & 0x3ffffffffff;
+    h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+    h1 += c;
+
+    m += 16, len -= 16;
+  }
+
+  st->h[0] = h0; st->h[1] = h1; st->h[2] = h2;
+}
+
+static void poly1305_finish(poly1305_t *st, uint8_t mac[16]) {
+  uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+  uint64_t g0, g1, g2, c, t0, t1;
+
+  /* Fully carry h */
+  c = h1 >> 44; h1 &= 0xfffffffffff;
+  h2 += c; c = h2 >> 42; h2 &= 0x3ffffffffff;
+  h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+  h1 += c; c = h1 >> 44; h1 &= 0xfffffffffff;
+  h2 += c; c = h2 >> 42; h2 &= 0x3ffffffffff;
+  h0 += c * 5; c = h0 >> 44; h0 &= 0xfffffffffff;
+  h1 += c;
+
+  /* g = h + -p */
+  g0 = h0 + 5; c = g0 >> 44; g0 &= 0xfffffffffff;
+  g1 = h1 + c; c = g1 >> 44; g1 &= 0xfffffffffff;
+  g2 = h2 + c - ((uint64_t)1 << 42);
+
+  /* Select h if h < p, or h + -p if h >= p, in constant time */
+  c = (g2 >> 63) - 1;
+  g0 &= c; g1 &= c; g2 &= c;
+  c = ~c;
+  h0 = (h0 & c) | g0;
+  h1 = (h1 & c) | g1;
+  h2 = (h2 & c) | g2;
+
+  /* mac = (h + pad) % 2^128 */
+  t0 = st->pad[0], t1 = st->pad[1];
+  h0 += (t0 & 0xfffffffffff); c = h0 >> 44; h0 &= 0xfffffffffff;
+  h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c; c = h1 >> 44; h1 &= 0xfffffffffff;
+  h2 += (((t1 >> 24)) & 0x3ffffffffff) + c; h2 &= 0x3ffffffffff;
+
+  h0 = (h0      ) | (h1 << 44);
+  h1 = (h1 >> 20) | (h2 << 24);
+
+  U64TO8_LE(mac + 0, h0);
+  U64TO8_LE(mac + 8, h1);
+
+  memset(st, 0, sizeof(*st));
+}
+
+#else /* __SIZEOF_INT128__ */
+
+/* poly1305-donna with 26-bit limbs */
+#define POLY1305_HIBIT          ((uint32_t)1 << 24)
+
+typedef struct poly1305 {
+  uint32_t      r[5];
+  uint32_t      h[5];
+  uint32_t      pad[4];
+} poly1305_t;
+
+static void poly1305_init(poly1305_t *st, const uint8_t key[32]) {
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  st->r[0] = (U8TO32_LE(&key[ 0])     ) & 0x3ffffff;
+  st->r[1] = (U8TO32_LE(&key[ 3]) >> 2) & 0x3ffff03;
+  st->r[2] = (U8TO32_LE(&key[ 6]) >> 4) & 0x3ffc0ff;
+  st->r[3] = (U8TO32_LE(&key[ 9]) >> 6) & 0x3f03fff;
+  st->r[4] = (U8TO32_LE(&key[12]) >> 8) & 0x00fffff;
+
+  memset(st->h, 0, sizeof(st->h));
+
+  st->pad[0] = U8TO32_LE(&key[16]);
+  st->pad[1] = U8TO32_LE(&key[20]);
+  st->pad[2] = U8TO32_LE(&key[24]);
+  st->pad[3] = U8TO32_LE(&key[28]);
+}
+
+/* Absorb whole 16-byte blocks, see above */
+static void poly1305_blocks(poly1305_t *st, const uint8_t *m, size_t len, uint32_t hibit) {
+  const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+  const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+  uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+
+  while(len >= 16) {
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    h0 += (U8TO32_LE(m +  0)     ) & 0x3ffffff;
+    h1 += (U8TO32_LE(m +  3) >> 2) & 0x3ffffff;
+    h2 += (U8TO32_LE(m +  6) >> 4) & 0x3ffffff;
+    h3 += (U8TO32_LE(m +  9) >> 6) & 0x3ffffff;
+    h4 += (U8TO32_LE(m + 12) >> 8) | hibit;
+
+    d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+    d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+    d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+    d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+    d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+    c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+    d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+    d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+    d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+    d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    m += 16, len -= 16;
+  }
+
+  st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+static void poly1305_finish(poly1305_t *st, uint8_t mac[16]) {
+  uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+  uint32_t g0, g1, g2, g3, g4, c, mask;
+  uint64_t f;
+
+  /* Fully carry h */
+  c = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += c;
+
+  /* g = h + -p */
+  g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+  g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+  g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+  g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+  g4 = h4 + c - (1UL << 26);
+
+  /* Select h if h < p, or h + -p if h >= p, in constant time */
+  mask = (g4 >> 31) - 1;
+  g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+  mask = ~mask;
+  h0 = (h0 & mask) | g0;
+  h1 = (h1 & mask) | g1;
+  h2 = (h2 & mask) | g2;
+  h3 = (h3 & mask) | g3;
+  h4 = (h4 & mask) | g4;
+
+  /* h = h % 2^128 */
+  h0 = ((h0      ) | (h1 << 26)) & 0xffffffff;
+  h1 = ((h1 >>  6) | (h2 << 20)) & 0xffffffff;
+  h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+  h3 = ((h3 >> 18) | (h4 <<  8)) & 0xffffffff;
+
+  /* mac = (h + pad) % 2^128 */
+  f = (uint64_t)h0 + st->pad[0]            ; h0 = (uint32_t)f;
+  f = (uint64_t)h1 + st->pad[1] + (f >> 32); h1 = (uint32_t)f;
+  f = (uint64_t)h2 + st->pad[2] + (f >> 32); h2 = (uint32_t)f;
+  f = (uint64_t)h3 + st->pad[3] + (f >> 32); h3 = (uint32_t)f;
+
+  U32TO8_LE(mac +  0, h0);
+  U32TO8_LE(mac +  4, h1);
+  U32TO8_LE(mac +  8, h2);
+  U32TO8_LE(mac + 12, h3);
+
+  memset(st, 0, sizeof(*st));
+}
+
+#endif /* __SIZEOF_INT128__ */
+
+/* Absorb data zero padded to a multiple of 16 bytes, as the AEAD does */
+static void poly1305_update_padded(poly1305_t *st, const uint8_t *m, size_t len) {
+  size_t full = len & ~(size_t)15;
+
+  poly1305_blocks(st, m, full, POLY1305_HIBIT);
+
+  if(len > full) {
+    uint8_t block[16] = { 0 };
+
+    memcpy(block, m + full, len - full);
+    poly1305_blocks(st, block, 16, POLY1305_HIBIT);
+  }
+}
+
+/* ************************************** */
+
+/* The one-time Poly1305 key is the key stream of block 0 and the data is
+ * encrypted from block 1 on. One kernel stride gives both, so that small
+ * packets need a single call: ks receives the stride, the return value is
+ * the number of data bytes it covers (from ks + CHACHA20_BLOCK_SIZE on) and
+ * state is left at the next block. */
+static size_t chacha20_poly1305_start(const chacha20_key_t *key,
+                                      const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                                      size_t len, uint32_t state[16],
+                                      uint8_t ks[CHACHA20_MAX_BLOCKS * CHACHA20_BLOCK_SIZE]) {
+  const chacha20_impl_t *impl = chacha20_pick_impl(len + CHACHA20_BLOCK_SIZE);
+  size_t n = (impl->num_blocks - 1) * CHACHA20_BLOCK_SIZE;
+
+  chacha20_init_state(state, key, 0, nonce);
+  impl->blocks(state, NULL, ks);
+  state[12] += impl->num_blocks;
+
+  return((n < len) ? n : len);
+}
+
+/* The Poly1305 tag of the AEAD construction over aad and the ciphertext */
+static void chacha20_poly1305_tag(const uint8_t otk[32],
+                                  const uint8_t *aad, size_t aad_len,
+                                  const uint8_t *ct, size_t len,
+                                  uint8_t tag[POLY1305_TAG_SIZE]) {
+  uint8_t lens[16];
+  poly1305_t st;
+  int i;
+
+  poly1305_init(&st, otk);
+
+  poly1305_update_padded(&st, aad, aad_len);
+  poly1305_update_padded(&st, ct, len);
+
+  for(i=0; i<8; i++) {
+    lens[i] = (uint8_t)((uint64_t)aad_len >> (8*i));
+    lens[8+i] = (uint8_t)((uint64_t)len >> (8*i));
+  }
+
+  poly1305_blocks(&st, lens, sizeof(lens), POLY1305_HIBIT);
+  poly1305_finish(&st, tag);
+}
+
+/* ************************************** */
+
+void chacha20_poly1305_seal(const chacha20_key_t *key,
+                            const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                            const uint8_t *aad, size_t aad_len,
+                            const uint8_t *in, size_t len,
+                            uint8_t *out, uint8_t tag[POLY1305_TAG_SIZE]) {
+  uint8_t ks[CHACHA20_MAX_BLOCKS * CHACHA20_BLOCK_SIZE];
+  uint32_t state[16];
+  size_t head = chacha20_poly1305_start(key, nonce, len, state, ks);
+
+  xor_bytes(out, in, ks + CHACHA20_BLOCK_SIZE, head);
+  chacha20_xor_state(state, in + head, out + head, len - head);
+
+  chacha20_poly1305_tag(ks, aad, aad_len, out, len, tag);
+
+  memset(ks, 0, sizeof(ks));
+}
+
+/* ************************************** */
+
+int chacha20_poly1305_open(const chacha20_key_t *key,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *aad, size_t aad_len,
+                           const uint8_t *in, size_t len,
+                           uint8_t *out, const uint8_t tag[POLY1305_TAG_SIZE]) {
+  uint8_t ks[CHACHA20_MAX_BLOCKS * CHACHA20_BLOCK_SIZE];
+  uint8_t expected[POLY1305_TAG_SIZE];
+  uint32_t state[16];
+  size_t head = chacha20_poly1305_start(key, nonce, len, state, ks);
+  uint8_t diff = 0;
+  int i;
+
+  chacha20_poly1305_tag(ks, aad, aad_len, in, len, expected);
+
+  /* Constant time compare */
+  for(i=0; i<POLY1305_TAG_SIZE; i++)
+    diff |= expected[i] ^ tag[i];
+
+  if(diff == 0) {
+    xor_bytes(out, in, ks + CHACHA20_BLOCK_SIZE, head);
+    chacha20_xor_state(state, in + head, out + head, len - head);
+  }
+
+  memset(ks, 0, sizeof(ks));
+
+  return((diff == 0) ? 0 : -1);
+}
+
+/* ************************************** */
+
+/* Run the key stream over the jobs with rc == 0: with otk, block 0 of each
+ * gives its one-time key, with data, blocks 1 and on are XORed with its
+ * data. The blocks of consecutive jobs are laid out one after the other over
+ * the kernel lanes, so that a batch of short packets fills the SIMD vectors
+ * as well as a long one: only the last stride of the batch may be narrower. */
+static void chacha20_poly1305_stream(const chacha20_key_t *key,
+                                     chacha20_poly1305_job_t *jobs, unsigned int num,
+                                     int otk, int data) {
+  static const uint8_t no_nonce[CHACHA20_NONCE_SIZE] = { 0 };
+  uint8_t ks[CHACHA20_MAX_BLOCKS * CHACHA20_BLOCK_SIZE];
+  uint32_t lanes[CHACHA20_MAX_BLOCKS][4];
+  chacha20_poly1305_job_t *lane_job[CHACHA20_MAX_BLOCKS];
+  uint32_t state[16];
+  const uint32_t first = otk ? 0 : 1;
+  size_t todo = 0;
+  unsigned int i = 0, j;
+  uint32_t blk = first, last = 0;
+
+  for(j=0; j<num; j++) {
+    if(jobs[j].rc == 0)
+      todo += (otk ? 1 : 0) + (data ? (jobs[j].len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE : 0);
+  }
+
+  /* Only words 0-11 are taken from the state, the lanes give the rest */
+  chacha20_init_state(state, key, 0, no_nonce);
+
+  /* i and blk are the job and block scheduled next, last the final block of
+   * job i, if i is valid */
+  if(num > 0)
+    last = data ? (jobs[0].len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE : 0;
+
+  while(todo > 0) {
+    const chacha20_impl_t *impl = chacha20_pick_impl(todo * CHACHA20_BLOCK_SIZE);
+    unsigned int n = impl->num_blocks, k;
+
+    for(k=0; k<n; k++) {
+      while((jobs[i].rc != 0) || (blk > last)) {
+        i++;
+        blk = first;
+        last = data ? (jobs[i].len + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE : 0;
+      }
+
+      lanes[k][0] = blk++;
+      lanes[k][1] = U8TO32_LE(jobs[i].nonce);
+      lanes[k][2] = U8TO32_LE(jobs[i].nonce + 4);
+      lanes[k][3] = U8TO32_LE(jobs[i].nonce + 8);
+      lane_job[k] = &jobs[i];
+    }
+
+    impl->blocks(state, lanes, ks);
+
+    for(k=0; k<n; k++) {
+      chacha20_poly1305_job_t *job = lane_job[k];
+
+      if(lanes[k][0] == 0)
+        memcpy(job->otk, ks + k*CHACHA20_BLOCK_SIZE, sizeof(job->otk));
+      else {
+        size_t off = (lanes[k][0] - 1) * CHACHA20_BLOCK_SIZE;
+        size_t len = job->len - off;
+
+        if(len > CHACHA20_BLOCK_SIZE) len = CHACHA20_BLOCK_SIZE;
+
+        xor_bytes(job->out + off, job->in + off, ks + k*CHACHA20_BLOCK_SIZE, len);
+      }
+    }
+
+    todo -= n;
+  }
+
+  memset(ks, 0, sizeof(ks));
+}
+
+/* ************************************** */
+
+void chacha20_poly1305_seal_batch(const chacha20_key_t *key,
+                                  chacha20_poly1305_job_t *jobs, unsigned int num) {
+  unsigned int i;
+
+  for(i=0; i<num; i++)
+    jobs[i].rc = 0;
+
+  chacha20_poly1305_stream(key, jobs, num, 1, 1);
+
+  for(i=0; i<num; i++) {
+    chacha20_poly1305_tag(jobs[i].otk, jobs[i].aad, jobs[i].aad_len,
+                          jobs[i].out, jobs[i].len, jobs[i].tag);
+    memset(jobs[i].otk, 0, sizeof(jobs[i].otk));
+  }
+}
+
+/* ************************************** */
+
+int chacha20_poly1305_open_batch(const chacha20_key_t *key,
+                                 chacha20_poly1305_job_t *jobs, unsigned int num) {
+  unsigned int i;
+  int num_failed = 0;
+
+  for(i=0; i<num; i++)
+    jobs[i].rc = 0;
+
+  /* All the one-time keys first, so that only the data that authenticates
+   * is decrypted */
+  chacha20_poly1305_stream(key, jobs, num, 1, 0);
+
+  for(i=0; i<num; i++) {
+    uint8_t expected[POLY1305_TAG_SIZE];
+    uint8_t diff = 0;
+    int j;
+
+    chacha20_poly1305_tag(jobs[i].otk, jobs[i].aad, jobs[i].aad_len,
+                          jobs[i].in, jobs[i].len, expected);
+    memset(jobs[i].otk, 0, sizeof(jobs[i].otk));
+
+    /* Constant time compare */
+    for(j=0; j<POLY1305_TAG_SIZE; j++)
+      diff |= expected[j] ^ jobs[i].tag[j];
+
+    if(diff != 0) {
+      jobs[i].rc = -1;
+      num_failed++;
+    }
+  }
+
+  chacha20_poly1305_stream(key, jobs, num, 0, 1);
+
+  return(num_failed);
+}
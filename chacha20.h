@@ -0,0 +1,113 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* ChaCha20-Poly1305 AEAD (RFC 8439) with SIMD ChaCha20 kernels chosen at
+ * runtime. Self contained, so that it is available without OpenSSL. */
+
+#ifndef _CHACHA20_H_
+#define _CHACHA20_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE       32
+#define CHACHA20_NONCE_SIZE     12
+#define POLY1305_TAG_SIZE       16
+
+typedef struct chacha20_key {
+  uint32_t      k[8];
+} chacha20_key_t;
+
+/** A message of a batch sealed or opened with a single call. */
+typedef struct chacha20_poly1305_job {
+  const uint8_t *       nonce;          /**< CHACHA20_NONCE_SIZE bytes */
+  const uint8_t *       aad;
+  size_t                aad_len;
+  const uint8_t *       in;
+  uint8_t *             out;            /**< May be in */
+  size_t                len;
+  uint8_t *             tag;            /**< Written by seal, checked by open */
+  int                   rc;             /**< 0, or -1 when open finds the tag wrong */
+  uint8_t               otk[32];        /**< Private: the one-time Poly1305 key */
+} chacha20_poly1305_job_t;
+
+/** Pick the fastest ChaCha20 kernel the CPU supports. Called by
+ *  chacha20_set_key(), calling it again is harmless. */
+void chacha20_select_impl(void);
+
+/** @return the name of the ChaCha20 kernel in use ("avx2", "sse2", "neon"
+ *          or "portable") */
+const char* chacha20_impl_name(void);
+
+/** List the ChaCha20 kernels the CPU supports, widest first, in names.
+ *
+ *  @return their number, which may exceed max
+ */
+unsigned int chacha20_impl_list(const char **names, unsigned int max);
+
+/** Compute the key stream with the kernel called name, and the narrower
+ *  ones for the tails. Not thread safe: meant for the start up, before any
+ *  key is in use.
+ *
+ *  @return 0 on success, -1 when the CPU does not support that kernel
+ */
+int chacha20_set_impl(const char *name);
+
+void chacha20_set_key(chacha20_key_t *key, const uint8_t raw[CHACHA20_KEY_SIZE]);
+
+/** XOR len bytes of in with the key stream starting at block counter and
+ *  write them to out, which may be in itself. */
+void chacha20_xor(const chacha20_key_t *key, uint32_t counter,
+                  const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                  const uint8_t *in, uint8_t *out, size_t len);
+
+/** Encrypt len bytes of in to out (in place allowed) and compute the tag
+ *  over aad and the ciphertext. */
+void chacha20_poly1305_seal(const chacha20_key_t *key,
+                            const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                            const uint8_t *aad, size_t aad_len,
+                            const uint8_t *in, size_t len,
+                            uint8_t *out, uint8_t tag[POLY1305_TAG_SIZE]);
+
+/** Check the tag and decrypt len bytes of in to out (in place allowed).
+ *
+ *  @return 0 on success, -1 when the data does not authenticate (out is
+ *          left untouched)
+ */
+int chacha20_poly1305_open(const chacha20_key_t *key,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *aad, size_t aad_len,
+                           const uint8_t *in, size_t len,
+                           uint8_t *out, const uint8_t tag[POLY1305_TAG_SIZE]);
+
+/** chacha20_poly1305_seal() over num messages. The key stream blocks of
+ *  all of them are computed together, filling the SIMD lanes even when the
+ *  messages are short. */
+void chacha20_poly1305_seal_batch(const chacha20_key_t *key,
+                                  chacha20_poly1305_job_t *jobs, unsigned int num);
+
+/** chacha20_poly1305_open() over num messages, see
+ *  chacha20_poly1305_seal_batch(). The rc of each job tells whether it
+ *  authenticated; the out of those that did not is left untouched.
+ *
+ *  @return the number of messages that did not authenticate
+ */
+int chacha20_poly1305_open_batch(const chacha20_key_t *key,
+                                 chacha20_poly1305_job_t *jobs, unsigned int num);
+
+#endif /* _CHACHA20_H_ */
@@ -0,0 +1,408 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Compression of the ethernet frames before the transform. The algorithm
+ * travels in the top bits of the transform field of the PACKET, so that a
+ * receiver knows what to undo whatever it compresses itself.
+ *
+ * Frames whose payload is already compressed or encrypted (TLS, SSH, media)
+ * would cost a compression attempt for nothing, so a sample of the payload
+ * is looked at first: random data shows many more distinct byte values than
+ * text or telemetry. When a frame that passed the check still does not
+ * shrink, the next ones are sent as they are, for longer after each miss.
+ *
+ * Each frame is compressed on its own, which leaves little to find in the
+ * short ones. lz4 and zstd can start from a dictionary trained on typical
+ * traffic (see n2n-dict): its id is announced in the REGISTER and
+ * REGISTER_ACK, and the dictionary is used towards the peers that announced
+ * the same one. */
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef N2N_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define N2N_COMPRESS_SAMPLE_OFF         64      /* past the ethernet, IP and TCP headers */
+#define N2N_COMPRESS_SAMPLE_LEN         256
+#define N2N_COMPRESS_SAMPLE_MIN         32      /* below this, no telling */
+#define N2N_COMPRESS_MAX_BACKOFF        63      /* frames */
+#define N2N_ZSTD_LEVEL                  3
+
+/* ************************************** */
+
+/** @return whether the frames compressed with id can be sent and received */
+int n2n_compression_supported(uint8_t id) {
+  switch(id) {
+  case N2N_COMPRESSION_ID_NONE:
+  case N2N_COMPRESSION_ID_LZO:
+    return(1);
+#ifdef N2N_HAVE_LZ4
+  case N2N_COMPRESSION_ID_LZ4:
+  case N2N_COMPRESSION_ID_LZ4_DICT:
+    return(1);
+#endif
+#ifdef N2N_HAVE_ZSTD
+  case N2N_COMPRESSION_ID_ZSTD:
+  case N2N_COMPRESSION_ID_ZSTD_DICT:
+    return(1);
+#endif
+  default:
+    return(0);
+  }
+}
+
+const char* n2n_compression_str(uint8_t id) {
+  switch(id) {
+  case N2N_COMPRESSION_ID_NONE:      return("none");
+  case N2N_COMPRESSION_ID_LZO:       return("lzo1x");
+  case N2N_COMPRESSION_ID_LZ4:       return("lz4");
+  case N2N_COMPRESSION_ID_ZSTD:      return("zstd");
+  case N2N_COMPRESSION_ID_LZ4_DICT:  return("lz4+dict");
+  case N2N_COMPRESSION_ID_ZSTD_DICT: return("zstd+dict");
+  default:                           return("invalid");
+  }
+}
+
+/* ************************************** */
+
+/** FNV-1a of the dictionary, never 0 which stands for none. */
+uint32_t n2n_compress_dict_id(const uint8_t *data, size_t len) {
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for(i=0; i<len; i++)
+    h = (h ^ data[i]) * 16777619U;
+
+  return(h ? h : 1);
+}
+
+/** Load the dictionary at path and prepare it for lz4 and zstd.
+ *
+ *  @return 0 on success, -1 on error (dict is then left empty)
+ */
+int n2n_compress_dict_load(n2n_compress_dict_t *dict, const char *path) {
+  FILE *fd;
+  long len;
+
+  memset(dict, 0, sizeof(*dict));
+
+#if !defined(N2N_HAVE_LZ4) && !defined(N2N_HAVE_ZSTD)
+  traceEvent(TRACE_ERROR, "Compression dictionaries need lz4 or zstd, not compiled in");
+  return(-1);
+#endif
+
+  if((fd = fopen(path, "rb")) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot open dictionary %s: %s", path, strerror(errno));
+    return(-1);
+  }
+
+  if((fseek(fd, 0, SEEK_END) != 0) || ((len = ftell(fd)) <= 0)
+     || (len > N2N_COMPRESS_DICT_MAX) || (fseek(fd, 0, SEEK_SET) != 0)) {
+    traceEvent(TRACE_ERROR, "Dictionary %s is empty or larger than %u bytes",
+               path, N2N_COMPRESS_DICT_MAX);
+    fclose(fd);
+    return(-1);
+  }
+
+  if(((dict->data = malloc(len)) == NULL)
+     || (fread(dict->data, 1, len, fd) != (size_t)len)) {
+    traceEvent(TRACE_ERROR, "Cannot read dictionary %s", path);
+    fclose(fd);
+    n2n_compress_dict_free(dict);
+    return(-1);
+  }
+
+  fclose(fd);
+  dict->len = len;
+  dict->id = n2n_compress_dict_id(dict->data, dict->len);
+
+#ifdef N2N_HAVE_LZ4
+  if((dict->lz4_stream = LZ4_createStream()) == NULL) {
+    n2n_compress_dict_free(dict);
+    return(-1);
+  }
+  LZ4_loadDict((LZ4_stream_t *)dict->lz4_stream, (const char *)dict->data, (int)dict->len);
+#endif
+
+#ifdef N2N_HAVE_ZSTD
+  dict->zstd_cdict = ZSTD_createCDict(dict->data, dict->len, N2N_ZSTD_LEVEL);
+  dict->zstd_ddict = ZSTD_createDDict(dict->data, dict->len);
+
+  if((dict->zstd_cdict == NULL) || (dict->zstd_ddict == NULL)) {
+    traceEvent(TRACE_ERROR, "Dictionary %s is not usable by zstd", path);
+    n2n_compress_dict_free(dict);
+    return(-1);
+  }
+#endif
+
+  traceEvent(TRACE_NORMAL, "Compression dictionary %s: %u bytes, id %08x",
+             path, (unsigned int)dict->len, dict->id);
+
+  return(0);
+}
+
+void n2n_compress_dict_free(n2n_compress_dict_t *dict) {
+#ifdef N2N_HAVE_LZ4
+  if(dict->lz4_stream)
+    LZ4_freeStream((LZ4_stream_t *)dict->lz4_stream);
+#endif
+#ifdef N2N_HAVE_ZSTD
+  ZSTD_freeCDict((ZSTD_CDict *)dict->zstd_cdict);
+  ZSTD_freeDDict((ZSTD_DDict *)dict->zstd_ddict);
+#endif
+  free(dict->data);
+  memset(dict, 0, sizeof(*dict));
+}
+
+/* ************************************** */
+
+/** Set up the compression of the frames sent with algorithm id, using dict
+ *  (may be NULL) towards the peers that have it too.
+ *
+ *  @return 0 on success, -1 when the algorithm is unknown or out of memory
+ */
+int n2n_compress_init(n2n_compress_t *c, uint8_t id, const n2n_compress_dict_t *dict) {
+  memset(c, 0, sizeof(*c));
+  c->id = id;
+  c->dict = (dict && dict->id) ? dict : NULL;
+
+  if(!n2n_compression_supported(id)) {
+    traceEvent(TRACE_ERROR, "Unsupported compression %u", (unsigned int)id);
+    return(-1);
+  }
+
+  switch(id) {
+  case N2N_COMPRESSION_ID_LZO:
+    c->wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+    break;
+#ifdef N2N_HAVE_LZ4
+  case N2N_COMPRESSION_ID_LZ4:
+    c->lz4_state = LZ4_createStream();
+    break;
+#endif
+#ifdef N2N_HAVE_ZSTD
+  case N2N_COMPRESSION_ID_ZSTD:
+    if((c->zstd_cctx = ZSTD_createCCtx()) != NULL) {
+      ZSTD_CCtx_setParameter((ZSTD_CCtx *)c->zstd_cctx, ZSTD_c_compressionLevel, N2N_ZSTD_LEVEL);
+      /* Both ends know the dictionary, do not spend 4 bytes on its id */
+      ZSTD_CCtx_setParameter((ZSTD_CCtx *)c->zstd_cctx, ZSTD_c_dictIDFlag, 0);
+    }
+    break;
+#endif
+  default:
+    return(0);
+  }
+
+  if(!c->wrkmem && !c->lz4_state && !c->zstd_cctx) {
+    traceEvent(TRACE_ERROR, "Cannot allocate the %s compression state", n2n_compression_str(id));
+    return(-1);
+  }
+
+  return(0);
+}
+
+void n2n_compress_free(n2n_compress_t *c) {
+  free(c->wrkmem);
+#ifdef N2N_HAVE_LZ4
+  if(c->lz4_state)
+    LZ4_freeStream((LZ4_stream_t *)c->lz4_state);
+#endif
+#ifdef N2N_HAVE_ZSTD
+  ZSTD_freeCCtx((ZSTD_CCtx *)c->zstd_cctx);
+  ZSTD_freeDCtx((ZSTD_DCtx *)c->zstd_dctx);
+#endif
+  c->wrkmem = c->lz4_state = c->zstd_cctx = c->zstd_dctx = NULL;
+}
+
+/* ************************************** */
+
+/* Tell apart compressible payloads from random looking ones by the distinct
+ * byte values in a sample: about 162 in 256 random bytes, usually below a
+ * hundred in text. Too short a payload gets the benefit of the doubt. */
+static int looks_compressible(const uint8_t *frame, size_t len) {
+  uint64_t seen[4] = { 0, 0, 0, 0 };
+  size_t i, n, distinct = 0;
+
+  if(len < N2N_COMPRESS_SAMPLE_OFF + N2N_COMPRESS_SAMPLE_MIN)
+    return(1);
+
+  frame += N2N_COMPRESS_SAMPLE_OFF;
+  n = min(len - N2N_COMPRESS_SAMPLE_OFF, N2N_COMPRESS_SAMPLE_LEN);
+
+  for(i=0; i<n; i++) {
+    uint64_t bit = (uint64_t)1 << (frame[i] & 63);
+
+    if(!(seen[frame[i] >> 6] & bit)) {
+      seen[frame[i] >> 6] |= bit;
+      distinct++;
+    }
+  }
+
+  return(distinct <= n / 2);
+}
+
+/* ************************************** */
+
+/** Compress a frame of len bytes to out, which must hold
+ *  N2N_COMPRESS_BOUND(len) bytes. The dictionary is used when the peer
+ *  announced peer_dict_id equal to ours.
+ *
+ *  @return the compressed length, or 0 when the frame is to be sent as it
+ *          is; out_id receives the N2N_COMPRESSION_ID_* to put on the wire
+ */
+size_t n2n_compress(n2n_compress_t *c, uint32_t peer_dict_id, const uint8_t *frame, size_t len,
+                    uint8_t *out, size_t out_size, uint8_t *out_id) {
+  int use_dict = (c->dict != NULL) && (peer_dict_id == c->dict->id)
+    && (c->id != N2N_COMPRESSION_ID_LZO);
+  size_t out_len = len;
+
+  if((c->id == N2N_COMPRESSION_ID_NONE) || (out_size < N2N_COMPRESS_BOUND(len))
+     || (len < (use_dict ? N2N_COMPRESS_MIN_LEN_DICT : N2N_COMPRESS_MIN_LEN)))
+    return(0);
+
+  if((c->skip > 0) || !looks_compressible(frame, len)) {
+    if(c->skip > 0)
+      c->skip--;
+
+    c->skipped++;
+    return(0);
+  }
+
+  switch(c->id) {
+  case N2N_COMPRESSION_ID_LZO: {
+    lzo_uint lzo_len = out_size;
+
+    if(lzo1x_1_compress(frame, len, out, &lzo_len, c->wrkmem) == LZO_E_OK)
+      out_len = lzo_len;
+    break;
+  }
+#ifdef N2N_HAVE_LZ4
+  case N2N_COMPRESSION_ID_LZ4: {
+    int rc;
+
+    if(use_dict) {
+      /* Start every frame from the state left by loading the dictionary */
+      memcpy(c->lz4_state, c->dict->lz4_stream, sizeof(LZ4_stream_t));
+      rc = LZ4_compress_fast_continue((LZ4_stream_t *)c->lz4_state, (const char *)frame,
+                                      (char *)out, (int)len, (int)out_size, 1);
+    } else
+      rc = LZ4_compress_fast_extState(c->lz4_state, (const char *)frame,
+                                      (char *)out, (int)len, (int)out_size, 1);
+    if(rc > 0)
+      out_len = rc;
+    break;
+  }
+#endif
+#ifdef N2N_HAVE_ZSTD
+  case N2N_COMPRESSION_ID_ZSTD: {
+    size_t rc;
+
+    ZSTD_CCtx_refCDict((ZSTD_CCtx *)c->zstd_cctx,
+                       use_dict ? (const ZSTD_CDict *)c->dict->zstd_cdict : NULL);
+    rc = ZSTD_compress2((ZSTD_CCtx *)c->zstd_cctx, out, out_size, frame, len);
+    if(!ZSTD_isError(rc))
+      out_len = rc;
+    break;
+  }
+#endif
+  default:
+    return(0);
+  }
+
+  /* A few percent are not worth the decompression at the other end */
+  if(out_len + len / 32 >= len) {
+    c->backoff = min(2 * c->backoff + 1, N2N_COMPRESS_MAX_BACKOFF);
+    c->skip = c->backoff;
+    c->skipped++;
+    return(0);
+  }
+
+  if(use_dict) {
+    *out_id = (c->id == N2N_COMPRESSION_ID_LZ4) ? N2N_COMPRESSION_ID_LZ4_DICT : N2N_COMPRESSION_ID_ZSTD_DICT;
+    c->dict_frames++;
+  } else
+    *out_id = c->id;
+
+  c->backoff = 0;
+  c->frames++;
+  c->bytes_in += len;
+  c->bytes_out += out_len;
+
+  return(out_len);
+}
+
+/* ************************************** */
+
+/** Decompress a frame compressed with algorithm id into out.
+ *
+ *  @return the frame length, or -1 when the data is corrupt, does not fit,
+ *          or needs an algorithm or a dictionary that is missing here
+ */
+int n2n_decompress(n2n_compress_t *c, uint8_t id, const uint8_t *in, size_t len,
+                   uint8_t *out, size_t out_size) {
+  switch(id) {
+  case N2N_COMPRESSION_ID_LZO: {
+    lzo_uint out_len = out_size;
+
+    if(lzo1x_decompress_safe(in, len, out, &out_len, NULL) != LZO_E_OK)
+      return(-1);
+    return((int)out_len);
+  }
+#ifdef N2N_HAVE_LZ4
+  case N2N_COMPRESSION_ID_LZ4:
+  case N2N_COMPRESSION_ID_LZ4_DICT: {
+    int rc;
+
+    if(id == N2N_COMPRESSION_ID_LZ4)
+      rc = LZ4_decompress_safe((const char *)in, (char *)out, (int)len, (int)out_size);
+    else if(c->dict)
+      rc = LZ4_decompress_safe_usingDict((const char *)in, (char *)out, (int)len, (int)out_size,
+                                         (const char *)c->dict->data, (int)c->dict->len);
+    else
+      return(-1);
+
+    return((rc < 0) ? -1 : rc);
+  }
+#endif
+#ifdef N2N_HAVE_ZSTD
+  case N2N_COMPRESSION_ID_ZSTD:
+  case N2N_COMPRESSION_ID_ZSTD_DICT: {
+    size_t rc;
+
+    if(!c->zstd_dctx && ((c->zstd_dctx = ZSTD_createDCtx()) == NULL))
+      return(-1);
+
+    if(id == N2N_COMPRESSION_ID_ZSTD)
+      rc = ZSTD_decompressDCtx((ZSTD_DCtx *)c->zstd_dctx, out, out_size, in, len);
+    else if(c->dict)
+      rc = ZSTD_decompress_usingDDict((ZSTD_DCtx *)c->zstd_dctx, out, out_size, in, len,
+                                      (const ZSTD_DDict *)c->dict->zstd_ddict);
+    else
+      return(-1);
+
+    return(ZSTD_isError(rc) ? -1 : (int)rc);
+  }
+#endif
+  default:
+    return(-1);
+  }
+}
@@ -0,0 +1,427 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* CPU feature detection and the start up self-benchmark of the transforms.
+ *
+ * n2n_crypto_select() runs each implementation of a transform the CPU can
+ * use over a few packets, binds the fastest and keeps the figures for the
+ * management console and n2n-benchmark. Only ChaCha20 has kernels of its
+ * own to choose from; AES goes through OpenSSL, which picks AES-NI and
+ * PCLMUL by itself, and Twofish has a single table driven core, so for
+ * those the benchmark just tells what they run on and how fast. */
+
+#include "n2n.h"
+#include "chacha20.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRYPTO_X86 1
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__) && (defined(__aarch64__) || defined(__arm__))
+#define CRYPTO_ARM_HWCAP 1
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CRYPTO_BENCH_LEN        1024    /* payload of the measured packets */
+#define CRYPTO_BENCH_PKTS       16      /* per round */
+#define CRYPTO_BENCH_ROUNDS     5       /* after a warm up one, the fastest counts */
+#define CRYPTO_MAX_TRANSFORMS   (N2N_TRANSFORM_ID_CHACHA20 + 1)
+
+static const struct {
+  uint32_t      flag;
+  const char *  name;
+} cpu_feature_names[] = {
+#ifdef CRYPTO_X86
+  { N2N_CPU_SSE2, "sse2" },
+  { N2N_CPU_AVX2, "avx2" },
+  { N2N_CPU_AES,  "aes-ni" },
+  { N2N_CPU_PMUL, "pclmul" },
+  { N2N_CPU_SHA,  "sha-ni" },
+#else
+  { N2N_CPU_NEON, "neon" },
+  { N2N_CPU_AES,  "aes" },
+  { N2N_CPU_PMUL, "pmull" },
+  { N2N_CPU_SHA,  "sha2" },
+#endif
+};
+
+/* By transform ID, num_impls is 0 until measured */
+static n2n_crypto_sel_t selections[CRYPTO_MAX_TRANSFORMS];
+
+/* ************************************** */
+
+/** @return the N2N_CPU_* flags of the crypto related features of the CPU */
+uint32_t n2n_cpu_features(void) {
+  static uint32_t features = 0;
+  static int detected = 0;
+
+  if(detected)
+    return(features);
+
+#ifdef CRYPTO_X86
+  {
+    unsigned int eax, ebx, ecx, edx;
+
+    /* Same test as chacha20.c, which also checks that the OS saves the
+     * AVX state */
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("sse2"))
+      features |= N2N_CPU_SSE2;
+
+    if(__builtin_cpu_supports("avx2"))
+      features |= N2N_CPU_AVX2;
+
+    if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      if(ecx & bit_AES)
+        features |= N2N_CPU_AES;
+
+      if(ecx & bit_PCLMUL)
+        features |= N2N_CPU_PMUL;
+    }
+
+    if(__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+      features |= N2N_CPU_SHA;
+  }
+#elif defined(CRYPTO_ARM_HWCAP)
+  {
+    unsigned long hwcap = getauxval(AT_HWCAP);
+
+#if defined(__aarch64__)
+    if(hwcap & HWCAP_ASIMD)
+      features |= N2N_CPU_NEON;
+
+    if(hwcap & HWCAP_AES)
+      features |= N2N_CPU_AES;
+
+    if(hwcap & HWCAP_PMULL)
+      features |= N2N_CPU_PMUL;
+
+    if(hwcap & HWCAP_SHA2)
+      features |= N2N_CPU_SHA;
+#else
+    unsigned long hwcap2 = getauxval(AT_HWCAP2);
+
+    if(hwcap & HWCAP_NEON)
+      features |= N2N_CPU_NEON;
+
+    if(hwcap2 & HWCAP2_AES)
+      features |= N2N_CPU_AES;
+
+    if(hwcap2 & HWCAP2_PMULL)
+      features |= N2N_CPU_PMUL;
+
+    if(hwcap2 & HWCAP2_SHA2)
+      features |= N2N_CPU_SHA;
+#endif
+  }
+#elif defined(__ARM_NEON)
+  features |= N2N_CPU_NEON;
+#endif
+
+  detected = 1;
+
+  return(features);
+}
+
+/* ************************************** */
+
+/** Write the names of the CPU features to buf, separated by spaces. */
+char* n2n_cpu_features_str(char *buf, size_t len) {
+  uint32_t features = n2n_cpu_features();
+  size_t i, off = 0;
+
+  buf[0] = '\0';
+
+  for(i=0; i<sizeof(cpu_feature_names)/sizeof(cpu_feature_names[0]); i++) {
+    if((features & cpu_feature_names[i].flag) && (off < len))
+      off += snprintf(buf + off, len - off, "%s%s", off ? " " : "", cpu_feature_names[i].name);
+  }
+
+  if(off == 0)
+    snprintf(buf, len, "none");
+
+  return(buf);
+}
+
+/* ************************************** */
+
+static uint64_t bench_ns(void) {
+#ifdef WIN32
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+
+  return((uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart));
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+/* The TSC ticks at the nominal frequency, close enough to the core cycles
+ * for telling implementations apart. 0 where there is no cycle counter. */
+static uint64_t bench_cycles(void) {
+#ifdef CRYPTO_X86
+  return(__rdtsc());
+#else
+  return(0);
+#endif
+}
+
+/* ************************************** */
+
+static int crypto_transop_init(n2n_transform_t transform_id, n2n_trans_op_t *op) {
+  n2n_edge_conf_t conf;
+
+  /* Not edge_init_conf_defaults(), which would pick up N2N_KEY */
+  memset(&conf, 0, sizeof(conf));
+  conf.transop_id = transform_id;
+  conf.encrypt_key = "n2n crypto self-benchmark";
+
+  memset(op, 0, sizeof(*op));
+
+  switch(transform_id) {
+  case N2N_TRANSFORM_ID_TWOFISH:
+    return(n2n_transop_twofish_init(&conf, op));
+  case N2N_TRANSFORM_ID_CHACHA20:
+    return(n2n_transop_cc20_init(&conf, op));
+#ifdef N2N_HAVE_AES
+  case N2N_TRANSFORM_ID_AESCBC:
+    return(n2n_transop_aes_cbc_init(&conf, op));
+  case N2N_TRANSFORM_ID_AESGCM:
+    return(n2n_transop_aes_gcm_init(&conf, op));
+#endif
+  default:
+    return(-1);
+  }
+}
+
+/* ************************************** */
+
+/* Measure the encoding of CRYPTO_BENCH_LEN byte packets by the transform,
+ * once it has been seen to get a packet back. @return 0 on success */
+static int bench_transop(n2n_transform_t transform_id, n2n_crypto_bench_t *bench) {
+  n2n_trans_op_t op;
+  n2n_mac_t mac;
+  uint8_t *plain, *enc, *dec;
+  uint64_t best_ns = UINT64_MAX, best_cycles = 0;
+  size_t bytes = CRYPTO_BENCH_PKTS * CRYPTO_BENCH_LEN;
+  int i, r, len, rc = -1;
+
+  bench->cycles_per_byte = -1;
+  bench->mbps = 0;
+
+  if(crypto_transop_init(transform_id, &op) < 0)
+    return(-1);
+
+  plain = malloc(3 * N2N_PKT_BUF_SIZE);
+
+  if(plain == NULL)
+    goto out;
+
+  enc = plain + N2N_PKT_BUF_SIZE;
+  dec = enc + N2N_PKT_BUF_SIZE;
+
+  memset(mac, 0, sizeof(mac));
+  for(i=0; i<CRYPTO_BENCH_LEN; i++)
+    plain[i] = (uint8_t)i;
+
+  len = op.fwd(&op, enc, N2N_PKT_BUF_SIZE, plain, CRYPTO_BENCH_LEN, mac);
+
+  if((len <= 0) || (op.rev(&op, dec, N2N_PKT_BUF_SIZE, enc, len, mac) != CRYPTO_BENCH_LEN)
+     || (memcmp(dec, plain, CRYPTO_BENCH_LEN) != 0)) {
+    traceEvent(TRACE_WARNING, "Self-test of transform %u failed", (unsigned int)transform_id);
+    goto out;
+  }
+
+  for(r=0; r<=CRYPTO_BENCH_ROUNDS; r++) {
+    uint64_t ns = bench_ns(), cycles = bench_cycles();
+
+    for(i=0; i<CRYPTO_BENCH_PKTS; i++)
+      op.fwd(&op, enc, N2N_PKT_BUF_SIZE, plain, CRYPTO_BENCH_LEN, mac);
+
+    ns = bench_ns() - ns;
+    cycles = bench_cycles() - cycles;
+
+    if((r > 0) && (ns < best_ns))
+      best_ns = ns, best_cycles = cycles;
+  }
+
+  if(best_ns == 0)
+    best_ns = 1;
+
+  bench->mbps = (double)bytes * 1e3 / (double)best_ns;
+  if(best_cycles)
+    bench->cycles_per_byte = (double)best_cycles / (double)bytes;
+
+  rc = 0;
+
+ out:
+  free(plain);
+  op.deinit(&op);
+
+  return(rc);
+}
+
+/* ************************************** */
+
+/* Measure the ChaCha20 kernels and bind the fastest. A kernel whose key
+ * stream differs from the portable code is never bound. */
+static void select_cc20(n2n_crypto_sel_t *sel) {
+  static const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0x4a };
+  const char *names[N2N_CRYPTO_MAX_IMPLS];
+  uint8_t raw[CHACHA20_KEY_SIZE], ref[1000], ks[sizeof(ref)];
+  chacha20_key_t key;
+  unsigned int i, num;
+  int best = -1;
+
+  num = min(chacha20_impl_list(names, N2N_CRYPTO_MAX_IMPLS), N2N_CRYPTO_MAX_IMPLS);
+
+  for(i=0; i<sizeof(raw); i++)
+    raw[i] = (uint8_t)i;
+  chacha20_set_key(&key, raw);
+
+  /* An odd length, for the strides of each width and a partial block */
+  memset(ref, 0, sizeof(ref));
+  chacha20_set_impl("portable");
+  chacha20_xor(&key, 1, nonce, ref, ref, sizeof(ref));
+
+  for(i=0; i<num; i++) {
+    n2n_crypto_bench_t *bench = &sel->impls[i];
+
+    bench->impl = names[i];
+    chacha20_set_impl(names[i]);
+
+    memset(ks, 0, sizeof(ks));
+    chacha20_xor(&key, 1, nonce, ks, ks, sizeof(ks));
+
+    if(memcmp(ks, ref, sizeof(ref)) != 0) {
+      traceEvent(TRACE_WARNING, "ChaCha20 %s kernel gives a wrong key stream, not using it", names[i]);
+      bench->cycles_per_byte = -1;
+      bench->mbps = 0;
+      continue;
+    }
+
+    if((bench_transop(N2N_TRANSFORM_ID_CHACHA20, bench) == 0)
+       && ((best < 0) || (bench->mbps > sel->impls[best].mbps)))
+      best = i;
+  }
+
+  sel->num_impls = num;
+  sel->selected = (best < 0) ? (num - 1) /* portable */ : best;
+
+  chacha20_set_impl(sel->impls[sel->selected].impl);
+}
+
+/* ************************************** */
+
+static void select_single(n2n_crypto_sel_t *sel, const char *impl) {
+  sel->impls[0].impl = impl;
+  bench_transop(sel->transform_id, &sel->impls[0]);
+
+  sel->num_impls = 1;
+  sel->selected = 0;
+}
+
+/* ************************************** */
+
+/** Run the self-benchmark of a transform, once, and bind its fastest
+ *  implementation. Not thread safe: meant for the start up, before the
+ *  transform is in use.
+ *
+ *  @return the measured implementations, NULL for the null transform and
+ *          those not compiled in
+ */
+const n2n_crypto_sel_t* n2n_crypto_select(n2n_transform_t transform_id) {
+  n2n_crypto_sel_t *sel;
+#ifdef N2N_HAVE_AES
+  uint32_t features = n2n_cpu_features();
+#endif
+
+  if(transform_id >= CRYPTO_MAX_TRANSFORMS)
+    return(NULL);
+
+  sel = &selections[transform_id];
+
+  if(sel->num_impls > 0)
+    return(sel);
+
+  sel->transform_id = transform_id;
+
+  switch(transform_id) {
+  case N2N_TRANSFORM_ID_TWOFISH:
+    sel->transform = "twofish";
+    select_single(sel, "table32");
+    break;
+  case N2N_TRANSFORM_ID_CHACHA20:
+    sel->transform = "ChaCha20";
+    select_cc20(sel);
+    break;
+#ifdef N2N_HAVE_AES
+  case N2N_TRANSFORM_ID_AESCBC:
+    sel->transform = "AES-CBC";
+    select_single(sel, (features & N2N_CPU_AES) ? "openssl+aes" : "openssl");
+    break;
+  case N2N_TRANSFORM_ID_AESGCM:
+    sel->transform = "AES-GCM";
+    select_single(sel, ((features & (N2N_CPU_AES | N2N_CPU_PMUL)) == (N2N_CPU_AES | N2N_CPU_PMUL)) ?
+                  "openssl+aes+pmul" : "openssl");
+    break;
+#endif
+  default:
+    return(NULL);
+  }
+
+  return(sel);
+}
+
+/* ************************************** */
+
+/** @return the result of an earlier n2n_crypto_select(), or NULL */
+const n2n_crypto_sel_t* n2n_crypto_selected(n2n_transform_t transform_id) {
+  if((transform_id >= CRYPTO_MAX_TRANSFORMS) || (selections[transform_id].num_impls == 0))
+    return(NULL);
+
+  return(&selections[transform_id]);
+}
+
+/* ************************************** */
+
+/** Describe the i-th implementation of sel, e.g. "avx2 1.52 cycles/byte
+ *  1734 MB/s". */
+char* n2n_crypto_bench_str(const n2n_crypto_sel_t *sel, unsigned int i, char *buf, size_t len) {
+  const n2n_crypto_bench_t *bench = &sel->impls[i];
+
+  if(bench->mbps <= 0)
+    snprintf(buf, len, "%s failed", bench->impl);
+  else if(bench->cycles_per_byte < 0)
+    snprintf(buf, len, "%s %.0f MB/s", bench->impl, bench->mbps);
+  else
+    snprintf(buf, len, "%s %.2f cycles/byte %.0f MB/s", bench->impl,
+             bench->cycles_per_byte, bench->mbps);
+
+  return(buf);
+}
@@ -0,0 +1,225 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Per-thread cryptographic random numbers, for the IVs, nonces, cookies and
+ * MAC addresses that used to come from rand(), which takes a global lock in
+ * glibc and is predictable.
+ *
+ * Each thread runs its own ChaCha20 generator with fast key erasure: a
+ * refill computes N2N_RAND_BUF_SIZE bytes of key stream, the first 32 of
+ * which replace the key at once, and every byte handed out is wiped from
+ * the buffer. A compromised state thus tells nothing about past output. The
+ * key comes from getrandom() (or /dev/urandom) the first time a thread asks
+ * for random bytes, and again in a child after fork(). */
+
+#include "n2n.h"
+#include "chacha20.h"
+
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#if defined(_MSC_VER)
+#define N2N_THREAD_LOCAL        __declspec(thread)
+#else
+#define N2N_THREAD_LOCAL        __thread
+#endif
+
+#define N2N_RAND_BUF_SIZE       (16 * 64)       /* a refill, 2 strides of the AVX2 kernel */
+
+typedef struct n2n_rand {
+  chacha20_key_t        key;
+  unsigned int          generation;     /* of the seed, see rand_generation */
+  size_t                avail;          /* unread bytes at the end of buf */
+  uint8_t               buf[N2N_RAND_BUF_SIZE];
+} n2n_rand_t;
+
+static N2N_THREAD_LOCAL n2n_rand_t rand_state;
+
+/* Bumped in the child after a fork(), so that parent and child do not share
+ * a key stream. 0 is never current: it marks a state not seeded yet. */
+static volatile unsigned int rand_generation = 1;
+
+/* ************************************** */
+
+#ifndef WIN32
+static void rand_atfork_child(void) {
+  if(++rand_generation == 0)
+    rand_generation = 1;
+}
+
+static pthread_once_t rand_atfork_once = PTHREAD_ONCE_INIT;
+
+static void rand_atfork_init(void) {
+  pthread_atfork(NULL, NULL, rand_atfork_child);
+}
+#endif
+
+/* ************************************** */
+
+/* Fill seed from the system entropy source. Where there is none, the time
+ * and the addresses at hand are better than a constant; warn about it. */
+static void rand_get_seed(uint8_t *seed, size_t len) {
+  static volatile int warned = 0;
+  uint64_t mix[4];
+  size_t i;
+
+#ifdef HAVE_GETRANDOM
+  {
+    ssize_t n;
+
+    do {
+      n = getrandom(seed, len, 0);
+    } while((n < 0) && (errno == EINTR));
+
+    if(n == (ssize_t)len)
+      return;
+  }
+#endif
+
+#ifndef WIN32
+  {
+    FILE *fd = fopen("/dev/urandom", "rb");
+
+    if(fd != NULL) {
+      size_t n = fread(seed, 1, len, fd);
+
+      fclose(fd);
+
+      if(n == len)
+        return;
+    }
+  }
+#endif
+
+  if(!warned) {
+    warned = 1;
+    traceEvent(TRACE_WARNING, "No system entropy source, random numbers are weak");
+  }
+
+  mix[0] = (uint64_t)time(NULL);
+  mix[1] = (uint64_t)clock();
+  mix[2] = (uint64_t)(uintptr_t)&rand_state;
+  mix[3] = (uint64_t)(uintptr_t)seed ^ ((uint64_t)rand() << 32);
+
+  for(i=0; i<len; i++)
+    seed[i] = (uint8_t)(mix[i % 4] >> (8 * ((i / 4) % 8)));
+}
+
+/* ************************************** */
+
+/* Compute the next buffer of key stream and move to its key. The nonce and
+ * counter can stay 0 as the key is never used twice. */
+static void rand_refill(n2n_rand_t *st) {
+  static const uint8_t nonce[CHACHA20_NONCE_SIZE] = { 0 };
+
+  memset(st->buf, 0, sizeof(st->buf));
+  chacha20_xor(&st->key, 0, nonce, st->buf, st->buf, sizeof(st->buf));
+
+  chacha20_set_key(&st->key, st->buf);
+  memset(st->buf, 0, CHACHA20_KEY_SIZE);
+
+  st->avail = sizeof(st->buf) - CHACHA20_KEY_SIZE;
+}
+
+/* ************************************** */
+
+static void rand_seed(n2n_rand_t *st) {
+  uint8_t seed[CHACHA20_KEY_SIZE];
+
+#ifndef WIN32
+  pthread_once(&rand_atfork_once, rand_atfork_init);
+#endif
+
+  rand_get_seed(seed, sizeof(seed));
+  chacha20_set_key(&st->key, seed);
+  memset(seed, 0, sizeof(seed));
+
+  st->generation = rand_generation;
+  rand_refill(st);
+}
+
+/* ************************************** */
+
+/** Fill buf with len cryptographically secure random bytes, from the
+ *  generator of the calling thread. Never fails nor blocks once the thread
+ *  is seeded. */
+void n2n_rand_bytes(void *buf, size_t len) {
+  n2n_rand_t *st = &rand_state;
+  uint8_t *out = (uint8_t *)buf;
+
+  if(st->generation != rand_generation)
+    rand_seed(st);
+
+  while(len > 0) {
+    uint8_t *src;
+    size_t n;
+
+    if(st->avail == 0)
+      rand_refill(st);
+
+    n = (len < st->avail) ? len : st->avail;
+    src = &st->buf[sizeof(st->buf) - st->avail];
+
+    memcpy(out, src, n);
+    memset(src, 0, n);
+
+    st->avail -= n;
+    out += n, len -= n;
+  }
+}
+
+/* ************************************** */
+
+/* Copy len bytes straight from the buffer when it has enough left, which
+ * the fixed size requests below mostly find: a copy and a wipe, without the
+ * loop of n2n_rand_bytes(). @return 0 on success */
+static inline int rand_take(void *out, size_t len) {
+  n2n_rand_t *st = &rand_state;
+  uint8_t *src;
+
+  if((st->avail < len) || (st->generation != rand_generation))
+    return(-1);
+
+  src = &st->buf[sizeof(st->buf) - st->avail];
+  memcpy(out, src, len);
+  memset(src, 0, len);
+  st->avail -= len;
+
+  return(0);
+}
+
+uint32_t n2n_rand32(void) {
+  uint32_t v;
+
+  if(rand_take(&v, sizeof(v)) != 0)
+    n2n_rand_bytes(&v, sizeof(v));
+
+  return(v);
+}
+
+/* ************************************** */
+
+uint64_t n2n_rand64(void) {
+  uint64_t v;
+
+  if(rand_take(&v, sizeof(v)) != 0)
+    n2n_rand_bytes(&v, sizeof(v));
+
+  return(v);
+}
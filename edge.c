@@ -44,8 +44,17 @@ typedef struct n2n_priv_config {
   char                netmask[N2N_NETMASK_STR_SIZE];
   char                device_mac[N2N_MACNAMSIZ];
   int                 mtu;
+#ifdef N2N_HAVE_TAP_MQ
+  int                 num_queues;
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  uint8_t             tap_offload;
+#endif
   uint8_t             got_s;
   uint8_t             daemon;
+#ifdef N2N_HAVE_TRACE_ASYNC
+  uint8_t             async_log;
+#endif
 #ifndef WIN32
   uid_t               userid;
   gid_t               groupid;
@@ -143,7 +152,41 @@ static void help() {
 #ifndef __APPLE__
 	 "[-D] "
 #endif
-	 "[-r] [-E] [-v] [-i <reg_interval>] [-L <reg_ttl>] [-t <mgmt port>] [-A] [-h]\n\n");
+	 "[-r] [-E] [-v] [-i <reg_interval>] [-L <reg_ttl>] [-t <mgmt port>] [-A[<cipher>]] "
+#if N2N_COMPRESSION_ENABLED
+	 "[-z[<n>]] "
+#endif
+	 "[-h]\n"
+#ifdef N2N_HAVE_MMSG
+	 "    "
+	 "[--batch <size>] [--flush <loop|immediate>]\n"
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+	 "    "
+	 "[--queues <n>] "
+#ifdef N2N_HAVE_TAP_OFFLOAD
+	 "[--offload] "
+#endif
+#ifdef N2N_HAVE_UDP_GSO
+	 "[--udp-offload] "
+#endif
+#ifdef N2N_HAVE_IO_URING
+	 "[--io-uring] "
+#endif
+#ifdef N2N_HAVE_PIPELINE
+	 "[--pipeline <lanes>] "
+#endif
+	 "[--huge-pages] "
+#if N2N_COMPRESSION_ENABLED
+	 "[--compress-dict <file>] "
+#endif
+	 "[--header-compression] "
+#ifdef N2N_HAVE_TRACE_ASYNC
+	 "[--async-log]"
+#endif
+	 "\n"
+#endif
+	 "\n");
 
 #if defined(N2N_CAN_NAME_IFACE)
   printf("-d <tun device>          | tun device name\n");
@@ -173,7 +216,16 @@ static void help() {
 #endif
   printf("-r                       | Enable packet forwarding through n2n community.\n");
 #ifdef N2N_HAVE_AES
-  printf("-A                       | Use AES CBC for encryption (default=use twofish).\n");
+  printf("-A[<cipher>]             | Select the cipher (default=use twofish): -A or -A3 for AES-CBC,\n"
+         "                         | -A4 for AES-GCM, -A5 for ChaCha20-Poly1305 (authenticated).\n");
+#else
+  printf("-A5                      | Use ChaCha20-Poly1305 for encryption (default=use twofish).\n");
+#endif
+#if N2N_COMPRESSION_ENABLED
+  printf("-z[<n>]                  | Compress the frames sent, before encryption: -z or -z1 for lzo1x,\n"
+         "                         | -z2 for lz4, -z3 for zstd (when built in). Frames that look\n"
+         "                         | incompressible are sent as they are. The peers must be recent\n"
+         "                         | enough to decompress them.\n");
 #endif
   printf("-E                       | Accept multicast MAC addresses (default=drop).\n");
   printf("-S                       | Do not connect P2P. Always use the supernode.\n");
@@ -182,6 +234,43 @@ static void help() {
 #endif
   printf("-v                       | Make more verbose. Repeat as required.\n");
   printf("-t <port>                | Management UDP Port (for multiple edges on a machine).\n");
+#ifdef N2N_HAVE_MMSG
+  printf("--batch <size>           | Move up to <size> datagrams per recvmmsg/sendmmsg call (1-%u, default 1=off).\n",
+         N2N_EDGE_BATCH_MAX);
+  printf("--flush <policy>         | When batched PACKETs are sent: 'loop' once per loop iteration (default)\n"
+         "                         | or 'immediate' as soon as each one is encoded.\n");
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+  printf("--queues <n>             | Open a multi-queue TAP and serve each queue with its own thread\n"
+         "                         | and UDP socket (1-%u, default 1).\n", N2N_TUNTAP_MAX_QUEUES);
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  printf("--offload                | Let the TAP pass TSO super frames and partial checksums, segmented\n"
+         "                         | by the edge, and coalesce the received TCP segments (GRO).\n");
+#endif
+#ifdef N2N_HAVE_UDP_GSO
+  printf("--udp-offload            | Send equal sized datagrams to a peer as one UDP_SEGMENT train (with\n"
+         "                         | --batch) and receive the trains coalesced by UDP_GRO.\n");
+#endif
+#ifdef N2N_HAVE_IO_URING
+  printf("--io-uring               | Move the TAP frames and UDP datagrams through io_uring (Linux 6.0+),\n"
+         "                         | falling back to epoll when the kernel lacks it.\n");
+#endif
+#ifdef N2N_HAVE_PIPELINE
+  printf("--pipeline <lanes>       | Split the data path into reader, crypto and writer threads, with\n"
+         "                         | <lanes> crypto threads (1-%u) fed by flow hash.\n", N2N_EDGE_PIPE_MAX_LANES);
+#endif
+  printf("--huge-pages             | Allocate the packet buffers on huge pages (falls back to normal pages).\n");
+#if N2N_COMPRESSION_ENABLED
+  printf("--compress-dict <file>   | Dictionary for -z2/-z3 (see n2n-dict), used towards the peers that\n"
+         "                         | load the same one. Shrinks short frames much further.\n");
+#endif
+  printf("--header-compression     | Send the IPv4/TCP/UDP headers of the frames as deltas, to the peers\n"
+         "                         | that announce they support it (ROHC-like), direct or via supernode.\n");
+#ifdef N2N_HAVE_TRACE_ASYNC
+  printf("--async-log              | Write the log lines from a thread of their own, so that the data\n"
+         "                         | path only queues them (lines are dropped when it falls behind).\n");
+#endif
 
   printf("\nEnvironment variables:\n");
   printf("  N2N_KEY                | Encryption key (ASCII). Not with -k.\n");
@@ -283,10 +372,50 @@ static int setOption(int optkey, char *optargument, n2n_priv_config_t *ec, n2n_e
       break;
     }
 
-#ifdef N2N_HAVE_AES
   case 'A':
     {
-      conf->transop_id = N2N_TRANSFORM_ID_AESCBC;
+#ifdef N2N_HAVE_AES
+      int cipher = optargument ? atoi(optargument) : N2N_TRANSFORM_ID_AESCBC;
+
+      if((cipher != N2N_TRANSFORM_ID_AESCBC) && (cipher != N2N_TRANSFORM_ID_AESGCM)
+         && (cipher != N2N_TRANSFORM_ID_CHACHA20)) {
+        traceEvent(TRACE_WARNING, "Unknown cipher -A%s, use -A3 (AES-CBC), -A4 (AES-GCM) or -A5 (ChaCha20-Poly1305)",
+                   optargument ? optargument : "");
+        return(-1);
+      }
+#else
+      int cipher = optargument ? atoi(optargument) : N2N_TRANSFORM_ID_INVAL;
+
+      if(cipher != N2N_TRANSFORM_ID_CHACHA20) {
+        traceEvent(TRACE_WARNING, "Unknown cipher -A%s, only -A5 (ChaCha20-Poly1305) is available in this build",
+                   optargument ? optargument : "");
+        return(-1);
+      }
+#endif
+
+      conf->transop_id = cipher;
+      break;
+    }
+
+#if N2N_COMPRESSION_ENABLED
+  case 'z':
+    {
+      int compression = optargument ? atoi(optargument) : N2N_COMPRESSION_ID_LZO;
+
+      if((compression < N2N_COMPRESSION_ID_LZO) || (compression > N2N_COMPRESSION_ID_ZSTD)
+         || !n2n_compression_supported(compression)) {
+        traceEvent(TRACE_WARNING, "Unknown or unsupported compression -z%s, use -z1 (lzo1x)"
+#ifdef N2N_HAVE_LZ4
+                   ", -z2 (lz4)"
+#endif
+#ifdef N2N_HAVE_ZSTD
+                   ", -z3 (zstd)"
+#endif
+                   , optargument ? optargument : "");
+        return(-1);
+      }
+
+      conf->compression = compression;
       break;
     }
 #endif
@@ -368,6 +497,103 @@ static int setOption(int optkey, char *optargument, n2n_priv_config_t *ec, n2n_e
     setTraceLevel(getTraceLevel() + 1);
     break;
 
+#ifdef N2N_HAVE_MMSG
+  case '[': /* --batch */
+    {
+      int size = atoi(optargument);
+
+      if((size < 1) || (size > N2N_EDGE_BATCH_MAX)) {
+        traceEvent(TRACE_WARNING, "Batch size must be between 1 and %u", N2N_EDGE_BATCH_MAX);
+        return(-1);
+      }
+
+      conf->batch_size = size;
+      break;
+    }
+
+  case ']': /* --flush */
+    {
+      if(!strcmp(optargument, "loop"))
+        conf->batch_flush = N2N_BATCH_FLUSH_LOOP;
+      else if(!strcmp(optargument, "immediate"))
+        conf->batch_flush = N2N_BATCH_FLUSH_IMMEDIATE;
+      else {
+        traceEvent(TRACE_WARNING, "Unknown flush policy '%s'", optargument);
+        return(-1);
+      }
+      break;
+    }
+#endif
+
+#ifdef N2N_HAVE_TAP_MQ
+  case '{': /* --queues */
+    {
+      int num = atoi(optargument);
+
+      if((num < 1) || (num > N2N_TUNTAP_MAX_QUEUES)) {
+        traceEvent(TRACE_WARNING, "Number of queues must be between 1 and %u", N2N_TUNTAP_MAX_QUEUES);
+        return(-1);
+      }
+
+      ec->num_queues = num;
+      break;
+    }
+#endif
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  case '}': /* --offload */
+    ec->tap_offload = 1;
+    break;
+#endif
+
+#ifdef N2N_HAVE_UDP_GSO
+  case '@': /* --udp-offload */
+    conf->udp_offload = 1;
+    break;
+#endif
+
+#ifdef N2N_HAVE_IO_URING
+  case '#': /* --io-uring */
+    conf->io_uring = 1;
+    break;
+#endif
+
+#ifdef N2N_HAVE_PIPELINE
+  case '~': /* --pipeline */
+    {
+      int num = atoi(optargument);
+
+      if((num < 1) || (num > N2N_EDGE_PIPE_MAX_LANES)) {
+        traceEvent(TRACE_WARNING, "Number of pipeline lanes must be between 1 and %u", N2N_EDGE_PIPE_MAX_LANES);
+        return(-1);
+      }
+
+      conf->pipeline_lanes = num;
+      break;
+    }
+#endif
+
+  case '^': /* --huge-pages */
+    conf->buf_hugepages = 1;
+    break;
+
+  case '%': /* --header-compression */
+    conf->header_compression = 1;
+    break;
+
+#if N2N_COMPRESSION_ENABLED
+  case '&': /* --compress-dict */
+    if(conf->compress_dict) free(conf->compress_dict);
+    conf->compress_dict = strdup(optargument);
+    break;
+#endif
+
+#ifdef N2N_HAVE_TRACE_ASYNC
+  case '$': /* --async-log */
+    ec->async_log = 1;
+    break;
+#endif
+
   default:
     {
       traceEvent(TRACE_WARNING, "Unknown option -%c: Ignored", (char)optkey);
@@ -388,6 +614,33 @@ static const struct option long_options[] = {
   { "egid",            required_argument, NULL, 'g' },
   { "help"   ,         no_argument,       NULL, 'h' },
   { "verbose",         no_argument,       NULL, 'v' },
+#ifdef N2N_HAVE_MMSG
+  { "batch",           required_argument, NULL, '[' },
+  { "flush",           required_argument, NULL, ']' },
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+  { "queues",          required_argument, NULL, '{' },
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  { "offload",         no_argument,       NULL, '}' },
+#endif
+#ifdef N2N_HAVE_UDP_GSO
+  { "udp-offload",     no_argument,       NULL, '@' },
+#endif
+#ifdef N2N_HAVE_IO_URING
+  { "io-uring",        no_argument,       NULL, '#' },
+#endif
+#ifdef N2N_HAVE_PIPELINE
+  { "pipeline",        required_argument, NULL, '~' },
+#endif
+  { "huge-pages",      no_argument,       NULL, '^' },
+#if N2N_COMPRESSION_ENABLED
+  { "compress-dict",   required_argument, NULL, '&' },
+#endif
+  { "header-compression", no_argument,    NULL, '%' },
+#ifdef N2N_HAVE_TRACE_ASYNC
+  { "async-log",       no_argument,       NULL, '$' },
+#endif
   { NULL,              0,                 NULL,  0  }
 };
 
@@ -398,10 +651,7 @@ static int loadFromCLI(int argc, char *argv[], n2n_edge_conf_t *conf, n2n_priv_c
   u_char c;
 
   while((c = getopt_long(argc, argv,
-			 "k:a:bc:Eu:g:m:M:s:d:l:p:fvhrt:i:SDL:"
-#ifdef N2N_HAVE_AES
-			 "A"
-#endif
+			 "k:a:bc:Eu:g:m:M:s:d:l:p:fvhrt:i:SDL:A::z::"
 #ifdef __linux__
 			 "T:"
 #endif
@@ -637,6 +887,9 @@ int main(int argc, char* argv[]) {
   edge_init_conf_defaults(&conf);
   memset(&ec, 0, sizeof(ec));
   ec.mtu = DEFAULT_MTU;
+#ifdef N2N_HAVE_TAP_MQ
+  ec.num_queues = 1;
+#endif
   ec.daemon = 1;    /* By default run in daemon mode. */
 
 #ifndef WIN32
@@ -701,8 +954,23 @@ int main(int argc, char* argv[]) {
   /* setgid(0); */
 #endif
 
+#ifdef N2N_HAVE_TAP_MQ
+  {
+    int tuntap_flags = 0;
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if(ec.tap_offload)
+      tuntap_flags |= N2N_TUNTAP_F_OFFLOAD;
+#endif
+
+    if(tuntap_open_mq(&tuntap, ec.tuntap_dev_name, ec.ip_mode, ec.ip_addr, ec.netmask, ec.device_mac, ec.mtu,
+                      ec.num_queues, tuntap_flags) < 0)
+      return(-1);
+  }
+#else
   if(tuntap_open(&tuntap, ec.tuntap_dev_name, ec.ip_mode, ec.ip_addr, ec.netmask, ec.device_mac, ec.mtu) < 0)
     return(-1);
+#endif
 
   if(conf.encrypt_key && !strcmp((char*)conf.community_name, conf.encrypt_key))
     traceEvent(TRACE_WARNING, "Community and encryption key must differ, otherwise security will be compromised");
@@ -719,6 +987,12 @@ int main(int argc, char* argv[]) {
   }
 #endif /* #ifndef WIN32 */
 
+#ifdef N2N_HAVE_TRACE_ASYNC
+  /* After daemonize(), which only keeps the calling thread */
+  if(ec.async_log)
+    traceAsyncStart();
+#endif
+
 #ifndef WIN32
   if((ec.userid != 0) || (ec.groupid != 0)) {
     traceEvent(TRACE_NORMAL, "Dropping privileges to uid=%d, gid=%d",
@@ -754,6 +1028,11 @@ int main(int argc, char* argv[]) {
   tuntap_close(&tuntap);
 
   if(conf.encrypt_key) free(conf.encrypt_key);
+  if(conf.compress_dict) free(conf.compress_dict);
+
+#ifdef N2N_HAVE_TRACE_ASYNC
+  traceAsyncStop();
+#endif
 
   return(rc);
 }
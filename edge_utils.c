@@ -30,6 +30,33 @@
 #include <tun2tap/tun2tap.h>
 #endif /* __ANDROID_NDK__ */
 
+#ifdef N2N_HAVE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#if defined(N2N_HAVE_IO_URING) || defined(N2N_HAVE_PIPELINE)
+#include <poll.h>
+#endif
+
+#ifdef N2N_HAVE_PIPELINE
+#include <sys/eventfd.h>
+#endif
+
+#ifdef N2N_HAVE_UDP_GSO
+#include <netinet/udp.h>
+#ifndef SOL_UDP
+#define SOL_UDP                         17
+#endif
+/* Missing from the headers of older C libraries */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT                     103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO                         104
+#endif
+#endif
+
 
 #define SOCKET_TIMEOUT_INTERVAL_SECS    10
 #define REGISTER_SUPER_INTERVAL_DFL     20 /* sec, usually UDP NAT entries in a firewall expire after 30 seconds */
@@ -41,6 +68,44 @@
 #define ARP_PERIOD_INTERVAL             (10) /* sec */
 #endif
 
+#ifdef N2N_HAVE_EPOLL
+#define EDGE_TIMER_TICK_MS              100  /* timer wheel resolution */
+#define EDGE_EPOLL_MAX_EVENTS           16
+#define EDGE_EPOLL_BUDGET               64   /* frames handled per fd before looking at the others */
+#endif
+
+#ifdef N2N_HAVE_UDP_GSO
+#define EDGE_UDP_GSO_MAX_SEGS           64    /* UDP_MAX_SEGMENTS of the oldest kernels with UDP_SEGMENT */
+#define EDGE_UDP_GSO_MAX_BYTES          65507 /* largest UDP payload over IPv4 */
+#define EDGE_UDP_GRO_BUFS               8     /* coalesced trains read per recvmmsg() */
+#define EDGE_UDP_GRO_BUF_SIZE           65536
+#endif
+
+#ifdef N2N_HAVE_IO_URING
+#define EDGE_URING_ENTRIES              256
+#define EDGE_URING_CQ_ENTRIES           1024
+#define EDGE_URING_RX_BUFS              256  /* provided buffers per receiving fd */
+#define EDGE_URING_RX_BUF_SIZE          (N2N_PKT_BUF_SIZE + 128) /* with room for the recvmsg header */
+#define EDGE_URING_TX_SLOTS             128  /* TAP writes and UDP sends in flight */
+#define EDGE_IORING_OP_READ_MULTISHOT   49   /* Linux 6.7, newer than most headers */
+
+/* Fixed files and buffer groups of a worker ring */
+#define EDGE_URING_FILE_TAP             0
+#define EDGE_URING_FILE_UDP             1
+#define EDGE_URING_BGID_TAP             0
+#define EDGE_URING_BGID_UDP             1
+#endif
+
+#define EDGE_BUF_POOL_SIZE              (2 * N2N_EDGE_BATCH_MAX) /* TAP frames per worker, some queued in the TX batch */
+#define EDGE_TX_CRYPT_MAX               16   /* TAP frames encoded per fwd_batch() call */
+#define EDGE_COMPRESSION_HDR            0x80 /* with an N2N_COMPRESSION_ID_*: send with N2N_FLAGS_HDR_COMPRESSION */
+
+#ifdef N2N_HAVE_PIPELINE
+#define EDGE_PIPE_RING_SIZE             256  /* frames queued between two stages */
+#define EDGE_PIPE_BUDGET                64   /* frames a stage takes from a ring before looking at the others */
+#define EDGE_PIPE_POOL_SIZE(lanes)      ((4 * (lanes) + 1) * EDGE_PIPE_RING_SIZE) /* all rings full, plus a burst per stage */
+#endif
+
 #define ETH_FRAMESIZE 14
 #define IP4_SRCOFFSET 12
 #define IP4_DSTOFFSET 16
@@ -62,6 +127,16 @@ static void check_known_peer_sock_change(n2n_edge_t * eee,
 			 const n2n_mac_t mac,
 			 const n2n_sock_t * peer,
 			 time_t when);
+struct n2n_edge_worker;
+static void flush_tx_crypt(struct n2n_edge_worker * w);
+#ifdef N2N_HAVE_MMSG
+struct n2n_edge_batch;
+static void setup_batch(struct n2n_edge_batch * b);
+#endif
+#ifdef N2N_HAVE_PIPELINE
+static int edge_init_pipe(n2n_edge_t *eee);
+static void edge_free_pipe(n2n_edge_t *eee);
+#endif
 
 /* ************************************** */
 
@@ -79,6 +154,9 @@ int edge_verify_conf(const n2n_edge_conf_t *conf) {
      ((conf->encrypt_key != NULL) && (conf->transop_id == N2N_TRANSFORM_ID_NULL)))
     return(-4);
 
+  if((conf->batch_size < 1) || (conf->batch_size > N2N_EDGE_BATCH_MAX))
+    return(-5);
+
   return(0);
 }
 
@@ -91,6 +169,223 @@ struct n2n_edge_stats {
   uint32_t rx_sup;
   uint32_t tx_sup_broadcast;
   uint32_t rx_sup_broadcast;
+  uint64_t rx_batches;       /* recvmmsg() calls returning data */
+  uint64_t rx_batched_pkts;  /* datagrams received by those calls */
+  uint64_t tx_batches;       /* sendmmsg() calls */
+  uint64_t tx_batched_pkts;  /* datagrams sent by those calls */
+  uint64_t tx_tso_frames;    /* TSO super frames read from the TAP */
+  uint64_t tx_tso_segs;      /* segments cut from them */
+  uint64_t rx_gro_frames;    /* coalesced frames written to the TAP */
+  uint64_t rx_gro_segs;      /* segments merged into them */
+  uint64_t tx_udp_trains;    /* UDP_SEGMENT sends of more than one datagram */
+  uint64_t tx_udp_segs;      /* datagrams sent by them */
+  uint64_t rx_udp_trains;    /* UDP_GRO reads of more than one datagram */
+  uint64_t rx_udp_segs;      /* datagrams split from them */
+  uint64_t uring_enters;     /* io_uring_enter() calls of the io_uring loop */
+  uint64_t uring_cqes;       /* completions reaped by them */
+};
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_MMSG
+/** A set of datagrams moved with a single recvmmsg()/sendmmsg() call. */
+struct n2n_edge_batch {
+  unsigned int        count;                  /**< Number of slots in use (TX only). */
+  struct mmsghdr      msgs[N2N_EDGE_BATCH_MAX];
+  struct iovec        iovs[N2N_EDGE_BATCH_MAX];
+  struct sockaddr_in  addrs[N2N_EDGE_BATCH_MAX];
+  uint8_t             bufs[N2N_EDGE_BATCH_MAX][N2N_PKT_BUF_SIZE];
+  n2n_buf_t *         owned[N2N_EDGE_BATCH_MAX];   /**< Pool buffer sent instead of bufs[i] (TX only). */
+};
+#endif
+
+/* ************************************** */
+
+/** Frames of a TAP burst waiting to be encoded with a single fwd_batch()
+ *  call of the transop, in pool buffers. */
+struct n2n_edge_tx_crypt {
+  unsigned int        count;
+  n2n_trans_pkt_t     pkts[EDGE_TX_CRYPT_MAX];
+};
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_UDP_GSO
+/** A control message carrying the segment size of a UDP train. */
+union n2n_udp_seg_cmsg {
+  char                buf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr      align;
+};
+
+/** The TX batch regrouped into UDP_SEGMENT trains: consecutive datagrams of
+ *  the same size towards the same peer leave as a single message. */
+struct n2n_edge_udp_gso {
+  struct mmsghdr          msgs[N2N_EDGE_BATCH_MAX];
+  unsigned int            first[N2N_EDGE_BATCH_MAX];   /**< First batch slot of each train. */
+  union n2n_udp_seg_cmsg  ctrl[N2N_EDGE_BATCH_MAX];
+};
+
+/** Receive buffers large enough for the trains coalesced by UDP_GRO. */
+struct n2n_edge_udp_gro {
+  struct mmsghdr          msgs[EDGE_UDP_GRO_BUFS];
+  struct iovec            iovs[EDGE_UDP_GRO_BUFS];
+  struct sockaddr_in      addrs[EDGE_UDP_GRO_BUFS];
+  union n2n_udp_seg_cmsg  ctrl[EDGE_UDP_GRO_BUFS];
+  uint8_t                 bufs[EDGE_UDP_GRO_BUFS][EDGE_UDP_GRO_BUF_SIZE];
+};
+#endif
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_IO_URING
+/* Kinds of requests, in the upper half of the SQE user_data */
+enum edge_uring_req {
+  EDGE_URING_REQ_TAP_READ = 1,
+  EDGE_URING_REQ_UDP_RECV,
+  EDGE_URING_REQ_TX,                            /**< Lower half: the TX slot. */
+  EDGE_URING_REQ_POLL,                          /**< Lower half: the polled fd. */
+  EDGE_URING_REQ_CANCEL
+};
+
+#define EDGE_URING_UD(req, val)         (((uint64_t)(req) << 32) | (uint32_t)(val))
+
+/** A TAP write or a UDP send. Its buffer belongs to the kernel until the
+ *  completion comes back. */
+struct n2n_edge_uring_slot {
+  struct msghdr       hdr;
+  struct iovec        iov;
+  struct sockaddr_in  addr;
+  uint8_t             buf[N2N_PKT_BUF_SIZE];
+};
+
+/** io_uring data path of a worker, only allocated while edge_uring_loop()
+ *  runs. Receives stay posted as multishot requests filling provided
+ *  buffers; writes and sends are queued from TX slots and submitted once per
+ *  loop turn together with the wait for completions. */
+struct n2n_edge_uring {
+  n2n_uring_t         ring;
+  n2n_uring_bufs_t    tap_bufs;
+  n2n_uring_bufs_t    udp_bufs;
+  struct msghdr       recv_hdr;                 /**< Layout of the multishot recvmsg buffers. */
+  uint8_t             tap_multishot;            /**< The kernel has IORING_OP_READ_MULTISHOT. */
+  unsigned            inflight;                 /**< Requests with a final completion still due. */
+  int                 tx_cur;                   /**< Slot handed out by uring_tx_buf(), -1 if none. */
+  unsigned            num_free;
+  uint16_t            free_slots[EDGE_URING_TX_SLOTS];
+  struct n2n_edge_uring_slot slots[EDGE_URING_TX_SLOTS];
+};
+#endif
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+/** Buffers used when the TAP has IFF_VNET_HDR, allocated per worker. */
+struct n2n_edge_offload {
+  uint8_t             tap_buf[sizeof(struct virtio_net_hdr) + N2N_GSO_MAX_SIZE];
+  uint8_t             seg_buf[N2N_PKT_BUF_SIZE];       /**< TSO segment being sent. */
+  n2n_gro_t           gro;                            /**< Frames towards the TAP. */
+};
+#endif
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_PIPELINE
+/* With --pipeline the data path of the edge is split into stages, each on a
+ * thread of its own:
+ *
+ *   TAP reader -> tx_in -> crypto lane -> udp_out -> UDP writer
+ *   UDP reader -> rx_in -> crypto lane -> tap_out -> TAP writer
+ *
+ * The frames travel in buffers of a shared pool over SPSC rings, one per
+ * direction and lane. The readers pick the lane of a frame from its flow (the
+ * addresses and ports of the inner packet, the peer of a datagram), and every
+ * ring is FIFO, so the frames of a flow keep their order. */
+
+/** Lets a stage sleep on an eventfd while its input rings are empty. */
+struct n2n_edge_pipe_waiter {
+  int                 efd;
+  int                 sleeping;               /**< Set by the stage before it sleeps. */
+};
+
+struct n2n_edge_pipe_stage {
+  uint64_t            pkts;                   /**< Frames or datagrams passed on. */
+  uint64_t            drops;                  /**< Next ring full, no free buffer or I/O error. */
+};
+
+struct n2n_edge_pipe;
+
+/** A crypto worker and the rings around it. */
+struct n2n_edge_pipe_lane {
+  struct n2n_edge_pipe *   pipe;
+  struct n2n_edge_worker * w;                 /**< Private transop and stats. */
+  n2n_ring_t          tx_in;                  /**< From the TAP reader: frames to encode. */
+  n2n_ring_t          rx_in;                  /**< From the UDP reader: datagrams to decode. */
+  n2n_ring_t          udp_out;                /**< To the UDP writer: PACKETs, destination in buf->peer. */
+  n2n_ring_t          tap_out;                /**< To the TAP writer: decoded frames. */
+  n2n_buf_t *         rx_buf;                 /**< Datagram being handled, until its frame is queued. */
+  struct n2n_edge_pipe_waiter wait;
+  struct n2n_edge_pipe_stage stats;
+  pthread_t           thread;
+};
+
+struct n2n_edge_pipe {
+  n2n_edge_t *        eee;
+  int *               keep_running;
+  n2n_buf_pool_t      pool;                   /**< Shared by all the stages. */
+  int                 num_lanes;
+  struct n2n_edge_pipe_lane lanes[N2N_EDGE_PIPE_MAX_LANES];
+  struct n2n_edge_pipe_waiter udp_wr_wait;
+  struct n2n_edge_pipe_waiter tap_wr_wait;
+  struct n2n_edge_pipe_stage tap_rd;
+  struct n2n_edge_pipe_stage udp_rd;
+  struct n2n_edge_pipe_stage udp_wr;
+  struct n2n_edge_pipe_stage tap_wr;
+  pthread_t           tap_rd_thread;
+  pthread_t           udp_rd_thread;
+  pthread_t           udp_wr_thread;
+  pthread_t           tap_wr_thread;
+};
+#endif
+
+/* ************************************** */
+
+/** Data path state of a thread moving frames between a TAP queue and a UDP
+ *  socket. Worker 0 runs inside run_edge_loop() on eee->device.fd and
+ *  eee->udp_sock; with a multi-queue TAP every other queue gets a worker
+ *  thread of its own. The peer tables are shared by all the workers. */
+struct n2n_edge_worker {
+  n2n_edge_t *          eee;
+  int                   idx;
+  int                   tap_fd;                 /**< TAP queue served by this worker. */
+  int                   udp_sock;               /**< Shares the edge UDP port via SO_REUSEPORT. */
+  n2n_trans_op_t        transop;                /**< Private transop instance, no locking needed. */
+  n2n_buf_pool_t        pool;                   /**< Buffers for the frames read from the TAP. */
+#ifdef N2N_HAVE_MMSG
+  /* Batched I/O, allocated only when conf.batch_size > 1 */
+  struct n2n_edge_batch * rx_batch;
+  struct n2n_edge_batch * tx_batch;
+#endif
+  struct n2n_edge_tx_crypt * tx_crypt;          /**< Only with a fwd_batch transop and bursts of frames. */
+  n2n_compress_t        compress;               /**< Of the frames sent, see conf.compression. */
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  struct n2n_edge_offload * offload;            /**< Only when the TAP has IFF_VNET_HDR. */
+#endif
+#ifdef N2N_HAVE_UDP_GSO
+  /* UDP offloads, allocated only when conf.udp_offload is set and the kernel supports them */
+  struct n2n_edge_udp_gso * udp_gso;            /**< Also needs the TX batch. */
+  struct n2n_edge_udp_gro * udp_gro;
+#endif
+#ifdef N2N_HAVE_IO_URING
+  struct n2n_edge_uring * uring;                /**< Only while the io_uring loop runs. */
+#endif
+#ifdef N2N_HAVE_PIPELINE
+  struct n2n_edge_pipe_lane * lane;             /**< Only for the crypto workers of the pipeline. */
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+  pthread_t             thread;
+  int *                 keep_running;
+#endif
+  struct n2n_edge_stats stats;
 };
 
 /* ************************************** */
@@ -103,9 +398,18 @@ struct n2n_edge {
   uint8_t             sn_wait;                /**< Whether we are waiting for a supernode response. */
   size_t              sup_attempts;           /**< Number of remaining attempts to this supernode. */
   tuntap_dev          device;                 /**< All about the TUNTAP device */
-  n2n_trans_op_t      transop;                /**< The transop to use when encoding */
   n2n_cookie_t        last_cookie;            /**< Cookie sent in last REGISTER_SUPER. */
 
+  /* Data path */
+  struct n2n_edge_worker * workers;           /**< One per TAP queue, workers[0] is the main loop. */
+  int                 num_workers;
+#ifdef N2N_HAVE_PIPELINE
+  struct n2n_edge_pipe * pipe;                /**< With --pipeline, workers[1..] are its crypto lanes. */
+#endif
+  n2n_compress_dict_t compress_dict;          /**< Shared by the workers, id 0 when none. */
+  n2n_hc_t            hc;                     /**< Inner header compression, under peers_lock. */
+  n2n_PACKET_tmpl_t   pkt_tmpl;               /**< Header of the PACKETs sent, see stamp_packet_hdr(). */
+
   /* Sockets */
   n2n_sock_t          supernode;
   int                 udp_sock;
@@ -120,6 +424,9 @@ struct n2n_edge {
   /* Peers */
   struct peer_info *  known_peers;            /**< Edges we are connected to. */
   struct peer_info *  pending_peers;          /**< Edges we have tried to register with. */
+#ifdef N2N_HAVE_TAP_MQ
+  pthread_mutex_t     peers_lock;             /**< Protects the peer lists when num_workers > 1. */
+#endif
 
   /* Timers */
   time_t              last_register_req;      /**< Check if time to re-register with super*/
@@ -127,17 +434,42 @@ struct n2n_edge {
   time_t              last_sup;               /**< Last time a packet arrived from supernode. */
   time_t              start_time;             /**< For calculating uptime */
 
-  /* Statistics */
-  struct n2n_edge_stats stats;
 };
 
 /* ************************************** */
 
+#ifdef N2N_HAVE_PIPELINE
+#define pipe_active(eee)        ((eee)->pipe != NULL)
+#else
+#define pipe_active(eee)        0
+#endif
+
+/* ************************************** */
+
+/* The peer lists are only shared when there are worker threads */
+static void peers_lock(n2n_edge_t * eee) {
+#ifdef N2N_HAVE_TAP_MQ
+  if(eee->num_workers > 1)
+    pthread_mutex_lock(&eee->peers_lock);
+#endif
+}
+
+static void peers_unlock(n2n_edge_t * eee) {
+#ifdef N2N_HAVE_TAP_MQ
+  if(eee->num_workers > 1)
+    pthread_mutex_unlock(&eee->peers_lock);
+#endif
+}
+
+/* ************************************** */
+
 static const char* transop_str(enum n2n_transform tr) {
   switch(tr) {
   case N2N_TRANSFORM_ID_NULL:    return("null");
   case N2N_TRANSFORM_ID_TWOFISH: return("twofish");
   case N2N_TRANSFORM_ID_AESCBC:  return("AES-CBC");
+  case N2N_TRANSFORM_ID_AESGCM:  return("AES-GCM");
+  case N2N_TRANSFORM_ID_CHACHA20: return("ChaCha20");
   default:                       return("invalid");
   };
 }
@@ -187,14 +519,149 @@ static int is_ip6_discovery(const void * buf, size_t bufsize) {
 
 /* ************************************** */
 
+/** Initialise a transop instance as selected by the edge configuration. */
+static int edge_init_transop(n2n_edge_t *eee, n2n_trans_op_t *transop) {
+  int rc;
+
+  switch(eee->conf.transop_id) {
+  case N2N_TRANSFORM_ID_TWOFISH:
+    rc = n2n_transop_twofish_init(&eee->conf, transop);
+    break;
+  case N2N_TRANSFORM_ID_CHACHA20:
+    rc = n2n_transop_cc20_init(&eee->conf, transop);
+    break;
+#ifdef N2N_HAVE_AES
+  case N2N_TRANSFORM_ID_AESCBC:
+    rc = n2n_transop_aes_cbc_init(&eee->conf, transop);
+    break;
+  case N2N_TRANSFORM_ID_AESGCM:
+    rc = n2n_transop_aes_gcm_init(&eee->conf, transop);
+    break;
+#endif
+  default:
+    rc = n2n_transop_null_init(&eee->conf, transop);
+  }
+
+  if((rc < 0) || (transop->fwd == NULL) || (transop->transform_id != eee->conf.transop_id)) {
+    traceEvent(TRACE_ERROR, "Transop init failed");
+    return((rc < 0) ? rc : -1);
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Release the resources owned by the workers, not their sockets. */
+static void edge_free_workers(n2n_edge_t *eee) {
+  int i;
+
+#ifdef N2N_HAVE_PIPELINE
+  edge_free_pipe(eee);
+#endif
+
+  for(i=0; i<eee->num_workers; i++) {
+    struct n2n_edge_worker *w = &eee->workers[i];
+
+    if(w->transop.deinit)
+      w->transop.deinit(&w->transop);
+    n2n_buf_pool_free(&w->pool);
+    n2n_compress_free(&w->compress);
+#ifdef N2N_HAVE_MMSG
+    if(w->rx_batch) free(w->rx_batch);
+    if(w->tx_batch) free(w->tx_batch);
+#endif
+    if(w->tx_crypt) free(w->tx_crypt);
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if(w->offload) free(w->offload);
+#endif
+#ifdef N2N_HAVE_UDP_GSO
+    if(w->udp_gso) free(w->udp_gso);
+    if(w->udp_gro) free(w->udp_gro);
+#endif
+  }
+
+  free(eee->workers);
+  eee->workers = NULL;
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_UDP_GSO
+/** Enable UDP_SEGMENT and UDP_GRO on the worker sockets. Either of them is
+ *  left off, with a warning, when the running kernel does not know it.
+ *
+ *  @return -1 when the buffers cannot be allocated, 0 otherwise
+ */
+static int edge_init_udp_offload(n2n_edge_t *eee) {
+  int i, num_gso = 0, num_gro = 0;
+
+  for(i=0; i<eee->num_workers; i++) {
+    struct n2n_edge_worker *w = &eee->workers[i];
+    int sockopt = 0;
+
+    /* Trains are cut from the TX batch. A zero default segment size only
+     * checks that the kernel knows UDP_SEGMENT (4.18+). */
+    if(w->tx_batch) {
+      if(setsockopt(w->udp_sock, SOL_UDP, UDP_SEGMENT, &sockopt, sizeof(sockopt)) < 0)
+        traceEvent(TRACE_WARNING, "UDP_SEGMENT not supported [%d]: %s", errno, strerror(errno));
+      else {
+        if((w->udp_gso = calloc(1, sizeof(struct n2n_edge_udp_gso))) == NULL)
+          goto udp_offload_nomem;
+        num_gso++;
+      }
+    }
+
+    sockopt = 1;
+
+    if(setsockopt(w->udp_sock, SOL_UDP, UDP_GRO, &sockopt, sizeof(sockopt)) < 0)
+      traceEvent(TRACE_WARNING, "UDP_GRO not supported [%d]: %s", errno, strerror(errno));
+    else {
+      struct n2n_edge_udp_gro *g;
+      int j;
+
+      if((g = w->udp_gro = calloc(1, sizeof(struct n2n_edge_udp_gro))) == NULL)
+        goto udp_offload_nomem;
+
+      for(j=0; j<EDGE_UDP_GRO_BUFS; j++) {
+        g->iovs[j].iov_base = g->bufs[j];
+        g->iovs[j].iov_len = EDGE_UDP_GRO_BUF_SIZE;
+        g->msgs[j].msg_hdr.msg_name = &g->addrs[j];
+        g->msgs[j].msg_hdr.msg_iov = &g->iovs[j];
+        g->msgs[j].msg_hdr.msg_iovlen = 1;
+        g->msgs[j].msg_hdr.msg_control = g->ctrl[j].buf;
+      }
+      num_gro++;
+    }
+  }
+
+  if(eee->workers[0].tx_batch == NULL)
+    traceEvent(TRACE_WARNING, "UDP segmentation needs --batch, datagrams are sent one by one");
+
+  traceEvent(TRACE_NORMAL, "UDP offloads enabled [segmentation %s, receive coalescing %s]",
+             num_gso ? "on" : "off", num_gro ? "on" : "off");
+
+  if((num_gso == 0) && (num_gro == 0))
+    eee->conf.udp_offload = 0;
+
+  return(0);
+
+udp_offload_nomem:
+  traceEvent(TRACE_ERROR, "Cannot allocate UDP offload buffers");
+  return(-1);
+}
+#endif
+
+/* ************************************** */
+
 /** Initialise an edge to defaults.
  *
  *  This also initialises the NULL transform operation opstruct.
  */
 n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *rv) {
-  n2n_transform_t transop_id = conf->transop_id;
   n2n_edge_t *eee = calloc(1, sizeof(n2n_edge_t));
   int rc = -1, i;
+  const n2n_crypto_sel_t *sel;
 
   if((rc = edge_verify_conf(conf)) != 0) {
     traceEvent(TRACE_ERROR, "Invalid configuration");
@@ -218,12 +685,13 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
   eee->pending_peers  = NULL;
   eee->sup_attempts = N2N_EDGE_SUP_ATTEMPTS;
 
-#ifdef NOT_USED
   if(lzo_init() != LZO_E_OK) {
     traceEvent(TRACE_ERROR, "LZO compression error");
     goto edge_init_error;
   }
-#endif
+
+  if(conf->compress_dict && (n2n_compress_dict_load(&eee->compress_dict, conf->compress_dict) < 0))
+    goto edge_init_error;
 
   for(i=0; i<conf->sn_num; ++i)
     traceEvent(TRACE_NORMAL, "supernode %u => %s\n", i, (conf->sn_ip_array[i]));
@@ -231,26 +699,68 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
   /* Set the active supernode */
   supernode2addr(&(eee->supernode), conf->sn_ip_array[eee->sn_idx]);
 
-  /* Set active transop */
-  switch(transop_id) {
-  case N2N_TRANSFORM_ID_TWOFISH:
-    rc = n2n_transop_twofish_init(&eee->conf, &eee->transop);
-    break;
-#ifdef N2N_HAVE_AES
-  case N2N_TRANSFORM_ID_AESCBC:
-    rc = n2n_transop_aes_cbc_init(&eee->conf, &eee->transop);
-    break;
+  /* One data path worker per TAP queue, each with its own transop */
+  eee->num_workers = 1;
+#ifdef N2N_HAVE_TAP_MQ
+  if(dev->num_queues > 1)
+    eee->num_workers = dev->num_queues;
+  pthread_mutex_init(&eee->peers_lock, NULL);
+#endif
+
+  if(conf->pipeline_lanes > 0) {
+#ifdef N2N_HAVE_PIPELINE
+    /* The pipeline has its own threads around a single TAP queue and UDP
+     * socket, the offloads and io_uring are bound to the workers */
+    if((dev->num_queues > 1) || dev->vnet_hdr || conf->udp_offload || conf->io_uring) {
+      traceEvent(TRACE_WARNING, "--pipeline cannot be combined with multiple TAP queues, the offloads or io_uring, ignoring it");
+      eee->conf.pipeline_lanes = 0;
+    } else
+      eee->num_workers = 1 + min(conf->pipeline_lanes, N2N_EDGE_PIPE_MAX_LANES);
+#else
+    traceEvent(TRACE_WARNING, "The pipelined data path is not supported on this platform, ignoring it");
+    eee->conf.pipeline_lanes = 0;
 #endif
-  default:
-    rc = n2n_transop_null_init(&eee->conf, &eee->transop);
   }
 
-  if((rc < 0) || (eee->transop.fwd == NULL) || (eee->transop.transform_id != transop_id)) {
-    traceEvent(TRACE_ERROR, "Transop init failed");
+  /* Bind the fastest implementation of the transform before its first use */
+  if((sel = n2n_crypto_select(conf->transop_id)) != NULL) {
+    char impl[64], cpu[64];
+
+    traceEvent(TRACE_NORMAL, "%s using %s [CPU: %s]", sel->transform,
+               n2n_crypto_bench_str(sel, sel->selected, impl, sizeof(impl)),
+               n2n_cpu_features_str(cpu, sizeof(cpu)));
+  }
+
+  if((eee->workers = calloc(eee->num_workers, sizeof(struct n2n_edge_worker))) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot allocate memory");
     goto edge_init_error;
   }
 
-  if(eee->transop.no_encryption)
+  for(i=0; i<eee->num_workers; i++) {
+    eee->workers[i].eee = eee;
+    eee->workers[i].idx = i;
+
+    if((rc = edge_init_transop(eee, &eee->workers[i].transop)) < 0)
+      goto edge_init_error;
+
+    if((rc = n2n_buf_pool_init(&eee->workers[i].pool, EDGE_BUF_POOL_SIZE,
+                               conf->buf_hugepages ? N2N_BUF_POOL_HUGEPAGES : 0)) < 0)
+      goto edge_init_error;
+
+    if((rc = n2n_compress_init(&eee->workers[i].compress, conf->compression,
+                                 &eee->compress_dict)) < 0)
+      goto edge_init_error;
+  }
+
+  encode_PACKET_tmpl(&eee->pkt_tmpl, conf->community_name, dev->mac_addr, conf->transop_id);
+
+  if(conf->compression != N2N_COMPRESSION_ID_NONE)
+    traceEvent(TRACE_NORMAL, "Compressing the frames sent with %s", n2n_compression_str(conf->compression));
+
+  if(conf->header_compression)
+    traceEvent(TRACE_NORMAL, "Compressing the inner headers towards the peers that support it");
+
+  if(eee->workers[0].transop.no_encryption)
     traceEvent(TRACE_WARNING, "Encryption is disabled in edge");
 
   if(edge_init_sockets(eee, conf->local_port, conf->mgmt_port, conf->tos) < 0) {
@@ -258,13 +768,96 @@ n2n_edge_t* edge_init(const tuntap_dev *dev, const n2n_edge_conf_t *conf, int *r
     goto edge_init_error;
   }
 
+#ifdef N2N_HAVE_PIPELINE
+  if(eee->conf.pipeline_lanes && (edge_init_pipe(eee) < 0))
+    goto edge_init_error;
+#endif
+
+  if(conf->batch_size > 1) {
+#ifdef N2N_HAVE_MMSG
+    for(i=0; i<eee->num_workers; i++) {
+      struct n2n_edge_worker *w = &eee->workers[i];
+
+      w->rx_batch = calloc(1, sizeof(struct n2n_edge_batch));
+      w->tx_batch = calloc(1, sizeof(struct n2n_edge_batch));
+
+      if(!w->rx_batch || !w->tx_batch) {
+        traceEvent(TRACE_ERROR, "Cannot allocate batch buffers");
+        goto edge_init_error;
+      }
+
+      setup_batch(w->rx_batch);
+      setup_batch(w->tx_batch);
+
+      /* The TAP is drained in bursts too, so it must not block once empty */
+      fcntl(w->tap_fd, F_SETFL, fcntl(w->tap_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    traceEvent(TRACE_NORMAL, "Batched I/O enabled [batch size %u, flush %s]", conf->batch_size,
+               (conf->batch_flush == N2N_BATCH_FLUSH_IMMEDIATE) ? "immediate" : "per loop");
+#else
+    traceEvent(TRACE_WARNING, "Batched I/O is not supported on this platform, ignoring batch size %u",
+               conf->batch_size);
+    eee->conf.batch_size = 1;
+#endif
+  }
+
+  /* Batched I/O and the pipeline handle the frames in bursts, which a
+   * transform that works on batches encodes together */
+  if(eee->workers[0].transop.fwd_batch && ((eee->conf.batch_size > 1) || eee->conf.pipeline_lanes)) {
+    for(i=0; i<eee->num_workers; i++) {
+      if((eee->workers[i].tx_crypt = calloc(1, sizeof(struct n2n_edge_tx_crypt))) == NULL) {
+        traceEvent(TRACE_ERROR, "Cannot allocate batch buffers");
+        goto edge_init_error;
+      }
+    }
+  }
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  if(dev->vnet_hdr) {
+    for(i=0; i<eee->num_workers; i++) {
+      if((eee->workers[i].offload = calloc(1, sizeof(struct n2n_edge_offload))) == NULL) {
+        traceEvent(TRACE_ERROR, "Cannot allocate offload buffers");
+        goto edge_init_error;
+      }
+    }
+  }
+#endif
+
+  if(conf->udp_offload) {
+#ifdef N2N_HAVE_UDP_GSO
+    if(edge_init_udp_offload(eee) < 0)
+      goto edge_init_error;
+#else
+    traceEvent(TRACE_WARNING, "UDP offloads are not supported on this platform, ignoring them");
+    eee->conf.udp_offload = 0;
+#endif
+  }
+
+  if(conf->io_uring) {
+#ifdef N2N_HAVE_IO_URING
+    /* The offloads move frames larger than the provided buffers */
+    if(dev->vnet_hdr || eee->conf.udp_offload) {
+      traceEvent(TRACE_WARNING, "io_uring cannot be combined with the TAP or UDP offloads, using epoll");
+      eee->conf.io_uring = 0;
+    }
+#else
+    traceEvent(TRACE_WARNING, "io_uring is not supported on this platform, ignoring it");
+    eee->conf.io_uring = 0;
+#endif
+  }
+
 //edge_init_success:
   *rv = 0;
   return(eee);
 
 edge_init_error:
-  if(eee)
+  if(eee) {
+    if(eee->workers)
+      edge_free_workers(eee);
+    n2n_compress_dict_free(&eee->compress_dict);
     free(eee);
+  }
   *rv = rc;
   return(NULL);
 }
@@ -545,6 +1138,53 @@ static void peer_set_p2p_confirmed(n2n_edge_t * eee,
 
 /* ************************************** */
 
+/* Record the compression dictionary and the N2N_CAPS_* a peer announced in
+ * its REGISTER or REGISTER_ACK. */
+static void peer_set_caps(n2n_edge_t * eee, const n2n_mac_t mac, uint32_t dict_id, uint16_t caps) {
+  struct peer_info *scan;
+  macstr_t mac_buf;
+
+  HASH_FIND_PEER(eee->known_peers, mac, scan);
+
+  if(scan == NULL)
+    HASH_FIND_PEER(eee->pending_peers, mac, scan);
+
+  if(scan == NULL)
+    return;
+
+  if(scan->dict_id != dict_id) {
+    if(eee->compress_dict.id)
+      traceEvent(TRACE_INFO, "Peer %s has compression dictionary %08x%s",
+		 macaddr_str(mac_buf, mac), dict_id,
+		 (dict_id == eee->compress_dict.id) ? " (same as ours)" : "");
+    scan->dict_id = dict_id;
+  }
+
+  scan->caps = caps;
+}
+
+/* Look up what the peer at mac announced, nothing when it is not known or
+ * mac is not a single peer. The pending peers are reached through the
+ * supernode, whose REGISTERs carry the caps too. */
+static void peer_get_caps(n2n_edge_t * eee, const n2n_mac_t mac, uint32_t *dict_id, uint16_t *caps) {
+  struct peer_info *scan;
+
+  *dict_id = 0, *caps = 0;
+
+  if(is_multi_broadcast(mac))
+    return;
+
+  peers_lock(eee);
+  HASH_FIND_PEER(eee->known_peers, mac, scan);
+  if(scan == NULL)
+    HASH_FIND_PEER(eee->pending_peers, mac, scan);
+  if(scan)
+    *dict_id = scan->dict_id, *caps = scan->caps;
+  peers_unlock(eee);
+}
+
+/* ************************************** */
+
 int is_empty_ip_address(const n2n_sock_t * sock) {
   const uint8_t * ptr=NULL;
   size_t len=0;
@@ -650,36 +1290,465 @@ static ssize_t sendto_sock(int fd, const void * buf,
 
 /* ************************************** */
 
-/* Bind eee->udp_multicast_sock to multicast group */
-static void check_join_multicast_group(n2n_edge_t *eee) {
-#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
-  if(!eee->multicast_joined) {
-    struct ip_mreq mreq;
-    mreq.imr_multiaddr.s_addr = inet_addr(N2N_MULTICAST_GROUP);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+#ifdef N2N_HAVE_MMSG
 
-    if(setsockopt(eee->udp_multicast_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq)) < 0) {
-      traceEvent(TRACE_WARNING, "Failed to bind to local multicast group %s:%u [errno %u]",
-        N2N_MULTICAST_GROUP, N2N_MULTICAST_PORT, errno);
+/** Point every message header of the batch at its own address and buffer. */
+static void setup_batch(struct n2n_edge_batch * b) {
+  int i;
 
-#ifdef WIN32
-      traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
-#endif
-    } else {
-      traceEvent(TRACE_NORMAL, "Successfully joined multicast group %s:%u",
-        N2N_MULTICAST_GROUP, N2N_MULTICAST_PORT);
-      eee->multicast_joined = 1;
-    }
+  for(i=0; i<N2N_EDGE_BATCH_MAX; i++) {
+    b->iovs[i].iov_base = b->bufs[i];
+    b->iovs[i].iov_len = N2N_PKT_BUF_SIZE;
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
   }
-#endif
 }
 
 /* ************************************** */
 
-/** Send a REGISTER_SUPER packet to the current supernode. */
-static void send_register_super(n2n_edge_t * eee,
-				const n2n_sock_t * supernode) {
-  uint8_t pktbuf[N2N_PKT_BUF_SIZE] = {0};
+/** Send count prepared messages with as few sendmmsg() calls as possible.
+ *
+ *  A datagram the kernel refuses is dropped, as sendto_sock() would do, and
+ *  the rest of the batch is still sent.
+ */
+static void send_tx_msgs(struct n2n_edge_worker * w, struct mmsghdr * msgs, unsigned int count) {
+  unsigned int sent = 0;
+  int rc;
+
+  while(sent < count) {
+    rc = sendmmsg(w->udp_sock, &msgs[sent], count - sent, 0 /*flags*/);
+
+    if(rc > 0) {
+      ++(w->stats.tx_batches);
+      w->stats.tx_batched_pkts += rc;
+      sent += rc;
+    } else if((rc < 0) && (errno == EINTR))
+      continue;
+    else {
+      traceEvent(TRACE_ERROR, "sendmmsg failed (%d) %s", errno, strerror(errno));
+      sent++; /* skip the offending datagram */
+    }
+  }
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_UDP_GSO
+/** Send the TX batch as UDP_SEGMENT trains.
+ *
+ *  All the datagrams of a train but the last must have the same size, so a
+ *  train ends at a change of peer, at a larger datagram or after a shorter
+ *  one. A train refused by the kernel is sent again one datagram at a time;
+ *  when the error says that the route cannot segment at all, UDP_SEGMENT is
+ *  turned off for the worker.
+ */
+static void flush_tx_trains(struct n2n_edge_worker * w) {
+  struct n2n_edge_batch *b = w->tx_batch;
+  struct n2n_edge_udp_gso *g = w->udp_gso;
+  unsigned int i = 0, num_trains = 0, sent = 0;
+  int rc;
+
+  while(i < b->count) {
+    struct msghdr *hdr = &g->msgs[num_trains].msg_hdr;
+    size_t seg_size = b->iovs[i].iov_len, total = seg_size;
+    unsigned int j = i + 1;
+
+    while((j < b->count) && ((j - i) < EDGE_UDP_GSO_MAX_SEGS)
+          && (b->iovs[j].iov_len <= seg_size)
+          && ((total + b->iovs[j].iov_len) <= EDGE_UDP_GSO_MAX_BYTES)
+          && (b->addrs[j].sin_port == b->addrs[i].sin_port)
+          && (b->addrs[j].sin_addr.s_addr == b->addrs[i].sin_addr.s_addr)) {
+      total += b->iovs[j].iov_len;
+      if(b->iovs[j++].iov_len < seg_size)
+        break;
+    }
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &b->addrs[i];
+    hdr->msg_namelen = sizeof(b->addrs[i]);
+    hdr->msg_iov = &b->iovs[i];
+    hdr->msg_iovlen = j - i;
+
+    if(hdr->msg_iovlen > 1) {
+      struct cmsghdr *cmsg;
+
+      hdr->msg_control = g->ctrl[num_trains].buf;
+      hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cmsg) = (uint16_t)seg_size;
+    }
+
+    g->first[num_trains++] = i;
+    i = j;
+  }
+
+  while(sent < num_trains) {
+    rc = sendmmsg(w->udp_sock, &g->msgs[sent], num_trains - sent, 0 /*flags*/);
+
+    if(rc > 0) {
+      ++(w->stats.tx_batches);
+
+      for(i=sent; i<(sent + rc); i++) {
+        w->stats.tx_batched_pkts += g->msgs[i].msg_hdr.msg_iovlen;
+
+        if(g->msgs[i].msg_hdr.msg_iovlen > 1) {
+          ++(w->stats.tx_udp_trains);
+          w->stats.tx_udp_segs += g->msgs[i].msg_hdr.msg_iovlen;
+        }
+      }
+
+      sent += rc;
+    } else if((rc < 0) && (errno == EINTR))
+      continue;
+    else {
+      unsigned int num_segs = g->msgs[sent].msg_hdr.msg_iovlen;
+
+      if(num_segs == 1)
+        traceEvent(TRACE_ERROR, "sendmmsg failed (%d) %s", errno, strerror(errno));
+      else {
+        if((errno == EIO) || (errno == ENOPROTOOPT) || (errno == EOPNOTSUPP)) {
+          traceEvent(TRACE_WARNING, "UDP segmentation failed (%d) %s, disabling it", errno, strerror(errno));
+          free(w->udp_gso);
+          w->udp_gso = NULL;
+          send_tx_msgs(w, &b->msgs[g->first[sent]], b->count - g->first[sent]);
+          return;
+        }
+
+        traceEvent(TRACE_INFO, "UDP train refused (%d) %s, sending it unsegmented", errno, strerror(errno));
+        send_tx_msgs(w, &b->msgs[g->first[sent]], num_segs);
+      }
+
+      sent++;
+    }
+  }
+}
+#endif
+
+/* ************************************** */
+
+/** Send all the queued PACKETs, as UDP_SEGMENT trains when enabled. */
+static void flush_tx_batch(struct n2n_edge_worker * w) {
+  struct n2n_edge_batch *b = w->tx_batch;
+  unsigned int i;
+
+  if((b == NULL) || (b->count == 0))
+    return;
+
+#ifdef N2N_HAVE_UDP_GSO
+  if(w->udp_gso && (b->count > 1))
+    flush_tx_trains(w);
+  else
+#endif
+    send_tx_msgs(w, b->msgs, b->count);
+
+  /* Give back the pool buffers sent in place */
+  for(i=0; i<b->count; i++) {
+    if(b->owned[i]) {
+      n2n_buf_release(b->owned[i]);
+      b->owned[i] = NULL;
+      b->iovs[i].iov_base = b->bufs[i];
+    }
+  }
+
+  b->count = 0;
+}
+
+/* ************************************** */
+
+/** Return the buffer of the next free TX batch slot, or NULL when batching is
+ *  disabled. A PACKET encoded there is queued by tx_batch_commit(). */
+static uint8_t * tx_batch_buf(struct n2n_edge_worker * w) {
+  if(w->tx_batch == NULL)
+    return(NULL);
+
+  return(w->tx_batch->bufs[w->tx_batch->count]);
+}
+
+/* ************************************** */
+
+/** Queue the datagram encoded into the current TX slot towards dest. */
+static void tx_batch_commit(struct n2n_edge_worker * w, size_t len, const n2n_sock_t * dest) {
+  struct n2n_edge_batch *b = w->tx_batch;
+  unsigned int i = b->count;
+
+  fill_sockaddr((struct sockaddr *)&b->addrs[i], sizeof(b->addrs[i]), dest);
+  b->iovs[i].iov_len = len;
+  b->count++;
+
+  if((b->count >= w->eee->conf.batch_size) || (w->eee->conf.batch_flush == N2N_BATCH_FLUSH_IMMEDIATE))
+    flush_tx_batch(w);
+}
+
+/* ************************************** */
+
+/** Queue a PACKET built in place in a pool buffer, which the batch keeps
+ *  until it is sent. */
+static void tx_batch_commit_buf(struct n2n_edge_worker * w, n2n_buf_t * buf, const n2n_sock_t * dest) {
+  struct n2n_edge_batch *b = w->tx_batch;
+
+  b->owned[b->count] = buf;
+  b->iovs[b->count].iov_base = buf->data;
+  tx_batch_commit(w, buf->len, dest);
+}
+
+#else
+#define tx_batch_buf(w)         NULL
+#define flush_tx_batch(w)
+#endif /* N2N_HAVE_MMSG */
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_IO_URING
+/** @return a free SQE, after submitting the queued ones when the queue is full */
+static struct io_uring_sqe * edge_uring_sqe(struct n2n_edge_uring * u) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+
+  if(sqe == NULL) {
+    uring_submit(&u->ring, 0);
+    sqe = uring_get_sqe(&u->ring);
+  }
+
+  return(sqe);
+}
+
+/* ************************************** */
+
+/** Return the buffer of the TX slot the next frame or PACKET goes into, or
+ *  NULL when all the slots are in flight. The same slot is returned until
+ *  uring_tx_commit() queues it. */
+static uint8_t * uring_tx_buf(struct n2n_edge_worker * w) {
+  struct n2n_edge_uring *u = w->uring;
+
+  if(u->tx_cur < 0) {
+    if(u->num_free == 0)
+      return(NULL);
+
+    u->tx_cur = u->free_slots[--u->num_free];
+  }
+
+  return(u->slots[u->tx_cur].buf);
+}
+
+/* ************************************** */
+
+/** Queue the current TX slot: a send of len bytes to dest, or a TAP write
+ *  when dest is NULL.
+ *
+ *  @return 0 when queued, -1 when the caller must do the I/O itself
+ */
+static int uring_tx_commit(struct n2n_edge_worker * w, size_t len, const n2n_sock_t * dest) {
+  struct n2n_edge_uring *u = w->uring;
+  struct n2n_edge_uring_slot *slot = &u->slots[u->tx_cur];
+  struct io_uring_sqe *sqe = edge_uring_sqe(u);
+
+  if(sqe == NULL)
+    return(-1);
+
+  slot->iov.iov_base = slot->buf;
+  slot->iov.iov_len = len;
+
+  if(dest) {
+    fill_sockaddr((struct sockaddr *)&slot->addr, sizeof(slot->addr), dest);
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+    slot->hdr.msg_name = &slot->addr;
+    slot->hdr.msg_namelen = sizeof(slot->addr);
+    slot->hdr.msg_iov = &slot->iov;
+    slot->hdr.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = EDGE_URING_FILE_UDP;
+    sqe->addr = (unsigned long)&slot->hdr;
+    sqe->len = 1;
+  } else {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = EDGE_URING_FILE_TAP;
+    sqe->addr = (unsigned long)slot->buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)-1;
+  }
+
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->user_data = EDGE_URING_UD(EDGE_URING_REQ_TX, u->tx_cur);
+
+  u->tx_cur = -1;
+  u->inflight++;
+
+  return(0);
+}
+#endif /* N2N_HAVE_IO_URING */
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_PIPELINE
+/** Wake a stage up if it sleeps, after queueing items to its rings. */
+static void pipe_wake(struct n2n_edge_pipe_waiter * wait) {
+  uint64_t one = 1;
+
+  /* Orders the ring updates before the check, see pipe_sleep() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&wait->sleeping, __ATOMIC_RELAXED)
+     && __atomic_exchange_n(&wait->sleeping, 0, __ATOMIC_ACQ_REL)) {
+    if(write(wait->efd, &one, sizeof(one)) < 0)
+      traceEvent(TRACE_WARNING, "eventfd write failed [%d]: %s", errno, strerror(errno));
+  }
+}
+
+/** Sleep until pipe_wake() or for at most 1s (to notice keep_running),
+ *  unless has_input() finds something to do after the stage announced it
+ *  is going to sleep. */
+static void pipe_sleep(struct n2n_edge_pipe_waiter * wait, int (*has_input)(void *), void * arg) {
+  struct pollfd pfd;
+  uint64_t val;
+
+  __atomic_store_n(&wait->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(!has_input(arg)) {
+    pfd.fd = wait->efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if((poll(&pfd, 1, 1000) > 0) && (read(wait->efd, &val, sizeof(val)) < 0))
+      traceEvent(TRACE_WARNING, "eventfd read failed [%d]: %s", errno, strerror(errno));
+  }
+
+  __atomic_store_n(&wait->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/** Queue a PACKET encoded by a crypto lane to the UDP writer. */
+static void pipe_send(struct n2n_edge_pipe_lane * lane, n2n_buf_t * buf, const n2n_sock_t * dest) {
+  memcpy(&buf->peer, dest, sizeof(buf->peer));
+
+  if(n2n_ring_push(&lane->udp_out, buf) == 0)
+    ++(lane->stats.pkts);
+  else {
+    ++(lane->stats.drops);
+    n2n_buf_release(buf);
+  }
+}
+
+/** Queue the frame decoded from lane->rx_buf to the TAP writer. A frame
+ *  decoded out of the datagram is copied back into its buffer first. */
+static int pipe_tap_write(struct n2n_edge_pipe_lane * lane, uint8_t * frame, int len) {
+  n2n_buf_t *buf = lane->rx_buf;
+
+  lane->rx_buf = NULL;
+
+  if((frame < buf->room) || (frame + len > &buf->room[N2N_BUF_ROOM])) {
+    buf->data = &buf->room[N2N_BUF_HEADROOM];
+    memcpy(buf->data, frame, len);
+  } else
+    buf->data = frame;
+
+  buf->len = len;
+
+  if(n2n_ring_push(&lane->tap_out, buf) == 0)
+    ++(lane->stats.pkts);
+  else {
+    ++(lane->stats.drops);
+    n2n_buf_release(buf);
+  }
+
+  return(len);
+}
+#endif /* N2N_HAVE_PIPELINE */
+
+/* ************************************** */
+
+/** Push out the frames of a worker queued during a loop turn. */
+static void flush_worker(struct n2n_edge_worker * w) {
+  flush_tx_crypt(w);
+  flush_tx_batch(w);
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  if(w->offload)
+    gro_flush(&w->offload->gro, w->tap_fd);
+#endif
+}
+
+/* ************************************** */
+
+/* Workers other than the first one use their own TAP queue */
+static int worker_tap_read(struct n2n_edge_worker * w, uint8_t * buf, int len) {
+#ifdef N2N_HAVE_TAP_MQ
+  if(w->idx > 0)
+    return(read(w->tap_fd, buf, len));
+#endif
+
+  return(tuntap_read(&(w->eee->device), buf, len));
+}
+
+static int worker_tap_write(struct n2n_edge_worker * w, uint8_t * buf, int len) {
+#ifdef N2N_HAVE_PIPELINE
+  if(w->lane && w->lane->rx_buf && (len <= N2N_PKT_BUF_SIZE))
+    return(pipe_tap_write(w->lane, buf, len));
+#endif
+#ifdef N2N_HAVE_IO_URING
+  if(w->uring && (len <= N2N_PKT_BUF_SIZE)) {
+    uint8_t *slot_buf = uring_tx_buf(w);
+
+    /* The frame is decoded on the stack, so it is copied to the slot */
+    if(slot_buf) {
+      memcpy(slot_buf, buf, len);
+
+      if(uring_tx_commit(w, len, NULL) == 0)
+        return(len);
+    }
+  }
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  if(w->offload) {
+    /* Written by gro_flush() at the latest at the end of this loop turn */
+    gro_receive(&w->offload->gro, w->tap_fd, buf, len);
+    return(len);
+  }
+#endif
+#ifdef N2N_HAVE_TAP_MQ
+  if(w->idx > 0)
+    return(write(w->tap_fd, buf, len));
+#endif
+
+  return(tuntap_write(&(w->eee->device), buf, len));
+}
+
+/* ************************************** */
+
+/* Bind eee->udp_multicast_sock to multicast group */
+static void check_join_multicast_group(n2n_edge_t *eee) {
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+  if(!eee->multicast_joined) {
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr.s_addr = inet_addr(N2N_MULTICAST_GROUP);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if(setsockopt(eee->udp_multicast_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&mreq, sizeof(mreq)) < 0) {
+      traceEvent(TRACE_WARNING, "Failed to bind to local multicast group %s:%u [errno %u]",
+        N2N_MULTICAST_GROUP, N2N_MULTICAST_PORT, errno);
+
+#ifdef WIN32
+      traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
+#endif
+    } else {
+      traceEvent(TRACE_NORMAL, "Successfully joined multicast group %s:%u",
+        N2N_MULTICAST_GROUP, N2N_MULTICAST_PORT);
+      eee->multicast_joined = 1;
+    }
+  }
+#endif
+}
+
+/* ************************************** */
+
+/** Send a REGISTER_SUPER packet to the current supernode. */
+static void send_register_super(n2n_edge_t * eee,
+				const n2n_sock_t * supernode) {
+  uint8_t pktbuf[N2N_PKT_BUF_SIZE] = {0};
   size_t idx;
   /* ssize_t sent; */
   n2n_common_t cmn;
@@ -693,8 +1762,7 @@ static void send_register_super(n2n_edge_t * eee,
   cmn.flags = 0;
   memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
 
-  for(idx=0; idx < N2N_COOKIE_SIZE; ++idx)
-    eee->last_cookie[idx] = rand() % 0xff;
+  n2n_rand_bytes(eee->last_cookie, N2N_COOKIE_SIZE);
 
   memcpy(reg.cookie, eee->last_cookie, N2N_COOKIE_SIZE);
   reg.auth.scheme=0; /* No auth yet */
@@ -750,7 +1818,9 @@ static void send_register(n2n_edge_t * eee,
   n2n_REGISTER_t reg;
   n2n_sock_str_t sockbuf;
 
-  if(!eee->conf.allow_p2p) {
+  /* Without P2P, the REGISTERs relayed by the supernode still tell the
+   * peer our dictionary and caps */
+  if(!eee->conf.allow_p2p && !sock_equal(remote_peer, &(eee->supernode))) {
     traceEvent(TRACE_DEBUG, "Skipping register as P2P is disabled");
     return;
   }
@@ -766,6 +1836,8 @@ static void send_register(n2n_edge_t * eee,
   encode_uint32(reg.cookie, &idx, 123456789);
   idx=0;
   encode_mac(reg.srcMac, &idx, eee->device.mac_addr);
+  reg.dict_id = eee->compress_dict.id;
+  reg.caps = N2N_CAPS_HDR_COMPRESSION;
 
   if(peer_mac) {
     /* Can be NULL for multicast registrations */
@@ -811,6 +1883,8 @@ static void send_register_ack(n2n_edge_t * eee,
   memcpy(ack.cookie, reg->cookie, N2N_COOKIE_SIZE);
   memcpy(ack.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
   memcpy(ack.dstMac, reg->srcMac, N2N_MAC_SIZE);
+  ack.dict_id = eee->compress_dict.id;
+  ack.caps = N2N_CAPS_HDR_COMPRESSION;
 
   idx=0;
   encode_REGISTER_ACK(pktbuf, &idx, &cmn, &ack);
@@ -897,13 +1971,15 @@ static const char * supernode_ip(const n2n_edge_t * eee) {
 /* ************************************** */
 
 /** A PACKET has arrived containing an encapsulated ethernet datagram - usually
- *  encrypted. */
-static int handle_PACKET(n2n_edge_t * eee,
-			 const n2n_common_t * cmn,
-			 const n2n_PACKET_t * pkt,
+ *  encrypted. When decoded is not NULL, the payload was already decoded with
+ *  the rest of its receive batch. */
+static int handle_PACKET(struct n2n_edge_worker * w,
+			 const n2n_PACKET_view_t * pkt,
 			 const n2n_sock_t * orig_sender,
 			 uint8_t * payload,
-			 size_t psize) {
+			 size_t psize,
+			 const n2n_trans_pkt_t * decoded) {
+  n2n_edge_t *        eee = w->eee;
   ssize_t             data_sent_len;
   uint8_t             from_supernode;
   uint8_t *           eth_payload=NULL;
@@ -911,6 +1987,7 @@ static int handle_PACKET(n2n_edge_t * eee,
   time_t              now;
   ether_hdr_t *       eh;
   ipstr_t             ip_buf;
+  macstr_t            mac_buf;
 
   now = time(NULL);
 
@@ -918,28 +1995,32 @@ static int handle_PACKET(n2n_edge_t * eee,
 	     (unsigned int)psize, (unsigned int)pkt->transform);
   /* hexdump(payload, psize); */
 
-  from_supernode= cmn->flags & N2N_FLAGS_FROM_SUPERNODE;
+  from_supernode= pkt->flags & N2N_FLAGS_FROM_SUPERNODE;
 
   if(from_supernode)
     {
       if(!memcmp(pkt->dstMac, broadcast_mac, 6))
-        ++(eee->stats.rx_sup_broadcast);
+        ++(w->stats.rx_sup_broadcast);
 
-      ++(eee->stats.rx_sup);
+      ++(w->stats.rx_sup);
       eee->last_sup=now;
     }
   else
     {
-      ++(eee->stats.rx_p2p);
+      ++(w->stats.rx_p2p);
       eee->last_p2p=now;
     }
 
   /* Update the sender in peer table entry */
+  peers_lock(eee);
   check_peer_registration_needed(eee, from_supernode, pkt->srcMac, orig_sender);
+  peers_unlock(eee);
 
   /* Handle transform. */
   {
     uint8_t decodebuf[N2N_PKT_BUF_SIZE];
+    uint8_t zbuf[N2N_PKT_BUF_SIZE];
+    uint8_t hcbuf[N2N_PKT_BUF_SIZE];
     size_t eth_size;
     n2n_transform_t rx_transop_id;
 
@@ -947,12 +2028,55 @@ static int handle_PACKET(n2n_edge_t * eee,
 
     if(rx_transop_id == eee->conf.transop_id) {
         uint8_t is_multicast;
-	eth_payload = decodebuf;
+	if(decoded) {
+	  eth_payload = decoded->data;
+	  eth_size = decoded->len;
+	} else if(w->transop.rev_inplace) {
+	  /* The frame is decoded over the datagram and written from there */
+	  eth_payload = payload;
+	  eth_size = w->transop.rev_inplace(&w->transop,
+					    payload, psize,
+					    &eth_payload, pkt->srcMac);
+	} else {
+	  eth_payload = decodebuf;
+	  eth_size = w->transop.rev(&w->transop,
+				    eth_payload, N2N_PKT_BUF_SIZE,
+				    payload, psize, pkt->srcMac);
+	}
+	++(w->transop.rx_cnt); /* stats */
+
+	if((pkt->compression != N2N_COMPRESSION_ID_NONE) && (eth_size > 0)) {
+	  int zlen = n2n_decompress(&w->compress, pkt->compression, eth_payload, eth_size, zbuf, sizeof(zbuf));
+
+	  if(zlen < 0) {
+	    traceEvent(TRACE_ERROR, "Cannot decompress a %s frame from %s",
+		       n2n_compression_str(pkt->compression), macaddr_str(mac_buf, pkt->srcMac));
+	    return(-1);
+	  }
+
+	  eth_payload = zbuf;
+	  eth_size = zlen;
+	}
+
+	if((pkt->flags & N2N_FLAGS_HDR_COMPRESSION) && (eth_size > 0)) {
+	  int hlen;
+
+	  peers_lock(eee);
+	  hlen = n2n_hc_decompress(&eee->hc, pkt->srcMac, eth_payload, eth_size,
+				   hcbuf, sizeof(hcbuf), time(NULL));
+	  peers_unlock(eee);
+
+	  if(hlen < 0) {
+	    traceEvent(TRACE_DEBUG, "Dropping a frame with headers out of sync from %s",
+		       macaddr_str(mac_buf, pkt->srcMac));
+	    return(-1);
+	  }
+
+	  eth_payload = hcbuf;
+	  eth_size = hlen;
+	}
+
 	eh = (ether_hdr_t*)eth_payload;
-	eth_size = eee->transop.rev(&eee->transop,
-						    eth_payload, N2N_PKT_BUF_SIZE,
-						    payload, psize, pkt->srcMac);
-	++(eee->transop.rx_cnt); /* stats */
 	is_multicast = (is_ip6_discovery(eth_payload, eth_size) || is_ethMulticast(eth_payload, eth_size));
 
 	if(eee->conf.drop_multicast && is_multicast) {
@@ -982,7 +2106,7 @@ static int handle_PACKET(n2n_edge_t * eee,
 
 	/* Write ethernet packet to tap device. */
 	traceEvent(TRACE_DEBUG, "sending to TAP %u", (unsigned int)eth_size);
-	data_sent_len = tuntap_write(&(eee->device), eth_payload, eth_size);
+	data_sent_len = worker_tap_write(w, eth_payload, eth_size);
 
 	if (data_sent_len == eth_size)
 	  {
@@ -1002,6 +2126,48 @@ static int handle_PACKET(n2n_edge_t * eee,
 
 /* ************************************** */
 
+/** Add up the statistics of all the workers. */
+static void edge_sum_stats(const n2n_edge_t * eee, struct n2n_edge_stats * sum,
+			   size_t * transop_tx, size_t * transop_rx) {
+  int i;
+
+  memset(sum, 0, sizeof(*sum));
+  *transop_tx = *transop_rx = 0;
+
+  for(i=0; i<eee->num_workers; i++) {
+    const struct n2n_edge_worker *w = &eee->workers[i];
+
+    sum->tx_p2p += w->stats.tx_p2p;
+    sum->rx_p2p += w->stats.rx_p2p;
+    sum->tx_sup += w->stats.tx_sup;
+    sum->rx_sup += w->stats.rx_sup;
+    sum->tx_sup_broadcast += w->stats.tx_sup_broadcast;
+    sum->rx_sup_broadcast += w->stats.rx_sup_broadcast;
+    sum->rx_batches += w->stats.rx_batches;
+    sum->rx_batched_pkts += w->stats.rx_batched_pkts;
+    sum->tx_batches += w->stats.tx_batches;
+    sum->tx_batched_pkts += w->stats.tx_batched_pkts;
+    sum->tx_tso_frames += w->stats.tx_tso_frames;
+    sum->tx_tso_segs += w->stats.tx_tso_segs;
+    sum->tx_udp_trains += w->stats.tx_udp_trains;
+    sum->tx_udp_segs += w->stats.tx_udp_segs;
+    sum->rx_udp_trains += w->stats.rx_udp_trains;
+    sum->rx_udp_segs += w->stats.rx_udp_segs;
+    sum->uring_enters += w->stats.uring_enters;
+    sum->uring_cqes += w->stats.uring_cqes;
+#ifdef N2N_HAVE_TAP_OFFLOAD
+    if(w->offload) {
+      sum->rx_gro_frames += w->offload->gro.super_frames;
+      sum->rx_gro_segs += w->offload->gro.merged_segs;
+    }
+#endif
+    *transop_tx += w->transop.tx_cnt;
+    *transop_rx += w->transop.rx_cnt;
+  }
+}
+
+/* ************************************** */
+
 /** Read a datagram from the management UDP socket and take appropriate
  *  action. */
 static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
@@ -1012,6 +2178,9 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
   socklen_t           i;
   size_t              msg_len;
   time_t              now;
+  struct n2n_edge_stats stats;
+  size_t              transop_tx, transop_rx;
+  const n2n_crypto_sel_t *sel;
 
   now = time(NULL);
   i = sizeof(sender_sock);
@@ -1098,6 +2267,8 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
 
   traceEvent(TRACE_DEBUG, "mgmt status rq");
 
+  edge_sum_stats(eee, &stats, &transop_tx, &transop_rx);
+
   msg_len=0;
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "Statistics for edge\n");
@@ -1108,26 +2279,129 @@ static void readFromMgmtSocket(n2n_edge_t * eee, int * keep_running) {
 
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "paths  super:%u,%u p2p:%u,%u\n",
-		      (unsigned int)eee->stats.tx_sup,
-		      (unsigned int)eee->stats.rx_sup,
-		      (unsigned int)eee->stats.tx_p2p,
-		      (unsigned int)eee->stats.rx_p2p);
+		      (unsigned int)stats.tx_sup,
+		      (unsigned int)stats.rx_sup,
+		      (unsigned int)stats.tx_p2p,
+		      (unsigned int)stats.rx_p2p);
 
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "transop |%6u|%6u|\n",
-		      (unsigned int)eee->transop.tx_cnt,
-		      (unsigned int)eee->transop.rx_cnt);
+		      (unsigned int)transop_tx,
+		      (unsigned int)transop_rx);
 
+  peers_lock(eee);
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "peers  pend:%u full:%u\n",
 		      HASH_COUNT(eee->pending_peers),
 		      HASH_COUNT(eee->known_peers));
+  peers_unlock(eee);
 
   msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
 		      "last super:%lu(%ld sec ago) p2p:%lu(%ld sec ago)\n",
 		      eee->last_sup, (now-eee->last_sup), eee->last_p2p,
 		      (now-eee->last_p2p));
 
+  if(eee->conf.batch_size > 1)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"batch  size:%u avg rx:%.1f tx:%.1f\n",
+			(unsigned int)eee->conf.batch_size,
+			stats.rx_batches ? ((double)stats.rx_batched_pkts / stats.rx_batches) : 0.0,
+			stats.tx_batches ? ((double)stats.tx_batched_pkts / stats.tx_batches) : 0.0);
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  if(eee->device.vnet_hdr)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"offld  tso:%llu (%.1f segs avg) gro:%llu (%.1f segs avg)\n",
+			(unsigned long long)stats.tx_tso_frames,
+			stats.tx_tso_frames ? ((double)stats.tx_tso_segs / stats.tx_tso_frames) : 0.0,
+			(unsigned long long)stats.rx_gro_frames,
+			stats.rx_gro_frames ? ((double)stats.rx_gro_segs / stats.rx_gro_frames) : 0.0);
+#endif
+
+  if(eee->conf.udp_offload)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"udp    gso:%llu (%.1f segs avg) gro:%llu (%.1f segs avg)\n",
+			(unsigned long long)stats.tx_udp_trains,
+			stats.tx_udp_trains ? ((double)stats.tx_udp_segs / stats.tx_udp_trains) : 0.0,
+			(unsigned long long)stats.rx_udp_trains,
+			stats.rx_udp_trains ? ((double)stats.rx_udp_segs / stats.rx_udp_trains) : 0.0);
+
+  if(eee->conf.io_uring)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"uring  enters:%llu (%.1f completions avg)\n",
+			(unsigned long long)stats.uring_enters,
+			stats.uring_enters ? ((double)stats.uring_cqes / stats.uring_enters) : 0.0);
+
+#ifdef N2N_HAVE_PIPELINE
+  if(eee->pipe) {
+    const struct n2n_edge_pipe *pipe = eee->pipe;
+    int l;
+
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"pipe   tap_rd:%llu/%llu udp_rd:%llu/%llu udp_wr:%llu/%llu tap_wr:%llu/%llu (pkts/drops)\n",
+			(unsigned long long)pipe->tap_rd.pkts, (unsigned long long)pipe->tap_rd.drops,
+			(unsigned long long)pipe->udp_rd.pkts, (unsigned long long)pipe->udp_rd.drops,
+			(unsigned long long)pipe->udp_wr.pkts, (unsigned long long)pipe->udp_wr.drops,
+			(unsigned long long)pipe->tap_wr.pkts, (unsigned long long)pipe->tap_wr.drops);
+
+    for(l=0; l<pipe->num_lanes; l++) {
+      const struct n2n_edge_pipe_lane *lane = &pipe->lanes[l];
+
+      msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			  "lane%-2d %llu/%llu tx_in:%u(%u) rx_in:%u(%u) udp_out:%u(%u) tap_out:%u(%u)\n",
+			  l, (unsigned long long)lane->stats.pkts, (unsigned long long)lane->stats.drops,
+			  n2n_ring_count(&lane->tx_in), lane->tx_in.hiwat,
+			  n2n_ring_count(&lane->rx_in), lane->rx_in.hiwat,
+			  n2n_ring_count(&lane->udp_out), lane->udp_out.hiwat,
+			  n2n_ring_count(&lane->tap_out), lane->tap_out.hiwat);
+    }
+  } else
+#endif
+  if(eee->num_workers > 1)
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"workers %u (one per TAP queue)\n", (unsigned int)eee->num_workers);
+
+  if(eee->conf.compression != N2N_COMPRESSION_ID_NONE) {
+    uint64_t frames = 0, dict_frames = 0, bytes_in = 0, bytes_out = 0, skipped = 0;
+    int k;
+
+    for(k=0; k<eee->num_workers; k++) {
+      const n2n_compress_t *c = &eee->workers[k].compress;
+
+      frames += c->frames;
+      dict_frames += c->dict_frames;
+      bytes_in += c->bytes_in;
+      bytes_out += c->bytes_out;
+      skipped += c->skipped;
+    }
+
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"compr  %s frames:%llu (%.1f%% saved) skipped:%llu dict:%08x (%llu frames)\n",
+			n2n_compression_str(eee->conf.compression), (unsigned long long)frames,
+			bytes_in ? (100.0 * (bytes_in - bytes_out) / bytes_in) : 0.0,
+			(unsigned long long)skipped, eee->compress_dict.id,
+			(unsigned long long)dict_frames);
+  }
+
+  if(eee->conf.header_compression || eee->hc.rx_frames) {
+    peers_lock(eee);
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"hdrc   tx:%llu (%llu full, %llu B saved) rx:%llu dropped:%llu\n",
+			(unsigned long long)eee->hc.tx_frames, (unsigned long long)eee->hc.tx_full,
+			(unsigned long long)eee->hc.tx_saved, (unsigned long long)eee->hc.rx_frames,
+			(unsigned long long)eee->hc.rx_errors);
+    peers_unlock(eee);
+  }
+
+  if((sel = n2n_crypto_selected(eee->conf.transop_id)) != NULL) {
+    char impl[64], cpu[64];
+
+    msg_len += snprintf((char *)(udp_buf+msg_len), (N2N_PKT_BUF_SIZE-msg_len),
+			"crypto %s %s [CPU: %s]\n", sel->transform,
+			n2n_crypto_bench_str(sel, sel->selected, impl, sizeof(impl)),
+			n2n_cpu_features_str(cpu, sizeof(cpu)));
+  }
+
   traceEvent(TRACE_DEBUG, "mgmt status sending: %s", udp_buf);
 
 
@@ -1219,11 +2493,14 @@ static int find_peer_destination(n2n_edge_t * eee,
 /* ***************************************************** */
 
 /** Send an ecapsulated ethernet PACKET to a destination edge or broadcast MAC
- *  address. */
-static int send_packet(n2n_edge_t * eee,
+ *  address. When buf is not NULL the PACKET was built in place in it, and
+ *  the buffer is released once sent. */
+static int send_packet(struct n2n_edge_worker * w,
 		       n2n_mac_t dstMac,
 		       const uint8_t * pktbuf,
-		       size_t pktlen) {
+		       size_t pktlen,
+		       n2n_buf_t * buf) {
+  n2n_edge_t * eee = w->eee;
   int is_p2p;
   /*ssize_t s; */
   n2n_sock_str_t sockbuf;
@@ -1232,58 +2509,180 @@ static int send_packet(n2n_edge_t * eee,
 
   /* hexdump(pktbuf, pktlen); */
 
+  peers_lock(eee);
   is_p2p = find_peer_destination(eee, dstMac, &destination);
+  peers_unlock(eee);
 
   if(is_p2p)
-    ++(eee->stats.tx_p2p);
+    ++(w->stats.tx_p2p);
   else {
-    ++(eee->stats.tx_sup);
+    ++(w->stats.tx_sup);
 
     if(!memcmp(dstMac, broadcast_mac, 6))
-      ++(eee->stats.tx_sup_broadcast);
+      ++(w->stats.tx_sup_broadcast);
   }
 
   traceEvent(TRACE_INFO, "Tx PACKET to %s (dest=%s) [%u B]",
     sock_to_cstr(sockbuf, &destination),
     macaddr_str(mac_buf, dstMac), pktlen);
 
-  /* s = */ sendto_sock(eee->udp_sock, pktbuf, pktlen, &destination);
+#ifdef N2N_HAVE_PIPELINE
+  if(buf && w->lane) {
+    pipe_send(w->lane, buf, &destination);
+    return 0;
+  }
+#endif
+
+#ifdef N2N_HAVE_MMSG
+  if(buf && (w->tx_batch != NULL)) {
+    tx_batch_commit_buf(w, buf, &destination);
+    return 0;
+  }
+#endif
+
+#ifdef N2N_HAVE_IO_URING
+  if(w->uring && (pktbuf == uring_tx_buf(w)) && (uring_tx_commit(w, pktlen, &destination) == 0))
+    return 0;
+#endif
+
+#ifdef N2N_HAVE_MMSG
+  if((w->tx_batch != NULL) && (pktbuf == tx_batch_buf(w)))
+    tx_batch_commit(w, pktlen, &destination);
+  else
+#endif
+  /* s = */ sendto_sock(w->udp_sock, pktbuf, pktlen, &destination);
+
+  n2n_buf_release(buf);
 
   return 0;
 }
 
 /* ************************************** */
 
-/** A layer-2 packet was received at the tunnel and needs to be sent via UDP. */
-static void send_packet2net(n2n_edge_t * eee,
-		     uint8_t *tap_pkt, size_t len) {
-  ipstr_t ip_buf;
-  n2n_mac_t destMac;
+/** Write at base the common and PACKET headers of a frame towards destMac,
+ *  compressed with the N2N_COMPRESSION_ID_* compression: no options, not
+ *  from supernode, no socket, so only the destination and the flags change
+ *  from the template of the edge.
+ *
+ *  @return their length, N2N_PACKET_HDR_SIZE
+ */
+static size_t stamp_packet_hdr(n2n_edge_t * eee, uint8_t * base,
+			       const n2n_mac_t destMac, uint8_t compression) {
+  return(stamp_PACKET(base, &eee->pkt_tmpl, destMac,
+		      (compression & EDGE_COMPRESSION_HDR) ? N2N_FLAGS_HDR_COMPRESSION : 0,
+		      compression & ~EDGE_COMPRESSION_HDR));
+}
 
-  n2n_common_t cmn;
-  n2n_PACKET_t pkt;
+/* ************************************** */
 
-  uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-  size_t idx=0;
-  n2n_transform_t tx_transop_idx = eee->transop.transform_id;
+/** Prepend the PACKET header to the payload encoded in place in buf, from a
+ *  frame of len bytes, and send it. The buffer is consumed. */
+static void send_packet_inplace(struct n2n_edge_worker * w, n2n_mac_t destMac,
+				uint8_t compression, n2n_buf_t * buf, size_t len) {
+  uint8_t *pkt_start;
 
-  ether_hdr_t eh;
+  if((pkt_start = n2n_buf_push(buf, N2N_PACKET_HDR_SIZE)) == NULL) {
+    traceEvent(TRACE_ERROR, "No room to encode the PACKET in place");
+    n2n_buf_release(buf);
+    return;
+  }
 
-  /* tap_pkt is not aligned so we have to copy to aligned memory */
-  memcpy(&eh, tap_pkt, sizeof(ether_hdr_t));
+  stamp_packet_hdr(w->eee, pkt_start, destMac, compression);
 
-  /* Discard IP packets that are not originated by this hosts */
-  if(!(eee->conf.allow_routing)) {
-    if(ntohs(eh.type) == 0x0800) {
-      /* This is an IP packet from the local source address - not forwarded. */
-      uint32_t *src = (uint32_t*)&tap_pkt[ETH_FRAMESIZE + IP4_SRCOFFSET];
+  traceEvent(TRACE_DEBUG, "Encode %u B PACKET [%u B data, %u B overhead] transform %u",
+	     (u_int)buf->len, (u_int)len, (u_int)(buf->len-len), w->transop.transform_id);
 
-      /* Note: all elements of the_ip are in network order */
-      if(*src != eee->device.ip_addr) {
-	/* This is a packet that needs to be routed */
-	traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
-		   intoa(ntohl(*src), ip_buf, sizeof(ip_buf)));
-	return;
+  w->transop.tx_cnt++; /* stats */
+
+  send_packet(w, destMac, buf->data, buf->len, buf);
+}
+
+/* ************************************** */
+
+/** Encode the frames queued by send_packet2net() with a single fwd_batch()
+ *  call of the transop and send them, in the order they were read. */
+static void flush_tx_crypt(struct n2n_edge_worker * w) {
+  struct n2n_edge_tx_crypt *c = w->tx_crypt;
+  unsigned int i;
+
+  if((c == NULL) || (c->count == 0))
+    return;
+
+  w->transop.fwd_batch(&w->transop, c->pkts, c->count);
+
+  for(i=0; i<c->count; i++) {
+    n2n_trans_pkt_t *p = &c->pkts[i];
+
+    if(p->rc != 0) {
+      traceEvent(TRACE_ERROR, "No room to encode the PACKET in place");
+      n2n_buf_release(p->buf);
+    } else
+      send_packet_inplace(w, p->peer_mac, p->compression, p->buf, p->len);
+  }
+
+  c->count = 0;
+}
+
+/* ************************************** */
+
+/** A layer-2 packet was received at the tunnel and needs to be sent via UDP.
+ *
+ *  When the frame sits in the pool buffer buf, which is always released, a
+ *  transform that does not encrypt leaves the payload where it is and only
+ *  the header is prepended in the headroom. With a transform that can work
+ *  on batches, such frames are queued and encoded together at the end of
+ *  the burst, see flush_tx_crypt(). */
+static void send_packet2net(struct n2n_edge_worker * w,
+		     uint8_t *tap_pkt, size_t len, n2n_buf_t * buf) {
+  n2n_edge_t * eee = w->eee;
+  ipstr_t ip_buf;
+  n2n_mac_t destMac;
+
+  uint8_t pktbuf_local[N2N_PKT_BUF_SIZE];
+  uint8_t zbuf[N2N_COMPRESS_BOUND(N2N_PKT_BUF_SIZE)];
+  uint8_t hcbuf[N2N_PKT_BUF_SIZE];
+  uint8_t *pktbuf;
+  size_t idx=0;
+  n2n_transform_t tx_transop_idx = w->transop.transform_id;
+  uint8_t compression = N2N_COMPRESSION_ID_NONE;
+  uint32_t dict_id = 0;
+  uint16_t caps = 0;
+  size_t hc_len = 0;
+  int inplace = (buf && w->transop.fwd_inplace && (buf->data == tap_pkt));
+
+  /* The frames queued for a batch go first, to keep the order */
+  if(!inplace)
+    flush_tx_crypt(w);
+
+  /* When batching or on io_uring, encode straight into the TX slot to avoid a copy */
+#ifdef N2N_HAVE_IO_URING
+  if(w->uring)
+    pktbuf = uring_tx_buf(w);
+  else
+#endif
+    pktbuf = tx_batch_buf(w);
+
+  if(pktbuf == NULL)
+    pktbuf = pktbuf_local;
+
+  ether_hdr_t eh;
+
+  /* tap_pkt is not aligned so we have to copy to aligned memory */
+  memcpy(&eh, tap_pkt, sizeof(ether_hdr_t));
+
+  /* Discard IP packets that are not originated by this hosts */
+  if(!(eee->conf.allow_routing)) {
+    if(ntohs(eh.type) == 0x0800) {
+      /* This is an IP packet from the local source address - not forwarded. */
+      uint32_t *src = (uint32_t*)&tap_pkt[ETH_FRAMESIZE + IP4_SRCOFFSET];
+
+      /* Note: all elements of the_ip are in network order */
+      if(*src != eee->device.ip_addr) {
+	/* This is a packet that needs to be routed */
+	traceEvent(TRACE_INFO, "Discarding routed packet [%s]",
+		   intoa(ntohl(*src), ip_buf, sizeof(ip_buf)));
+	n2n_buf_release(buf);
+	return;
       } else {
 	/* This packet is originated by us */
 	/* traceEvent(TRACE_INFO, "Sending non-routed packet"); */
@@ -1291,31 +2690,91 @@ static void send_packet2net(n2n_edge_t * eee,
     }
   }
 
-  /* Optionally compress then apply transforms, eg encryption. */
+  memcpy(destMac, tap_pkt, N2N_MAC_SIZE); /* dest MAC is first in ethernet header */
+
+  if(eee->conf.header_compression || eee->compress_dict.id)
+    peer_get_caps(eee, destMac, &dict_id, &caps);
+
+  /* Optionally compress the inner headers, then the frame, then apply
+   * transforms, eg encryption. */
+  if(eee->conf.header_compression && (caps & N2N_CAPS_HDR_COMPRESSION)) {
+    uint8_t hdr[N2N_HC_MAX_LEN];
+    size_t consumed;
+
+    peers_lock(eee);
+    hc_len = n2n_hc_compress(&eee->hc, destMac, tap_pkt, len, hdr, &consumed, time(NULL));
+    peers_unlock(eee);
+
+    if(hc_len > 0) {
+      if(!inplace) {
+	memcpy(hcbuf, hdr, hc_len);
+	memcpy(&hcbuf[hc_len], &tap_pkt[consumed], len - consumed);
+	tap_pkt = hcbuf;
+	len = len - consumed + hc_len;
+      } else if((hc_len <= consumed) ? (n2n_buf_pull(buf, consumed - hc_len) != NULL)
+		: (n2n_buf_push(buf, hc_len - consumed) != NULL)) {
+	/* The compressed headers take the place of the last bytes of the
+	 * original ones, or of the byte before them when sent in full */
+	tap_pkt = buf->data;
+	memcpy(tap_pkt, hdr, hc_len);
+	len = buf->len;
+      } else
+	hc_len = 0;
+    }
+  }
+
+  if(w->compress.id != N2N_COMPRESSION_ID_NONE) {
+    size_t zlen = n2n_compress(&w->compress, dict_id, tap_pkt, len,
+			       zbuf, sizeof(zbuf), &compression);
+
+    if(zlen > 0) {
+      /* An in place frame stays in its buffer, shorter */
+      if(inplace) {
+	memcpy(tap_pkt, zbuf, zlen);
+	buf->len = zlen;
+      } else
+	tap_pkt = zbuf;
+
+      len = zlen;
+    }
+  }
+
+  if(hc_len > 0)
+    compression |= EDGE_COMPRESSION_HDR;
 
   /* Once processed, send to destination in PACKET */
 
-  memcpy(destMac, tap_pkt, N2N_MAC_SIZE); /* dest MAC is first in ethernet header */
+  if(inplace) {
+    struct n2n_edge_tx_crypt *c = w->tx_crypt;
 
-  memset(&cmn, 0, sizeof(cmn));
-  cmn.ttl = N2N_DEFAULT_TTL;
-  cmn.pc = n2n_packet;
-  cmn.flags=0; /* no options, not from supernode, no socket */
-  memcpy(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE);
+    if(c) {
+      n2n_trans_pkt_t *p = &c->pkts[c->count];
 
-  memset(&pkt, 0, sizeof(pkt));
-  memcpy(pkt.srcMac, eee->device.mac_addr, N2N_MAC_SIZE);
-  memcpy(pkt.dstMac, destMac, N2N_MAC_SIZE);
+      p->buf = buf;
+      p->len = len;
+      p->compression = compression;
+      memcpy(p->peer_mac, destMac, N2N_MAC_SIZE);
 
-  pkt.sock.family=0; /* do not encode sock */
-  pkt.transform = tx_transop_idx;
+      if(++c->count == EDGE_TX_CRYPT_MAX)
+	flush_tx_crypt(w);
+      return;
+    }
 
-  idx=0;
-  encode_PACKET(pktbuf, &idx, &cmn, &pkt);
+    if(w->transop.fwd_inplace(&w->transop, buf, destMac) != 0) {
+      traceEvent(TRACE_ERROR, "No room to encode the PACKET in place");
+      n2n_buf_release(buf);
+      return;
+    }
+
+    send_packet_inplace(w, destMac, compression, buf, len);
+    return;
+  }
 
-  idx += eee->transop.fwd(&eee->transop,
-					  pktbuf+idx, N2N_PKT_BUF_SIZE-idx,
-					  tap_pkt, len, pkt.dstMac);
+  idx = stamp_packet_hdr(eee, pktbuf, destMac, compression);
+
+  idx += w->transop.fwd(&w->transop,
+			pktbuf+idx, N2N_PKT_BUF_SIZE-idx,
+			tap_pkt, len, destMac);
 
   traceEvent(TRACE_DEBUG, "Encode %u B PACKET [%u B data, %u B overhead] transform %u",
      (u_int)idx, (u_int)len, (u_int)(idx-len), tx_transop_idx);
@@ -1329,22 +2788,102 @@ static void send_packet2net(n2n_edge_t * eee,
   }
 #endif
 
-  eee->transop.tx_cnt++; /* stats */
+  w->transop.tx_cnt++; /* stats */
+
+  send_packet(w, destMac, pktbuf, idx, NULL); /* to peer or supernode */
 
-  send_packet(eee, destMac, pktbuf, idx); /* to peer or supernode */
+  n2n_buf_release(buf);
 }
 
 /* ************************************** */
 
+/** Send an ethernet frame read from the TAP to the community. When the frame
+ *  is in the pool buffer buf, the buffer is consumed. */
+static void send_tap_buf(struct n2n_edge_worker * w, uint8_t * eth_pkt, size_t len, n2n_buf_t * buf) {
+  macstr_t            mac_buf;
+  const uint8_t *     mac = eth_pkt;
+
+  traceEvent(TRACE_DEBUG, "### Rx TAP packet (%4d) for %s",
+	     (signed int)len, macaddr_str(mac_buf, mac));
+
+  if(w->eee->conf.drop_multicast &&
+     (is_ip6_discovery(eth_pkt, len) ||
+      is_ethMulticast(eth_pkt, len)
+      )
+     )
+    {
+      traceEvent(TRACE_INFO, "Dropping TX multicast");
+      n2n_buf_release(buf);
+    }
+  else
+    {
+      send_packet2net(w, eth_pkt, len, buf);
+    }
+}
+
+/** n2n_frame_cb_t sending a frame out of a buffer of the caller. */
+static void send_tap_frame(void * arg, uint8_t * eth_pkt, size_t len) {
+  send_tap_buf((struct n2n_edge_worker *)arg, eth_pkt, len, NULL);
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+/** Like readFromTAPSocket() for a TAP with IFF_VNET_HDR: the frame may be a
+ *  TSO super frame, sent as several segments. */
+static int readFromTAPSocketOffload(struct n2n_edge_worker * w) {
+  struct n2n_edge_offload * o = w->offload;
+  struct virtio_net_hdr vh;
+  ssize_t len;
+  int num_segs;
+
+  len = read(w->tap_fd, o->tap_buf, sizeof(o->tap_buf));
+
+  if(len < (ssize_t)sizeof(vh)) {
+    if((len >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+      traceEvent(TRACE_WARNING, "read()=%d [%d/%s]",
+		 (signed int)len, errno, strerror(errno));
+    return(-1);
+  }
+
+  memcpy(&vh, o->tap_buf, sizeof(vh));
+  num_segs = tap_offload_tx(&vh, &o->tap_buf[sizeof(vh)], len - sizeof(vh),
+			    o->seg_buf, sizeof(o->seg_buf), send_tap_frame, w);
+
+  if((vh.gso_type != VIRTIO_NET_HDR_GSO_NONE) && (num_segs > 0)) {
+    ++(w->stats.tx_tso_frames);
+    w->stats.tx_tso_segs += num_segs;
+  }
+
+  return(len);
+}
+#endif
+
+/* ************************************** */
+
 /** Read a single packet from the TAP interface, process it and write out the
  *  corresponding packet to the cooked socket.
+ *
+ *  @return the frame length or -1 when nothing could be read
  */
-static void readFromTAPSocket(n2n_edge_t * eee) {
+static int readFromTAPSocket(struct n2n_edge_worker * w) {
   /* tun -> remote */
-  uint8_t             eth_pkt[N2N_PKT_BUF_SIZE];
-  macstr_t            mac_buf;
+  uint8_t             eth_pkt_local[N2N_PKT_BUF_SIZE];
+  uint8_t *           eth_pkt;
+  n2n_buf_t *         buf;
   ssize_t             len;
 
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  if(w->offload)
+    return(readFromTAPSocketOffload(w));
+#endif
+
+  /* Read after the headroom, so that the PACKET can be built around the frame */
+  if((buf = n2n_buf_alloc(&w->pool)) != NULL)
+    eth_pkt = buf->data;
+  else
+    eth_pkt = eth_pkt_local;
+
 #ifdef __ANDROID_NDK__
   if (uip_arp_len != 0) {
     len = uip_arp_len;
@@ -1354,35 +2893,27 @@ static void readFromTAPSocket(n2n_edge_t * eee) {
   else
     {
 #endif /* #ifdef __ANDROID_NDK__ */
-      len = tuntap_read( &(eee->device), eth_pkt, N2N_PKT_BUF_SIZE );
+      len = worker_tap_read(w, eth_pkt, N2N_PKT_BUF_SIZE);
 #ifdef __ANDROID_NDK__
     }
 #endif /* #ifdef __ANDROID_NDK__ */
 
   if((len <= 0) || (len > N2N_PKT_BUF_SIZE))
     {
-      traceEvent(TRACE_WARNING, "read()=%d [%d/%s]",
-                (signed int)len, errno, strerror(errno));
-    }
-  else
-    {
-      const uint8_t * mac = eth_pkt;
-      traceEvent(TRACE_DEBUG, "### Rx TAP packet (%4d) for %s",
-		 (signed int)len, macaddr_str(mac_buf, mac));
-
-      if(eee->conf.drop_multicast &&
-	 (is_ip6_discovery(eth_pkt, len) ||
-	  is_ethMulticast(eth_pkt, len)
-	  )
-	 )
-        {
-	  traceEvent(TRACE_INFO, "Dropping TX multicast");
-        }
-      else
-        {
-	  send_packet2net(eee, eth_pkt, len);
-        }
+      /* A drained non-blocking TAP is not an error */
+      if((len > 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        traceEvent(TRACE_WARNING, "read()=%d [%d/%s]",
+                   (signed int)len, errno, strerror(errno));
+      n2n_buf_release(buf);
+      return(-1);
     }
+
+  if(buf)
+    n2n_buf_put(buf, len);
+
+  send_tap_buf(w, eth_pkt, len, buf);
+
+  return(len);
 }
 
 /* ************************************** */
@@ -1398,7 +2929,7 @@ static DWORD* tunReadThread(LPVOID lpArg) {
   struct tunread_arg *arg = (struct tunread_arg*)lpArg;
 
   while(*arg->keep_running)
-    readFromTAPSocket(arg->eee);
+    readFromTAPSocket(&arg->eee->workers[0]);
 
   return((DWORD*)NULL);
 }
@@ -1421,51 +2952,36 @@ static HANDLE startTunReadThread(struct tunread_arg *arg) {
 
 /* ************************************** */
 
-/** Read a datagram from the main UDP socket to the internet. */
-static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
+/** Process a datagram received on one of the UDP sockets to the internet.
+ *  decoded, when not NULL, holds its PACKET payload decoded by
+ *  rx_batch_decode(). */
+static void process_udp(struct n2n_edge_worker * w, uint8_t * udp_buf, ssize_t recvlen,
+			const struct sockaddr_in * sender_sock,
+			const n2n_trans_pkt_t * decoded) {
+  n2n_edge_t *        eee = w->eee;
   n2n_common_t        cmn; /* common fields in the packet header */
+  n2n_PACKET_view_t   pkt; /* PACKET header, read in place */
+  const uint8_t *     community;
 
   n2n_sock_str_t      sockbuf1;
   n2n_sock_str_t      sockbuf2; /* don't clobber sockbuf1 if writing two addresses to trace */
   macstr_t            mac_buf1;
   macstr_t            mac_buf2;
 
-  uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
-  ssize_t             recvlen;
   size_t              rem;
   size_t              idx;
+  int                 pkt_hlen;
   size_t              msg_type;
   uint8_t             from_supernode;
-  struct sockaddr_in  sender_sock;
   n2n_sock_t          sender;
   n2n_sock_t *        orig_sender=NULL;
   time_t              now=0;
 
-  size_t              i;
-
-  i = sizeof(sender_sock);
-  recvlen = recvfrom(in_sock, udp_buf, N2N_PKT_BUF_SIZE, 0/*flags*/,
-		     (struct sockaddr *)&sender_sock, (socklen_t*)&i);
-
-  if(recvlen < 0) {
-#ifdef WIN32
-    if(WSAGetLastError() != WSAECONNRESET)
-#endif
-    {
-      traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", recvlen, errno, strerror(errno));
-#ifdef WIN32
-      traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
-#endif
-    }
-
-    return; /* failed to receive data from UDP */
-  }
-
   /* REVISIT: when UDP/IPv6 is supported we will need a flag to indicate which
    * IP transport version the packet arrived on. May need to UDP sockets. */
   sender.family = AF_INET; /* UDP socket was opened PF_INET v4 */
-  sender.port = ntohs(sender_sock.sin_port);
-  memcpy(&(sender.addr.v4), &(sender_sock.sin_addr.s_addr), IPV4_SIZE);
+  sender.port = ntohs(sender_sock->sin_port);
+  memcpy(&(sender.addr.v4), &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
 
   /* The packet may not have an orig_sender socket spec. So default to last
    * hop as sender. */
@@ -1478,26 +2994,37 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 
   rem = recvlen; /* Counts down bytes of packet to protect against buffer overruns. */
   idx = 0; /* marches through packet header as parts are decoded. */
-  if(decode_common(&cmn, udp_buf, &rem, &idx) < 0)
-    {
-      traceEvent(TRACE_ERROR, "Failed to decode common section in N2N_UDP");
-      return; /* failed to decode packet */
-    }
+
+  /* PACKETs - most frequent - take the fast path, the control messages the
+   * generic codec */
+  if((pkt_hlen = decode_PACKET_fast(&pkt, udp_buf, recvlen)) >= 0) {
+    msg_type = MSG_TYPE_PACKET;
+    from_supernode = pkt.flags & N2N_FLAGS_FROM_SUPERNODE;
+    community = pkt.community;
+  } else if(decode_common(&cmn, udp_buf, &rem, &idx) < 0) {
+    traceEvent(TRACE_ERROR, "Failed to decode common section in N2N_UDP");
+    return; /* failed to decode packet */
+  } else if(cmn.pc == MSG_TYPE_PACKET) {
+    traceEvent(TRACE_WARNING, "Dropping a truncated PACKET from %s", sock_to_cstr(sockbuf1, &sender));
+    return;
+  } else {
+    msg_type = cmn.pc; /* packet code */
+    from_supernode = cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
+    community = cmn.community;
+  }
 
   now = time(NULL);
 
-  msg_type = cmn.pc; /* packet code */
-  from_supernode= cmn.flags & N2N_FLAGS_FROM_SUPERNODE;
+  if(0 == memcmp(community, eee->conf.community_name, N2N_COMMUNITY_SIZE)) {
+      /* PACKETs only take the lock to update the peers, the rarer control
+       * messages are handled as a whole under it */
+      if(msg_type != MSG_TYPE_PACKET)
+	peers_lock(eee);
 
-  if(0 == memcmp(cmn.community, eee->conf.community_name, N2N_COMMUNITY_SIZE)) {
       switch(msg_type) {
       case MSG_TYPE_PACKET:
       {
 	  /* process PACKET - most frequent so first in list. */
-	  n2n_PACKET_t pkt;
-
-	  decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
-
 	  if(is_valid_peer_sock(&pkt.sock))
 	    orig_sender = &(pkt.sock);
 
@@ -1508,7 +3035,9 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 	     * handle_PACKET to double check this.
 	     */
 	    traceEvent(TRACE_DEBUG, "Got P2P packet");
+	    peers_lock(eee);
 	    find_and_remove_peer(&eee->pending_peers, pkt.srcMac);
+	    peers_unlock(eee);
 	  }
 
 	  traceEvent(TRACE_INFO, "Rx PACKET from %s (sender=%s) [%u B]",
@@ -1516,7 +3045,7 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 		     sock_to_cstr(sockbuf2, orig_sender),
 		     recvlen);
 
-	  handle_PACKET(eee, &cmn, &pkt, orig_sender, udp_buf+idx, recvlen-idx);
+	  handle_PACKET(w, &pkt, orig_sender, udp_buf+pkt_hlen, recvlen-pkt_hlen, decoded);
 	  break;
       }
       case MSG_TYPE_REGISTER:
@@ -1563,6 +3092,7 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 		     sock_to_cstr(sockbuf2, orig_sender));
 
 	  check_peer_registration_needed(eee, from_supernode, reg.srcMac, orig_sender);
+	  peer_set_caps(eee, reg.srcMac, reg.dict_id, reg.caps);
 	  break;
       }
       case MSG_TYPE_REGISTER_ACK:
@@ -1582,6 +3112,7 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 		     sock_to_cstr(sockbuf2, orig_sender));
 
 	  peer_set_p2p_confirmed(eee, ra.srcMac, &sender, now);
+	  peer_set_caps(eee, ra.srcMac, ra.dict_id, ra.caps);
 	  break;
       }
       case MSG_TYPE_REGISTER_SUPER_ACK:
@@ -1656,8 +3187,11 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
       default:
         /* Not a known message type */
         traceEvent(TRACE_WARNING, "Unable to handle packet type %d: ignored", (signed int)msg_type);
-        return;
+        break;
       } /* switch(msg_type) */
+
+      if(msg_type != MSG_TYPE_PACKET)
+	peers_unlock(eee);
   } else if(from_supernode) /* if (community match) */
     traceEvent(TRACE_WARNING, "Received packet with unknown community");
   else
@@ -1666,126 +3200,1756 @@ static void readFromIPSocket(n2n_edge_t * eee, int in_sock) {
 
 /* ************************************** */
 
-void print_edge_stats(const n2n_edge_t *eee) {
-  const struct n2n_edge_stats *s = &eee->stats;
+/** Read a datagram from a UDP socket to the internet.
+ *
+ *  @return -1 when the socket had no data, 0 otherwise
+ */
+static int readFromIPSocket(struct n2n_edge_worker * w, int in_sock) {
+  uint8_t             udp_buf[N2N_PKT_BUF_SIZE];      /* Compete UDP packet */
+  ssize_t             recvlen;
+  struct sockaddr_in  sender_sock;
+  size_t              i;
+  int                 flags = 0;
 
-  traceEvent(TRACE_NORMAL, "**********************************");
-  traceEvent(TRACE_NORMAL, "Packet stats:");
-  traceEvent(TRACE_NORMAL, "    TX P2P: %u pkts", s->tx_p2p);
-  traceEvent(TRACE_NORMAL, "    RX P2P: %u pkts", s->rx_p2p);
-  traceEvent(TRACE_NORMAL, "    TX Supernode: %u pkts (%u broadcast)", s->tx_sup, s->tx_sup_broadcast);
-  traceEvent(TRACE_NORMAL, "    RX Supernode: %u pkts (%u broadcast)", s->rx_sup, s->rx_sup_broadcast);
-  traceEvent(TRACE_NORMAL, "**********************************");
-}
+#ifdef MSG_DONTWAIT
+  /* The epoll loop drains the socket until it is empty */
+  flags = MSG_DONTWAIT;
+#endif
 
-/* ************************************** */
+  i = sizeof(sender_sock);
+  recvlen = recvfrom(in_sock, udp_buf, N2N_PKT_BUF_SIZE, flags,
+		     (struct sockaddr *)&sender_sock, (socklen_t*)&i);
 
-int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
-  size_t numPurged;
-  time_t lastIfaceCheck=0;
-  time_t lastTransop=0;
-  time_t last_purge_known = 0;
-  time_t last_purge_pending = 0;
-#ifdef __ANDROID_NDK__
-  time_t lastArpPeriod=0;
+  if(recvlen < 0) {
+#ifdef WIN32
+    if(WSAGetLastError() != WSAECONNRESET)
+#else
+    if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return(-1);
 #endif
-
+    {
+      traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", recvlen, errno, strerror(errno));
 #ifdef WIN32
-  struct tunread_arg arg;
-  arg.eee = eee;
-  arg.keep_running = keep_running;
-  HANDLE tun_read_thread = startTunReadThread(&arg);
+      traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
 #endif
+    }
 
-  *keep_running = 1;
-  update_supernode_reg(eee, time(NULL));
+    return(0); /* failed to receive data from UDP */
+  }
 
-  /* Main loop
-   *
-   * select() is used to wait for input on either the TAP fd or the UDP/TCP
-   * socket. When input is present the data is read and processed by either
-   * readFromIPSocket() or readFromTAPSocket()
-   */
+  process_udp(w, udp_buf, recvlen, &sender_sock, NULL);
+  return(0);
+}
 
-  while(*keep_running) {
-    int rc, max_sock = 0;
-    fd_set socket_mask;
-    struct timeval wait_time;
-    time_t nowTime;
+/* ************************************** */
 
-    FD_ZERO(&socket_mask);
-    FD_SET(eee->udp_sock, &socket_mask);
-    FD_SET(eee->udp_mgmt_sock, &socket_mask);
-    max_sock = max(eee->udp_sock, eee->udp_mgmt_sock);
+#ifdef N2N_HAVE_MMSG
+/** Decode the payloads of the PACKETs of a receive batch, those of our
+ *  community and transform, with a single rev_batch() call of the transop.
+ *  slot[i] is the index in pkts of datagram i, or -1 when it was left alone
+ *  to be handled as usual by process_udp(). */
+static void rx_batch_decode(struct n2n_edge_worker * w, struct n2n_edge_batch * b, int n,
+			    n2n_trans_pkt_t * pkts, int * slot) {
+  n2n_edge_t *eee = w->eee;
+  unsigned int num_pkts = 0;
+  int i;
+
+  for(i=0; i<n; i++) {
+    n2n_PACKET_view_t pkt;
+    int idx;
+
+    slot[i] = -1;
+
+    if(((idx = decode_PACKET_fast(&pkt, b->bufs[i], b->msgs[i].msg_len)) < 0)
+       || memcmp(pkt.community, eee->conf.community_name, N2N_COMMUNITY_SIZE)
+       || (pkt.transform != eee->conf.transop_id))
+      continue;
+
+    pkts[num_pkts].data = &b->bufs[i][idx];
+    pkts[num_pkts].len = b->msgs[i].msg_len - idx;
+    memcpy(pkts[num_pkts].peer_mac, pkt.srcMac, N2N_MAC_SIZE);
+    slot[i] = num_pkts++;
+  }
 
-#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
-    FD_SET(eee->udp_multicast_sock, &socket_mask);
-    max_sock = max(eee->udp_sock, eee->udp_multicast_sock);
-#endif
+  if(num_pkts > 0)
+    w->transop.rev_batch(&w->transop, pkts, num_pkts);
+}
 
-#ifndef WIN32
-    FD_SET(eee->device.fd, &socket_mask);
-    max_sock = max(max_sock, eee->device.fd);
-#endif
+/* ************************************** */
 
-    wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+/** Read up to conf.batch_size datagrams from the worker UDP socket with a
+ *  single recvmmsg() call and process them in arrival order.
+ *
+ *  @return -1 when the socket has been emptied, 0 otherwise
+ */
+static int readFromIPSocketBatch(struct n2n_edge_worker * w, int in_sock) {
+  n2n_edge_t *eee = w->eee;
+  struct n2n_edge_batch *b = w->rx_batch;
+  int i, n;
 
-    rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
-    nowTime=time(NULL);
+  for(i=0; i<eee->conf.batch_size; i++)
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
 
-    /* Make sure ciphers are updated before the packet is treated. */
-    if((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL) {
-      lastTransop = nowTime;
+  n = recvmmsg(in_sock, b->msgs, eee->conf.batch_size, MSG_DONTWAIT, NULL);
 
-      eee->transop.tick(&eee->transop, nowTime);
-    }
+  if(n < 0) {
+    if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return(-1);
 
-    if(rc > 0) {
-      /* Any or all of the FDs could have input; check them all. */
+    if(errno != EINTR)
+      traceEvent(TRACE_ERROR, "recvmmsg() failed errno %d (%s)", errno, strerror(errno));
 
-      if(FD_ISSET(eee->udp_sock, &socket_mask)) {
-	/* Read a cooked socket from the internet socket (unicast). Writes on the TAP
-	 * socket. */
-	readFromIPSocket(eee, eee->udp_sock);
-      }
+    return(0); /* failed to receive data from UDP */
+  }
 
+  ++(w->stats.rx_batches);
+  w->stats.rx_batched_pkts += n;
 
-#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
-      if(FD_ISSET(eee->udp_multicast_sock, &socket_mask)) {
-	      /* Read a cooked socket from the internet socket (multicast). Writes on the TAP
-	       * socket. */
-	      traceEvent(TRACE_DEBUG, "Received packet from multicast socket");
-	      readFromIPSocket(eee, eee->udp_multicast_sock);
-      }
-#endif
+  if(w->transop.rev_batch) {
+    n2n_trans_pkt_t pkts[N2N_EDGE_BATCH_MAX];
+    int slot[N2N_EDGE_BATCH_MAX];
 
-#ifdef __ANDROID_NDK__
-      if (uip_arp_len != 0) {
-	readFromTAPSocket(eee);
-	uip_arp_len = 0;
-      }
-#endif /* #ifdef __ANDROID_NDK__ */
+    rx_batch_decode(w, b, n, pkts, slot);
 
-      if(FD_ISSET(eee->udp_mgmt_sock, &socket_mask)) {
-	/* Read a cooked socket from the internet socket. Writes on the TAP
-	 * socket. */
-	readFromMgmtSocket(eee, keep_running);
-      }
+    for(i=0; i<n; i++)
+      process_udp(w, b->bufs[i], b->msgs[i].msg_len, &b->addrs[i],
+                  (slot[i] >= 0) ? &pkts[slot[i]] : NULL);
+  } else {
+    for(i=0; i<n; i++)
+      process_udp(w, b->bufs[i], b->msgs[i].msg_len, &b->addrs[i], NULL);
+  }
 
-#ifndef WIN32
-      if(FD_ISSET(eee->device.fd, &socket_mask)) {
-	/* Read an ethernet frame from the TAP socket. Write on the IP
-	 * socket. */
-	readFromTAPSocket(eee);
-      }
+  /* A short read means that the receive queue was empty */
+  return((n < eee->conf.batch_size) ? -1 : 0);
+}
 #endif
-    }
 
-    /* Finished processing select data. */
-    update_supernode_reg(eee, nowTime);
+/* ************************************** */
 
-    numPurged =  purge_expired_registrations(&eee->known_peers, &last_purge_known);
+#ifdef N2N_HAVE_UDP_GSO
+/** Read the datagrams of a socket with UDP_GRO enabled. The kernel may
+ *  deliver a train of datagrams from the same peer in one buffer, all of the
+ *  size given by the UDP_GRO control message but the last; each of them is
+ *  processed on its own.
+ *
+ *  @return -1 when the socket has been emptied, 0 otherwise
+ */
+static int readFromIPSocketGRO(struct n2n_edge_worker * w, int in_sock) {
+  struct n2n_edge_udp_gro *g = w->udp_gro;
+  int i, n;
+
+  for(i=0; i<EDGE_UDP_GRO_BUFS; i++) {
+    g->msgs[i].msg_hdr.msg_namelen = sizeof(g->addrs[i]);
+    g->msgs[i].msg_hdr.msg_controllen = sizeof(g->ctrl[i].buf);
+  }
+
+  n = recvmmsg(in_sock, g->msgs, EDGE_UDP_GRO_BUFS, MSG_DONTWAIT, NULL);
+
+  if(n < 0) {
+    if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return(-1);
+
+    if(errno != EINTR)
+      traceEvent(TRACE_ERROR, "recvmmsg() failed errno %d (%s)", errno, strerror(errno));
+
+    return(0); /* failed to receive data from UDP */
+  }
+
+  ++(w->stats.rx_batches);
+
+  for(i=0; i<n; i++) {
+    struct msghdr *hdr = &g->msgs[i].msg_hdr;
+    size_t len = g->msgs[i].msg_len, seg_size = len, off;
+    struct cmsghdr *cmsg;
+
+    for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+        int gso_size;
+
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        if(gso_size > 0)
+          seg_size = gso_size;
+        break;
+      }
+    }
+
+    if(seg_size < len) {
+      ++(w->stats.rx_udp_trains);
+      w->stats.rx_udp_segs += (len + seg_size - 1) / seg_size;
+    }
+
+    for(off = 0; off < len; off += seg_size) {
+      process_udp(w, g->bufs[i] + off, min(seg_size, len - off), &g->addrs[i], NULL);
+      ++(w->stats.rx_batched_pkts);
+    }
+  }
+
+  return((n < EDGE_UDP_GRO_BUFS) ? -1 : 0);
+}
+#endif
+
+/* ************************************** */
+
+/** Handle the data waiting on the UDP socket of a worker. */
+static void readFromWorkerSocket(struct n2n_edge_worker * w) {
+#ifdef N2N_HAVE_UDP_GSO
+  if(w->udp_gro)
+    readFromIPSocketGRO(w, w->udp_sock);
+  else
+#endif
+#ifdef N2N_HAVE_MMSG
+  if(w->rx_batch)
+    readFromIPSocketBatch(w, w->udp_sock);
+  else
+#endif
+    readFromIPSocket(w, w->udp_sock);
+}
+
+/* ************************************** */
+
+/** Handle the frames waiting on the TAP queue of a worker. When batching, a
+ *  burst of up to batch_size frames is read so that it can leave with a
+ *  single sendmmsg(). */
+static void readFromWorkerTAP(struct n2n_edge_worker * w) {
+  int num_read = 0;
+
+  while((readFromTAPSocket(w) > 0) && (++num_read < w->eee->conf.batch_size))
+    ;
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_EPOLL
+/* With edge-triggered epoll an fd is only reported again after new data
+ * arrives, so each ready fd is drained until EAGAIN. To keep the UDP and
+ * TAP directions fair, at most EDGE_EPOLL_BUDGET frames are handled per fd
+ * and turn: an fd not yet drained stays ready and epoll_wait() does not
+ * block until all of them are. */
+
+/** @return 1 once the UDP socket of the worker is empty */
+static int drainWorkerSocket(struct n2n_edge_worker * w) {
+  int num_read = 0;
+
+  while(num_read < EDGE_EPOLL_BUDGET) {
+#ifdef N2N_HAVE_UDP_GSO
+    if(w->udp_gro) {
+      if(readFromIPSocketGRO(w, w->udp_sock) < 0)
+	return(1);
+
+      num_read += EDGE_UDP_GRO_BUFS;
+      continue;
+    }
+#endif
+#ifdef N2N_HAVE_MMSG
+    if(w->rx_batch) {
+      if(readFromIPSocketBatch(w, w->udp_sock) < 0)
+	return(1);
+
+      num_read += w->eee->conf.batch_size;
+      continue;
+    }
+#endif
+
+    if(readFromIPSocket(w, w->udp_sock) < 0)
+      return(1);
+
+    num_read++;
+  }
+
+  return(0);
+}
+
+/** @return 1 once the TAP queue of the worker is empty */
+static int drainWorkerTAP(struct n2n_edge_worker * w) {
+  int num_read;
+
+  for(num_read = 0; num_read < EDGE_EPOLL_BUDGET; num_read++) {
+    if(readFromTAPSocket(w) < 0)
+      return(1);
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+static int epoll_add_fd(int efd, int fd, uint32_t events) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    traceEvent(TRACE_ERROR, "epoll_ctl(%d) failed [%d]: %s", fd, errno, strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Create a periodic timerfd firing every period_ms milliseconds. */
+static int open_timerfd(unsigned int period_ms) {
+  struct itimerspec its;
+  int tfd;
+
+  if((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+    traceEvent(TRACE_ERROR, "timerfd_create failed [%d]: %s", errno, strerror(errno));
+    return(-1);
+  }
+
+  memset(&its, 0, sizeof(its));
+  its.it_interval.tv_sec = period_ms / 1000;
+  its.it_interval.tv_nsec = (period_ms % 1000) * 1000000;
+  its.it_value = its.it_interval;
+
+  if(timerfd_settime(tfd, 0, &its, NULL) < 0) {
+    traceEvent(TRACE_ERROR, "timerfd_settime failed [%d]: %s", errno, strerror(errno));
+    close(tfd);
+    return(-1);
+  }
+
+  return(tfd);
+}
+
+/* ************************************** */
+
+/** Current time in timer wheel ticks. */
+static uint64_t edge_timer_ticks(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return(((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / EDGE_TIMER_TICK_MS);
+}
+
+#define EDGE_SECS_TO_TICKS(s)   ((uint64_t)(s) * 1000 / EDGE_TIMER_TICK_MS)
+
+/** The periodic work of the main loop. */
+struct edge_timers {
+  n2n_timer_wheel_t   tw;
+  n2n_timer_t         register_timer;
+  n2n_timer_t         purge_timer;
+  n2n_timer_t         transop_timer;
+  n2n_timer_t         iface_timer;
+};
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_TAP_MQ
+/** Event loop of the worker threads: the only periodic work is the tick of
+ *  the private transop, driven by a timerfd.
+ *
+ *  @return 0 when the loop ran until the edge stopped, -1 when it could not
+ *          be set up and the caller should use select() instead
+ */
+static int edge_worker_epoll_loop(struct n2n_edge_worker * w) {
+  struct epoll_event events[EDGE_EPOLL_MAX_EVENTS];
+  int efd, tfd, udp_ready = 0, tap_ready = 0;
+
+  if((efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    return(-1);
+
+  if((tfd = open_timerfd(TRANSOP_TICK_INTERVAL * 1000)) < 0) {
+    close(efd);
+    return(-1);
+  }
+
+  fcntl(w->tap_fd, F_SETFL, fcntl(w->tap_fd, F_GETFL) | O_NONBLOCK);
+
+  if((epoll_add_fd(efd, w->udp_sock, EPOLLIN | EPOLLET) < 0)
+     || (epoll_add_fd(efd, w->tap_fd, EPOLLIN | EPOLLET) < 0)
+     || (epoll_add_fd(efd, tfd, EPOLLIN) < 0)) {
+    close(tfd);
+    close(efd);
+    return(-1);
+  }
+
+  while(*w->keep_running) {
+    int i, n;
+
+    /* The 1s timeout lets the thread notice keep_running */
+    n = epoll_wait(efd, events, EDGE_EPOLL_MAX_EVENTS, (udp_ready || tap_ready) ? 0 : 1000);
+
+    for(i=0; i<n; i++) {
+      if(events[i].data.fd == w->udp_sock)
+	udp_ready = 1;
+      else if(events[i].data.fd == w->tap_fd)
+	tap_ready = 1;
+      else if(events[i].data.fd == tfd) {
+	uint64_t expirations;
+
+	if(read(tfd, &expirations, sizeof(expirations)) > 0)
+	  w->transop.tick(&w->transop, time(NULL));
+      }
+    }
+
+    if(udp_ready && drainWorkerSocket(w))
+      udp_ready = 0;
+
+    if(tap_ready && drainWorkerTAP(w))
+      tap_ready = 0;
+
+    flush_worker(w);
+  }
+
+  close(tfd);
+  close(efd);
+
+  return(0);
+}
+#endif
+
+/* ************************************** */
+
+static void edge_timer_register(n2n_timer_wheel_t *tw, n2n_timer_t *timer) {
+  n2n_edge_t *eee = (n2n_edge_t*)timer->data;
+  time_t now = time(NULL);
+  time_t next;
+
+  peers_lock(eee);
+  update_supernode_reg(eee, now);
+
+  /* Same deadlines checked by update_supernode_reg() */
+  if(eee->sn_wait)
+    next = eee->last_register_req + (eee->conf.register_interval/10) + 1;
+  else
+    next = eee->last_register_req + eee->conf.register_interval;
+  peers_unlock(eee);
+
+  timer_wheel_add(tw, timer, EDGE_SECS_TO_TICKS(max(next - now, 1)));
+}
+
+static void edge_timer_purge(n2n_timer_wheel_t *tw, n2n_timer_t *timer) {
+  n2n_edge_t *eee = (n2n_edge_t*)timer->data;
+  time_t now = time(NULL);
+  size_t numPurged;
+
+  peers_lock(eee);
+  numPurged =  purge_peer_list(&eee->known_peers, now - REGISTRATION_TIMEOUT);
+  numPurged += purge_peer_list(&eee->pending_peers, now - REGISTRATION_TIMEOUT);
+  n2n_hc_purge(&eee->hc, now);
+
+  if(numPurged > 0) {
+    traceEvent(TRACE_INFO, "%u peers removed. now: pending=%u, operational=%u",
+	       numPurged,
+	       HASH_COUNT(eee->pending_peers),
+	       HASH_COUNT(eee->known_peers));
+  }
+  peers_unlock(eee);
+
+  timer_wheel_add(tw, timer, EDGE_SECS_TO_TICKS(PURGE_REGISTRATION_FREQUENCY));
+}
+
+static void edge_timer_transop(n2n_timer_wheel_t *tw, n2n_timer_t *timer) {
+  n2n_edge_t *eee = (n2n_edge_t*)timer->data;
+
+  eee->workers[0].transop.tick(&eee->workers[0].transop, time(NULL));
+
+  timer_wheel_add(tw, timer, EDGE_SECS_TO_TICKS(TRANSOP_TICK_INTERVAL));
+}
+
+static void edge_timer_iface(n2n_timer_wheel_t *tw, n2n_timer_t *timer) {
+  n2n_edge_t *eee = (n2n_edge_t*)timer->data;
+
+  traceEvent(TRACE_NORMAL, "Re-checking dynamic IP address.");
+  tuntap_get_address(&(eee->device));
+
+  timer_wheel_add(tw, timer, EDGE_SECS_TO_TICKS(IFACE_UPDATE_INTERVAL));
+}
+
+/* ************************************** */
+
+/** Schedule the periodic work of the main loop. */
+static void edge_timers_init(n2n_edge_t * eee, struct edge_timers * t) {
+  timer_wheel_init(&t->tw, edge_timer_ticks());
+
+  timer_init(&t->register_timer, edge_timer_register, eee);
+  timer_init(&t->purge_timer, edge_timer_purge, eee);
+  timer_init(&t->transop_timer, edge_timer_transop, eee);
+  timer_init(&t->iface_timer, edge_timer_iface, eee);
+
+  /* run_edge_loop() has just registered */
+  timer_wheel_add(&t->tw, &t->register_timer, 1);
+  timer_wheel_add(&t->tw, &t->purge_timer, EDGE_SECS_TO_TICKS(PURGE_REGISTRATION_FREQUENCY));
+  timer_wheel_add(&t->tw, &t->transop_timer, 1);
+  if(eee->conf.dyn_ip_mode)
+    timer_wheel_add(&t->tw, &t->iface_timer, EDGE_SECS_TO_TICKS(IFACE_UPDATE_INTERVAL));
+}
+
+/* ************************************** */
+
+/** Main loop based on edge-triggered epoll. The periodic work runs from a
+ *  timer wheel advanced by a timerfd, so handling a packet never looks at
+ *  the clock or at the registrations.
+ *
+ *  @return 0 when the loop ran until the edge stopped, -1 when it could not
+ *          be set up and the caller should use select() instead
+ */
+static int edge_epoll_loop(n2n_edge_t * eee, int *keep_running) {
+  struct n2n_edge_worker *w0 = &eee->workers[0];
+  struct epoll_event events[EDGE_EPOLL_MAX_EVENTS];
+  struct edge_timers timers;
+  int efd, tfd, udp_ready = 0, tap_ready = 0, rc = 0;
+
+  if((efd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    traceEvent(TRACE_WARNING, "epoll_create1 failed [%d]: %s", errno, strerror(errno));
+    return(-1);
+  }
+
+  if((tfd = open_timerfd(EDGE_TIMER_TICK_MS)) < 0) {
+    close(efd);
+    return(-1);
+  }
+
+  /* Edge-triggered fds must not block once drained */
+  fcntl(eee->device.fd, F_SETFL, fcntl(eee->device.fd, F_GETFL) | O_NONBLOCK);
+
+  /* The data path is edge-triggered, the rare control traffic is not. With
+   * the pipeline the data path has threads of its own. */
+  if((!pipe_active(eee) && (epoll_add_fd(efd, eee->udp_sock, EPOLLIN | EPOLLET) < 0))
+     || (!pipe_active(eee) && (epoll_add_fd(efd, eee->device.fd, EPOLLIN | EPOLLET) < 0))
+     || (epoll_add_fd(efd, eee->udp_mgmt_sock, EPOLLIN) < 0)
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+     || (epoll_add_fd(efd, eee->udp_multicast_sock, EPOLLIN) < 0)
+#endif
+     || (epoll_add_fd(efd, tfd, EPOLLIN) < 0)) {
+    close(tfd);
+    close(efd);
+    return(-1);
+  }
+
+  edge_timers_init(eee, &timers);
+
+  while(*keep_running) {
+    int i, n;
+
+    n = epoll_wait(efd, events, EDGE_EPOLL_MAX_EVENTS, (udp_ready || tap_ready) ? 0 : -1);
+
+    if((n < 0) && (errno != EINTR)) {
+      traceEvent(TRACE_ERROR, "epoll_wait failed [%d]: %s", errno, strerror(errno));
+      rc = -1;
+      break;
+    }
+
+    for(i=0; i<n; i++) {
+      int fd = events[i].data.fd;
+
+      if(fd == eee->udp_sock)
+	udp_ready = 1;
+      else if(fd == eee->device.fd)
+	tap_ready = 1;
+      else if(fd == tfd) {
+	uint64_t expirations;
+
+	if(read(tfd, &expirations, sizeof(expirations)) > 0)
+	  timer_wheel_advance(&timers.tw, edge_timer_ticks());
+      } else if(fd == eee->udp_mgmt_sock)
+	readFromMgmtSocket(eee, keep_running);
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+      else if(fd == eee->udp_multicast_sock) {
+	traceEvent(TRACE_DEBUG, "Received packet from multicast socket");
+	readFromIPSocket(w0, eee->udp_multicast_sock);
+      }
+#endif
+    }
+
+    if(udp_ready && drainWorkerSocket(w0))
+      udp_ready = 0;
+
+    if(tap_ready && drainWorkerTAP(w0))
+      tap_ready = 0;
+
+    /* Send the PACKETs queued in this turn */
+    flush_worker(w0);
+  }
+
+  close(tfd);
+  close(efd);
+
+  return(rc);
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_IO_URING
+/** Post the multishot receive of the UDP socket. */
+static int edge_uring_post_udp(struct n2n_edge_uring * u) {
+  struct io_uring_sqe *sqe = edge_uring_sqe(u);
+
+  if(sqe == NULL)
+    return(-1);
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = EDGE_URING_FILE_UDP;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->addr = (unsigned long)&u->recv_hdr;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = EDGE_URING_BGID_UDP;
+  sqe->user_data = EDGE_URING_UD(EDGE_URING_REQ_UDP_RECV, 0);
+  u->inflight++;
+
+  return(0);
+}
+
+/** Post the read of the TAP, multishot when the kernel has it. */
+static int edge_uring_post_tap(struct n2n_edge_uring * u) {
+  struct io_uring_sqe *sqe = edge_uring_sqe(u);
+
+  if(sqe == NULL)
+    return(-1);
+
+  sqe->opcode = u->tap_multishot ? EDGE_IORING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd = EDGE_URING_FILE_TAP;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->len = u->tap_multishot ? 0 : u->tap_bufs.buf_size;
+  sqe->off = (uint64_t)-1;
+  sqe->buf_group = EDGE_URING_BGID_TAP;
+  sqe->user_data = EDGE_URING_UD(EDGE_URING_REQ_TAP_READ, 0);
+  u->inflight++;
+
+  return(0);
+}
+
+/** Post a multishot poll of a control fd, handled by the existing readers. */
+static int edge_uring_post_poll(struct n2n_edge_uring * u, int fd) {
+  struct io_uring_sqe *sqe = edge_uring_sqe(u);
+
+  if(sqe == NULL)
+    return(-1);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  sqe->poll32_events = (uint32_t)POLLIN << 16; /* read as two 16 bit halves */
+#else
+  sqe->poll32_events = POLLIN;
+#endif
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = EDGE_URING_UD(EDGE_URING_REQ_POLL, fd);
+  u->inflight++;
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Cancel the requests still posted and wait for all of them to complete,
+ *  as their buffers are released right after. */
+static void edge_uring_drain(struct n2n_edge_uring * u) {
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+
+  if((u->inflight == 0) || ((sqe = edge_uring_sqe(u)) == NULL))
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = EDGE_URING_UD(EDGE_URING_REQ_CANCEL, 0);
+
+  while(u->inflight > 0) {
+    if((uring_submit(&u->ring, 1) < 0) && (errno != EINTR))
+      break;
+
+    while((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+      if((cqe->user_data >> 32) != EDGE_URING_REQ_CANCEL) {
+        if(!(cqe->flags & IORING_CQE_F_MORE))
+          u->inflight--;
+      } else if((cqe->res < 0) && (cqe->res != -ENOENT)) {
+        traceEvent(TRACE_WARNING, "io_uring cancel failed: %s", strerror(-cqe->res));
+        u->inflight = 0;
+      }
+
+      uring_cqe_seen(&u->ring);
+    }
+  }
+}
+
+/* ************************************** */
+
+/** Data path based on io_uring, for the main loop (worker 0, which also
+ *  serves the control sockets and the timers) and for the worker threads.
+ *  Apart from the rare control traffic, a loop turn is a single
+ *  io_uring_enter() submitting the TAP writes and UDP sends queued in the
+ *  previous turn and waiting for the next completions.
+ *
+ *  @return 0 when the loop ran until the edge stopped, -1 when io_uring
+ *          cannot be used and the caller should fall back to epoll
+ */
+static int edge_uring_loop(struct n2n_edge_worker * w, int *keep_running) {
+  n2n_edge_t *eee = w->eee;
+  struct n2n_edge_uring *u;
+  struct edge_timers timers;
+  struct io_uring_cqe *cqe;
+  int fds[2], tfd = -1, tap_flags = -1, rc = -1, i;
+  int is_main = (w->idx == 0);
+  time_t last_transop = time(NULL);
+
+  if((u = calloc(1, sizeof(struct n2n_edge_uring))) == NULL)
+    return(-1);
+
+  if(uring_init(&u->ring, EDGE_URING_ENTRIES, EDGE_URING_CQ_ENTRIES) < 0) {
+    free(u);
+    return(-1);
+  }
+
+  fds[EDGE_URING_FILE_TAP] = w->tap_fd;
+  fds[EDGE_URING_FILE_UDP] = w->udp_sock;
+
+  /* Buffer rings need Linux 5.19 */
+  if((uring_register_files(&u->ring, fds, 2) < 0)
+     || (uring_bufs_init(&u->ring, &u->tap_bufs, EDGE_URING_BGID_TAP,
+                         EDGE_URING_RX_BUFS, N2N_PKT_BUF_SIZE) < 0)
+     || (uring_bufs_init(&u->ring, &u->udp_bufs, EDGE_URING_BGID_UDP,
+                         EDGE_URING_RX_BUFS, EDGE_URING_RX_BUF_SIZE) < 0)
+     || ((tfd = open_timerfd(is_main ? EDGE_TIMER_TICK_MS : 1000)) < 0))
+    goto uring_loop_cleanup;
+
+  u->tap_multishot = uring_op_supported(&u->ring, EDGE_IORING_OP_READ_MULTISHOT);
+  u->recv_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  u->tx_cur = -1;
+  for(i=0; i<EDGE_URING_TX_SLOTS; i++)
+    u->free_slots[u->num_free++] = i;
+
+  /* Reads of a non-blocking fd fail with EAGAIN instead of waiting for data */
+  tap_flags = fcntl(w->tap_fd, F_GETFL);
+  fcntl(w->tap_fd, F_SETFL, tap_flags & ~O_NONBLOCK);
+
+  if((edge_uring_post_udp(u) < 0) || (edge_uring_post_tap(u) < 0) || (edge_uring_post_poll(u, tfd) < 0))
+    goto uring_loop_cleanup;
+
+  if(is_main) {
+    if((edge_uring_post_poll(u, eee->udp_mgmt_sock) < 0)
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+       || (edge_uring_post_poll(u, eee->udp_multicast_sock) < 0)
+#endif
+       )
+      goto uring_loop_cleanup;
+
+    edge_timers_init(eee, &timers);
+  }
+
+  traceEvent(TRACE_NORMAL, "io_uring data path started [worker %d, %s TAP reads]", w->idx,
+             u->tap_multishot ? "multishot" : "single shot");
+
+  w->uring = u;
+  rc = 0;
+
+  while(*keep_running && (rc == 0)) {
+    if((uring_submit(&u->ring, 1) < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+      traceEvent(TRACE_ERROR, "io_uring_enter failed [%d]: %s", errno, strerror(errno));
+      rc = -1;
+      break;
+    }
+
+    ++(w->stats.uring_enters);
+
+    while((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+      unsigned req = (unsigned)(cqe->user_data >> 32), val = (uint32_t)cqe->user_data;
+      unsigned flags = cqe->flags;
+      uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      int res = cqe->res, more = (flags & IORING_CQE_F_MORE) ? 1 : 0;
+
+      uring_cqe_seen(&u->ring);
+      ++(w->stats.uring_cqes);
+
+      if(!more)
+        u->inflight--;
+
+      switch(req) {
+      case EDGE_URING_REQ_TAP_READ:
+        if(flags & IORING_CQE_F_BUFFER) {
+          if(res > 0)
+            send_tap_frame(w, uring_buf(&u->tap_bufs, bid), res);
+          uring_bufs_recycle(&u->tap_bufs, bid);
+        } else if((res < 0) && (res != -ENOBUFS) && (res != -EINTR) && (res != -EAGAIN)) {
+          traceEvent(TRACE_WARNING, "io_uring TAP read failed: %s", strerror(-res));
+          rc = -1;
+        }
+
+        if(!more && (rc == 0) && (edge_uring_post_tap(u) < 0))
+          rc = -1;
+        break;
+
+      case EDGE_URING_REQ_UDP_RECV:
+        if(flags & IORING_CQE_F_BUFFER) {
+          uint8_t *buf = uring_buf(&u->udp_bufs, bid);
+          struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+          size_t hdr_len = sizeof(*out) + u->recv_hdr.msg_namelen + u->recv_hdr.msg_controllen;
+
+          if((res >= (int)hdr_len) && (out->namelen >= sizeof(struct sockaddr_in))
+             && !(out->flags & MSG_TRUNC)) {
+            struct sockaddr_in sender;
+
+            memcpy(&sender, buf + sizeof(*out), sizeof(sender));
+            process_udp(w, buf + hdr_len, out->payloadlen, &sender, NULL);
+          }
+
+          uring_bufs_recycle(&u->udp_bufs, bid);
+        } else if((res < 0) && (res != -ENOBUFS) && (res != -EINTR) && (res != -EAGAIN)) {
+          /* Multishot recvmsg needs Linux 6.0 */
+          traceEvent(TRACE_WARNING, "io_uring UDP receive failed: %s", strerror(-res));
+          rc = -1;
+        }
+
+        if(!more && (rc == 0) && (edge_uring_post_udp(u) < 0))
+          rc = -1;
+        break;
+
+      case EDGE_URING_REQ_TX:
+        if(res < 0)
+          traceEvent(TRACE_ERROR, "io_uring %s failed: %s",
+                     u->slots[val].hdr.msg_name ? "sendmsg" : "TAP write", strerror(-res));
+
+        u->slots[val].hdr.msg_name = NULL;
+        u->free_slots[u->num_free++] = val;
+        break;
+
+      case EDGE_URING_REQ_POLL:
+        if(res < 0) {
+          traceEvent(TRACE_WARNING, "io_uring poll failed: %s", strerror(-res));
+          rc = -1;
+          break;
+        }
+
+        if((int)val == tfd) {
+          uint64_t expirations;
+
+          if(read(tfd, &expirations, sizeof(expirations)) > 0) {
+            if(is_main)
+              timer_wheel_advance(&timers.tw, edge_timer_ticks());
+            else if((time(NULL) - last_transop) >= TRANSOP_TICK_INTERVAL) {
+              last_transop = time(NULL);
+              w->transop.tick(&w->transop, last_transop);
+            }
+          }
+        } else if((int)val == eee->udp_mgmt_sock)
+          readFromMgmtSocket(eee, keep_running);
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+        else if((int)val == eee->udp_multicast_sock) {
+          traceEvent(TRACE_DEBUG, "Received packet from multicast socket");
+          readFromIPSocket(w, eee->udp_multicast_sock);
+        }
+#endif
+
+        if(!more && (edge_uring_post_poll(u, val) < 0))
+          rc = -1;
+        break;
+      }
+    }
+  }
+
+ uring_loop_cleanup:
+  edge_uring_drain(u);
+  w->uring = NULL;
+
+  if(tap_flags >= 0)
+    fcntl(w->tap_fd, F_SETFL, tap_flags);
+  if(tfd >= 0)
+    close(tfd);
+
+  uring_bufs_free(&u->ring, &u->udp_bufs);
+  uring_bufs_free(&u->ring, &u->tap_bufs);
+  uring_exit(&u->ring);
+  free(u);
+
+  return(rc);
+}
+#endif /* N2N_HAVE_IO_URING */
+#endif /* N2N_HAVE_EPOLL */
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_TAP_MQ
+/** Body of the threads serving the TAP queues other than the first one.
+ *  The supernode registration and the peers maintenance are left to the
+ *  main loop. */
+static void* edge_worker_thread(void *arg) {
+  struct n2n_edge_worker *w = (struct n2n_edge_worker*)arg;
+  time_t lastTransop = 0;
+
+#ifdef N2N_HAVE_IO_URING
+  if(w->eee->conf.io_uring && (edge_uring_loop(w, w->keep_running) == 0))
+    return(NULL);
+  /* else fall back to epoll */
+#endif
+
+#ifdef N2N_HAVE_EPOLL
+  if(edge_worker_epoll_loop(w) == 0)
+    return(NULL);
+  /* else fall back to select() */
+#endif
+
+  while(*w->keep_running) {
+    int rc;
+    fd_set socket_mask;
+    struct timeval wait_time;
+    time_t nowTime;
+
+    FD_ZERO(&socket_mask);
+    FD_SET(w->udp_sock, &socket_mask);
+    FD_SET(w->tap_fd, &socket_mask);
+
+    wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+
+    rc = select(max(w->udp_sock, w->tap_fd)+1, &socket_mask, NULL, NULL, &wait_time);
+    nowTime = time(NULL);
+
+    if((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL) {
+      lastTransop = nowTime;
+
+      w->transop.tick(&w->transop, nowTime);
+    }
+
+    if(rc > 0) {
+      if(FD_ISSET(w->udp_sock, &socket_mask))
+	readFromWorkerSocket(w);
+
+      if(FD_ISSET(w->tap_fd, &socket_mask))
+	readFromWorkerTAP(w);
+    }
+
+    flush_worker(w);
+  }
+
+  return(NULL);
+}
+#endif
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_PIPELINE
+/* The pipelined data path, see struct n2n_edge_pipe */
+
+/** FNV-1a */
+static uint32_t pipe_hash(uint32_t h, const uint8_t * p, size_t len) {
+  while(len--)
+    h = (h ^ *p++) * 16777619;
+
+  return(h);
+}
+
+/** Lane of a frame read from the TAP. The frames of a TCP or UDP flow hash
+ *  the same, as do the fragments of an IPv4 datagram (ports left out). */
+static unsigned int pipe_frame_lane(const struct n2n_edge_pipe * pipe, const uint8_t * frame, size_t len) {
+  const uint8_t *l3 = frame + ETH_FRAMESIZE;
+  uint32_t h = 2166136261u;
+  uint16_t type;
+
+  if(len < ETH_FRAMESIZE)
+    return(0);
+
+  type = (frame[12] << 8) | frame[13];
+
+  if((type == 0x0800) && (len >= ETH_FRAMESIZE + IP4_MIN_SIZE)) {
+    size_t ihl = (l3[0] & 0x0f) * 4;
+
+    h = pipe_hash(h, &l3[IP4_SRCOFFSET], 8); /* addresses */
+    h = pipe_hash(h, &l3[9], 1);             /* protocol */
+
+    if(((l3[9] == IPPROTO_TCP) || (l3[9] == IPPROTO_UDP))
+       && !(l3[6] & 0x3f) && !l3[7]         /* not a fragment */
+       && (len >= ETH_FRAMESIZE + ihl + 4))
+      h = pipe_hash(h, &l3[ihl], 4);         /* ports */
+  } else if((type == 0x86DD) && (len >= ETH_FRAMESIZE + 40)) {
+    h = pipe_hash(h, &l3[8], 32);            /* addresses */
+    h = pipe_hash(h, &l3[6], 1);             /* next header */
+
+    if(((l3[6] == IPPROTO_TCP) || (l3[6] == IPPROTO_UDP))
+       && (len >= ETH_FRAMESIZE + 40 + 4))
+      h = pipe_hash(h, &l3[40], 4);
+  } else
+    h = pipe_hash(h, frame, 2 * N2N_MAC_SIZE);
+
+  return(h % pipe->num_lanes);
+}
+
+/** Lane of a datagram: all the PACKETs of a peer are decoded in order. */
+static unsigned int pipe_peer_lane(const struct n2n_edge_pipe * pipe, const struct sockaddr_in * peer) {
+  uint32_t h = 2166136261u;
+
+  h = pipe_hash(h, (const uint8_t *)&peer->sin_addr, sizeof(peer->sin_addr));
+  h = pipe_hash(h, (const uint8_t *)&peer->sin_port, sizeof(peer->sin_port));
+
+  return(h % pipe->num_lanes);
+}
+
+/* ************************************** */
+
+static int pipe_lane_has_input(void * arg) {
+  struct n2n_edge_pipe_lane *lane = (struct n2n_edge_pipe_lane *)arg;
+
+  return(n2n_ring_count(&lane->rx_in) || n2n_ring_count(&lane->tx_in));
+}
+
+static int pipe_udp_out_has_input(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int i;
+
+  for(i=0; i<pipe->num_lanes; i++)
+    if(n2n_ring_count(&pipe->lanes[i].udp_out))
+      return(1);
+
+  return(0);
+}
+
+static int pipe_tap_out_has_input(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int i;
+
+  for(i=0; i<pipe->num_lanes; i++)
+    if(n2n_ring_count(&pipe->lanes[i].tap_out))
+      return(1);
+
+  return(0);
+}
+
+/** Wait up to 1s for fd to become readable. */
+static void pipe_poll_in(int fd) {
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  poll(&pfd, 1, 1000);
+}
+
+/* ************************************** */
+
+/** Reads the frames of the TAP and hands them to the lanes by flow. */
+static void* pipe_tap_reader(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int fd = pipe->eee->device.fd;
+  uint8_t discard[N2N_PKT_BUF_SIZE];
+
+  while(*pipe->keep_running) {
+    uint32_t woken = 0;
+    int i, n;
+
+    for(n=0; n<EDGE_PIPE_BUDGET; n++) {
+      n2n_buf_t *buf = n2n_buf_alloc(&pipe->pool);
+      struct n2n_edge_pipe_lane *lane;
+      ssize_t len;
+
+      len = read(fd, buf ? buf->data : discard, N2N_PKT_BUF_SIZE);
+
+      if(len <= 0) {
+        if((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+          traceEvent(TRACE_WARNING, "read()=%d [%d/%s]", (signed int)len, errno, strerror(errno));
+
+        n2n_buf_release(buf);
+        break;
+      }
+
+      if(buf == NULL) {
+        ++(pipe->tap_rd.drops);
+        continue;
+      }
+
+      n2n_buf_put(buf, len);
+      lane = &pipe->lanes[pipe_frame_lane(pipe, buf->data, len)];
+
+      if(n2n_ring_push(&lane->tx_in, buf) == 0) {
+        ++(pipe->tap_rd.pkts);
+        woken |= 1 << (lane - pipe->lanes);
+      } else {
+        ++(pipe->tap_rd.drops);
+        n2n_buf_release(buf);
+      }
+    }
+
+    for(i=0; woken; i++, woken >>= 1)
+      if(woken & 1)
+        pipe_wake(&pipe->lanes[i].wait);
+
+    if(n < EDGE_PIPE_BUDGET)
+      pipe_poll_in(fd);
+  }
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+/** Hand a received datagram to the lane of its peer. */
+static void pipe_udp_dispatch(struct n2n_edge_pipe * pipe, n2n_buf_t * buf,
+                              const struct sockaddr_in * sender, uint32_t * woken) {
+  struct n2n_edge_pipe_lane *lane = &pipe->lanes[pipe_peer_lane(pipe, sender)];
+
+  buf->peer.family = AF_INET;
+  buf->peer.port = ntohs(sender->sin_port);
+  memcpy(&buf->peer.addr.v4, &sender->sin_addr.s_addr, IPV4_SIZE);
+
+  if(n2n_ring_push(&lane->rx_in, buf) == 0) {
+    ++(pipe->udp_rd.pkts);
+    *woken |= 1 << (lane - pipe->lanes);
+  } else {
+    ++(pipe->udp_rd.drops);
+    n2n_buf_release(buf);
+  }
+}
+
+/** Reads the datagrams of the UDP socket, with recvmmsg() when available,
+ *  and hands them to the lanes by peer. */
+static void* pipe_udp_reader(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int sock = pipe->eee->udp_sock;
+  uint8_t discard[N2N_PKT_BUF_SIZE];
+#ifdef N2N_HAVE_MMSG
+  struct mmsghdr msgs[EDGE_PIPE_BUDGET];
+  struct iovec iovs[EDGE_PIPE_BUDGET];
+  struct sockaddr_in addrs[EDGE_PIPE_BUDGET];
+  n2n_buf_t *bufs[EDGE_PIPE_BUDGET];
+
+  memset(msgs, 0, sizeof(msgs));
+  memset(bufs, 0, sizeof(bufs));
+#endif
+
+  while(*pipe->keep_running) {
+    uint32_t woken = 0;
+    int i, n = 0;
+
+#ifdef N2N_HAVE_MMSG
+    /* Buffers not filled by the previous call are kept for the next one */
+    for(n=0; n<EDGE_PIPE_BUDGET; n++) {
+      if((bufs[n] == NULL) && ((bufs[n] = n2n_buf_alloc(&pipe->pool)) == NULL))
+        break;
+
+      iovs[n].iov_base = bufs[n]->data;
+      iovs[n].iov_len = N2N_PKT_BUF_SIZE;
+      msgs[n].msg_hdr.msg_name = &addrs[n];
+      msgs[n].msg_hdr.msg_namelen = sizeof(addrs[n]);
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+    }
+
+    if(n > 0) {
+      int num = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+
+      for(i=0; i<num; i++) {
+        n2n_buf_put(bufs[i], msgs[i].msg_len);
+        pipe_udp_dispatch(pipe, bufs[i], &addrs[i], &woken);
+      }
+
+      /* Move the unused buffers to the front */
+      if(num > 0) {
+        for(i=num; i<n; i++)
+          bufs[i-num] = bufs[i];
+        for(i=n-num; i<n; i++)
+          bufs[i] = NULL;
+      }
+
+      if((num < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        traceEvent(TRACE_ERROR, "recvmmsg failed (%d) %s", errno, strerror(errno));
+
+      n = (num > 0) ? num : 0;
+    } else
+#endif
+    {
+      /* No buffer left: the datagrams are dropped, rather than left to
+       * fill the socket buffer while the lanes catch up */
+      for(n=0; n<EDGE_PIPE_BUDGET; n++) {
+        struct sockaddr_in sender;
+        socklen_t slen = sizeof(sender);
+        n2n_buf_t *buf = n2n_buf_alloc(&pipe->pool);
+        ssize_t len;
+
+        len = recvfrom(sock, buf ? buf->data : discard, N2N_PKT_BUF_SIZE, MSG_DONTWAIT,
+                       (struct sockaddr *)&sender, &slen);
+
+        if(len < 0) {
+          n2n_buf_release(buf);
+          break;
+        }
+
+        if(buf == NULL) {
+          ++(pipe->udp_rd.drops);
+          continue;
+        }
+
+        n2n_buf_put(buf, len);
+        pipe_udp_dispatch(pipe, buf, &sender, &woken);
+      }
+    }
+
+    for(i=0; woken; i++, woken >>= 1)
+      if(woken & 1)
+        pipe_wake(&pipe->lanes[i].wait);
+
+    if(n < EDGE_PIPE_BUDGET)
+      pipe_poll_in(sock);
+  }
+
+#ifdef N2N_HAVE_MMSG
+  {
+    int i;
+
+    for(i=0; i<EDGE_PIPE_BUDGET; i++)
+      n2n_buf_release(bufs[i]);
+  }
+#endif
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+/** Crypto lane: decodes the datagrams of its peers and encodes the frames of
+ *  its flows with the private transop of its worker. */
+static void* pipe_lane_thread(void * arg) {
+  struct n2n_edge_pipe_lane *lane = (struct n2n_edge_pipe_lane *)arg;
+  struct n2n_edge_pipe *pipe = lane->pipe;
+  struct n2n_edge_worker *w = lane->w;
+  time_t lastTransop = 0;
+
+  while(*pipe->keep_running) {
+    n2n_buf_t *buf;
+    time_t nowTime;
+    int n, busy = 0;
+
+    for(n=0; (n<EDGE_PIPE_BUDGET) && ((buf = n2n_ring_pop(&lane->rx_in)) != NULL); n++) {
+      struct sockaddr_in sender;
+
+      fill_sockaddr((struct sockaddr *)&sender, sizeof(sender), &buf->peer);
+
+      /* Taken by worker_tap_write() when a frame comes out of it */
+      lane->rx_buf = buf;
+      process_udp(w, buf->data, buf->len, &sender, NULL);
+      n2n_buf_release(lane->rx_buf);
+      lane->rx_buf = NULL;
+    }
+    busy |= n;
+
+    for(n=0; (n<EDGE_PIPE_BUDGET) && ((buf = n2n_ring_pop(&lane->tx_in)) != NULL); n++)
+      send_tap_buf(w, buf->data, buf->len, buf);
+    flush_tx_crypt(w);
+    busy |= n;
+
+    nowTime = time(NULL);
+    if((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL) {
+      lastTransop = nowTime;
+
+      w->transop.tick(&w->transop, nowTime);
+    }
+
+    if(busy) {
+      pipe_wake(&pipe->udp_wr_wait);
+      pipe_wake(&pipe->tap_wr_wait);
+    } else
+      pipe_sleep(&lane->wait, pipe_lane_has_input, lane);
+  }
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+/** Sends the PACKETs of all the lanes, up to a batch per sendmmsg(). The
+ *  lane served first changes at every turn so that none is starved. */
+static void* pipe_udp_writer(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int sock = pipe->eee->udp_sock;
+  n2n_buf_t *bufs[N2N_EDGE_BATCH_MAX];
+  int first = 0;
+#ifdef N2N_HAVE_MMSG
+  struct mmsghdr msgs[N2N_EDGE_BATCH_MAX];
+  struct iovec iovs[N2N_EDGE_BATCH_MAX];
+  struct sockaddr_in addrs[N2N_EDGE_BATCH_MAX];
+
+  memset(msgs, 0, sizeof(msgs));
+#endif
+
+  while(*pipe->keep_running) {
+    unsigned int count = 0, sent = 0, i;
+
+    for(i=0; (i<pipe->num_lanes) && (count<N2N_EDGE_BATCH_MAX); i++) {
+      n2n_ring_t *ring = &pipe->lanes[(first + i) % pipe->num_lanes].udp_out;
+
+      while((count < N2N_EDGE_BATCH_MAX) && ((bufs[count] = n2n_ring_pop(ring)) != NULL))
+        count++;
+    }
+
+    first = (first + 1) % pipe->num_lanes;
+
+    if(count == 0) {
+      pipe_sleep(&pipe->udp_wr_wait, pipe_udp_out_has_input, pipe);
+      continue;
+    }
+
+#ifdef N2N_HAVE_MMSG
+    for(i=0; i<count; i++) {
+      fill_sockaddr((struct sockaddr *)&addrs[i], sizeof(addrs[i]), &bufs[i]->peer);
+      iovs[i].iov_base = bufs[i]->data;
+      iovs[i].iov_len = bufs[i]->len;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(sent < count) {
+      int rc = sendmmsg(sock, &msgs[sent], count - sent, 0 /*flags*/);
+
+      if(rc > 0) {
+        pipe->udp_wr.pkts += rc;
+        sent += rc;
+      } else if((rc < 0) && (errno == EINTR))
+        continue;
+      else {
+        traceEvent(TRACE_ERROR, "sendmmsg failed (%d) %s", errno, strerror(errno));
+        ++(pipe->udp_wr.drops);
+        sent++; /* skip the offending datagram */
+      }
+    }
+#else
+    for(sent=0; sent<count; sent++) {
+      if(sendto_sock(sock, bufs[sent]->data, bufs[sent]->len, &bufs[sent]->peer) < 0)
+        ++(pipe->udp_wr.drops);
+      else
+        ++(pipe->udp_wr.pkts);
+    }
+#endif
+
+    for(i=0; i<count; i++)
+      n2n_buf_release(bufs[i]);
+  }
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+/** Writes the frames decoded by all the lanes to the TAP. */
+static void* pipe_tap_writer(void * arg) {
+  struct n2n_edge_pipe *pipe = (struct n2n_edge_pipe *)arg;
+  int fd = pipe->eee->device.fd;
+  int first = 0;
+
+  while(*pipe->keep_running) {
+    int i, n, busy = 0;
+
+    for(i=0; i<pipe->num_lanes; i++) {
+      n2n_ring_t *ring = &pipe->lanes[(first + i) % pipe->num_lanes].tap_out;
+      n2n_buf_t *buf;
+
+      for(n=0; (n<EDGE_PIPE_BUDGET) && ((buf = n2n_ring_pop(ring)) != NULL); n++) {
+        if(write(fd, buf->data, buf->len) < 0) {
+          traceEvent(TRACE_WARNING, "TAP write failed [%d]: %s", errno, strerror(errno));
+          ++(pipe->tap_wr.drops);
+        } else
+          ++(pipe->tap_wr.pkts);
+
+        n2n_buf_release(buf);
+      }
+
+      busy |= n;
+    }
+
+    first = (first + 1) % pipe->num_lanes;
+
+    if(!busy)
+      pipe_sleep(&pipe->tap_wr_wait, pipe_tap_out_has_input, pipe);
+  }
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+static int pipe_init_waiter(struct n2n_edge_pipe_waiter * wait) {
+  wait->sleeping = 0;
+
+  if((wait->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    traceEvent(TRACE_ERROR, "eventfd failed [%d]: %s", errno, strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+}
+
+/** Allocate the pipeline of an edge whose workers[1..] become its lanes. */
+static int edge_init_pipe(n2n_edge_t *eee) {
+  struct n2n_edge_pipe *pipe;
+  int i;
+
+  /* The ring indexes sit on cache lines of their own */
+  if(posix_memalign((void **)&pipe, N2N_CACHELINE_SIZE, sizeof(struct n2n_edge_pipe)) != 0) {
+    traceEvent(TRACE_ERROR, "Cannot allocate memory");
+    return(-1);
+  }
+
+  memset(pipe, 0, sizeof(*pipe));
+  eee->pipe = pipe;
+  pipe->eee = eee;
+  pipe->num_lanes = eee->num_workers - 1;
+  pipe->udp_wr_wait.efd = pipe->tap_wr_wait.efd = -1;
+
+  for(i=0; i<pipe->num_lanes; i++)
+    pipe->lanes[i].wait.efd = -1;
+
+  if(n2n_buf_pool_init(&pipe->pool, EDGE_PIPE_POOL_SIZE(pipe->num_lanes),
+                       N2N_BUF_POOL_SHARED | (eee->conf.buf_hugepages ? N2N_BUF_POOL_HUGEPAGES : 0)) < 0)
+    return(-1);
+
+  if((pipe_init_waiter(&pipe->udp_wr_wait) < 0) || (pipe_init_waiter(&pipe->tap_wr_wait) < 0))
+    return(-1);
+
+  for(i=0; i<pipe->num_lanes; i++) {
+    struct n2n_edge_pipe_lane *lane = &pipe->lanes[i];
+
+    lane->pipe = pipe;
+    lane->w = &eee->workers[i+1];
+    lane->w->lane = lane;
+    lane->w->udp_sock = eee->udp_sock;
+    lane->w->tap_fd = eee->device.fd;
+
+    if((n2n_ring_init(&lane->tx_in, EDGE_PIPE_RING_SIZE) < 0)
+       || (n2n_ring_init(&lane->rx_in, EDGE_PIPE_RING_SIZE) < 0)
+       || (n2n_ring_init(&lane->udp_out, EDGE_PIPE_RING_SIZE) < 0)
+       || (n2n_ring_init(&lane->tap_out, EDGE_PIPE_RING_SIZE) < 0)
+       || (pipe_init_waiter(&lane->wait) < 0))
+      return(-1);
+  }
+
+  traceEvent(TRACE_NORMAL, "Pipelined data path with %d crypto lanes", pipe->num_lanes);
+
+  return(0);
+}
+
+/* ************************************** */
+
+static void pipe_drain_ring(n2n_ring_t * ring) {
+  n2n_buf_t *buf;
+
+  if(ring->slots == NULL)
+    return;
+
+  while((buf = n2n_ring_pop(ring)) != NULL)
+    n2n_buf_release(buf);
+
+  n2n_ring_free(ring);
+}
+
+static void edge_free_pipe(n2n_edge_t *eee) {
+  struct n2n_edge_pipe *pipe = eee->pipe;
+  int i;
+
+  if(pipe == NULL)
+    return;
+
+  for(i=0; i<pipe->num_lanes; i++) {
+    struct n2n_edge_pipe_lane *lane = &pipe->lanes[i];
+
+    pipe_drain_ring(&lane->tx_in);
+    pipe_drain_ring(&lane->rx_in);
+    pipe_drain_ring(&lane->udp_out);
+    pipe_drain_ring(&lane->tap_out);
+
+    if(lane->wait.efd >= 0)
+      close(lane->wait.efd);
+  }
+
+  if(pipe->udp_wr_wait.efd >= 0)
+    close(pipe->udp_wr_wait.efd);
+  if(pipe->tap_wr_wait.efd >= 0)
+    close(pipe->tap_wr_wait.efd);
+
+  n2n_buf_pool_free(&pipe->pool);
+
+  free(pipe);
+  eee->pipe = NULL;
+}
+
+/* ************************************** */
+
+/** Start the threads of the stages. On failure the ones already started are
+ *  stopped again. */
+static int edge_start_pipe(n2n_edge_t *eee, int *keep_running) {
+  struct n2n_edge_pipe *pipe = eee->pipe;
+  int i, started = 0;
+
+  pipe->keep_running = keep_running;
+
+  /* The readers drain their fd and then poll() it */
+  fcntl(eee->device.fd, F_SETFL, fcntl(eee->device.fd, F_GETFL) | O_NONBLOCK);
+
+  for(i=0; i<pipe->num_lanes; i++, started++) {
+    if(pthread_create(&pipe->lanes[i].thread, NULL, pipe_lane_thread, &pipe->lanes[i]) != 0)
+      goto start_error;
+  }
+
+  if(pthread_create(&pipe->udp_wr_thread, NULL, pipe_udp_writer, pipe) != 0)
+    goto start_error;
+  started++;
+
+  if(pthread_create(&pipe->tap_wr_thread, NULL, pipe_tap_writer, pipe) != 0)
+    goto start_error;
+  started++;
+
+  if(pthread_create(&pipe->udp_rd_thread, NULL, pipe_udp_reader, pipe) != 0)
+    goto start_error;
+  started++;
+
+  if(pthread_create(&pipe->tap_rd_thread, NULL, pipe_tap_reader, pipe) != 0)
+    goto start_error;
+
+  return(0);
+
+ start_error:
+  traceEvent(TRACE_ERROR, "Cannot start the pipeline threads");
+  *keep_running = 0;
+
+  for(i=0; i<started; i++) {
+    if(i < pipe->num_lanes)
+      pthread_join(pipe->lanes[i].thread, NULL);
+    else if(i == pipe->num_lanes)
+      pthread_join(pipe->udp_wr_thread, NULL);
+    else if(i == pipe->num_lanes + 1)
+      pthread_join(pipe->tap_wr_thread, NULL);
+    else
+      pthread_join(pipe->udp_rd_thread, NULL);
+  }
+
+  return(-1);
+}
+
+/** Join the threads of the stages once keep_running is cleared. */
+static void edge_stop_pipe(n2n_edge_t *eee) {
+  struct n2n_edge_pipe *pipe = eee->pipe;
+  int i;
+
+  pthread_join(pipe->tap_rd_thread, NULL);
+  pthread_join(pipe->udp_rd_thread, NULL);
+
+  for(i=0; i<pipe->num_lanes; i++) {
+    pipe_wake(&pipe->lanes[i].wait);
+    pthread_join(pipe->lanes[i].thread, NULL);
+  }
+
+  pipe_wake(&pipe->udp_wr_wait);
+  pipe_wake(&pipe->tap_wr_wait);
+  pthread_join(pipe->udp_wr_thread, NULL);
+  pthread_join(pipe->tap_wr_thread, NULL);
+}
+#endif /* N2N_HAVE_PIPELINE */
+
+/* ************************************** */
+
+void print_edge_stats(const n2n_edge_t *eee) {
+  struct n2n_edge_stats stats, *s = &stats;
+  size_t transop_tx, transop_rx;
+
+  edge_sum_stats(eee, &stats, &transop_tx, &transop_rx);
+
+  traceEvent(TRACE_NORMAL, "**********************************");
+  traceEvent(TRACE_NORMAL, "Packet stats:");
+  traceEvent(TRACE_NORMAL, "    TX P2P: %u pkts", s->tx_p2p);
+  traceEvent(TRACE_NORMAL, "    RX P2P: %u pkts", s->rx_p2p);
+  traceEvent(TRACE_NORMAL, "    TX Supernode: %u pkts (%u broadcast)", s->tx_sup, s->tx_sup_broadcast);
+  traceEvent(TRACE_NORMAL, "    RX Supernode: %u pkts (%u broadcast)", s->rx_sup, s->rx_sup_broadcast);
+
+  if(eee->conf.batch_size > 1) {
+    traceEvent(TRACE_NORMAL, "    RX batches: %llu (%.1f pkts avg)", (unsigned long long)s->rx_batches,
+               s->rx_batches ? ((double)s->rx_batched_pkts / s->rx_batches) : 0.0);
+    traceEvent(TRACE_NORMAL, "    TX batches: %llu (%.1f pkts avg)", (unsigned long long)s->tx_batches,
+               s->tx_batches ? ((double)s->tx_batched_pkts / s->tx_batches) : 0.0);
+  }
+
+  if(s->tx_tso_frames || s->rx_gro_frames) {
+    traceEvent(TRACE_NORMAL, "    TX TSO frames: %llu (%.1f segs avg)", (unsigned long long)s->tx_tso_frames,
+               s->tx_tso_frames ? ((double)s->tx_tso_segs / s->tx_tso_frames) : 0.0);
+    traceEvent(TRACE_NORMAL, "    RX GRO frames: %llu (%.1f segs avg)", (unsigned long long)s->rx_gro_frames,
+               s->rx_gro_frames ? ((double)s->rx_gro_segs / s->rx_gro_frames) : 0.0);
+  }
+
+  if(s->tx_udp_trains || s->rx_udp_trains) {
+    traceEvent(TRACE_NORMAL, "    TX UDP trains: %llu (%.1f segs avg)", (unsigned long long)s->tx_udp_trains,
+               s->tx_udp_trains ? ((double)s->tx_udp_segs / s->tx_udp_trains) : 0.0);
+    traceEvent(TRACE_NORMAL, "    RX UDP trains: %llu (%.1f segs avg)", (unsigned long long)s->rx_udp_trains,
+               s->rx_udp_trains ? ((double)s->rx_udp_segs / s->rx_udp_trains) : 0.0);
+  }
+
+#ifdef N2N_HAVE_PIPELINE
+  if(eee->pipe) {
+    const struct n2n_edge_pipe *pipe = eee->pipe;
+    int i;
+
+    traceEvent(TRACE_NORMAL, "    Pipeline drops: tap_rd %llu udp_rd %llu udp_wr %llu tap_wr %llu",
+               (unsigned long long)pipe->tap_rd.drops, (unsigned long long)pipe->udp_rd.drops,
+               (unsigned long long)pipe->udp_wr.drops, (unsigned long long)pipe->tap_wr.drops);
+
+    for(i=0; i<pipe->num_lanes; i++)
+      traceEvent(TRACE_NORMAL, "    Lane %d: %llu pkts, %llu drops", i,
+                 (unsigned long long)pipe->lanes[i].stats.pkts,
+                 (unsigned long long)pipe->lanes[i].stats.drops);
+  }
+#endif
+  traceEvent(TRACE_NORMAL, "**********************************");
+}
+
+/* ************************************** */
+
+int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
+  struct n2n_edge_worker *w0 = &eee->workers[0];
+  size_t numPurged;
+  time_t lastIfaceCheck=0;
+  time_t lastTransop=0;
+  time_t last_purge_known = 0;
+  time_t last_purge_pending = 0;
+#ifdef __ANDROID_NDK__
+  time_t lastArpPeriod=0;
+#endif
+
+#ifdef WIN32
+  struct tunread_arg arg;
+  arg.eee = eee;
+  arg.keep_running = keep_running;
+  HANDLE tun_read_thread = startTunReadThread(&arg);
+#endif
+
+  *keep_running = 1;
+  update_supernode_reg(eee, time(NULL));
+
+#ifdef N2N_HAVE_PIPELINE
+  if(eee->pipe && (edge_start_pipe(eee, keep_running) < 0))
+    return(-1);
+#endif
+
+#ifdef N2N_HAVE_TAP_MQ
+  {
+    int i;
+
+    /* The workers of the pipeline are driven by its own threads */
+    for(i=1; i<eee->num_workers && !pipe_active(eee); i++) {
+      eee->workers[i].keep_running = keep_running;
+
+      if(pthread_create(&eee->workers[i].thread, NULL, edge_worker_thread, &eee->workers[i]) != 0) {
+        traceEvent(TRACE_ERROR, "Cannot start worker thread %d", i);
+        *keep_running = 0;
+
+        while(--i > 0)
+          pthread_join(eee->workers[i].thread, NULL);
+
+        return(-1);
+      }
+    }
+  }
+#endif
+
+#ifdef N2N_HAVE_EPOLL
+  {
+    int rc = -1;
+
+#ifdef N2N_HAVE_IO_URING
+    if(eee->conf.io_uring && ((rc = edge_uring_loop(w0, keep_running)) < 0))
+      traceEvent(TRACE_WARNING, "io_uring loop failed, using epoll");
+#endif
+
+    /* Only returns early on failure, then the select() loop takes over */
+    if((rc < 0) && (edge_epoll_loop(eee, keep_running) < 0))
+      traceEvent(TRACE_WARNING, "epoll loop failed, using select()");
+  }
+#endif
+
+  /* Main loop
+   *
+   * select() is used to wait for input on either the TAP fd or the UDP/TCP
+   * socket. When input is present the data is read and processed by either
+   * readFromIPSocket() or readFromTAPSocket()
+   */
+
+  while(*keep_running) {
+    int rc, max_sock = 0;
+    fd_set socket_mask;
+    struct timeval wait_time;
+    time_t nowTime;
+
+    FD_ZERO(&socket_mask);
+    if(!pipe_active(eee))
+      FD_SET(eee->udp_sock, &socket_mask);
+    FD_SET(eee->udp_mgmt_sock, &socket_mask);
+    max_sock = max(eee->udp_sock, eee->udp_mgmt_sock);
+
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+    FD_SET(eee->udp_multicast_sock, &socket_mask);
+    max_sock = max(eee->udp_sock, eee->udp_multicast_sock);
+#endif
+
+#ifndef WIN32
+    if(!pipe_active(eee)) {
+      FD_SET(eee->device.fd, &socket_mask);
+      max_sock = max(max_sock, eee->device.fd);
+    }
+#endif
+
+    wait_time.tv_sec = SOCKET_TIMEOUT_INTERVAL_SECS; wait_time.tv_usec = 0;
+
+    rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
+    nowTime=time(NULL);
+
+    /* Make sure ciphers are updated before the packet is treated. */
+    if((nowTime - lastTransop) > TRANSOP_TICK_INTERVAL) {
+      lastTransop = nowTime;
+
+      w0->transop.tick(&w0->transop, nowTime);
+    }
+
+    if(rc > 0) {
+      /* Any or all of the FDs could have input; check them all. */
+
+      if(FD_ISSET(eee->udp_sock, &socket_mask)) {
+	/* Read a cooked socket from the internet socket (unicast). Writes on the TAP
+	 * socket. */
+	readFromWorkerSocket(w0);
+      }
+
+
+#ifndef SKIP_MULTICAST_PEERS_DISCOVERY
+      if(FD_ISSET(eee->udp_multicast_sock, &socket_mask)) {
+	      /* Read a cooked socket from the internet socket (multicast). Writes on the TAP
+	       * socket. */
+	      traceEvent(TRACE_DEBUG, "Received packet from multicast socket");
+	      readFromIPSocket(w0, eee->udp_multicast_sock);
+      }
+#endif
+
+#ifdef __ANDROID_NDK__
+      if (uip_arp_len != 0) {
+	readFromTAPSocket(w0);
+	uip_arp_len = 0;
+      }
+#endif /* #ifdef __ANDROID_NDK__ */
+
+      if(FD_ISSET(eee->udp_mgmt_sock, &socket_mask)) {
+	/* Read a cooked socket from the internet socket. Writes on the TAP
+	 * socket. */
+	readFromMgmtSocket(eee, keep_running);
+      }
+
+#ifndef WIN32
+      if(FD_ISSET(eee->device.fd, &socket_mask)) {
+	/* Read an ethernet frame from the TAP socket. Write on the IP
+	 * socket. */
+	readFromWorkerTAP(w0);
+      }
+#endif
+    }
+
+    /* Send the PACKETs queued while processing select data. */
+    flush_worker(w0);
+
+    /* Finished processing select data. */
+    peers_lock(eee);
+    update_supernode_reg(eee, nowTime);
+
+    numPurged =  purge_expired_registrations(&eee->known_peers, &last_purge_known);
     numPurged += purge_expired_registrations(&eee->pending_peers, &last_purge_pending);
+    n2n_hc_purge(&eee->hc, nowTime);
 
     if(numPurged > 0) {
      traceEvent(TRACE_INFO, "%u peers removed. now: pending=%u, operational=%u",
@@ -1793,6 +4957,7 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
 		 HASH_COUNT(eee->pending_peers),
 		 HASH_COUNT(eee->known_peers));
     }
+    peers_unlock(eee);
 
     if(eee->conf.dyn_ip_mode &&
        ((nowTime - lastIfaceCheck) > IFACE_UPDATE_INTERVAL)) {
@@ -1813,6 +4978,20 @@ int run_edge_loop(n2n_edge_t * eee, int *keep_running) {
   WaitForSingleObject(tun_read_thread, INFINITE);
 #endif
 
+#ifdef N2N_HAVE_PIPELINE
+  if(eee->pipe)
+    edge_stop_pipe(eee);
+#endif
+
+#ifdef N2N_HAVE_TAP_MQ
+  {
+    int i;
+
+    for(i=1; i<eee->num_workers && !pipe_active(eee); i++)
+      pthread_join(eee->workers[i].thread, NULL);
+  }
+#endif
+
   send_deregister(eee, &(eee->supernode));
 
   closesocket(eee->udp_sock);
@@ -1838,43 +5017,109 @@ void edge_term(n2n_edge_t * eee) {
   clear_peer_list(&eee->pending_peers);
   clear_peer_list(&eee->known_peers);
 
-  eee->transop.deinit(&eee->transop);
+#ifdef N2N_HAVE_TAP_MQ
+  {
+    int i;
+
+    /* Worker 0, and the crypto lanes of the pipeline, use eee->udp_sock */
+    for(i=1; i<eee->num_workers; i++) {
+      if((eee->workers[i].udp_sock >= 0) && (eee->workers[i].udp_sock != eee->udp_sock))
+        closesocket(eee->workers[i].udp_sock);
+    }
+  }
+
+  pthread_mutex_destroy(&eee->peers_lock);
+#endif
+
+  edge_free_workers(eee);
+  n2n_compress_dict_free(&eee->compress_dict);
+  n2n_hc_free(&eee->hc);
+
   free(eee);
 }
 
 /* ************************************** */
 
-static int edge_init_sockets(n2n_edge_t *eee, int udp_local_port, int mgmt_port, uint8_t tos) {
+/** Apply the TOS and PMTU discovery settings to a data socket. */
+static void edge_setup_data_socket(n2n_edge_t *eee, int sock, uint8_t tos, int verbose) {
   int sockopt;
 
-  if(udp_local_port > 0)
-    traceEvent(TRACE_NORMAL, "Binding to local port %d", udp_local_port);
-
-  eee->udp_sock = open_socket(udp_local_port, 1 /* bind ANY */);
-  if(eee->udp_sock < 0) {
-    traceEvent(TRACE_ERROR, "Failed to bind main UDP port %u", udp_local_port);
-    return(-1);
-  }
-
   if(tos) {
     /* https://www.tucny.com/Home/dscp-tos */
     sockopt = tos;
 
-    if(setsockopt(eee->udp_sock, IPPROTO_IP, IP_TOS, &sockopt, sizeof(sockopt)) == 0)
-      traceEvent(TRACE_NORMAL, "TOS set to 0x%x", tos);
-    else
+    if(setsockopt(sock, IPPROTO_IP, IP_TOS, &sockopt, sizeof(sockopt)) == 0) {
+      if(verbose) traceEvent(TRACE_NORMAL, "TOS set to 0x%x", tos);
+    } else
       traceEvent(TRACE_ERROR, "Could not set TOS 0x%x[%d]: %s", tos, errno, strerror(errno));
   }
 
 #ifdef IP_PMTUDISC_DO
   sockopt = (eee->conf.disable_pmtu_discovery) ? IP_PMTUDISC_DONT : IP_PMTUDISC_DO;
 
-  if(setsockopt(eee->udp_sock, IPPROTO_IP, IP_MTU_DISCOVER, &sockopt, sizeof(sockopt)) < 0)
+  if(setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &sockopt, sizeof(sockopt)) < 0)
     traceEvent(TRACE_WARNING, "Could not %s PMTU discovery[%d]: %s",
       (eee->conf.disable_pmtu_discovery) ? "disable" : "enable", errno, strerror(errno));
-  else
+  else if(verbose)
     traceEvent(TRACE_DEBUG, "PMTU discovery %s", (eee->conf.disable_pmtu_discovery) ? "disabled" : "enabled");
 #endif
+}
+
+/* ************************************** */
+
+static int edge_init_sockets(n2n_edge_t *eee, int udp_local_port, int mgmt_port, uint8_t tos) {
+  if(udp_local_port > 0)
+    traceEvent(TRACE_NORMAL, "Binding to local port %d", udp_local_port);
+
+#ifdef N2N_HAVE_TAP_MQ
+  if(eee->device.num_queues > 1)
+    eee->udp_sock = open_socket_reuseport(udp_local_port, 1 /* bind ANY */);
+  else
+#endif
+    eee->udp_sock = open_socket(udp_local_port, 1 /* bind ANY */);
+  if(eee->udp_sock < 0) {
+    traceEvent(TRACE_ERROR, "Failed to bind main UDP port %u", udp_local_port);
+    return(-1);
+  }
+
+  edge_setup_data_socket(eee, eee->udp_sock, tos, 1);
+
+  eee->workers[0].udp_sock = eee->udp_sock;
+  eee->workers[0].tap_fd = eee->device.fd;
+
+#ifdef N2N_HAVE_TAP_MQ
+  if(eee->device.num_queues > 1) {
+    struct sockaddr_in local_sock;
+    socklen_t len = sizeof(local_sock);
+    int i;
+
+    /* The other workers join the same port, possibly chosen by the kernel */
+    if(getsockname(eee->udp_sock, (struct sockaddr*)&local_sock, &len) < 0) {
+      traceEvent(TRACE_ERROR, "getsockname() failed [%d]: %s", errno, strerror(errno));
+      return(-1);
+    }
+
+    for(i=1; i<eee->num_workers; i++)
+      eee->workers[i].udp_sock = -1;
+
+    for(i=1; i<eee->num_workers; i++) {
+      struct n2n_edge_worker *w = &eee->workers[i];
+
+      w->tap_fd = eee->device.queue_fds[i];
+      w->udp_sock = open_socket_reuseport(ntohs(local_sock.sin_port), 1 /* bind ANY */);
+
+      if(w->udp_sock < 0) {
+        traceEvent(TRACE_ERROR, "Failed to bind UDP port %u for worker %d", ntohs(local_sock.sin_port), i);
+        return(-1);
+      }
+
+      edge_setup_data_socket(eee, w->udp_sock, tos, 0);
+    }
+
+    traceEvent(TRACE_NORMAL, "Started %d data path workers on UDP port %u",
+               eee->num_workers, ntohs(local_sock.sin_port));
+  }
+#endif
 
   eee->udp_mgmt_sock = open_socket(mgmt_port, 0 /* bind LOOPBACK */);
   if(eee->udp_mgmt_sock < 0) {
@@ -1920,6 +5165,8 @@ void edge_init_conf_defaults(n2n_edge_conf_t *conf) {
   conf->allow_p2p = 1;
   conf->disable_pmtu_discovery = 1;
   conf->register_interval = REGISTER_SUPER_INTERVAL_DFL;
+  conf->batch_size = 1; /* no batching */
+  conf->batch_flush = N2N_BATCH_FLUSH_LOOP;
 
   if(getenv("N2N_KEY")) {
     conf->encrypt_key = strdup(getenv("N2N_KEY"));
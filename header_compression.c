@@ -0,0 +1,500 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Compression of the ethernet, IPv4 and TCP/UDP headers of the frames sent
+ * to a peer, along the lines of ROHC (RFC 3095) in its unidirectional mode.
+ *
+ * The first frames of a flow are sent in full, prefixed by the id of the
+ * context the receiver keeps them in. The next ones only carry the id, a
+ * CRC of the original headers and the fields that change: the IP id and
+ * the TCP sequence and ack numbers as their low 8 or 16 bits when that is
+ * enough, the checksums as they are. Lengths and the IP checksum are
+ * computed again by the receiver.
+ *
+ * The low bits are chosen so that they decode right against any of the
+ * last N2N_HC_WINDOW values sent, so a flow survives one less lost frames
+ * in a row. Past that, the CRC tells the receiver that it is out of sync
+ * and the frame is dropped; a flow is sent in full again every
+ * HC_REFRESH_FRAMES frames or HC_REFRESH_SECS seconds, which brings the
+ * receiver back after a loss or a restart. No feedback is needed. */
+
+#include "n2n.h"
+
+#define HC_IR                   0x80    /* first byte: the frame follows in full */
+#define HC_CID_MASK             0x3f
+
+#define HC_IR_REPEAT            2       /* frames sent in full to set up a flow */
+#define HC_REFRESH_FRAMES       32
+#define HC_REFRESH_SECS         5
+
+/* Third byte of a compressed header: how each field is sent */
+#define HC_IPID_SHIFT           0       /* 0 unchanged, 1 low 8 bits, 2 16 bits */
+#define HC_SEQ_SHIFT            2       /* 0 unchanged, 1 low 8 bits, 2 low 16 bits, 3 32 bits */
+#define HC_ACK_SHIFT            4
+#define HC_WIN                  0x40    /* TCP window changed */
+
+#define HC_ETH_LEN              14
+#define HC_IP                   14      /* offset of the IPv4 header */
+#define HC_L4                   34      /* and of the TCP or UDP one */
+#define HC_TCP                  6
+#define HC_UDP                  17
+
+/* ************************************** */
+
+static inline uint16_t get16(const uint8_t *p) {
+  return((uint16_t)((p[0] << 8) | p[1]));
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  return(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]);
+}
+
+static inline void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8, p[1] = v & 0xff;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24, p[1] = (v >> 16) & 0xff, p[2] = (v >> 8) & 0xff, p[3] = v & 0xff;
+}
+
+/* CRC-8 with polynomial 0x07, a nibble at a time */
+static uint8_t hc_crc8(const uint8_t *data, size_t len) {
+  static const uint8_t table[16] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+    0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+  };
+  uint8_t crc = 0;
+  size_t i;
+
+  for(i=0; i<len; i++) {
+    crc ^= data[i];
+    crc = (uint8_t)(crc << 4) ^ table[crc >> 4];
+    crc = (uint8_t)(crc << 4) ^ table[crc >> 4];
+  }
+
+  return(crc);
+}
+
+static uint16_t ip_checksum(const uint8_t *ip) {
+  uint32_t sum = 0;
+  int i;
+
+  for(i=0; i<20; i+=2) {
+    if(i != 10)
+      sum += get16(&ip[i]);
+  }
+
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+
+  return((uint16_t)~sum);
+}
+
+/* ************************************** */
+
+/* @return the length of the headers of frame when they can be compressed:
+ *         IPv4 without options nor fragments, TCP without urgent data or
+ *         UDP, lengths and IP checksum as the receiver will compute them.
+ *         0 otherwise. */
+static size_t hc_header_len(const uint8_t *frame, size_t len) {
+  const uint8_t *ip = &frame[HC_IP];
+  size_t hlen;
+
+  if((len < HC_L4 + 8) || (get16(&frame[12]) != 0x0800) || (ip[0] != 0x45)
+     || ((get16(&ip[6]) & 0xbfff) != 0) || (get16(&ip[2]) != len - HC_ETH_LEN)
+     || (get16(&ip[10]) != ip_checksum(ip)))
+    return(0);
+
+  switch(ip[9]) {
+  case HC_UDP:
+    return((get16(&frame[HC_L4 + 4]) == len - HC_L4) ? HC_L4 + 8 : 0);
+  case HC_TCP:
+    if(len < HC_L4 + 20)
+      return(0);
+
+    hlen = HC_L4 + 4 * (frame[HC_L4 + 12] >> 4);
+
+    if((hlen < HC_L4 + 20) || (hlen > len)
+       || (frame[HC_L4 + 13] & 0x20) || (get16(&frame[HC_L4 + 18]) != 0))
+      return(0);
+    return(hlen);
+  default:
+    return(0);
+  }
+}
+
+/* Whether frame belongs to the flow of the template t: same ethernet
+ * header, IP TOS, DF, TTL, protocol, addresses and ports. */
+static int hc_same_flow(const uint8_t *t, const uint8_t *frame) {
+  return(!memcmp(t, frame, HC_IP + 2)
+         && !memcmp(&t[HC_IP + 6], &frame[HC_IP + 6], 4)
+         && !memcmp(&t[HC_IP + 12], &frame[HC_IP + 12], 8 + 4));
+}
+
+/* ************************************** */
+
+/* The smallest encoding of v that decodes right against any value of the
+ * window w: 0 when they all equal v, then 1 for 8 bits and 2 for 16 bits,
+ * in an interval reaching a quarter back; 3 when v has to be sent whole. */
+static unsigned int hc_wlsb(const uint32_t *w, unsigned int n, uint32_t v, uint32_t mask) {
+  unsigned int i, code;
+
+  for(i=0; (i < n) && (w[i] == v); i++);
+  if(i == n)
+    return(0);
+
+  for(code=1; code<=2; code++) {
+    uint32_t span = (uint32_t)1 << (8 * code), back = span >> 2;
+
+    for(i=0; i<n; i++) {
+      if(((v - w[i] + back) & mask) >= span)
+        break;
+    }
+
+    if(i == n)
+      return(code);
+  }
+
+  return(3);
+}
+
+/* Decode the k low bits lsb against the reference value ref */
+static uint32_t hc_lsb_decode(uint32_t ref, uint32_t lsb, unsigned int k) {
+  uint32_t base = ref - ((uint32_t)1 << (k - 2));
+
+  return(base + ((lsb - base) & (((uint32_t)1 << k) - 1)));
+}
+
+/* Add the fields of frame to the window of ctx, or make them the reference
+ * of a receiver context (window of one) */
+static void hc_window_push(n2n_hc_ctx_t *ctx, const uint8_t *frame, int tcp) {
+  unsigned int slot = ctx->pos;
+
+  ctx->ipid[slot] = get16(&frame[HC_IP + 4]);
+
+  if(tcp) {
+    ctx->seq[slot] = get32(&frame[HC_L4 + 4]);
+    ctx->ack[slot] = get32(&frame[HC_L4 + 8]);
+    ctx->win[slot] = get16(&frame[HC_L4 + 14]);
+  }
+
+  ctx->pos = (ctx->pos + 1) % N2N_HC_WINDOW;
+  if(ctx->num < N2N_HC_WINDOW)
+    ctx->num++;
+}
+
+/* ************************************** */
+
+static n2n_hc_peer_t* hc_peer(n2n_hc_t *hc, const n2n_mac_t mac, time_t now) {
+  n2n_hc_peer_t *p;
+
+  HASH_FIND(hh, hc->peers, mac, N2N_MAC_SIZE, p);
+
+  if(p == NULL) {
+    if((p = calloc(1, sizeof(*p))) == NULL)
+      return(NULL);
+
+    memcpy(p->mac, mac, N2N_MAC_SIZE);
+    HASH_ADD(hh, hc->peers, mac, N2N_MAC_SIZE, p);
+  }
+
+  p->last_seen = now;
+  return(p);
+}
+
+/* ************************************** */
+
+/** Compress the headers of a frame of len bytes sent to peer. On success the
+ *  first consumed bytes of the frame are to be replaced by the returned
+ *  number of bytes of hdr, which must hold N2N_HC_MAX_LEN bytes, and the
+ *  PACKET flagged with N2N_FLAGS_HDR_COMPRESSION.
+ *
+ *  @return the length of hdr, 0 when the frame is to be sent as it is
+ */
+size_t n2n_hc_compress(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *frame, size_t len,
+                       uint8_t *hdr, size_t *consumed, time_t now) {
+  size_t hlen = hc_header_len(frame, len), tlen;
+  n2n_hc_peer_t *p;
+  n2n_hc_ctx_t *ctx = NULL, *lru = NULL;
+  uint8_t *q, enc, code;
+  int i, tcp;
+
+  if((hlen == 0) || ((p = hc_peer(hc, peer, now)) == NULL))
+    return(0);
+
+  tcp = (frame[HC_IP + 9] == HC_TCP);
+  tlen = HC_L4 + (tcp ? 20 : 8);
+
+  for(i=0; i<N2N_HC_CONTEXTS; i++) {
+    n2n_hc_ctx_t *c = &p->tx[i];
+
+    if(c->valid && hc_same_flow(c->tmpl, frame)) {
+      ctx = c;
+      break;
+    }
+
+    if(!lru || !c->valid || (lru->valid && (c->last_used < lru->last_used)))
+      lru = c;
+  }
+
+  if(ctx == NULL) {
+    /* A new flow, in place of the oldest one */
+    ctx = lru;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->valid = 1;
+    ctx->ir_left = HC_IR_REPEAT;
+    memcpy(ctx->tmpl, frame, tlen);
+  }
+
+  ctx->last_used = now;
+
+  if(ctx->ir_left || (ctx->since_ir >= HC_REFRESH_FRAMES) || (now - ctx->last_ir >= HC_REFRESH_SECS)) {
+    if(ctx->ir_left)
+      ctx->ir_left--;
+
+    ctx->since_ir = 0;
+    ctx->last_ir = now;
+    hc_window_push(ctx, frame, tcp);
+
+    hdr[0] = HC_IR | (uint8_t)(ctx - p->tx);
+    *consumed = 0;
+    hc->tx_frames++, hc->tx_full++;
+    return(1);
+  }
+
+  q = &hdr[3];
+
+  /* 16 bits are the whole IP id, the code is never 3 */
+  code = hc_wlsb(ctx->ipid, ctx->num, get16(&frame[HC_IP + 4]), 0xffff);
+  enc = code << HC_IPID_SHIFT;
+  if(code == 1)
+    *q++ = frame[HC_IP + 5];
+  else if(code == 2)
+    memcpy(q, &frame[HC_IP + 4], 2), q += 2;
+
+  if(tcp) {
+    static const uint8_t widths[4] = { 0, 1, 2, 4 };
+    uint16_t win = get16(&frame[HC_L4 + 14]);
+
+    code = hc_wlsb(ctx->seq, ctx->num, get32(&frame[HC_L4 + 4]), 0xffffffff);
+    enc |= code << HC_SEQ_SHIFT;
+    memcpy(q, &frame[HC_L4 + 8 - widths[code]], widths[code]), q += widths[code];
+
+    code = hc_wlsb(ctx->ack, ctx->num, get32(&frame[HC_L4 + 8]), 0xffffffff);
+    enc |= code << HC_ACK_SHIFT;
+    memcpy(q, &frame[HC_L4 + 12 - widths[code]], widths[code]), q += widths[code];
+
+    /* Data offset and flags */
+    *q++ = frame[HC_L4 + 12];
+    *q++ = frame[HC_L4 + 13];
+
+    for(i=0; (i < ctx->num) && (ctx->win[i] == win); i++);
+    if(i < ctx->num) {
+      enc |= HC_WIN;
+      memcpy(q, &frame[HC_L4 + 14], 2), q += 2;
+    }
+
+    /* Checksum and options */
+    memcpy(q, &frame[HC_L4 + 16], 2), q += 2;
+    memcpy(q, &frame[HC_L4 + 20], hlen - HC_L4 - 20), q += hlen - HC_L4 - 20;
+  } else
+    memcpy(q, &frame[HC_L4 + 6], 2), q += 2;
+
+  hdr[0] = (uint8_t)(ctx - p->tx);
+  hdr[1] = hc_crc8(frame, hlen);
+  hdr[2] = enc;
+
+  ctx->since_ir++;
+  hc_window_push(ctx, frame, tcp);
+
+  *consumed = hlen;
+  hc->tx_frames++;
+  hc->tx_saved += hlen - (q - hdr);
+
+  return(q - hdr);
+}
+
+/* ************************************** */
+
+/** Rebuild into out a frame of len bytes received from peer with
+ *  N2N_FLAGS_HDR_COMPRESSION.
+ *
+ *  @return the frame length, or -1 when it is malformed or its flow is not
+ *          known or out of sync
+ */
+int n2n_hc_decompress(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t out_size, time_t now) {
+  const uint8_t *q = &in[3], *end = &in[len];
+  n2n_hc_peer_t *p;
+  n2n_hc_ctx_t *ctx;
+  size_t hlen, flen;
+  uint32_t v;
+  uint8_t enc, code;
+  int tcp;
+
+#define HC_NEED(n) do { if(end - q < (n)) goto hc_error; } while(0)
+
+  if((len < 1) || ((in[0] & HC_CID_MASK) >= N2N_HC_CONTEXTS)
+     || ((p = hc_peer(hc, peer, now)) == NULL))
+    goto hc_error;
+
+  ctx = &p->rx[in[0] & HC_CID_MASK];
+
+  if(in[0] & HC_IR) {
+    flen = len - 1;
+
+    if((flen > out_size) || ((hlen = hc_header_len(&in[1], flen)) == 0))
+      goto hc_error;
+
+    memcpy(out, &in[1], flen);
+
+    tcp = (out[HC_IP + 9] == HC_TCP);
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->valid = 1;
+    memcpy(ctx->tmpl, out, HC_L4 + (tcp ? 20 : 8));
+    hc_window_push(ctx, out, tcp);
+
+    hc->rx_frames++;
+    return((int)flen);
+  }
+
+  if(!ctx->valid || (len < 3))
+    goto hc_error;
+
+  enc = in[2];
+  tcp = (ctx->tmpl[HC_IP + 9] == HC_TCP);
+  hlen = HC_L4 + (tcp ? 20 : 8);
+
+  if(out_size < hlen + 40)
+    goto hc_error;
+
+  memcpy(out, ctx->tmpl, hlen);
+
+  /* The reference is slot 0, rewritten by hc_window_push() below */
+  ctx->pos = 0;
+
+  code = (enc >> HC_IPID_SHIFT) & 3;
+  v = ctx->ipid[0];
+  if(code == 1) {
+    HC_NEED(1);
+    v = hc_lsb_decode(v, *q++, 8);
+  } else if(code >= 2) {
+    HC_NEED(2);
+    v = get16(q), q += 2;
+  }
+  put16(&out[HC_IP + 4], (uint16_t)v);
+
+  if(tcp) {
+    uint8_t *tcph = &out[HC_L4];
+    const uint32_t refs[2] = { ctx->seq[0], ctx->ack[0] };
+    size_t optlen;
+    int f;
+
+    for(f=0; f<2; f++) {
+      code = (enc >> (f ? HC_ACK_SHIFT : HC_SEQ_SHIFT)) & 3;
+      v = refs[f];
+
+      switch(code) {
+      case 1: HC_NEED(1); v = hc_lsb_decode(v, *q, 8); q += 1; break;
+      case 2: HC_NEED(2); v = hc_lsb_decode(v, get16(q), 16); q += 2; break;
+      case 3: HC_NEED(4); v = get32(q); q += 4; break;
+      }
+      put32(&tcph[4 + 4 * f], v);
+    }
+
+    HC_NEED(2);
+    tcph[12] = *q++;
+    tcph[13] = *q++;
+
+    if(enc & HC_WIN) {
+      HC_NEED(2);
+      memcpy(&tcph[14], q, 2), q += 2;
+    } else
+      put16(&tcph[14], ctx->win[0]);
+
+    HC_NEED(2);
+    memcpy(&tcph[16], q, 2), q += 2;
+
+    optlen = 4 * (tcph[12] >> 4);
+    if(optlen < 20)
+      goto hc_error;
+    optlen -= 20;
+
+    HC_NEED((ptrdiff_t)optlen);
+    memcpy(&tcph[20], q, optlen), q += optlen;
+    hlen += optlen;
+  } else {
+    HC_NEED(2);
+    memcpy(&out[HC_L4 + 6], q, 2), q += 2;
+  }
+
+  flen = hlen + (end - q);
+  if(flen > out_size)
+    goto hc_error;
+
+  memcpy(&out[hlen], q, end - q);
+
+  put16(&out[HC_IP + 2], (uint16_t)(flen - HC_ETH_LEN));
+  put16(&out[HC_IP + 10], ip_checksum(&out[HC_IP]));
+  if(!tcp)
+    put16(&out[HC_L4 + 4], (uint16_t)(flen - HC_L4));
+
+  if(hc_crc8(out, hlen) != in[1])
+    goto hc_error;
+
+  hc_window_push(ctx, out, tcp);
+  hc->rx_frames++;
+
+  return((int)flen);
+
+ hc_error:
+  hc->rx_errors++;
+  return(-1);
+
+#undef HC_NEED
+}
+
+/* ************************************** */
+
+/** Forget the flows of the peers not heard of for N2N_HC_PEER_TIMEOUT.
+ *
+ *  @return the number of peers removed
+ */
+size_t n2n_hc_purge(n2n_hc_t *hc, time_t now) {
+  n2n_hc_peer_t *p, *tmp;
+  size_t num = 0;
+
+  HASH_ITER(hh, hc->peers, p, tmp) {
+    if(now - p->last_seen > N2N_HC_PEER_TIMEOUT) {
+      HASH_DEL(hc->peers, p);
+      free(p);
+      num++;
+    }
+  }
+
+  return(num);
+}
+
+void n2n_hc_free(n2n_hc_t *hc) {
+  n2n_hc_peer_t *p, *tmp;
+
+  HASH_ITER(hh, hc->peers, p, tmp) {
+    HASH_DEL(hc->peers, p);
+    free(p);
+  }
+}
@@ -22,8 +22,9 @@
 
 #include <assert.h>
 
-#define PURGE_REGISTRATION_FREQUENCY   30
-#define REGISTRATION_TIMEOUT           60
+#ifdef N2N_HAVE_TRACE_ASYNC
+#include <poll.h>
+#endif
 
 static const uint8_t broadcast_addr[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 static const uint8_t multicast_addr[6] = { 0x01, 0x00, 0x5E, 0x00, 0x00, 0x00 }; /* First 3 bytes are meaningful */
@@ -31,7 +32,7 @@ static const uint8_t ipv6_multicast_addr[6] = { 0x33, 0x33, 0x00, 0x00, 0x00, 0x
 
 /* ************************************** */
 
-SOCKET open_socket(int local_port, int bind_any) {
+static SOCKET open_socket_opts(int local_port, int bind_any, int reuse_port) {
   SOCKET sock_fd;
   struct sockaddr_in local_address;
   int sockopt;
@@ -49,6 +50,14 @@ SOCKET open_socket(int local_port, int bind_any) {
   sockopt = 1;
   setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
 
+#ifdef SO_REUSEPORT
+  if(reuse_port && (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(sockopt)) < 0)) {
+    traceEvent(TRACE_ERROR, "Unable to set SO_REUSEPORT [%s]\n", strerror(errno));
+    closesocket(sock_fd);
+    return(-1);
+  }
+#endif
+
   memset(&local_address, 0, sizeof(local_address));
   local_address.sin_family = AF_INET;
   local_address.sin_port = htons(local_port);
@@ -62,7 +71,19 @@ SOCKET open_socket(int local_port, int bind_any) {
   return(sock_fd);
 }
 
-static int traceLevel = 2 /* NORMAL */;
+SOCKET open_socket(int local_port, int bind_any) {
+  return(open_socket_opts(local_port, bind_any, 0));
+}
+
+#ifdef SO_REUSEPORT
+/** Open a UDP socket which can share local_port with other sockets opened the
+ *  same way. The kernel spreads incoming datagrams among them by flow. */
+SOCKET open_socket_reuseport(int local_port, int bind_any) {
+  return(open_socket_opts(local_port, bind_any, 1));
+}
+#endif
+
+int traceLevel = 2 /* NORMAL */;
 static int useSyslog = 0, syslog_opened = 0;
 static FILE *traceFile = NULL;
 
@@ -83,89 +104,344 @@ void setTraceFile(FILE *f) {
 }
 
 #define N2N_TRACE_DATESIZE 32
-void traceEvent(int eventTraceLevel, char* file, int line, char * format, ...) {
-  va_list va_ap;
 
-  if(traceFile == NULL)
-    traceFile = stdout;
-
-  if(eventTraceLevel <= traceLevel) {
-    char buf[1024];
-    char out_buf[1280];
-    char theDate[N2N_TRACE_DATESIZE];
-    char *extra_msg = "";
-    time_t theTime = time(NULL);
+/* Write one formatted trace line. msg loses its trailing newlines. */
+static void trace_output(int eventTraceLevel, const char *file, int line,
+			 const char *theDate, char *msg, int flush) {
+  char out_buf[1280];
+  char *extra_msg = "";
+  size_t len = strlen(msg);
 #ifdef WIN32
-    int i;
+  int i;
 #endif
 
-    /* We have two paths - one if we're logging, one if we aren't
-     *   Note that the no-log case is those systems which don't support it(WIN32),
-     *                                those without the headers !defined(USE_SYSLOG)
-     *                                those where it's parametrically off...
-     */
-
-    memset(buf, 0, sizeof(buf));
-    strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&theTime));
-
-    va_start(va_ap, format);
-    vsnprintf(buf, sizeof(buf)-1, format, va_ap);
-    va_end(va_ap);
+  if(traceFile == NULL)
+    traceFile = stdout;
 
-    if(eventTraceLevel == 0 /* TRACE_ERROR */)
-      extra_msg = "ERROR: ";
-    else if(eventTraceLevel == 1 /* TRACE_WARNING */)
-      extra_msg = "WARNING: ";
+  if(eventTraceLevel == 0 /* TRACE_ERROR */)
+    extra_msg = "ERROR: ";
+  else if(eventTraceLevel == 1 /* TRACE_WARNING */)
+    extra_msg = "WARNING: ";
 
-    while(buf[strlen(buf)-1] == '\n') buf[strlen(buf)-1] = '\0';
+  while((len > 0) && (msg[len-1] == '\n')) msg[--len] = '\0';
 
 #ifndef WIN32
-    if(useSyslog) {
-      if(!syslog_opened) {
-        openlog("n2n", LOG_PID, LOG_DAEMON);
-        syslog_opened = 1;
-      }
+  if(useSyslog) {
+    if(!syslog_opened) {
+      openlog("n2n", LOG_PID, LOG_DAEMON);
+      syslog_opened = 1;
+    }
 
-      snprintf(out_buf, sizeof(out_buf), "%s%s", extra_msg, buf);
-      syslog(LOG_INFO, "%s", out_buf);
-    } else {
-      snprintf(out_buf, sizeof(out_buf), "%s [%s:%d] %s%s", theDate, file, line, extra_msg, buf);
+    snprintf(out_buf, sizeof(out_buf), "%s%s", extra_msg, msg);
+    syslog(LOG_INFO, "%s", out_buf);
+  } else {
+    snprintf(out_buf, sizeof(out_buf), "%s [%s:%d] %s%s", theDate, file, line, extra_msg, msg);
 #ifdef __ANDROID_NDK__
-        switch (eventTraceLevel) {
-            case 0:         // ERROR
-                eventTraceLevel = ANDROID_LOG_ERROR;
-                break;
-            case 1:         // WARNING
-                eventTraceLevel = ANDROID_LOG_WARN;
-                break;
-            case 2:         // NORMAL
-                eventTraceLevel = ANDROID_LOG_INFO;
-                break;
-            case 3:         // INFO
-                eventTraceLevel = ANDROID_LOG_DEBUG;
-                break;
-            case 4:         // DEBUG
-                eventTraceLevel = ANDROID_LOG_VERBOSE;
-                break;
-            default:        // NORMAL
-                eventTraceLevel = ANDROID_LOG_INFO;
-                break;
-        }
-        __android_log_write(eventTraceLevel, "n2n", out_buf);
+      switch (eventTraceLevel) {
+          case 0:         // ERROR
+              eventTraceLevel = ANDROID_LOG_ERROR;
+              break;
+          case 1:         // WARNING
+              eventTraceLevel = ANDROID_LOG_WARN;
+              break;
+          case 2:         // NORMAL
+              eventTraceLevel = ANDROID_LOG_INFO;
+              break;
+          case 3:         // INFO
+              eventTraceLevel = ANDROID_LOG_DEBUG;
+              break;
+          case 4:         // DEBUG
+              eventTraceLevel = ANDROID_LOG_VERBOSE;
+              break;
+          default:        // NORMAL
+              eventTraceLevel = ANDROID_LOG_INFO;
+              break;
+      }
+      __android_log_write(eventTraceLevel, "n2n", out_buf);
 #else
-      fprintf(traceFile, "%s\n", out_buf);
+    fprintf(traceFile, "%s\n", out_buf);
+    if(flush)
       fflush(traceFile);
 #endif /* #ifdef __ANDROID_NDK__ */
-    }
+  }
 #else
-    /* this is the WIN32 code */
-    for(i=strlen(file)-1; i>0; i--) if(file[i] == '\\') { i++; break; };
-    snprintf(out_buf, sizeof(out_buf), "%s [%s:%d] %s%s", theDate, &file[i], line, extra_msg, buf);
-    fprintf(traceFile, "%s\n", out_buf);
-    fflush(traceFile);
+  /* this is the WIN32 code */
+  for(i=strlen(file)-1; i>0; i--) if(file[i] == '\\') { i++; break; };
+  snprintf(out_buf, sizeof(out_buf), "%s [%s:%d] %s%s", theDate, &file[i], line, extra_msg, msg);
+  fprintf(traceFile, "%s\n", out_buf);
+  fflush(traceFile);
 #endif
+}
+
+/* ************************************** */
+
+#ifdef N2N_HAVE_TRACE_ASYNC
+
+/* Asynchronous tracing.
+ *
+ * traceEvent() only renders the message into a slot of a bounded ring and
+ * a thread of its own adds the date, writes the lines and flushes the file
+ * once per burst. The message has to be rendered by the caller since its
+ * arguments (macaddr_str() buffers and the like) do not outlive the call.
+ * Any thread may log: the slots are claimed with a CAS on the enqueue
+ * position and carry a sequence number telling the writer when they are
+ * filled (Vyukov's bounded queue). When the ring is full the line is
+ * dropped and counted rather than blocking the data path. */
+
+#define N2N_TRACE_RING_SIZE     1024    /* Power of 2 */
+#define N2N_TRACE_MSG_SIZE      496
+
+struct n2n_trace_rec {
+  uint32_t            seq;                    /**< == position + 1 once filled. */
+  int                 level;
+  int                 line;
+  const char *        file;                   /**< __FILE__, a string literal. */
+  time_t              when;
+  char                msg[N2N_TRACE_MSG_SIZE];
+};
+
+static struct {
+  struct n2n_trace_rec * recs;
+  uint32_t            enq_pos;
+  uint32_t            deq_pos;                /**< Owned by the writer thread. */
+  uint32_t            dropped;
+  int                 running;
+  int                 sleeping;               /**< Set by the writer before it sleeps. */
+  int                 wake_fd[2];
+  pthread_t           thread;
+} trace_ring;
+
+static int traceAsync = 0;
+
+/* ************************************** */
+
+static int trace_ring_push(int eventTraceLevel, const char *file, int line,
+			   const char *format, va_list va_ap) {
+  uint32_t pos = __atomic_load_n(&trace_ring.enq_pos, __ATOMIC_RELAXED);
+  struct n2n_trace_rec *rec;
+
+  for(;;) {
+    int32_t diff;
+
+    rec = &trace_ring.recs[pos & (N2N_TRACE_RING_SIZE - 1)];
+    diff = (int32_t)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+
+    if(diff == 0) {
+      if(__atomic_compare_exchange_n(&trace_ring.enq_pos, &pos, pos + 1, 1,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if(diff < 0) {
+      __atomic_fetch_add(&trace_ring.dropped, 1, __ATOMIC_RELAXED);
+      return(-1);
+    } else
+      pos = __atomic_load_n(&trace_ring.enq_pos, __ATOMIC_RELAXED);
+  }
+
+  rec->level = eventTraceLevel;
+  rec->file = file;
+  rec->line = line;
+  rec->when = time(NULL);
+  vsnprintf(rec->msg, sizeof(rec->msg), format, va_ap);
+
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+  /* Pairs with the fence of the writer going to sleep */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(&trace_ring.sleeping, __ATOMIC_RELAXED)
+     && __atomic_exchange_n(&trace_ring.sleeping, 0, __ATOMIC_RELAXED)) {
+    uint8_t c = 0;
+
+    if(write(trace_ring.wake_fd[1], &c, 1) < 0) { /* The writer is awake anyway */ }
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Write out the filled slots. @return the number of lines written */
+static unsigned int trace_ring_drain(char *theDate, time_t *date_when) {
+  unsigned int num = 0;
+  uint32_t dropped;
+
+  for(;;) {
+    struct n2n_trace_rec *rec = &trace_ring.recs[trace_ring.deq_pos & (N2N_TRACE_RING_SIZE - 1)];
+
+    if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != (trace_ring.deq_pos + 1))
+      break;
+
+    /* The date only changes once per second */
+    if(rec->when != *date_when) {
+      strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&rec->when));
+      *date_when = rec->when;
+    }
+
+    trace_output(rec->level, rec->file, rec->line, theDate, rec->msg, 0);
+
+    __atomic_store_n(&rec->seq, trace_ring.deq_pos + N2N_TRACE_RING_SIZE, __ATOMIC_RELEASE);
+    trace_ring.deq_pos++;
+    num++;
+  }
+
+  if((dropped = __atomic_exchange_n(&trace_ring.dropped, 0, __ATOMIC_RELAXED)) > 0) {
+    char msg[64];
+
+    snprintf(msg, sizeof(msg), "%u trace lines dropped, the log ring was full", dropped);
+    trace_output(1 /* TRACE_WARNING */, __FILE__, __LINE__, theDate, msg, 0);
+    num++;
+  }
+
+  if(num && (traceFile != NULL))
+    fflush(traceFile);
+
+  return(num);
+}
+
+/* ************************************** */
+
+static void* trace_thread(void *arg) {
+  char theDate[N2N_TRACE_DATESIZE] = "";
+  time_t date_when = 0;
+
+  for(;;) {
+    struct pollfd pfd;
+    uint8_t drain[64];
+
+    if(trace_ring_drain(theDate, &date_when) > 0)
+      continue;
+
+    if(!__atomic_load_n(&trace_ring.running, __ATOMIC_ACQUIRE))
+      break;
+
+    __atomic_store_n(&trace_ring.sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* Something may have been queued before the flag was visible */
+    if(__atomic_load_n(&trace_ring.recs[trace_ring.deq_pos & (N2N_TRACE_RING_SIZE - 1)].seq,
+		       __ATOMIC_ACQUIRE) == (trace_ring.deq_pos + 1)) {
+      __atomic_store_n(&trace_ring.sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    pfd.fd = trace_ring.wake_fd[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, 1000);
+
+    while(read(trace_ring.wake_fd[0], drain, sizeof(drain)) > 0)
+      ;
+
+    __atomic_store_n(&trace_ring.sleeping, 0, __ATOMIC_RELAXED);
+  }
+
+  /* The lines queued while stopping */
+  trace_ring_drain(theDate, &date_when);
+
+  return(NULL);
+}
+
+/* ************************************** */
+
+/** Hand the trace lines over to a writer thread, until traceAsyncStop().
+ *  Call it after daemonizing, as fork() only keeps the calling thread.
+ *
+ *  @return 0 on success, -1 when the thread could not be started (the
+ *          lines are then written synchronously as before)
+ */
+int traceAsyncStart(void) {
+  uint32_t i;
+
+  if(traceAsync)
+    return(0);
+
+  memset(&trace_ring, 0, sizeof(trace_ring));
+
+  if((trace_ring.recs = calloc(N2N_TRACE_RING_SIZE, sizeof(struct n2n_trace_rec))) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot allocate the trace ring");
+    return(-1);
+  }
+
+  for(i=0; i<N2N_TRACE_RING_SIZE; i++)
+    trace_ring.recs[i].seq = i;
+
+  if(pipe(trace_ring.wake_fd) != 0) {
+    traceEvent(TRACE_ERROR, "Cannot create the trace pipe [%s]", strerror(errno));
+    free(trace_ring.recs);
+    return(-1);
   }
 
+  for(i=0; i<2; i++)
+    fcntl(trace_ring.wake_fd[i], F_SETFL, fcntl(trace_ring.wake_fd[i], F_GETFL) | O_NONBLOCK);
+
+  trace_ring.running = 1;
+
+  if(pthread_create(&trace_ring.thread, NULL, trace_thread, NULL) != 0) {
+    traceEvent(TRACE_ERROR, "Cannot start the trace thread");
+    close(trace_ring.wake_fd[0]);
+    close(trace_ring.wake_fd[1]);
+    free(trace_ring.recs);
+    return(-1);
+  }
+
+  __atomic_store_n(&traceAsync, 1, __ATOMIC_RELEASE);
+
+  /* Do not lose the last lines when exit() is called along the way */
+  atexit(traceAsyncStop);
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Write out the queued lines and go back to synchronous tracing. */
+void traceAsyncStop(void) {
+  uint8_t c = 0;
+
+  if(!__atomic_exchange_n(&traceAsync, 0, __ATOMIC_ACQ_REL))
+    return;
+
+  __atomic_store_n(&trace_ring.running, 0, __ATOMIC_RELEASE);
+  if(write(trace_ring.wake_fd[1], &c, 1) < 0) { /* Wakes up within a second anyway */ }
+  pthread_join(trace_ring.thread, NULL);
+
+  close(trace_ring.wake_fd[0]);
+  close(trace_ring.wake_fd[1]);
+  free(trace_ring.recs);
+  trace_ring.recs = NULL;
+}
+
+#endif /* N2N_HAVE_TRACE_ASYNC */
+
+/* ************************************** */
+
+/* Not expanded as the traceEvent() macro of n2n.h, which skips the call
+ * altogether when the level is disabled */
+void (traceEvent)(int eventTraceLevel, char* file, int line, char * format, ...) {
+  va_list va_ap;
+
+  if(eventTraceLevel <= traceLevel) {
+    char buf[1024];
+    char theDate[N2N_TRACE_DATESIZE];
+    time_t theTime;
+
+#ifdef N2N_HAVE_TRACE_ASYNC
+    if(__atomic_load_n(&traceAsync, __ATOMIC_ACQUIRE)) {
+      va_start(va_ap, format);
+      trace_ring_push(eventTraceLevel, file, line, format, va_ap);
+      va_end(va_ap);
+      return;
+    }
+#endif
+
+    theTime = time(NULL);
+    strftime(theDate, N2N_TRACE_DATESIZE, "%d/%b/%Y %H:%M:%S", localtime(&theTime));
+
+    va_start(va_ap, format);
+    vsnprintf(buf, sizeof(buf), format, va_ap);
+    va_end(va_ap);
+
+    trace_output(eventTraceLevel, file, line, theDate, buf, 1);
+  }
 }
 
 /* *********************************************** */
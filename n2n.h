@@ -34,6 +34,11 @@
 
 /* #define N2N_CAN_NAME_IFACE */
 
+/* recvmmsg()/sendmmsg() and struct mmsghdr are GNU extensions in glibc */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 /* Moved here to define _CRT_SECURE_NO_WARNINGS before all the including takes place */
 #ifdef WIN32
 #include "win32/n2n_win32.h"
@@ -47,6 +52,15 @@
 #endif
 #endif
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define N2N_HAVE_MMSG 1
+#endif
+
+/* UDP_SEGMENT/UDP_GRO trains are built on top of the mmsg batches */
+#if defined(N2N_HAVE_MMSG) && defined(__linux__) && !defined(__ANDROID_NDK__)
+#define N2N_HAVE_UDP_GSO 1
+#endif
+
 #define PACKAGE_BUILDDATE (__DATE__ " " __TIME__)
 
 #include <time.h>
@@ -76,6 +90,17 @@
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #define N2N_CAN_NAME_IFACE 1
+#ifndef __ANDROID_NDK__
+#define N2N_HAVE_TAP_MQ 1     /* IFF_MULTI_QUEUE TAP served by one thread per queue */
+#define N2N_HAVE_EPOLL  1     /* epoll + timerfd edge loop, select() elsewhere */
+#define N2N_HAVE_TAP_OFFLOAD 1 /* IFF_VNET_HDR with TSO/GRO, see tap_offload.c */
+#define N2N_HAVE_PIPELINE 1   /* RX, TX and crypto stages on threads linked by rings, see spsc_ring.c */
+#include <linux/virtio_net.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#define N2N_HAVE_IO_URING 1   /* optional io_uring data path, see uring.c */
+#include <linux/io_uring.h>
+#endif
+#endif
 #endif /* #ifdef __linux__ */
 
 #ifdef __FreeBSD__
@@ -99,6 +124,8 @@ typedef struct ether_hdr ether_hdr_t;
 #undef N2N_HAVE_DAEMON
 #undef N2N_HAVE_SETUID
 #undef N2N_CAN_NAME_IFACE
+#else
+#define N2N_HAVE_TRACE_ASYNC 1 /* trace lines written by a thread of their own, see n2n.c */
 #endif /* #ifdef __ANDROID_NDK__ */
 
 #include <netinet/in.h>
@@ -134,6 +161,11 @@ typedef struct ether_hdr ether_hdr_t;
 #define N2N_IFNAMSIZ            16 /* 15 chars * NULL */
 #endif
 
+#define N2N_TUNTAP_MAX_QUEUES   16
+
+/* tuntap_open_mq() flags */
+#define N2N_TUNTAP_F_OFFLOAD    0x01    /* IFF_VNET_HDR with checksum and TSO offload */
+
 #ifndef WIN32
 typedef struct tuntap_dev {
   int           fd;
@@ -141,6 +173,13 @@ typedef struct tuntap_dev {
   uint32_t      ip_addr, device_mask;
   uint16_t      mtu;
   char          dev_name[N2N_IFNAMSIZ];
+#ifdef N2N_HAVE_TAP_MQ
+  int           num_queues;                          /* 1 unless opened with tuntap_open_mq() */
+  int           queue_fds[N2N_TUNTAP_MAX_QUEUES];    /* queue_fds[0] == fd */
+#endif
+#ifdef N2N_HAVE_TAP_OFFLOAD
+  uint8_t       vnet_hdr;                            /* frames are preceded by a struct virtio_net_hdr */
+#endif
 } tuntap_dev;
 
 #define SOCKET int
@@ -160,10 +199,9 @@ typedef struct tuntap_dev {
 #define MSG_TYPE_PEER_INFO              9
 #define MSG_TYPE_QUERY_PEER            10
 
-/* Set N2N_COMPRESSION_ENABLED to 0 to disable lzo1x compression of ethernet
- * frames. Doing this will break compatibility with the standard n2n packet
- * format so do it only for experimentation. All edges must be built with the
- * same value if they are to understand each other. */
+/* Set N2N_COMPRESSION_ENABLED to 0 to build an edge without the -z option.
+ * It still decompresses the frames of the edges that compress them, as told
+ * by the PACKET header. */
 #define N2N_COMPRESSION_ENABLED 1
 
 #define DEFAULT_MTU   1290
@@ -186,6 +224,8 @@ struct peer_info {
   time_t              last_seen;
   time_t              last_p2p;
   time_t              last_sent_query;
+  uint32_t            dict_id;                /**< Compression dictionary it announced, 0 for none. */
+  uint16_t            caps;                   /**< N2N_CAPS_* it announced. */
 
   UT_hash_handle hh; /* makes this structure hashable */
 };
@@ -200,6 +240,12 @@ struct peer_info {
 #define N2N_EDGE_SUP_ATTEMPTS   3       /* Number of failed attmpts before moving on to next supernode. */
 #define N2N_PATHNAME_MAXLEN     256
 #define N2N_EDGE_MGMT_PORT      5644
+#define N2N_EDGE_BATCH_MAX      64      /* Max datagrams moved per recvmmsg/sendmmsg call. */
+#define N2N_EDGE_PIPE_MAX_LANES 16      /* Max crypto threads of the pipelined data path. */
+
+/* When the queued PACKETs of a TX batch are handed to the kernel. */
+#define N2N_BATCH_FLUSH_LOOP      0     /* Once per main loop iteration (or when the batch is full) */
+#define N2N_BATCH_FLUSH_IMMEDIATE 1     /* As soon as each PACKET is encoded */
 
 
 typedef char n2n_sn_name_t[N2N_EDGE_SN_HOST_SIZE];
@@ -220,12 +266,244 @@ typedef struct n2n_edge_conf {
   int                 register_ttl;           /**< TTL for registration packet when UDP NAT hole punching through supernode. */
   int                 local_port;
   int                 mgmt_port;
+  uint16_t            batch_size;             /**< Datagrams per recvmmsg/sendmmsg call, 1 disables batching. */
+  uint8_t             batch_flush;            /**< N2N_BATCH_FLUSH_LOOP or N2N_BATCH_FLUSH_IMMEDIATE */
+  uint8_t             udp_offload;            /**< Send UDP_SEGMENT trains and receive UDP_GRO trains. */
+  uint8_t             io_uring;               /**< Run the data path on io_uring when the kernel allows it. */
+  uint8_t             buf_hugepages;          /**< Allocate the packet buffers on huge pages. */
+  uint8_t             pipeline_lanes;         /**< Crypto threads of the pipelined data path, 0 disables it. */
+  uint8_t             compression;            /**< N2N_COMPRESSION_ID_* applied to the frames sent. */
+  char                *compress_dict;         /**< Dictionary file for lz4 and zstd, NULL for none. */
+  uint8_t             header_compression;     /**< Compress the inner headers towards the peers that can take it. */
 } n2n_edge_conf_t;
 
 typedef struct n2n_edge n2n_edge_t; /* Opaque, see edge_utils.c */
 
 /* ************************************** */
 
+#define PURGE_REGISTRATION_FREQUENCY   30
+#define REGISTRATION_TIMEOUT           60
+
+/* Hierarchical timer wheel, see timer_wheel.c. Times are in ticks, whose
+ * length is chosen by the user of the wheel. */
+#define N2N_TW_LEVEL_BITS       6
+#define N2N_TW_LEVEL_SIZE       (1 << N2N_TW_LEVEL_BITS)
+#define N2N_TW_LEVELS           4       /* Reach: 2^24 ticks */
+
+struct n2n_timer;
+struct n2n_timer_wheel;
+
+typedef void (*n2n_timer_cb_t)(struct n2n_timer_wheel *tw, struct n2n_timer *timer);
+
+typedef struct n2n_timer {
+  struct n2n_timer *  next;
+  struct n2n_timer ** pprev;                  /**< NULL when the timer is not pending. */
+  uint64_t            expires;                /**< Absolute expiry, in ticks. */
+  n2n_timer_cb_t      cb;
+  void *              data;
+} n2n_timer_t;
+
+typedef struct n2n_timer_wheel {
+  uint64_t            now;                    /**< Last tick processed. */
+  n2n_timer_t *       slots[N2N_TW_LEVELS][N2N_TW_LEVEL_SIZE];
+} n2n_timer_wheel_t;
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+/* TAP offloads, see tap_offload.c */
+#define N2N_GSO_MAX_SIZE        (18 + 65535)    /* ethernet header with a VLAN tag + max IP packet */
+
+typedef void (*n2n_frame_cb_t)(void *arg, uint8_t *frame, size_t len);
+
+/** TCP segments being coalesced into a super frame. */
+typedef struct n2n_gro {
+  size_t              len;                    /**< Frame length, 0 when empty. */
+  size_t              l4_off;                 /**< Offset of the TCP header. */
+  size_t              hdr_len;                /**< Offset of the TCP payload. */
+  uint32_t            next_seq;               /**< Sequence number expected next. */
+  uint16_t            next_ip_id;             /**< IPv4 id expected next. */
+  uint16_t            mss;                    /**< Payload of the first segment. */
+  uint16_t            segs;
+  uint8_t             ipv6;
+  uint64_t            super_frames;           /**< Stats: coalesced frames written. */
+  uint64_t            merged_segs;            /**< Stats: segments in those frames. */
+  uint8_t             frame[N2N_GSO_MAX_SIZE];
+} n2n_gro_t;
+#endif
+
+/* Packet buffer pool, see buf_pool.c. A pool is not thread safe unless it
+ * is created with N2N_BUF_POOL_SHARED: each data path thread owns one. */
+#define N2N_BUF_POOL_HUGEPAGES  0x01    /* Back the buffers with huge pages if possible */
+#define N2N_BUF_POOL_SHARED     0x02    /* Buffers allocated and released by several threads */
+
+typedef struct n2n_buf_pool {
+  n2n_buf_t *         free_list;
+  n2n_buf_t *         bufs;
+  size_t              num_bufs;
+  size_t              num_free;
+  size_t              mem_size;
+  uint8_t             hugepages;              /**< The buffers are on huge pages. */
+  uint8_t             shared;                 /**< The free list is protected by lock. */
+#ifndef WIN32
+  pthread_mutex_t     lock;
+#endif
+} n2n_buf_pool_t;
+
+#ifdef N2N_HAVE_PIPELINE
+#define N2N_CACHELINE_SIZE      64
+
+/* Lock-free ring passing pointers from a single producer thread to a single
+ * consumer thread, see spsc_ring.c. Each side keeps its index on a cache
+ * line of its own, with a cached copy of the index of the other side. */
+typedef struct n2n_ring {
+  void **             slots;
+  uint32_t            mask;                   /**< Size - 1, the size is a power of 2. */
+  /* Producer */
+  uint32_t            head __attribute__((aligned(N2N_CACHELINE_SIZE)));
+  uint32_t            tail_cache;
+  /* Consumer */
+  uint32_t            tail __attribute__((aligned(N2N_CACHELINE_SIZE)));
+  uint32_t            head_cache;
+  uint32_t            hiwat;                  /**< Highest occupancy seen by the consumer. */
+} n2n_ring_t;
+#endif
+
+#ifdef N2N_HAVE_IO_URING
+/* io_uring through the raw system calls, see uring.c */
+typedef struct n2n_uring {
+  int                   fd;
+  unsigned              sq_entries;
+  unsigned *            sq_head;
+  unsigned *            sq_tail;
+  unsigned *            sq_mask;
+  unsigned *            sq_array;
+  unsigned              sqe_tail;               /**< Next free SQE, published by uring_submit(). */
+  unsigned              sqe_submitted;          /**< SQEs already handed to the kernel. */
+  struct io_uring_sqe * sqes;
+  unsigned *            cq_head;
+  unsigned *            cq_tail;
+  unsigned *            cq_mask;
+  struct io_uring_cqe * cqes;
+  void *                sq_ring;
+  void *                cq_ring;
+  size_t                sq_ring_size;
+  size_t                cq_ring_size;
+  size_t                sqes_size;
+} n2n_uring_t;
+
+/** Buffers provided to the kernel, which picks one for each IOSQE_BUFFER_SELECT
+ *  completion and reports its id in the CQE flags. */
+typedef struct n2n_uring_bufs {
+  struct io_uring_buf_ring * br;
+  uint8_t *             mem;
+  unsigned              entries;                /**< Power of 2. */
+  size_t                buf_size;
+  uint16_t              bgid;                   /**< Buffer group id. */
+} n2n_uring_bufs_t;
+
+#define uring_buf(bufs, bid)    ((bufs)->mem + (size_t)(bid) * (bufs)->buf_size)
+#endif
+
+/* Frame compression, see compression.c */
+#define N2N_COMPRESS_MIN_LEN    128     /* Shorter frames are sent as they are, */
+#define N2N_COMPRESS_MIN_LEN_DICT 48    /* unless there is a dictionary */
+#define N2N_COMPRESS_BOUND(len) ((len) + (len) / 16 + 64 + 3)  /* lzo1x worst case, above lz4 and zstd */
+#define N2N_COMPRESS_DICT_MAX   (1024 * 1024)
+
+/** A dictionary trained on typical frames (see n2n-dict), shared by the
+ *  workers and used towards the peers that announced the same one. */
+typedef struct n2n_compress_dict {
+  uint8_t *           data;
+  size_t              len;
+  uint32_t            id;                     /**< Announced at registration, never 0. */
+  void *              lz4_stream;             /**< LZ4_stream_t with the dictionary loaded. */
+  void *              zstd_cdict;
+  void *              zstd_ddict;
+} n2n_compress_dict_t;
+
+typedef struct n2n_compress {
+  uint8_t             id;                     /**< N2N_COMPRESSION_ID_* of the frames sent. */
+  uint8_t             backoff;                /**< Frames skipped after the last miss. */
+  uint8_t             skip;                   /**< Frames still to send as they are. */
+  const n2n_compress_dict_t * dict;           /**< NULL without a dictionary. */
+  void *              wrkmem;                 /**< lzo1x-1 work memory. */
+  void *              lz4_state;              /**< LZ4_stream_t */
+  void *              zstd_cctx;
+  void *              zstd_dctx;              /**< Created with the first zstd frame received. */
+  uint64_t            frames;                 /**< Stats: frames sent compressed, */
+  uint64_t            dict_frames;            /**< with the dictionary, */
+  uint64_t            bytes_in;               /**< their length before */
+  uint64_t            bytes_out;              /**< and after compression. */
+  uint64_t            skipped;                /**< Stats: frames sent as they are. */
+} n2n_compress_t;
+
+/* Inner header compression, see header_compression.c */
+#define N2N_HC_CONTEXTS         16      /* Flows per peer and direction */
+#define N2N_HC_WINDOW           4       /* Values the fields sent are decodable against */
+#define N2N_HC_TEMPLATE_LEN     (14 + 20 + 20)  /* Ethernet, IPv4 and TCP without options */
+#define N2N_HC_MAX_LEN          (3 + 2 + 4 + 4 + 2 + 2 + 2 + 40)  /* Compressed header, at most */
+#define N2N_HC_PEER_TIMEOUT     300     /* s */
+
+/** A flow whose headers are compressed: the first one sent or received in
+ *  full, and the last values of the fields that change. */
+typedef struct n2n_hc_ctx {
+  uint8_t             valid;
+  uint8_t             ir_left;                /**< tx: frames still to send in full. */
+  uint16_t            since_ir;               /**< tx: frames sent since the last in full. */
+  uint8_t             num;                    /**< tx: values in the window, rx: 1. */
+  uint8_t             pos;                    /**< tx: next slot of the window. */
+  uint32_t            ipid[N2N_HC_WINDOW];
+  uint32_t            seq[N2N_HC_WINDOW];
+  uint32_t            ack[N2N_HC_WINDOW];
+  uint16_t            win[N2N_HC_WINDOW];
+  time_t              last_used;
+  time_t              last_ir;                /**< tx: when last sent in full. */
+  uint8_t             tmpl[N2N_HC_TEMPLATE_LEN];
+} n2n_hc_ctx_t;
+
+typedef struct n2n_hc_peer {
+  n2n_mac_t           mac;
+  time_t              last_seen;
+  n2n_hc_ctx_t        tx[N2N_HC_CONTEXTS];    /**< Flows towards the peer. */
+  n2n_hc_ctx_t        rx[N2N_HC_CONTEXTS];    /**< Flows from the peer, by the id it chose. */
+  UT_hash_handle      hh;
+} n2n_hc_peer_t;
+
+typedef struct n2n_hc {
+  n2n_hc_peer_t *     peers;
+  uint64_t            tx_frames;              /**< Stats: frames sent with compressed headers, */
+  uint64_t            tx_full;                /**< sent in full to set up or refresh a flow, */
+  uint64_t            tx_saved;               /**< and the bytes spared. */
+  uint64_t            rx_frames;
+  uint64_t            rx_errors;              /**< Frames dropped, out of sync. */
+} n2n_hc_t;
+
+/* CPU features and self-benchmark of the transforms, see crypto_dispatch.c */
+#define N2N_CPU_SSE2            0x01
+#define N2N_CPU_AVX2            0x02
+#define N2N_CPU_AES             0x04    /* AES-NI, or the ARMv8 AES instructions */
+#define N2N_CPU_PMUL            0x08    /* PCLMULQDQ, or ARMv8 PMULL */
+#define N2N_CPU_SHA             0x10    /* SHA-NI, or the ARMv8 SHA2 instructions */
+#define N2N_CPU_NEON            0x20
+
+#define N2N_CRYPTO_MAX_IMPLS    4
+
+typedef struct n2n_crypto_bench {
+  const char *        impl;
+  double              cycles_per_byte;        /**< TSC cycles, < 0 without a cycle counter. */
+  double              mbps;                   /**< 0 when the implementation failed its self-test. */
+} n2n_crypto_bench_t;
+
+/** The implementations of a transform measured by the self-benchmark. */
+typedef struct n2n_crypto_sel {
+  n2n_transform_t     transform_id;
+  const char *        transform;
+  unsigned int        num_impls;
+  unsigned int        selected;               /**< Index of the bound implementation. */
+  n2n_crypto_bench_t  impls[N2N_CRYPTO_MAX_IMPLS];
+} n2n_crypto_sel_t;
+
+/* ************************************** */
+
 #ifdef __ANDROID_NDK__
 #include <android/log.h>
 #endif /* #ifdef __ANDROID_NDK__ */
@@ -257,16 +535,34 @@ typedef struct n2n_edge n2n_edge_t; /* Opaque, see edge_utils.c */
 /* Transop Init Functions */
 int n2n_transop_null_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 int n2n_transop_twofish_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
+int n2n_transop_cc20_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 #ifdef N2N_HAVE_AES
 int n2n_transop_aes_cbc_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
+int n2n_transop_aes_gcm_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt);
 #endif
 
 /* Log */
+extern int traceLevel;
 void setTraceLevel(int level);
 void setUseSyslog(int use_syslog);
 void setTraceFile(FILE *f);
 int getTraceLevel();
 void traceEvent(int eventTraceLevel, char* file, int line, char * format, ...);
+#ifdef N2N_HAVE_TRACE_ASYNC
+int traceAsyncStart(void);
+void traceAsyncStop(void);
+#endif
+
+/* The level is tested before the call, so that the arguments of a disabled
+ * trace (often macaddr_str() or sock_to_cstr() calls) are not evaluated.
+ * N2N_TRACE_EXPAND splits the TRACE_xxx triple on MSVC too. */
+#define N2N_TRACE_EXPAND(x)                     x
+#define N2N_TRACE_LEVEL(level, ...)             (level)
+#define traceEvent(...)                                                 \
+  do {                                                                  \
+    if(N2N_TRACE_EXPAND(N2N_TRACE_LEVEL(__VA_ARGS__)) <= traceLevel)    \
+      traceEvent(__VA_ARGS__);                                          \
+  } while(0)
 
 /* Tuntap API */
 int tuntap_open(tuntap_dev *device, char *dev, const char *address_mode, char *device_ip,
@@ -275,6 +571,88 @@ int tuntap_read(struct tuntap_dev *tuntap, unsigned char *buf, int len);
 int tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len);
 void tuntap_close(struct tuntap_dev *tuntap);
 void tuntap_get_address(struct tuntap_dev *tuntap);
+#ifdef N2N_HAVE_TAP_MQ
+int tuntap_open_mq(tuntap_dev *device, char *dev, const char *address_mode, char *device_ip,
+                   char *device_mask, const char * device_mac, int mtu, int num_queues, int flags);
+#endif
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+/* TAP offloads */
+int tap_offload_tx(const struct virtio_net_hdr *vh, uint8_t *frame, size_t len,
+                   uint8_t *seg_buf, size_t seg_buf_size, n2n_frame_cb_t cb, void *arg);
+int tap_offload_write(int fd, const uint8_t *frame, size_t len);
+void gro_receive(n2n_gro_t *gro, int fd, const uint8_t *frame, size_t len);
+void gro_flush(n2n_gro_t *gro, int fd);
+#endif
+
+/* Packet buffers */
+int n2n_buf_pool_init(n2n_buf_pool_t *pool, size_t num_bufs, int flags);
+void n2n_buf_pool_free(n2n_buf_pool_t *pool);
+n2n_buf_t* n2n_buf_alloc(n2n_buf_pool_t *pool);
+void n2n_buf_release(n2n_buf_t *buf);
+uint8_t* n2n_buf_push(n2n_buf_t *buf, size_t len);
+uint8_t* n2n_buf_pull(n2n_buf_t *buf, size_t len);
+uint8_t* n2n_buf_put(n2n_buf_t *buf, size_t len);
+size_t n2n_buf_headroom(const n2n_buf_t *buf);
+size_t n2n_buf_tailroom(const n2n_buf_t *buf);
+
+#ifdef N2N_HAVE_PIPELINE
+/* SPSC rings */
+int n2n_ring_init(n2n_ring_t *ring, uint32_t size);
+void n2n_ring_free(n2n_ring_t *ring);
+int n2n_ring_push(n2n_ring_t *ring, void *item);
+void* n2n_ring_pop(n2n_ring_t *ring);
+uint32_t n2n_ring_count(const n2n_ring_t *ring);
+#endif
+
+#ifdef N2N_HAVE_IO_URING
+/* io_uring */
+int uring_init(n2n_uring_t *ring, unsigned entries, unsigned cq_entries);
+void uring_exit(n2n_uring_t *ring);
+int uring_register_files(n2n_uring_t *ring, const int *fds, unsigned num);
+int uring_op_supported(n2n_uring_t *ring, unsigned op);
+struct io_uring_sqe* uring_get_sqe(n2n_uring_t *ring);
+int uring_submit(n2n_uring_t *ring, unsigned wait_nr);
+struct io_uring_cqe* uring_peek_cqe(n2n_uring_t *ring);
+void uring_cqe_seen(n2n_uring_t *ring);
+int uring_bufs_init(n2n_uring_t *ring, n2n_uring_bufs_t *bufs, uint16_t bgid,
+                    unsigned entries, size_t buf_size);
+void uring_bufs_free(n2n_uring_t *ring, n2n_uring_bufs_t *bufs);
+void uring_bufs_recycle(n2n_uring_bufs_t *bufs, uint16_t bid);
+#endif
+
+/* Random numbers, see csprng.c */
+void n2n_rand_bytes(void *buf, size_t len);
+uint32_t n2n_rand32(void);
+uint64_t n2n_rand64(void);
+
+/* Compression */
+int n2n_compression_supported(uint8_t id);
+const char* n2n_compression_str(uint8_t id);
+int n2n_compress_dict_load(n2n_compress_dict_t *dict, const char *path);
+void n2n_compress_dict_free(n2n_compress_dict_t *dict);
+uint32_t n2n_compress_dict_id(const uint8_t *data, size_t len);
+int n2n_compress_init(n2n_compress_t *c, uint8_t id, const n2n_compress_dict_t *dict);
+void n2n_compress_free(n2n_compress_t *c);
+size_t n2n_compress(n2n_compress_t *c, uint32_t peer_dict_id, const uint8_t *frame, size_t len,
+                    uint8_t *out, size_t out_size, uint8_t *out_id);
+int n2n_decompress(n2n_compress_t *c, uint8_t id, const uint8_t *in, size_t len,
+                   uint8_t *out, size_t out_size);
+
+/* Header compression */
+size_t n2n_hc_compress(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *frame, size_t len,
+                       uint8_t *hdr, size_t *consumed, time_t now);
+int n2n_hc_decompress(n2n_hc_t *hc, const n2n_mac_t peer, const uint8_t *in, size_t len,
+                      uint8_t *out, size_t out_size, time_t now);
+size_t n2n_hc_purge(n2n_hc_t *hc, time_t now);
+void n2n_hc_free(n2n_hc_t *hc);
+
+/* Crypto dispatch */
+uint32_t n2n_cpu_features(void);
+char* n2n_cpu_features_str(char *buf, size_t len);
+const n2n_crypto_sel_t* n2n_crypto_select(n2n_transform_t transform_id);
+const n2n_crypto_sel_t* n2n_crypto_selected(n2n_transform_t transform_id);
+char* n2n_crypto_bench_str(const n2n_crypto_sel_t *sel, unsigned int i, char *buf, size_t len);
 
 /* Utils */
 char* intoa(uint32_t addr, char* buf, uint16_t buf_len);
@@ -291,6 +669,9 @@ void print_edge_stats(const n2n_edge_t *eee);
 char* sock_to_cstr( n2n_sock_str_t out,
                             const n2n_sock_t * sock );
 SOCKET open_socket(int local_port, int bind_any);
+#ifdef SO_REUSEPORT
+SOCKET open_socket_reuseport(int local_port, int bind_any);
+#endif
 int sock_equal( const n2n_sock_t * a,
                        const n2n_sock_t * b );
 
@@ -300,6 +681,14 @@ size_t purge_peer_list( struct peer_info ** peer_list,
 size_t clear_peer_list( struct peer_info ** peer_list );
 size_t purge_expired_registrations( struct peer_info ** peer_list, time_t* p_last_purge );
 
+/* Timer wheel */
+void timer_init(n2n_timer_t *timer, n2n_timer_cb_t cb, void *data);
+void timer_wheel_init(n2n_timer_wheel_t *tw, uint64_t now);
+void timer_wheel_add(n2n_timer_wheel_t *tw, n2n_timer_t *timer, uint64_t delay);
+void timer_wheel_cancel(n2n_timer_t *timer);
+int timer_is_pending(const n2n_timer_t *timer);
+size_t timer_wheel_advance(n2n_timer_wheel_t *tw, uint64_t now);
+
 /* Edge conf */
 void edge_init_conf_defaults(n2n_edge_conf_t *conf);
 int edge_verify_conf(const n2n_edge_conf_t *conf);
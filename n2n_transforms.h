@@ -23,13 +23,15 @@
 #include "n2n_wire.h"
 
 #define N2N_TRANSFORM_ID_USER_START     64
-#define N2N_TRANSFORM_ID_MAX            65535
+#define N2N_TRANSFORM_ID_MAX            N2N_TRANSFORM_ID_MASK /* the top bits carry the compression */
 
 typedef enum n2n_transform {
   N2N_TRANSFORM_ID_INVAL = 0,
   N2N_TRANSFORM_ID_NULL = 1,
   N2N_TRANSFORM_ID_TWOFISH = 2,
   N2N_TRANSFORM_ID_AESCBC = 3,
+  N2N_TRANSFORM_ID_AESGCM = 4,
+  N2N_TRANSFORM_ID_CHACHA20 = 5,
 } n2n_transform_t;
 
 struct n2n_trans_op;
@@ -42,6 +44,37 @@ typedef int             (*n2n_transform_f)( struct n2n_trans_op * arg,
                                             const uint8_t * inbuf,
                                             size_t in_len,
                                             const n2n_mac_t peer_mac);
+/* Encode the payload of buf where it is: the preamble is pushed into the
+ * headroom and the padding put into the tailroom. 0 on success, -1 leaves
+ * buf untouched. */
+typedef int             (*n2n_transform_fwd_inplace_f)( struct n2n_trans_op * arg,
+                                                        n2n_buf_t * buf,
+                                                        const n2n_mac_t peer_mac);
+/* Decode the in_len bytes of buf where they are. Returns the payload length,
+ * with *out pointing at it inside buf, or 0 on failure. */
+typedef int             (*n2n_transform_rev_inplace_f)( struct n2n_trans_op * arg,
+                                                        uint8_t * buf,
+                                                        size_t in_len,
+                                                        uint8_t ** out,
+                                                        const n2n_mac_t peer_mac);
+
+/* A packet of a batch handed to fwd_batch or rev_batch. */
+typedef struct n2n_trans_pkt {
+  n2n_buf_t *         buf;            /* fwd: the frame to encode in place */
+  uint8_t *           data;           /* rev: the payload, then the decoded frame */
+  size_t              len;            /* rev: its length, then the frame length or 0 on failure;
+                                       * fwd: free for the caller */
+  n2n_mac_t           peer_mac;
+  uint8_t             compression;    /* fwd: free for the caller */
+  int                 rc;             /* fwd: as returned by fwd_inplace */
+} n2n_trans_pkt_t;
+
+/* Encode (fwd) or decode (rev) num packets in place, each as fwd_inplace or
+ * rev_inplace would. Lets a transform work on several packets at once, e.g.
+ * to fill the SIMD lanes of its cipher with the blocks of short packets. */
+typedef void            (*n2n_transform_batch_f)( struct n2n_trans_op * arg,
+                                                  n2n_trans_pkt_t * pkts,
+                                                  unsigned int num);
 
 /** Holds the info associated with a data transform plugin.
  *
@@ -60,6 +93,10 @@ typedef struct n2n_trans_op {
   n2n_transtick_f    tick;   /* periodic maintenance */
   n2n_transform_f     fwd;    /* encode a payload */
   n2n_transform_f     rev;    /* decode a payload */
+  n2n_transform_fwd_inplace_f fwd_inplace; /* encode a payload in place (optional) */
+  n2n_transform_rev_inplace_f rev_inplace; /* decode a payload in place (optional) */
+  n2n_transform_batch_f fwd_batch; /* encode several payloads in place (optional) */
+  n2n_transform_batch_f rev_batch; /* decode several payloads in place (optional) */
 } n2n_trans_op_t;
 
 #endif /* #if !defined(N2N_TRANSFORMS_H_) */
@@ -69,6 +69,7 @@ typedef enum n2n_pc
 #define N2N_FLAGS_OPTIONS               0x0080
 #define N2N_FLAGS_SOCKET                0x0040
 #define N2N_FLAGS_FROM_SUPERNODE        0x0020
+#define N2N_FLAGS_HDR_COMPRESSION       0x0100  /* PACKET: inner headers compressed, see header_compression.c */
 
 /* The bits in flag that are the packet type */
 #define N2N_FLAGS_TYPE_MASK             0x001f  /* 0 - 31 */
@@ -121,6 +122,8 @@ typedef struct n2n_REGISTER
     n2n_mac_t           srcMac;         /* MAC of registering party */
     n2n_mac_t           dstMac;         /* MAC of target edge */
     n2n_sock_t          sock;           /* REVISIT: unused? */
+    uint32_t            dict_id;        /* Compression dictionary of the sender, 0 for none */
+    uint16_t            caps;           /* N2N_CAPS_* of the sender */
 } n2n_REGISTER_t;
 
 typedef struct n2n_REGISTER_ACK
@@ -129,16 +132,64 @@ typedef struct n2n_REGISTER_ACK
     n2n_mac_t           srcMac;         /* MAC of acknowledging party (supernode or edge) */
     n2n_mac_t           dstMac;         /* Reflected MAC of registering edge from REGISTER */
     n2n_sock_t          sock;           /* Supernode's view of edge socket (IP Addr, port) */
+    uint32_t            dict_id;        /* Compression dictionary of the sender, 0 for none */
+    uint16_t            caps;           /* N2N_CAPS_* of the sender */
 } n2n_REGISTER_ACK_t;
 
+/* What an edge announces it supports in REGISTER and REGISTER_ACK */
+#define N2N_CAPS_HDR_COMPRESSION        0x0001  /* receives N2N_FLAGS_HDR_COMPRESSION */
+
+/* The top bits of the transform field of a PACKET tell how the frame was
+ * compressed before the transform was applied. */
+#define N2N_COMPRESSION_ID_SHIFT        13
+#define N2N_TRANSFORM_ID_MASK           ((1 << N2N_COMPRESSION_ID_SHIFT) - 1)
+
+#define N2N_COMPRESSION_ID_NONE         0
+#define N2N_COMPRESSION_ID_LZO          1       /* lzo1x-1 */
+#define N2N_COMPRESSION_ID_LZ4          2
+#define N2N_COMPRESSION_ID_ZSTD         3
+#define N2N_COMPRESSION_ID_LZ4_DICT     4       /* with the dictionary both ends announced */
+#define N2N_COMPRESSION_ID_ZSTD_DICT    5
+
 typedef struct n2n_PACKET
 {
     n2n_mac_t           srcMac;
     n2n_mac_t           dstMac;
     n2n_sock_t          sock;
     uint16_t            transform;
+    uint8_t             compression;    /* N2N_COMPRESSION_ID_* */
 } n2n_PACKET_t;
 
+/* Version, TTL, flags and community, then the MACs and the transform of a
+ * PACKET sent without a socket */
+#define N2N_COMMON_SIZE                 (4 + N2N_COMMUNITY_SIZE)
+#define N2N_PACKET_HDR_SIZE             (N2N_COMMON_SIZE + 2 * N2N_MAC_SIZE + 2)
+
+/* Where the socket goes in a PACKET or a REGISTER with N2N_FLAGS_SOCKET */
+#define N2N_PACKET_SOCK_OFFSET          (N2N_COMMON_SIZE + 2 * N2N_MAC_SIZE)
+#define N2N_REGISTER_SOCK_OFFSET        (N2N_COMMON_SIZE + N2N_COOKIE_SIZE + 2 * N2N_MAC_SIZE)
+
+/* A PACKET decoded by decode_PACKET_fast(): the community and the MACs are
+ * read where they are in the datagram. */
+typedef struct n2n_PACKET_view
+{
+    uint8_t             ttl;
+    uint16_t            flags;          /* N2N_FLAGS_BITS_MASK bits of the common header */
+    const uint8_t *     community;      /* N2N_COMMUNITY_SIZE bytes */
+    const uint8_t *     srcMac;
+    const uint8_t *     dstMac;
+    n2n_sock_t          sock;           /* family 0 without N2N_FLAGS_SOCKET */
+    uint16_t            transform;
+    uint8_t             compression;    /* N2N_COMPRESSION_ID_* */
+} n2n_PACKET_view_t;
+
+/* The header of the PACKETs an edge sends, encoded once by
+ * encode_PACKET_tmpl() and completed for each frame by stamp_PACKET(). */
+typedef struct n2n_PACKET_tmpl
+{
+    uint8_t             hdr[N2N_PACKET_HDR_SIZE];
+} n2n_PACKET_tmpl_t;
+
 /* Linked with n2n_register_super in n2n_pc_t. Only from edge to supernode. */
 typedef struct n2n_REGISTER_SUPER
 {
@@ -186,7 +237,23 @@ typedef struct n2n_QUERY_PEER
   n2n_mac_t           targetMac;
 } n2n_QUERY_PEER_t;
 
-typedef struct n2n_buf n2n_buf_t;
+/* A packet buffer with room to prepend the headers in place, taken from a
+ * n2n_buf_pool_t (see buf_pool.c). A frame is stored after the headroom,
+ * leaving space for the n2n header and the transform preamble. */
+#define N2N_BUF_HEADROOM        128
+#define N2N_BUF_TAILROOM        64      /* cipher padding and tags */
+#define N2N_BUF_ROOM            (N2N_BUF_HEADROOM + N2N_PKT_BUF_SIZE + N2N_BUF_TAILROOM)
+
+struct n2n_buf_pool;
+
+typedef struct n2n_buf {
+  struct n2n_buf *      next;           /* free list link */
+  struct n2n_buf_pool * pool;           /* owner */
+  uint8_t *             data;           /* first valid byte */
+  size_t                len;            /* valid bytes from data */
+  n2n_sock_t            peer;           /* sender or destination, when queued between threads */
+  uint8_t               room[N2N_BUF_ROOM];
+} n2n_buf_t;
 
 int encode_uint8( uint8_t * base,
                   size_t * idx,
@@ -312,6 +379,21 @@ int decode_PACKET( n2n_PACKET_t * pkt,
                    size_t * rem,
                    size_t * idx );
 
+int decode_PACKET_fast( n2n_PACKET_view_t * pkt,
+                        const uint8_t * base,
+                        size_t len );
+
+void encode_PACKET_tmpl( n2n_PACKET_tmpl_t * tmpl,
+                         const n2n_community_t community,
+                         const n2n_mac_t srcMac,
+                         uint16_t transform );
+
+size_t stamp_PACKET( uint8_t * base,
+                     const n2n_PACKET_tmpl_t * tmpl,
+                     const n2n_mac_t dstMac,
+                     uint16_t flags,
+                     uint8_t compression );
+
 int encode_PEER_INFO( uint8_t * base,
                    size_t * idx,
                    const n2n_common_t * common,
@@ -24,11 +24,29 @@
 #include <signal.h>
 #endif
 
+#if defined(__GNUC__) && defined(__SSE2__)
+#define N2N_SN_SSE2 1
+#include <emmintrin.h>
+#endif
+
 #define N2N_SN_LPORT_DEFAULT 7654
 #define N2N_SN_PKTBUF_SIZE   2048
+#define N2N_SN_HEADROOM      (4 + IPV4_SIZE)    /* for the socket added to relayed messages */
 
 #define N2N_SN_MGMT_PORT                5645
 
+#ifdef N2N_HAVE_MMSG
+#define N2N_SN_BATCH_MAX     64         /* Max datagrams received per recvmmsg call */
+#define N2N_SN_TX_MAX        256        /* Max relayed copies sent per sendmmsg call */
+#endif
+
+/* Worker threads, each with a socket of its own on the same port */
+#if defined(SO_REUSEPORT) && !defined(WIN32)
+#define N2N_SN_HAVE_WORKERS  1
+#endif
+#define N2N_SN_MAX_WORKERS   64
+#define N2N_SN_CACHELINE_SIZE 64        /* the stats of each worker on lines of their own */
+
 typedef struct sn_stats {
   size_t errors;              /* Number of errors encountered. */
   size_t reg_super;           /* Number of REGISTER_SUPER requests received. */
@@ -37,35 +55,149 @@ typedef struct sn_stats {
   size_t broadcast;           /* Number of messages broadcast to a community. */
   time_t last_fwd;            /* Time when last message was forwarded. */
   time_t last_reg_super;      /* Time when last REGISTER_SUPER was received. */
+  size_t rx_batches;          /* Number of recvmmsg calls that returned datagrams. */
+  size_t rx_batched;          /* Number of datagrams they returned. */
+  size_t rx_dropped;          /* Datagrams dropped by the kernel, socket buffer full. */
+  size_t tx_batches;          /* Number of sendmmsg calls that sent datagrams. */
+  size_t tx_batched;          /* Number of datagrams they sent. */
+  size_t tx_dropped;          /* Number of relayed datagrams sendmmsg refused. */
 } sn_stats_t;
 
+/* The relay path reads the tables below without locks. The memory it may
+ * still read is only freed once every worker went through a quiescent
+ * state, when it holds no pointer into the tables (see sn_retire()). */
+
+/* The edges of a community, in groups of SN_GROUP_SIZE slots as in Swiss
+ * tables: a control byte per slot tells whether it is empty, deleted, or
+ * holds an edge and then 7 bits of the hash of its MAC, the tag. A lookup
+ * compares the tags of a whole group at once and only reads the slots
+ * whose tag matches.
+ *
+ * Registrations update the table in place, under the lock of the
+ * community: a slot is written before its control byte, and never holds
+ * another edge once used. Deleted slots are only reused by a rebuild into a
+ * new table, which replaces the old one. The socket of an edge is updated
+ * with a single 64-bit store. */
+#define SN_GROUP_SIZE        16
+#define SN_CTRL_EMPTY        0x80
+#define SN_CTRL_DELETED      0xfe
+
+struct sn_edge {
+  uint64_t            mac;            /* See sn_mac_key(). */
+  uint64_t            sock;           /* See sn_sock_key(). */
+  time_t              last_seen;      /* Under the lock of the community. */
+};
+
+struct sn_edge_table {
+  uint32_t            mask;           /* Number of groups - 1. */
+  uint32_t            num;            /* Number of edges. */
+  uint32_t            used;           /* Slots holding an edge or deleted. */
+  struct sn_edge *    slots;
+  uint8_t             ctrl[] __attribute__((aligned(SN_GROUP_SIZE)));
+};
+
 struct sn_community {
   char community[N2N_COMMUNITY_SIZE];
-  struct peer_info *edges;          /* Link list of registered edges. */
+  struct sn_edge_table *edges;      /* Registered edges, written under lock. */
+  int               dead;           /* Purged, under lock: registrations go elsewhere. */
+  time_t            last_purge;     /* Of its expired registrations. */
+#ifdef N2N_SN_HAVE_WORKERS
+  pthread_mutex_t   lock;           /* Serialises the registrations of the community. */
+#endif
 
   UT_hash_handle   hh; /* makes this structure hashable */
 };
 
+/* The communities as the relay path sees them, an open addressing table
+ * by name that is never modified: it is built again when a community is
+ * added or removed. */
+struct sn_comm_table {
+  unsigned int        mask;
+  struct sn_community *slots[];
+};
+
+/* Memory unpublished at epoch, freed by sn_reclaim() */
+struct sn_retired {
+  struct sn_retired * next;
+  uint64_t            epoch;
+  void *              ptr;
+  void                (*free_fn)(void *);
+};
+
+#define SN_RCU_OFFLINE       UINT64_MAX /* a worker waiting for datagrams */
+
+/* A thread serving a socket. Worker 0 is the main loop, on sss->sock. */
+struct sn_worker {
+  struct n2n_sn *     sss;
+  int                 idx;
+  int                 sock;
+  uint64_t            rcu_epoch;      /* Epoch seen at the last quiescent state, or SN_RCU_OFFLINE. */
+  sn_stats_t          stats __attribute__((aligned(N2N_SN_CACHELINE_SIZE)));
+  struct sn_batch *   batch;          /* Only when batching. */
+#ifdef N2N_SN_HAVE_WORKERS
+  pthread_t           thread;
+#endif
+};
+
 typedef struct n2n_sn {
   time_t              start_time;     /* Used to measure uptime. */
-  sn_stats_t          stats;
   int                 daemon;         /* If non-zero then daemonise. */
+  int                 async_log;      /* If non-zero then trace from a thread of its own. */
   uint16_t            lport;          /* Local UDP port to bind to. */
   int                 sock;           /* Main socket for UDP traffic with edges. */
   int                 mgmt_sock;      /* management socket. */
   int 	              lock_communities; /* If true, only loaded communities can be used. */
-  struct sn_community *communities;
+  struct sn_community *communities;   /* All of them, under comm_lock. */
+  struct sn_comm_table *comm_table;   /* Published copy of communities. */
+  uint16_t            batch_size;     /* Datagrams per recvmmsg call, 1 disables batching. */
+  int                 num_workers;
+  struct sn_worker *  workers;
+  uint64_t            rcu_epoch;      /* Bumped by each sn_retire(). */
+  struct sn_retired * retired;        /* Under retire_lock. */
+#ifdef N2N_SN_HAVE_WORKERS
+  pthread_mutex_t     comm_lock;      /* Serialises the changes to the communities. */
+  pthread_mutex_t     retire_lock;
+#endif
 } n2n_sn_t;
 
+#ifdef N2N_HAVE_MMSG
+/* The datagrams of a receive batch, and the copies relayed while processing
+ * them. The relayed copies point into the receive buffers, so they are sent
+ * before the next batch is received. */
+struct sn_batch {
+  struct mmsghdr      rx_msgs[N2N_SN_BATCH_MAX];
+  struct iovec        rx_iovs[N2N_SN_BATCH_MAX];
+  struct sockaddr_in  rx_addrs[N2N_SN_BATCH_MAX];
+#ifdef SO_RXQ_OVFL
+  uint8_t             rx_ctrl[N2N_SN_BATCH_MAX][CMSG_SPACE(sizeof(uint32_t))];
+#endif
+  uint8_t             rx_bufs[N2N_SN_BATCH_MAX][N2N_SN_HEADROOM + N2N_SN_PKTBUF_SIZE];
+
+  unsigned int        tx_count;
+  struct mmsghdr      tx_msgs[N2N_SN_TX_MAX];
+  struct iovec        tx_iovs[N2N_SN_TX_MAX];
+  struct sockaddr_in  tx_addrs[N2N_SN_TX_MAX];
+};
+#endif
+
 #define HASH_FIND_COMMUNITY(head,name,out) HASH_FIND_STR(head,name,out)
 
-static int try_forward(n2n_sn_t * sss,
+/* The locks are only taken when there are worker threads */
+#ifdef N2N_SN_HAVE_WORKERS
+#define sn_lock(sss, m)      do { if((sss)->num_workers > 1) pthread_mutex_lock(m); } while(0)
+#define sn_unlock(sss, m)    do { if((sss)->num_workers > 1) pthread_mutex_unlock(m); } while(0)
+#else
+#define sn_lock(sss, m)      do { } while(0)
+#define sn_unlock(sss, m)    do { } while(0)
+#endif
+
+static int try_forward(struct sn_worker * w,
 		       const n2n_common_t * cmn,
 		       const n2n_mac_t dstMac,
 		       const uint8_t * pktbuf,
 		       size_t pktsize);
 
-static int try_broadcast(n2n_sn_t * sss,
+static int try_broadcast(struct sn_worker * w,
 			 const n2n_common_t * cmn,
 			 const n2n_mac_t srcMac,
 			 const uint8_t * pktbuf,
@@ -84,10 +216,31 @@ static int init_sn(n2n_sn_t * sss) {
   sss->lport = N2N_SN_LPORT_DEFAULT;
   sss->sock = -1;
   sss->mgmt_sock = -1;
+#ifdef N2N_HAVE_MMSG
+  sss->batch_size = N2N_SN_BATCH_MAX;
+#else
+  sss->batch_size = 1;
+#endif
+  sss->num_workers = 1;
+  sss->rcu_epoch = 1;
+#ifdef N2N_SN_HAVE_WORKERS
+  pthread_mutex_init(&sss->comm_lock, NULL);
+  pthread_mutex_init(&sss->retire_lock, NULL);
+#endif
 
   return 0; /* OK */
 }
 
+static void free_community(void *ptr) {
+  struct sn_community *comm = (struct sn_community*)ptr;
+
+  free(comm->edges);
+#ifdef N2N_SN_HAVE_WORKERS
+  pthread_mutex_destroy(&comm->lock);
+#endif
+  free(comm);
+}
+
 /** Deinitialise the supernode structure and deallocate any memory owned by
  *  it. */
 static void deinit_sn(n2n_sn_t * sss)
@@ -106,10 +259,34 @@ static void deinit_sn(n2n_sn_t * sss)
     }
   sss->mgmt_sock=-1;
 
+  if(sss->workers) {
+    int i;
+
+    for(i=0; i<sss->num_workers; i++) {
+      if((i > 0) && (sss->workers[i].sock >= 0))
+	closesocket(sss->workers[i].sock);
+      free(sss->workers[i].batch);
+    }
+
+    free(sss->workers);
+    sss->workers = NULL;
+  }
+
+  /* The workers are gone, nothing refers to the retired memory any more */
+  while(sss->retired) {
+    struct sn_retired *r = sss->retired;
+
+    sss->retired = r->next;
+    r->free_fn(r->ptr);
+    free(r);
+  }
+
+  free(sss->comm_table);
+  sss->comm_table = NULL;
+
   HASH_ITER(hh, sss->communities, community, tmp) {
-    clear_peer_list(&community->edges);
     HASH_DEL(sss->communities, community);
-    free(community);
+    free_community(community);
   }
 }
 
@@ -125,8 +302,312 @@ static uint16_t reg_lifetime(n2n_sn_t * sss) {
 }
 
 
+/* *************************************************** */
+
+/* Quiescent state based reclamation: a worker only holds pointers into the
+ * published tables while it processes datagrams. Each time it is done with
+ * them it records the epoch it saw, and memory retired at some epoch is
+ * freed once every worker saw that epoch or is waiting for datagrams. */
+
+/** Note that w holds no pointer into the published tables. */
+static void sn_quiescent(n2n_sn_t * sss, struct sn_worker * w) {
+  /* Ordered before the loads of the tables that follow */
+  __atomic_store_n(&w->rcu_epoch, __atomic_load_n(&sss->rcu_epoch, __ATOMIC_SEQ_CST),
+		   __ATOMIC_SEQ_CST);
+}
+
+/** Note that w is about to wait for datagrams, and does not delay the
+ *  reclamation until it gets some. */
+static void sn_offline(struct sn_worker * w) {
+  __atomic_store_n(&w->rcu_epoch, SN_RCU_OFFLINE, __ATOMIC_RELEASE);
+}
+
+/** Free ptr with free_fn once no worker can see it. ptr must have been
+ *  unpublished already. */
+static void sn_retire(n2n_sn_t * sss, void * ptr, void (*free_fn)(void *)) {
+  struct sn_retired *r = (struct sn_retired*)malloc(sizeof(struct sn_retired));
+
+  if(r == NULL) {
+    traceEvent(TRACE_ERROR, "Out of memory, leaking %p", ptr);
+    return;
+  }
+
+  r->ptr = ptr;
+  r->free_fn = free_fn;
+
+  sn_lock(sss, &sss->retire_lock);
+  r->epoch = __atomic_add_fetch(&sss->rcu_epoch, 1, __ATOMIC_SEQ_CST);
+  r->next = sss->retired;
+  sss->retired = r;
+  sn_unlock(sss, &sss->retire_lock);
+}
+
+/** Free the retired memory that no worker can see any more. Called by the
+ *  main loop between two datagrams. */
+static void sn_reclaim(n2n_sn_t * sss) {
+  struct sn_retired **pr, *r;
+  uint64_t min_epoch = SN_RCU_OFFLINE;
+  int i;
+
+  if(sss->retired == NULL)
+    return;
+
+  for(i=0; i<sss->num_workers; i++)
+    min_epoch = MIN(min_epoch, __atomic_load_n(&sss->workers[i].rcu_epoch, __ATOMIC_SEQ_CST));
+
+  sn_lock(sss, &sss->retire_lock);
+
+  for(pr = &sss->retired; (r = *pr) != NULL; ) {
+    if(r->epoch <= min_epoch) {
+      *pr = r->next;
+      r->free_fn(r->ptr);
+      free(r);
+    } else
+      pr = &r->next;
+  }
+
+  sn_unlock(sss, &sss->retire_lock);
+}
+
+/* *************************************************** */
+
+static uint32_t sn_community_hash(const char *name) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+  size_t i;
+
+  for(i=0; (i < N2N_COMMUNITY_SIZE) && name[i]; i++)
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+
+  return(h);
+}
+
+/** @return the MAC as a 48-bit integer, the key of the edge tables */
+static inline uint64_t sn_mac_key(const n2n_mac_t mac) {
+  return(((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) | ((uint64_t)mac[2] << 24)
+	 | ((uint64_t)mac[3] << 16) | ((uint64_t)mac[4] << 8) | (uint64_t)mac[5]);
+}
+
+static inline void sn_mac_from_key(uint64_t key, n2n_mac_t mac) {
+  int i;
+
+  for(i=N2N_MAC_SIZE-1; i>=0; i--, key >>= 8)
+    mac[i] = (uint8_t)key;
+}
+
+/** @return the IPv4 socket as a 64-bit integer, or 0 for another family.
+ *          The edges register from the IPv4 socket of the supernode. */
+static inline uint64_t sn_sock_key(const n2n_sock_t * sock) {
+  if(sock->family != AF_INET)
+    return(0);
+
+  return(((uint64_t)AF_INET << 48) | ((uint64_t)sock->addr.v4[0] << 40)
+	 | ((uint64_t)sock->addr.v4[1] << 32) | ((uint64_t)sock->addr.v4[2] << 24)
+	 | ((uint64_t)sock->addr.v4[3] << 16) | sock->port);
+}
+
+static inline void sn_sock_from_key(uint64_t key, n2n_sock_t * sock) {
+  sock->family = AF_INET;
+  sock->port = (uint16_t)key;
+  sock->addr.v4[0] = (uint8_t)(key >> 40);
+  sock->addr.v4[1] = (uint8_t)(key >> 32);
+  sock->addr.v4[2] = (uint8_t)(key >> 24);
+  sock->addr.v4[3] = (uint8_t)(key >> 16);
+}
+
+/* The final mix of MurmurHash3: the low bits pick the group, the top 7 are
+ * the tag */
+static inline uint64_t sn_edge_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+
+  return(key);
+}
+
+/** @return a mask with bit i set when the control byte i of group is tag */
+static inline uint32_t sn_group_match(const uint8_t * group, uint8_t tag) {
+#ifdef N2N_SN_SSE2
+  return((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i*)group),
+						    _mm_set1_epi8((char)tag))));
+#else
+  uint32_t mask = 0;
+  int i;
+
+  for(i=0; i<SN_GROUP_SIZE; i++)
+    mask |= (uint32_t)(group[i] == tag) << i;
+
+  return(mask);
+#endif
+}
+
+/** @return a mask with bit i set when the slot i of group holds an edge */
+static inline uint32_t sn_group_full(const uint8_t * group) {
+#ifdef N2N_SN_SSE2
+  /* The top bit of the control byte is set when empty or deleted */
+  return(~(uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i*)group)) & 0xffff);
+#else
+  uint32_t mask = 0;
+  int i;
+
+  for(i=0; i<SN_GROUP_SIZE; i++)
+    mask |= (uint32_t)!(group[i] & 0x80) << i;
+
+  return(mask);
+#endif
+}
+
+/** @return an edge table of groups groups (a power of 2), or NULL when out
+ *          of memory. Freed with free(). */
+static struct sn_edge_table* sn_edges_alloc(uint32_t groups) {
+  size_t num_slots = (size_t)groups * SN_GROUP_SIZE;
+  size_t ctrl_size = sizeof(struct sn_edge_table) + num_slots;
+  struct sn_edge_table *t;
+
+  if(posix_memalign((void **)&t, N2N_SN_CACHELINE_SIZE, ctrl_size + num_slots * sizeof(struct sn_edge)) != 0)
+    return(NULL);
+
+  memset(t, 0, sizeof(struct sn_edge_table));
+  memset(t->ctrl, SN_CTRL_EMPTY, num_slots);
+  t->mask = groups - 1;
+  t->slots = (struct sn_edge*)((uint8_t*)t + ctrl_size);
+
+  return(t);
+}
+
+/** Find the edge key without a lock: the slot may be deleted meanwhile, but
+ *  not reused for another edge.
+ *
+ *  @return its slot, or NULL
+ */
+static struct sn_edge* sn_edges_find(const struct sn_edge_table * t, uint64_t key) {
+  uint64_t hash = sn_edge_hash(key);
+  uint8_t tag = (uint8_t)(hash >> 57);
+  uint32_t g = (uint32_t)hash & t->mask, step;
+
+  /* Triangular probing visits each group once */
+  for(step=1; step<=t->mask+1; step++) {
+    const uint8_t *group = &t->ctrl[g * SN_GROUP_SIZE];
+    uint32_t match = sn_group_match(group, tag);
+
+    /* The slots are written before their control bytes */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    while(match) {
+      struct sn_edge *e = &t->slots[g * SN_GROUP_SIZE + __builtin_ctz(match)];
+
+      if(e->mac == key)
+	return(e);
+
+      match &= match - 1;
+    }
+
+    if(sn_group_match(group, SN_CTRL_EMPTY))
+      break;
+
+    g = (g + step) & t->mask;
+  }
+
+  return(NULL);
+}
+
+/** Add the edge key, which is not in t, in a free slot of its probe
+ *  sequence. Called under the lock of the community, t having room. */
+static void sn_edges_put(struct sn_edge_table * t, uint64_t key, uint64_t sock, time_t now) {
+  uint64_t hash = sn_edge_hash(key);
+  uint32_t g = (uint32_t)hash & t->mask, step;
+
+  for(step=1; ; step++) {
+    uint32_t empty = sn_group_match(&t->ctrl[g * SN_GROUP_SIZE], SN_CTRL_EMPTY);
+
+    if(empty) {
+      uint32_t i = g * SN_GROUP_SIZE + __builtin_ctz(empty);
+
+      t->slots[i].mac = key;
+      t->slots[i].sock = sock;
+      t->slots[i].last_seen = now;
+      __atomic_store_n(&t->ctrl[i], (uint8_t)(hash >> 57), __ATOMIC_RELEASE);
+
+      t->used++;
+      __atomic_store_n(&t->num, t->num + 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    g = (g + step) & t->mask;
+  }
+}
+
+/** @return a copy of the edges of t, NULL for none, with room for num edges
+ *          up to half full, or NULL when out of memory */
+static struct sn_edge_table* sn_edges_rebuild(const struct sn_edge_table * t, uint32_t num) {
+  struct sn_edge_table *n;
+  uint32_t groups = 1, g;
+
+  while(groups * SN_GROUP_SIZE < 2 * num)
+    groups <<= 1;
+
+  if((n = sn_edges_alloc(groups)) == NULL)
+    return(NULL);
+
+  for(g=0; t && (g <= t->mask); g++) {
+    uint32_t full = sn_group_full(&t->ctrl[g * SN_GROUP_SIZE]);
+
+    while(full) {
+      const struct sn_edge *e = &t->slots[g * SN_GROUP_SIZE + __builtin_ctz(full)];
+
+      sn_edges_put(n, e->mac, e->sock, e->last_seen);
+      full &= full - 1;
+    }
+  }
+
+  return(n);
+}
+
+/** Replace the edges of comm by n. Called under the lock of comm. */
+static void sn_edges_replace(n2n_sn_t * sss, struct sn_community * comm, struct sn_edge_table * n) {
+  struct sn_edge_table *old = comm->edges;
+
+  __atomic_store_n(&comm->edges, n, __ATOMIC_RELEASE);
+
+  if(old)
+    sn_retire(sss, old, free);
+}
+
+/** Delete the edges of t not seen since purge_before. Called under the lock
+ *  of the community.
+ *
+ *  @return the number of edges deleted
+ */
+static size_t sn_edges_purge(struct sn_edge_table * t, time_t purge_before) {
+  size_t num = 0;
+  uint32_t g;
+
+  for(g=0; g<=t->mask; g++) {
+    uint32_t full = sn_group_full(&t->ctrl[g * SN_GROUP_SIZE]);
+
+    while(full) {
+      uint32_t i = g * SN_GROUP_SIZE + __builtin_ctz(full);
+
+      if(t->slots[i].last_seen < purge_before) {
+	__atomic_store_n(&t->ctrl[i], SN_CTRL_DELETED, __ATOMIC_RELAXED);
+	num++;
+      }
+
+      full &= full - 1;
+    }
+  }
+
+  __atomic_store_n(&t->num, t->num - num, __ATOMIC_RELAXED);
+
+  return(num);
+}
+
 /** Update the edge table with the details of the edge which contacted the
- *  supernode. */
+ *  supernode. Called under the lock of comm.
+ *
+ *  @return 0 on success, -1 when out of memory or the socket is not IPv4
+ */
 static int update_edge(n2n_sn_t * sss,
 		       const n2n_mac_t edgeMac,
 		       struct sn_community *comm,
@@ -134,31 +615,44 @@ static int update_edge(n2n_sn_t * sss,
 		       time_t now) {
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
-  struct peer_info *  scan;
+  struct sn_edge *    scan = NULL;
+  uint64_t            key = sn_mac_key(edgeMac), sock = sn_sock_key(sender_sock);
 
   traceEvent(TRACE_DEBUG, "update_edge for %s [%s]",
 	     macaddr_str(mac_buf, edgeMac),
 	     sock_to_cstr(sockbuf, sender_sock));
 
-  HASH_FIND_PEER(comm->edges, edgeMac, scan);
+  if(sock == 0)
+    return(-1);
+
+  if(comm->edges)
+    scan = sn_edges_find(comm->edges, key);
 
   if(NULL == scan) {
       /* Not known */
+      struct sn_edge_table *t = comm->edges;
+
+      if((t == NULL) || ((t->used + 1) * 8 > (t->mask + 1) * SN_GROUP_SIZE * 7)) {
+	/* Over 7/8 full with the deleted slots, the edges move to a new table */
+	if((t = sn_edges_rebuild(t, t ? (t->num + 1) : 1)) == NULL) {
+	  traceEvent(TRACE_ERROR, "Out of memory, cannot add %s to %s",
+		     macaddr_str(mac_buf, edgeMac), comm->community);
+	  return(-1);
+	}
 
-      scan = (struct peer_info*)calloc(1, sizeof(struct peer_info)); /* deallocated in purge_expired_registrations */
-
-      memcpy(&(scan->mac_addr), edgeMac, sizeof(n2n_mac_t));
-      memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
+	sn_edges_replace(sss, comm, t);
+      }
 
-      HASH_ADD_PEER(comm->edges, scan);
+      sn_edges_put(t, key, sock, now);
 
       traceEvent(TRACE_INFO, "update_edge created   %s ==> %s",
 		 macaddr_str(mac_buf, edgeMac),
 		 sock_to_cstr(sockbuf, sender_sock));
     } else  {
       /* Known */
-      if(!sock_equal(sender_sock, &(scan->sock))) {
-	  memcpy(&(scan->sock), sender_sock, sizeof(n2n_sock_t));
+      if(scan->sock != sock) {
+	  /* Read by the relay path meanwhile */
+	  __atomic_store_n(&scan->sock, sock, __ATOMIC_RELAXED);
 
 	  traceEvent(TRACE_INFO, "update_edge updated   %s ==> %s",
 		     macaddr_str(mac_buf, edgeMac),
@@ -171,18 +665,256 @@ static int update_edge(n2n_sn_t * sss,
 		     sock_to_cstr(sockbuf, sender_sock));
         }
 
+      scan->last_seen = now;
     }
 
-  scan->last_seen = now;
   return 0;
 }
 
+/** Publish a copy of the communities for the relay path. Called under
+ *  comm_lock each time one is added or removed. */
+static void sn_publish_communities(n2n_sn_t * sss) {
+  struct sn_comm_table *t, *old;
+  struct sn_community *comm, *tmp;
+  unsigned int num = HASH_COUNT(sss->communities), size = 8;
+
+  while(size < 2 * num)
+    size <<= 1;
+
+  t = (struct sn_comm_table*)calloc(1, sizeof(struct sn_comm_table) + size * sizeof(struct sn_community*));
+
+  if(t == NULL) {
+    traceEvent(TRACE_ERROR, "Out of memory, the communities are not updated");
+    return;
+  }
+
+  t->mask = size - 1;
+
+  HASH_ITER(hh, sss->communities, comm, tmp) {
+    uint32_t i = sn_community_hash(comm->community) & t->mask;
+
+    while(t->slots[i] != NULL)
+      i = (i + 1) & t->mask;
+
+    t->slots[i] = comm;
+  }
+
+  old = sss->comm_table;
+  __atomic_store_n(&sss->comm_table, t, __ATOMIC_RELEASE);
+
+  if(old)
+    sn_retire(sss, old, free);
+}
+
+/** @return the published community called name, valid until the next
+ *          quiescent state, or NULL */
+static struct sn_community* sn_find_community(n2n_sn_t * sss, const char * name) {
+  struct sn_comm_table *t = __atomic_load_n(&sss->comm_table, __ATOMIC_ACQUIRE);
+  uint32_t i;
+
+  if(t == NULL)
+    return(NULL);
+
+  for(i = sn_community_hash(name) & t->mask; t->slots[i] != NULL; i = (i + 1) & t->mask) {
+    if(strncmp(t->slots[i]->community, name, N2N_COMMUNITY_SIZE) == 0)
+      return(t->slots[i]);
+  }
+
+  return(NULL);
+}
+
+/** Look up the edge mac of comm for the relay path, without a lock.
+ *
+ *  @return 1 when found, its socket in sock, 0 otherwise
+ */
+static int sn_find_edge(const struct sn_community * comm, const n2n_mac_t mac, n2n_sock_t * sock) {
+  const struct sn_edge_table *t = __atomic_load_n(&comm->edges, __ATOMIC_ACQUIRE);
+  const struct sn_edge *e;
+
+  if((t == NULL) || ((e = sn_edges_find(t, sn_mac_key(mac))) == NULL))
+    return(0);
+
+  sn_sock_from_key(__atomic_load_n(&e->sock, __ATOMIC_RELAXED), sock);
+  return(1);
+}
+
+/** Add the community called name, unless another worker just did.
+ *
+ *  @return the community, or NULL when out of memory
+ */
+static struct sn_community* sn_add_community(n2n_sn_t * sss, const char * name) {
+  struct sn_community *comm;
+  char community[N2N_COMMUNITY_SIZE];
+
+  strncpy(community, name, N2N_COMMUNITY_SIZE-1);
+  community[N2N_COMMUNITY_SIZE-1] = '\0';
+
+  sn_lock(sss, &sss->comm_lock);
+
+  HASH_FIND_COMMUNITY(sss->communities, community, comm);
+
+  if(comm == NULL) {
+    comm = calloc(1, sizeof(struct sn_community));
+
+    if(comm) {
+      memcpy(comm->community, community, N2N_COMMUNITY_SIZE);
+#ifdef N2N_SN_HAVE_WORKERS
+      pthread_mutex_init(&comm->lock, NULL);
+#endif
+      HASH_ADD_STR(sss->communities, community, comm);
+      sn_publish_communities(sss);
+
+      traceEvent(TRACE_INFO, "New community: %s", comm->community);
+    }
+  }
+
+  sn_unlock(sss, &sss->comm_lock);
+
+  return(comm);
+}
+
+/** Purge the expired registrations of the communities, and the idle
+ *  communities unless they were loaded from a file. Called by the main
+ *  loop. */
+static void sn_purge(n2n_sn_t * sss, time_t now) {
+  struct sn_community *comm, *tmp;
+
+  sn_lock(sss, &sss->comm_lock);
+
+  HASH_ITER(hh, sss->communities, comm, tmp) {
+    struct sn_edge_table *t;
+
+    sn_lock(sss, &comm->lock);
+    t = comm->edges;
+
+    if(t && (now - comm->last_purge >= PURGE_REGISTRATION_FREQUENCY)) {
+      size_t num = sn_edges_purge(t, now - REGISTRATION_TIMEOUT);
+
+      comm->last_purge = now;
+      traceEvent(TRACE_DEBUG, "Removed %u registrations from %s", (unsigned int)num, comm->community);
+
+      /* The deleted slots are only reused by a rebuild */
+      if((num > 0) && (2 * (t->used - t->num) > t->used)) {
+	struct sn_edge_table *n = sn_edges_rebuild(t, t->num);
+
+	if(n)
+	  sn_edges_replace(sss, comm, n);
+      }
+    }
+
+    if(((comm->edges == NULL) || (comm->edges->num == 0)) && (!sss->lock_communities)) {
+      traceEvent(TRACE_INFO, "Purging idle community %s", comm->community);
+
+      /* A registration that found it meanwhile adds it again */
+      comm->dead = 1;
+      HASH_DEL(sss->communities, comm);
+      sn_publish_communities(sss);
+      sn_unlock(sss, &comm->lock);
+      sn_retire(sss, comm, free_community);
+    } else
+      sn_unlock(sss, &comm->lock);
+  }
+
+  sn_unlock(sss, &sss->comm_lock);
+}
+
+
+#ifdef N2N_HAVE_MMSG
+/** Set up the buffers of the batched relay loop, see sn_recv_batch().
+ *
+ *  @return 0 on success, -1 when out of memory
+ */
+static int sn_init_batch(struct sn_worker * w) {
+  struct sn_batch *b;
+  unsigned int i;
+
+  if((b = calloc(1, sizeof(struct sn_batch))) == NULL)
+    return(-1);
+
+  for(i=0; i<N2N_SN_BATCH_MAX; i++) {
+    b->rx_iovs[i].iov_base = &b->rx_bufs[i][N2N_SN_HEADROOM]; /* room to relay in place */
+    b->rx_iovs[i].iov_len = N2N_SN_PKTBUF_SIZE;
+    b->rx_msgs[i].msg_hdr.msg_name = &b->rx_addrs[i];
+    b->rx_msgs[i].msg_hdr.msg_iov = &b->rx_iovs[i];
+    b->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  for(i=0; i<N2N_SN_TX_MAX; i++) {
+    b->tx_msgs[i].msg_hdr.msg_name = &b->tx_addrs[i];
+    b->tx_msgs[i].msg_hdr.msg_namelen = sizeof(b->tx_addrs[i]);
+    b->tx_msgs[i].msg_hdr.msg_iov = &b->tx_iovs[i];
+    b->tx_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+#ifdef SO_RXQ_OVFL
+  {
+    /* Each datagram then tells how many the socket dropped so far */
+    int one = 1;
+
+    if(setsockopt(w->sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+      traceEvent(TRACE_INFO, "SO_RXQ_OVFL not supported, the kernel drops will not be counted");
+  }
+#endif
+
+  w->batch = b;
+  return(0);
+}
+
+/** Send the relayed copies queued by sn_queue_tx() with as few sendmmsg()
+ *  calls as possible. A copy that is refused is dropped. */
+static void sn_flush_tx(struct sn_worker * w) {
+  struct sn_batch *b = w->batch;
+  unsigned int sent = 0;
+  int rc;
+
+  while(sent < b->tx_count) {
+    rc = sendmmsg(w->sock, &b->tx_msgs[sent], b->tx_count - sent, 0 /*flags*/);
+
+    if(rc > 0) {
+      ++(w->stats.tx_batches);
+      w->stats.tx_batched += rc;
+      sent += rc;
+    } else if((rc < 0) && (errno == EINTR))
+      continue;
+    else {
+      /* The first one could not be sent, go on with the others */
+      ++(w->stats.tx_dropped);
+      ++(w->stats.errors);
+      traceEvent(TRACE_DEBUG, "sendmmsg failed (%d) %s", errno, strerror(errno));
+      sent++;
+    }
+  }
+
+  b->tx_count = 0;
+}
 
-/** Send a datagram to the destination embodied in a n2n_sock_t.
+/** Queue pktsize bytes at pktbuf, which must stay put until sn_flush_tx(),
+ *  towards udpsock.
+ *
+ *  @return pktsize, the errors are only known when sent
+ */
+static ssize_t sn_queue_tx(struct sn_worker * w, const struct sockaddr_in * udpsock,
+			   const uint8_t * pktbuf, size_t pktsize) {
+  struct sn_batch *b = w->batch;
+
+  if(b->tx_count == N2N_SN_TX_MAX)
+    sn_flush_tx(w);
+
+  memcpy(&b->tx_addrs[b->tx_count], udpsock, sizeof(*udpsock));
+  b->tx_iovs[b->tx_count].iov_base = (void*)pktbuf;
+  b->tx_iovs[b->tx_count].iov_len = pktsize;
+  b->tx_count++;
+
+  return(pktsize);
+}
+#endif
+
+/** Send a datagram to the destination embodied in a n2n_sock_t. While a
+ *  receive batch is processed it is only queued, see sn_queue_tx().
  *
  *  @return -1 on error otherwise number of bytes sent
  */
-static ssize_t sendto_sock(n2n_sn_t * sss,
+static ssize_t sendto_sock(struct sn_worker * w,
                            const n2n_sock_t * sock,
                            const uint8_t * pktbuf,
                            size_t pktsize)
@@ -201,7 +933,12 @@ static ssize_t sendto_sock(n2n_sn_t * sss,
 		 pktsize,
 		 sock_to_cstr(sockbuf, sock));
 
-      return sendto(sss->sock, pktbuf, pktsize, 0,
+#ifdef N2N_HAVE_MMSG
+      if(w->batch)
+	return sn_queue_tx(w, &udpsock, pktbuf, pktsize);
+#endif
+
+      return sendto(w->sock, pktbuf, pktsize, 0,
 		    (const struct sockaddr *)&udpsock, sizeof(struct sockaddr_in));
     }
   else
@@ -212,46 +949,44 @@ static ssize_t sendto_sock(n2n_sn_t * sss,
     }
 }
 
-static int try_forward(n2n_sn_t * sss,
+static int try_forward(struct sn_worker * w,
 		       const n2n_common_t * cmn,
 		       const n2n_mac_t dstMac,
 		       const uint8_t * pktbuf,
 		       size_t pktsize)
 {
-  struct peer_info *  scan;
+  n2n_sock_t          sock;
   struct sn_community *community;
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
 
-  HASH_FIND_COMMUNITY(sss->communities, (char*)cmn->community, community);
+  community = sn_find_community(w->sss, (char*)cmn->community);
 
   if(!community) {
     traceEvent(TRACE_DEBUG, "try_forward unknown community %s", cmn->community);
     return(-1);
   }
 
-  HASH_FIND_PEER(community->edges, dstMac, scan);
-
-  if(NULL != scan)
+  if(sn_find_edge(community, dstMac, &sock))
     {
       int data_sent_len;
-      data_sent_len = sendto_sock(sss, &(scan->sock), pktbuf, pktsize);
+      data_sent_len = sendto_sock(w, &sock, pktbuf, pktsize);
 
       if(data_sent_len == pktsize)
         {
-	  ++(sss->stats.fwd);
+	  ++(w->stats.fwd);
 	  traceEvent(TRACE_DEBUG, "unicast %lu to [%s] %s",
 		     pktsize,
-		     sock_to_cstr(sockbuf, &(scan->sock)),
-		     macaddr_str(mac_buf, scan->mac_addr));
+		     sock_to_cstr(sockbuf, &sock),
+		     macaddr_str(mac_buf, dstMac));
         }
       else
         {
-	  ++(sss->stats.errors);
+	  ++(w->stats.errors);
 	  traceEvent(TRACE_ERROR, "unicast %lu to [%s] %s FAILED (%d: %s)",
 		     pktsize,
-		     sock_to_cstr(sockbuf, &(scan->sock)),
-		     macaddr_str(mac_buf, scan->mac_addr),
+		     sock_to_cstr(sockbuf, &sock),
+		     macaddr_str(mac_buf, dstMac),
 		     errno, strerror(errno));
         }
     }
@@ -272,46 +1007,63 @@ static int try_forward(n2n_sn_t * sss,
  *  This will send the exact same datagram to zero or more edges registered to
  *  the supernode.
  */
-static int try_broadcast(n2n_sn_t * sss,
+static int try_broadcast(struct sn_worker * w,
 			 const n2n_common_t * cmn,
 			 const n2n_mac_t srcMac,
 			 const uint8_t * pktbuf,
 			 size_t pktsize)
 {
-  struct peer_info *scan, *tmp;
+  const struct sn_edge_table *edges;
   struct sn_community *community;
   macstr_t            mac_buf;
   n2n_sock_str_t      sockbuf;
+  n2n_mac_t           mac;
+  n2n_sock_t          sock;
+  uint64_t            src = sn_mac_key(srcMac);
+  uint32_t            g;
 
   traceEvent(TRACE_DEBUG, "try_broadcast");
 
-  HASH_FIND_COMMUNITY(sss->communities, (char*)cmn->community, community);
+  community = sn_find_community(w->sss, (char*)cmn->community);
 
   if(community) {
-    HASH_ITER(hh, community->edges, scan, tmp) {
-      if(memcmp(srcMac, scan->mac_addr, sizeof(n2n_mac_t)) != 0) {
-	  /* REVISIT: exclude if the destination socket is where the packet came from. */
-	  int data_sent_len;
-
-	  data_sent_len = sendto_sock(sss, &(scan->sock), pktbuf, pktsize);
-
-	  if(data_sent_len != pktsize)
-            {
-	      ++(sss->stats.errors);
-	      traceEvent(TRACE_WARNING, "multicast %lu to [%s] %s failed %s",
-			 pktsize,
-			 sock_to_cstr(sockbuf, &(scan->sock)),
-			 macaddr_str(mac_buf, scan->mac_addr),
-			 strerror(errno));
-            }
-	  else
-            {
-	      ++(sss->stats.broadcast);
-	      traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
-			 pktsize,
-			 sock_to_cstr(sockbuf, &(scan->sock)),
-			 macaddr_str(mac_buf, scan->mac_addr));
-            }
+    edges = __atomic_load_n(&community->edges, __ATOMIC_ACQUIRE);
+
+    for(g=0; edges && (g <= edges->mask); g++) {
+      uint32_t full = sn_group_full(&edges->ctrl[g * SN_GROUP_SIZE]);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      for(; full; full &= full - 1) {
+	const struct sn_edge *scan = &edges->slots[g * SN_GROUP_SIZE + __builtin_ctz(full)];
+	/* REVISIT: exclude if the destination socket is where the packet came from. */
+	int data_sent_len;
+
+	if(scan->mac == src)
+	  continue;
+
+	sn_mac_from_key(scan->mac, mac);
+	sn_sock_from_key(__atomic_load_n(&scan->sock, __ATOMIC_RELAXED), &sock);
+
+	data_sent_len = sendto_sock(w, &sock, pktbuf, pktsize);
+
+	if(data_sent_len != pktsize)
+	  {
+	    ++(w->stats.errors);
+	    traceEvent(TRACE_WARNING, "multicast %lu to [%s] %s failed %s",
+		       pktsize,
+		       sock_to_cstr(sockbuf, &sock),
+		       macaddr_str(mac_buf, mac),
+		       strerror(errno));
+	  }
+	else
+	  {
+	    ++(w->stats.broadcast);
+	    traceEvent(TRACE_DEBUG, "multicast %lu to [%s] %s",
+		       pktsize,
+		       sock_to_cstr(sockbuf, &sock),
+		       macaddr_str(mac_buf, mac));
+	  }
       }
     }
   } else
@@ -322,6 +1074,31 @@ static int try_broadcast(n2n_sn_t * sss,
 }
 
 
+/** Add up the stats of the workers into sum. */
+static void sn_sum_stats(const n2n_sn_t * sss, sn_stats_t * sum) {
+  int i;
+
+  memset(sum, 0, sizeof(*sum));
+
+  for(i=0; i<sss->num_workers; i++) {
+    const sn_stats_t *st = &sss->workers[i].stats;
+
+    sum->errors += st->errors;
+    sum->reg_super += st->reg_super;
+    sum->reg_super_nak += st->reg_super_nak;
+    sum->fwd += st->fwd;
+    sum->broadcast += st->broadcast;
+    sum->last_fwd = MAX(sum->last_fwd, st->last_fwd);
+    sum->last_reg_super = MAX(sum->last_reg_super, st->last_reg_super);
+    sum->rx_batches += st->rx_batches;
+    sum->rx_batched += st->rx_batched;
+    sum->rx_dropped += st->rx_dropped;
+    sum->tx_batches += st->tx_batches;
+    sum->tx_batched += st->tx_batched;
+    sum->tx_dropped += st->tx_dropped;
+  }
+}
+
 static int process_mgmt(n2n_sn_t * sss,
 			const struct sockaddr_in * sender_sock,
 			const uint8_t * mgmt_buf,
@@ -332,18 +1109,29 @@ static int process_mgmt(n2n_sn_t * sss,
   size_t ressize=0;
   uint32_t num_edges=0;
   ssize_t r;
-  struct sn_community *community, *tmp;
+  const struct sn_comm_table *communities;
+  sn_stats_t stats;
+  unsigned int i;
 
   traceEvent(TRACE_DEBUG, "process_mgmt");
 
+  sn_sum_stats(sss, &stats);
+
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "----------------\n");
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "uptime    %lu\n", (now - sss->start_time));
 
-  HASH_ITER(hh, sss->communities, community, tmp) {
-    num_edges += HASH_COUNT(community->edges);
+  /* Like the relay path, the main loop is a worker */
+  communities = __atomic_load_n(&sss->comm_table, __ATOMIC_ACQUIRE);
+
+  for(i=0; communities && (i <= communities->mask); i++) {
+    const struct sn_edge_table *edges;
+
+    if(communities->slots[i]
+       && ((edges = __atomic_load_n(&communities->slots[i]->edges, __ATOMIC_ACQUIRE)) != NULL))
+      num_edges += __atomic_load_n(&edges->num, __ATOMIC_RELAXED);
   }
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
@@ -352,31 +1140,47 @@ static int process_mgmt(n2n_sn_t * sss,
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "errors    %u\n",
-		      (unsigned int)sss->stats.errors);
+		      (unsigned int)stats.errors);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "reg_sup   %u\n",
-		      (unsigned int)sss->stats.reg_super);
+		      (unsigned int)stats.reg_super);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "reg_nak   %u\n",
-		      (unsigned int)sss->stats.reg_super_nak);
+		      (unsigned int)stats.reg_super_nak);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "fwd       %u\n",
-		      (unsigned int) sss->stats.fwd);
+		      (unsigned int) stats.fwd);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "broadcast %u\n",
-		      (unsigned int) sss->stats.broadcast);
+		      (unsigned int) stats.broadcast);
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "last fwd  %lu sec ago\n",
-		      (long unsigned int)(now - sss->stats.last_fwd));
+		      (long unsigned int)(now - stats.last_fwd));
 
   ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
 		      "last reg  %lu sec ago\n",
-		      (long unsigned int) (now - sss->stats.last_reg_super));
+		      (long unsigned int) (now - stats.last_reg_super));
+
+  if(sss->workers[0].batch) {
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"batch rx  %u pkts in %u calls (%.1f avg)\n",
+			(unsigned int)stats.rx_batched, (unsigned int)stats.rx_batches,
+			stats.rx_batches ? ((float)stats.rx_batched / stats.rx_batches) : 0);
+
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"batch tx  %u pkts in %u calls (%.1f avg)\n",
+			(unsigned int)stats.tx_batched, (unsigned int)stats.tx_batches,
+			stats.tx_batches ? ((float)stats.tx_batched / stats.tx_batches) : 0);
+
+    ressize += snprintf(resbuf+ressize, N2N_SN_PKTBUF_SIZE-ressize,
+			"dropped   rx %u tx %u\n",
+			(unsigned int)stats.rx_dropped, (unsigned int)stats.tx_dropped);
+  }
 
 
   r = sendto(sss->mgmt_sock, resbuf, ressize, 0/*flags*/,
@@ -384,7 +1188,7 @@ static int process_mgmt(n2n_sn_t * sss,
 
   if(r <= 0)
     {
-      ++(sss->stats.errors);
+      ++(sss->workers[0].stats.errors);
       traceEvent(TRACE_ERROR, "process_mgmt : sendto failed. %s", strerror(errno));
     }
 
@@ -405,9 +1209,10 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
     return -1;
   }
 
+  /* Still at start up, before the workers */
   HASH_ITER(hh, sss->communities, s, tmp) {
     HASH_DEL(sss->communities, s);
-    free(s);
+    free_community(s);
   }
 
   while((line = fgets(buffer, sizeof(buffer), fd)) != NULL) {
@@ -430,6 +1235,9 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
     if(s != NULL) {
       strncpy((char*)s->community, line, N2N_COMMUNITY_SIZE-1);
       s->community[N2N_COMMUNITY_SIZE-1] = '\0';
+#ifdef N2N_SN_HAVE_WORKERS
+      pthread_mutex_init(&s->lock, NULL);
+#endif
       HASH_ADD_STR(sss->communities, community, s);
       num_communities++;
       traceEvent(TRACE_INFO, "Added allowed community '%s' [total: %u]",
@@ -439,6 +1247,10 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
 
   fclose(fd);
 
+  free(sss->comm_table);
+  sss->comm_table = NULL;
+  sn_publish_communities(sss);
+
   traceEvent(TRACE_NORMAL, "Loaded %u communities from %s",
 	     num_communities, path);
 
@@ -448,15 +1260,68 @@ static int load_allowed_sn_community(n2n_sn_t *sss, char *path) {
   return(0);
 }
 
-/** Examine a datagram and determine what to do with it.
+/** Turn the PACKET or REGISTER from an edge at udp_buf into one relayed by
+ *  the supernode, in place: the socket of the sender is written at sock_idx,
+ *  in place of the one the header may have, with N2N_FLAGS_SOCKET,
+ *  N2N_FLAGS_FROM_SUPERNODE and the ttl of cmn. Only the sock_idx bytes of
+ *  the header in front of the socket move, into the N2N_SN_HEADROOM bytes
+ *  before udp_buf; the payload stays where it is.
  *
+ *  @return the start of the datagram, its length in *udp_size, or NULL when
+ *          it is too short for its header
  */
-static int process_udp(n2n_sn_t * sss,
+static uint8_t* stamp_sender_sock(uint8_t * udp_buf,
+				  size_t * udp_size,
+				  size_t sock_idx,
+				  const n2n_common_t * cmn,
+				  const struct sockaddr_in * sender_sock)
+{
+  n2n_sock_t          sock;
+  size_t              old_len = 0, new_len = 4 + IPV4_SIZE, idx;
+  uint8_t *           start;
+
+  if(cmn->flags & N2N_FLAGS_SOCKET) {
+    /* The top bit of the family tells IPv6 */
+    if(*udp_size <= sock_idx)
+      return(NULL);
+
+    old_len = 4 + ((udp_buf[sock_idx] & 0x80) ? IPV6_SIZE : IPV4_SIZE);
+  }
+
+  if(*udp_size < sock_idx + old_len)
+    return(NULL);
+
+  sock.family = AF_INET;
+  sock.port = ntohs(sender_sock->sin_port);
+  memcpy(sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
+
+  start = udp_buf + old_len - new_len;
+  memmove(start, udp_buf, sock_idx);
+
+  idx = 1;
+  encode_uint8(start, &idx, cmn->ttl);
+  encode_uint16(start, &idx, (cmn->pc & N2N_FLAGS_TYPE_MASK)
+		| ((cmn->flags | N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE) & N2N_FLAGS_BITS_MASK));
+
+  idx = sock_idx;
+  encode_sock(start, &idx, &sock);
+
+  *udp_size = *udp_size + new_len - old_len;
+
+  return(start);
+}
+
+/** Examine a datagram and determine what to do with it. There must be
+ *  N2N_SN_HEADROOM bytes before udp_buf to relay the messages in place.
+ *
+ */
+static int process_udp(struct sn_worker * w,
 		       const struct sockaddr_in * sender_sock,
-		       const uint8_t * udp_buf,
+		       uint8_t * udp_buf,
 		       size_t udp_size,
 		       time_t now)
 {
+  n2n_sn_t *          sss = w->sss;
   n2n_common_t        cmn; /* common fields in the packet header */
   size_t              rem;
   size_t              idx;
@@ -502,17 +1367,15 @@ static int process_udp(n2n_sn_t * sss,
   {
     /* PACKET from one edge to another edge via supernode. */
 
-    /* pkt will be modified in place and recoded to an output of potentially
-     * different size due to addition of the socket.*/
+    /* The header gets the socket of the sender in place, growing into the
+     * headroom, and the payload is relayed where it is. */
     n2n_PACKET_t                    pkt;
-    n2n_common_t                    cmn2;
-    uint8_t                         encbuf[N2N_SN_PKTBUF_SIZE];
-    size_t                          encx=0;
+    size_t                          encx=udp_size;
     int                             unicast; /* non-zero if unicast */
-    const uint8_t *                 rec_buf; /* either udp_buf or encbuf */
+    const uint8_t *                 rec_buf = udp_buf;
 
 
-    sss->stats.last_fwd=now;
+    w->stats.last_fwd=now;
     decode_PACKET(&pkt, &cmn, udp_buf, &rem, &idx);
 
     unicast = (0 == is_multi_broadcast(pkt.dstMac));
@@ -524,37 +1387,24 @@ static int process_udp(n2n_sn_t * sss,
 	       (from_supernode?"from sn":"local"));
 
     if(!from_supernode) {
-      memcpy(&cmn2, &cmn, sizeof(n2n_common_t));
-
       /* We are going to add socket even if it was not there before */
-      cmn2.flags |= N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
-
-      pkt.sock.family = AF_INET;
-      pkt.sock.port = ntohs(sender_sock->sin_port);
-      memcpy(pkt.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
-
-      rec_buf = encbuf;
-
-      /* Re-encode the header. */
-      encode_PACKET(encbuf, &encx, &cmn2, &pkt);
-
-      /* Copy the original payload unchanged */
-      encode_buf(encbuf, &encx, (udp_buf + idx), (udp_size - idx));
+      if((rec_buf = stamp_sender_sock(udp_buf, &encx, N2N_PACKET_SOCK_OFFSET,
+				      &cmn, sender_sock)) == NULL) {
+	traceEvent(TRACE_WARNING, "Dropping a truncated PACKET");
+	return -1;
+      }
     } else {
       /* Already from a supernode. Nothing to modify, just pass to
        * destination. */
 
       traceEvent(TRACE_DEBUG, "Rx PACKET fwd unmodified");
-
-      rec_buf = udp_buf;
-      encx = udp_size;
     }
 
     /* Common section to forward the final product. */
     if(unicast)
-      try_forward(sss, &cmn, pkt.dstMac, rec_buf, encx);
+      try_forward(w, &cmn, pkt.dstMac, rec_buf, encx);
     else
-      try_broadcast(sss, &cmn, pkt.srcMac, rec_buf, encx);
+      try_broadcast(w, &cmn, pkt.srcMac, rec_buf, encx);
     break;
   }
   case MSG_TYPE_REGISTER:
@@ -562,13 +1412,11 @@ static int process_udp(n2n_sn_t * sss,
     /* Forwarding a REGISTER from one edge to the next */
 
     n2n_REGISTER_t                  reg;
-    n2n_common_t                    cmn2;
-    uint8_t                         encbuf[N2N_SN_PKTBUF_SIZE];
-    size_t                          encx=0;
+    size_t                          encx=udp_size;
     int                             unicast; /* non-zero if unicast */
-    const uint8_t *                 rec_buf; /* either udp_buf or encbuf */
+    const uint8_t *                 rec_buf = udp_buf;
 
-    sss->stats.last_fwd=now;
+    w->stats.last_fwd=now;
     decode_REGISTER(&reg, &cmn, udp_buf, &rem, &idx);
 
     unicast = (0 == is_multi_broadcast(reg.dstMac));
@@ -580,31 +1428,19 @@ static int process_udp(n2n_sn_t * sss,
 		 ((cmn.flags & N2N_FLAGS_FROM_SUPERNODE)?"from sn":"local"));
 
       if(0 == (cmn.flags & N2N_FLAGS_FROM_SUPERNODE)) {
-	memcpy(&cmn2, &cmn, sizeof(n2n_common_t));
-
-	/* We are going to add socket even if it was not there before */
-	cmn2.flags |= N2N_FLAGS_SOCKET | N2N_FLAGS_FROM_SUPERNODE;
-
-	reg.sock.family = AF_INET;
-	reg.sock.port = ntohs(sender_sock->sin_port);
-	memcpy(reg.sock.addr.v4, &(sender_sock->sin_addr.s_addr), IPV4_SIZE);
-
-	rec_buf = encbuf;
-
-	/* Re-encode the header. */
-	encode_REGISTER(encbuf, &encx, &cmn2, &reg);
-
-	/* Copy the original payload unchanged */
-	encode_buf(encbuf, &encx, (udp_buf + idx), (udp_size - idx));
-      } else {
-	/* Already from a supernode. Nothing to modify, just pass to
-	 * destination. */
-
-	rec_buf = udp_buf;
-	encx = udp_size;
+	/* We are going to add socket even if it was not there before. The
+	 * trailer after it, if any, stays as it is. */
+	if((rec_buf = stamp_sender_sock(udp_buf, &encx, N2N_REGISTER_SOCK_OFFSET,
+					&cmn, sender_sock)) == NULL) {
+	  traceEvent(TRACE_WARNING, "Dropping a truncated REGISTER");
+	  return -1;
+	}
       }
 
-      try_forward(sss, &cmn, reg.dstMac, rec_buf, encx); /* unicast only */
+      /* Otherwise already from a supernode: nothing to modify, just pass to
+       * destination. */
+
+      try_forward(w, &cmn, reg.dstMac, rec_buf, encx); /* unicast only */
     } else
       traceEvent(TRACE_ERROR, "Rx REGISTER with multicast destination");
     break;
@@ -622,11 +1458,11 @@ static int process_udp(n2n_sn_t * sss,
     struct sn_community          *comm;
 
     /* Edge requesting registration with us.  */
-    sss->stats.last_reg_super=now;
-    ++(sss->stats.reg_super);
+    w->stats.last_reg_super=now;
+    ++(w->stats.reg_super);
     decode_REGISTER_SUPER(&reg, &cmn, udp_buf, &rem, &idx);
 
-    HASH_FIND_COMMUNITY(sss->communities, (char*)cmn.community, comm);
+    comm = sn_find_community(sss, (char*)cmn.community);
 
     /*
       Before we move any further, we need to check if the requested
@@ -634,16 +1470,22 @@ static int process_udp(n2n_sn_t * sss,
       not report any message back to the edge to hide the supernode
       existance (better from the security standpoint)
     */
-    if(!comm && !sss->lock_communities) {
-      comm = calloc(1, sizeof(struct sn_community));
+    for(;;) {
+      if(!comm && !sss->lock_communities)
+	comm = sn_add_community(sss, (char*)cmn.community);
 
-      if(comm) {
-	strncpy(comm->community, (char*)cmn.community, N2N_COMMUNITY_SIZE-1);
-	comm->community[N2N_COMMUNITY_SIZE-1] = '\0';
-	HASH_ADD_STR(sss->communities, community, comm);
+      if(!comm)
+	break;
 
-	traceEvent(TRACE_INFO, "New community: %s", comm->community);
-      }
+      /* The registrations of a community are serialised */
+      sn_lock(sss, &comm->lock);
+
+      if(!comm->dead)
+	break;
+
+      /* Purged as idle meanwhile, add it again */
+      sn_unlock(sss, &comm->lock);
+      comm = NULL;
     }
 
     if(comm) {
@@ -668,10 +1510,11 @@ static int process_udp(n2n_sn_t * sss,
 		 sock_to_cstr(sockbuf, &(ack.sock)));
 
       update_edge(sss, reg.edgeMac, comm, &(ack.sock), now);
+      sn_unlock(sss, &comm->lock);
 
       encode_REGISTER_SUPER_ACK(ackbuf, &encx, &cmn2, &ack);
 
-      sendto(sss->sock, ackbuf, encx, 0,
+      sendto(w->sock, ackbuf, encx, 0,
 	     (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in));
 
       traceEvent(TRACE_DEBUG, "Tx REGISTER_SUPER_ACK for %s [%s]",
@@ -695,13 +1538,12 @@ static int process_udp(n2n_sn_t * sss,
                 macaddr_str( mac_buf,  query.srcMac ),
                 macaddr_str( mac_buf2, query.targetMac ) );
 
-    HASH_FIND_COMMUNITY(sss->communities, (char*)cmn.community, community);
+    community = sn_find_community(sss, (char*)cmn.community);
 
     if(community) {
-      struct peer_info *scan;
-      HASH_FIND_PEER(community->edges, query.targetMac, scan);
+      n2n_sock_t sock;
 
-      if (scan) {
+      if (sn_find_edge(community, query.targetMac, &sock)) {
 	  cmn2.ttl = N2N_DEFAULT_TTL;
 	  cmn2.pc = n2n_peer_info;
 	  cmn2.flags = N2N_FLAGS_FROM_SUPERNODE;
@@ -709,11 +1551,11 @@ static int process_udp(n2n_sn_t * sss,
 
 	  pi.aflags = 0;
 	  memcpy( pi.mac, query.targetMac, sizeof(n2n_mac_t) );
-	  pi.sock = scan->sock;
+	  pi.sock = sock;
 
 	  encode_PEER_INFO( encbuf, &encx, &cmn2, &pi );
 
-	  sendto( sss->sock, encbuf, encx, 0,
+	  sendto( w->sock, encbuf, encx, 0,
 		  (struct sockaddr *)sender_sock, sizeof(struct sockaddr_in) );
 
 	  traceEvent( TRACE_DEBUG, "Tx PEER_INFO to %s",
@@ -734,6 +1576,62 @@ static int process_udp(n2n_sn_t * sss,
   return 0;
 }
 
+/** Set up the workers: worker 0 is the main loop, on sss->sock, the others
+ *  get sockets of their own bound to the same port.
+ *
+ *  @return 0 on success, -1 on failure
+ */
+static int sn_init_workers(n2n_sn_t * sss) {
+  size_t size = sss->num_workers * sizeof(struct sn_worker);
+  int i;
+
+  if(posix_memalign((void **)&sss->workers, N2N_SN_CACHELINE_SIZE, size) != 0) {
+    sss->workers = NULL;
+    traceEvent(TRACE_ERROR, "Cannot allocate memory");
+    return(-1);
+  }
+
+  memset(sss->workers, 0, size);
+
+  for(i=0; i<sss->num_workers; i++) {
+    struct sn_worker *w = &sss->workers[i];
+
+    w->sss = sss;
+    w->idx = i;
+    w->sock = (i == 0) ? sss->sock : -1;
+    w->rcu_epoch = SN_RCU_OFFLINE;
+  }
+
+#ifdef N2N_SN_HAVE_WORKERS
+  for(i=1; i<sss->num_workers; i++) {
+    struct sn_worker *w = &sss->workers[i];
+
+    if((w->sock = open_socket_reuseport(sss->lport, 1 /*bind ANY*/)) < 0) {
+      traceEvent(TRACE_ERROR, "Failed to open the socket of worker %d. %s", i, strerror(errno));
+      return(-1);
+    }
+  }
+
+  if(sss->num_workers > 1)
+    traceEvent(TRACE_NORMAL, "Relaying with %d workers on UDP %u", sss->num_workers, sss->lport);
+#endif
+
+#ifdef N2N_HAVE_MMSG
+  if(sss->batch_size > 1) {
+    for(i=0; i<sss->num_workers; i++) {
+      if(sn_init_batch(&sss->workers[i]) < 0) {
+	traceEvent(TRACE_ERROR, "Cannot allocate memory");
+	return(-1);
+      }
+    }
+
+    traceEvent(TRACE_NORMAL, "Relaying in batches of up to %u datagrams", sss->batch_size);
+  }
+#endif
+
+  return(0);
+}
+
 /* *************************************************** */
 
 /** Help message to print if the command line arguments are not valid. */
@@ -750,6 +1648,15 @@ static void help() {
   printf("[-f] ");
 #endif
   printf("[-v] ");
+#ifdef N2N_HAVE_MMSG
+  printf("[--batch <size>] ");
+#endif
+#ifdef N2N_SN_HAVE_WORKERS
+  printf("[--workers <n>] ");
+#endif
+#ifdef N2N_HAVE_TRACE_ASYNC
+  printf("[--async-log] ");
+#endif
   printf("\n\n");
 
   printf("-l <lport>\tSet UDP main listen port to <lport>\n");
@@ -758,6 +1665,17 @@ static void help() {
   printf("-f        \tRun in foreground.\n");
 #endif /* #if defined(N2N_HAVE_DAEMON) */
   printf("-v        \tIncrease verbosity. Can be used multiple times.\n");
+#ifdef N2N_HAVE_MMSG
+  printf("--batch <size>\tReceive up to <size> datagrams per recvmmsg call and send what they\n"
+	 "          \trelay with sendmmsg (1-%u, default %u, 1=off).\n", N2N_SN_BATCH_MAX, N2N_SN_BATCH_MAX);
+#endif
+#ifdef N2N_SN_HAVE_WORKERS
+  printf("--workers <n>\tRelay with <n> threads, each on a socket of its own bound to the\n"
+	 "          \tsame port with SO_REUSEPORT (1-%u, default 1).\n", N2N_SN_MAX_WORKERS);
+#endif
+#ifdef N2N_HAVE_TRACE_ASYNC
+  printf("--async-log\tWrite the log lines from a thread of their own.\n");
+#endif
   printf("-h        \tThis help message.\n");
   printf("\n");
 
@@ -794,6 +1712,42 @@ static int setOption(int optkey, char *_optarg, n2n_sn_t *sss) {
     setTraceLevel(getTraceLevel() + 1);
     break;
 
+#ifdef N2N_HAVE_TRACE_ASYNC
+  case '$': /* --async-log */
+    sss->async_log = 1;
+    break;
+#endif
+
+#ifdef N2N_HAVE_MMSG
+  case '[': /* --batch */
+    {
+      int size = atoi(_optarg);
+
+      if((size < 1) || (size > N2N_SN_BATCH_MAX)) {
+	traceEvent(TRACE_WARNING, "Batch size must be between 1 and %u", N2N_SN_BATCH_MAX);
+	return(-1);
+      }
+
+      sss->batch_size = size;
+      break;
+    }
+#endif
+
+#ifdef N2N_SN_HAVE_WORKERS
+  case ']': /* --workers */
+    {
+      int num = atoi(_optarg);
+
+      if((num < 1) || (num > N2N_SN_MAX_WORKERS)) {
+	traceEvent(TRACE_WARNING, "The number of workers must be between 1 and %u", N2N_SN_MAX_WORKERS);
+	return(-1);
+      }
+
+      sss->num_workers = num;
+      break;
+    }
+#endif
+
   default:
     traceEvent(TRACE_WARNING, "Unknown option -%c: Ignored.", (char)optkey);
     return(-1);
@@ -810,6 +1764,15 @@ static const struct option long_options[] = {
   { "local-port",      required_argument, NULL, 'l' },
   { "help"   ,         no_argument,       NULL, 'h' },
   { "verbose",         no_argument,       NULL, 'v' },
+#ifdef N2N_HAVE_TRACE_ASYNC
+  { "async-log",       no_argument,       NULL, '$' },
+#endif
+#ifdef N2N_HAVE_MMSG
+  { "batch",           required_argument, NULL, '[' },
+#endif
+#ifdef N2N_SN_HAVE_WORKERS
+  { "workers",         required_argument, NULL, ']' },
+#endif
   { NULL,              0,                 NULL,  0  }
 };
 
@@ -915,27 +1878,35 @@ static int loadFromFile(const char *path, n2n_sn_t *sss) {
 
 static void dump_registrations(int signo) {
   struct sn_community *comm, *ctmp;
-  struct peer_info *list, *tmp;
   char buf[32];
   time_t now = time(NULL);
   u_int num = 0;
+  uint32_t g;
 
   traceEvent(TRACE_NORMAL, "====================================");
 
   HASH_ITER(hh, sss_node.communities, comm, ctmp) {
+    const struct sn_edge_table *t = comm->edges;
+
     traceEvent(TRACE_NORMAL, "Dumping community: %s", comm->community);
 
-    HASH_ITER(hh, comm->edges, list, tmp) {
-      if(list->sock.family == AF_INET)
+    for(g=0; t && (g <= t->mask); g++) {
+      uint32_t full;
+
+      for(full = sn_group_full(&t->ctrl[g * SN_GROUP_SIZE]); full; full &= full - 1) {
+	const struct sn_edge *e = &t->slots[g * SN_GROUP_SIZE + __builtin_ctz(full)];
+	n2n_mac_t mac;
+	n2n_sock_t sock;
+
+	sn_mac_from_key(e->mac, mac);
+	sn_sock_from_key(e->sock, &sock);
+
 	traceEvent(TRACE_NORMAL, "[id: %u][MAC: %s][edge: %u.%u.%u.%u:%u][last seen: %u sec ago]",
-		   ++num, macaddr_str(buf, list->mac_addr),
-		   list->sock.addr.v4[0], list->sock.addr.v4[1], list->sock.addr.v4[2], list->sock.addr.v4[3],
-		   list->sock.port,
-		   now-list->last_seen);
-      else
-	traceEvent(TRACE_NORMAL, "[id: %u][MAC: %s][edge: IPv6:%u][last seen: %u sec ago]",
-		   ++num, macaddr_str(buf, list->mac_addr), list->sock.port,
-		   now-list->last_seen);
+		   ++num, macaddr_str(buf, mac),
+		   sock.addr.v4[0], sock.addr.v4[1], sock.addr.v4[2], sock.addr.v4[3],
+		   sock.port,
+		   now-e->last_seen);
+      }
     }
   }
 
@@ -1004,6 +1975,12 @@ int main(int argc, char * const argv[]) {
   }
 #endif /* #if defined(N2N_HAVE_DAEMON) */
 
+#ifdef N2N_HAVE_TRACE_ASYNC
+  /* After daemon(), which only keeps the calling thread */
+  if(sss_node.async_log)
+    traceAsyncStart();
+#endif
+
 #ifndef WIN32
   if((getuid() == 0) || (getgid() == 0))
     traceEvent(TRACE_WARNING, "Running as root is discouraged");
@@ -1011,6 +1988,11 @@ int main(int argc, char * const argv[]) {
 
   traceEvent(TRACE_DEBUG, "traceLevel is %d", getTraceLevel());
 
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss_node.num_workers > 1)
+    sss_node.sock = open_socket_reuseport(sss_node.lport, 1 /*bind ANY*/);
+  else
+#endif
   sss_node.sock = open_socket(sss_node.lport, 1 /*bind ANY*/);
   if(-1 == sss_node.sock) {
     traceEvent(TRACE_ERROR, "Failed to open main socket. %s", strerror(errno));
@@ -1026,6 +2008,9 @@ int main(int argc, char * const argv[]) {
   } else
     traceEvent(TRACE_NORMAL, "supernode is listening on UDP %u (management)", N2N_SN_MGMT_PORT);
 
+  if(sn_init_workers(&sss_node) < 0)
+    exit(-2);
+
   traceEvent(TRACE_NORMAL, "supernode started");
 
 #ifdef __linux__
@@ -1042,15 +2027,197 @@ int main(int argc, char * const argv[]) {
 }
 
 
+#ifdef N2N_HAVE_MMSG
+/** Drain the socket of w with recvmmsg(), batch_size datagrams at a time,
+ *  and send the copies relayed while processing each batch with
+ *  sendmmsg().
+ *
+ *  @return 0, or -1 when the socket failed
+ */
+static int sn_recv_batch(struct sn_worker * w, time_t now) {
+  struct sn_batch *b = w->batch;
+  int batch_size = w->sss->batch_size;
+  int i, n;
+
+  do {
+    for(i=0; i<batch_size; i++) {
+      b->rx_msgs[i].msg_hdr.msg_namelen = sizeof(b->rx_addrs[i]);
+#ifdef SO_RXQ_OVFL
+      b->rx_msgs[i].msg_hdr.msg_control = b->rx_ctrl[i];
+      b->rx_msgs[i].msg_hdr.msg_controllen = sizeof(b->rx_ctrl[i]);
+#endif
+    }
+
+    n = recvmmsg(w->sock, b->rx_msgs, batch_size, MSG_DONTWAIT, NULL);
+
+    if(n < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+	return(0);
+
+      traceEvent(TRACE_ERROR, "recvmmsg() failed errno %d (%s)", errno, strerror(errno));
+      return(-1);
+    }
+
+    ++(w->stats.rx_batches);
+    w->stats.rx_batched += n;
+
+    for(i=0; i<n; i++) {
+#ifdef SO_RXQ_OVFL
+      struct cmsghdr *cmsg;
+
+      for(cmsg = CMSG_FIRSTHDR(&b->rx_msgs[i].msg_hdr); cmsg != NULL;
+	  cmsg = CMSG_NXTHDR(&b->rx_msgs[i].msg_hdr, cmsg)) {
+	if((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL)) {
+	  uint32_t dropped;
+
+	  memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+	  w->stats.rx_dropped = dropped; /* since the socket was opened */
+	}
+      }
+#endif
+
+      if(b->rx_msgs[i].msg_len > 0)
+	process_udp(w, &b->rx_addrs[i], b->rx_iovs[i].iov_base, b->rx_msgs[i].msg_len, now);
+    }
+
+    sn_flush_tx(w);
+    sn_quiescent(w->sss, w);
+  } while(n == batch_size); /* a full batch, there may be more */
+
+  return(0);
+}
+#endif
+
+/** Receive and process a datagram from the socket of w.
+ *
+ *  @return 0, or -1 when the socket failed
+ */
+static int sn_recv_one(struct sn_worker * w, time_t now) {
+  uint8_t rxbuf[N2N_SN_HEADROOM + N2N_SN_PKTBUF_SIZE];
+  uint8_t *pktbuf = &rxbuf[N2N_SN_HEADROOM]; /* room to relay in place */
+  struct sockaddr_in  sender_sock;
+  socklen_t           i;
+  ssize_t             bread;
+
+  i = sizeof(sender_sock);
+  bread = recvfrom(w->sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
+		   (struct sockaddr *)&sender_sock, (socklen_t*)&i);
+
+  if((bread < 0)
+#ifdef WIN32
+     && (WSAGetLastError() != WSAECONNRESET)
+#endif
+  ) {
+    /* For UDP bread of zero just means no data (unlike TCP). */
+    /* The fd is no good now. Maybe we lost our interface. */
+    traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
+#ifdef WIN32
+    traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
+#endif
+    return(-1);
+  }
+
+  /* We have a datagram to process */
+  if(bread > 0) {
+    /* And the datagram has data (not just a header) */
+    process_udp(w, &sender_sock, pktbuf, bread, now);
+  }
+
+  sn_quiescent(w->sss, w);
+  return(0);
+}
+
+/** Receive from the socket of w, with batches when enabled.
+ *
+ *  @return 0, or -1 when the socket failed
+ */
+static int sn_recv(struct sn_worker * w, time_t now) {
+#ifdef N2N_HAVE_MMSG
+  if(w->batch)
+    return(sn_recv_batch(w, now));
+#endif
+
+  return(sn_recv_one(w, now));
+}
+
+#ifdef N2N_SN_HAVE_WORKERS
+/** Relay loop of the workers other than the main one. The socket is waited
+ *  for a second at most, to notice the shutdown. */
+static void* sn_worker_thread(void *arg) {
+  struct sn_worker *w = (struct sn_worker*)arg;
+
+  while(keep_running) {
+    fd_set socket_mask;
+    struct timeval wait_time;
+    int rc;
+
+    FD_ZERO(&socket_mask);
+    FD_SET(w->sock, &socket_mask);
+    wait_time.tv_sec = 1; wait_time.tv_usec = 0;
+
+    sn_offline(w);
+    rc = select(w->sock+1, &socket_mask, NULL, NULL, &wait_time);
+    sn_quiescent(w->sss, w);
+
+    if((rc > 0) && (sn_recv(w, time(NULL)) < 0)) {
+      keep_running = 0;
+      break;
+    }
+  }
+
+  sn_offline(w);
+  return(NULL);
+}
+
+/** Start the threads of the workers other than the main one. The signals are
+ *  left to the main loop.
+ *
+ *  @return 0 on success, -1 on failure
+ */
+static int sn_start_workers(n2n_sn_t * sss) {
+  sigset_t all, prev;
+  int i, rc = 0;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &prev);
+
+  for(i=1; i<sss->num_workers; i++) {
+    if(pthread_create(&sss->workers[i].thread, NULL, sn_worker_thread, &sss->workers[i]) != 0) {
+      traceEvent(TRACE_ERROR, "Cannot start worker %d", i);
+      sss->num_workers = i; /* the ones to join */
+      rc = -1;
+      break;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+  return(rc);
+}
+
+static void sn_join_workers(n2n_sn_t * sss) {
+  int i;
+
+  for(i=1; i<sss->num_workers; i++)
+    pthread_join(sss->workers[i].thread, NULL);
+}
+#endif
+
 /** Long lived processing entry point. Split out from main to simply
  *  daemonisation on some platforms. */
 static int run_loop(n2n_sn_t * sss) {
+  struct sn_worker *w = &sss->workers[0];
   uint8_t pktbuf[N2N_SN_PKTBUF_SIZE];
-  time_t last_purge_edges = 0;
-  struct sn_community *comm, *tmp;
+  time_t last_purge = 0;
 
   sss->start_time = time(NULL);
 
+#ifdef N2N_SN_HAVE_WORKERS
+  if(sss->num_workers > 1) {
+    if(sn_start_workers(sss) < 0)
+      keep_running = 0;
+  }
+#endif
+
   while(keep_running) {
     int rc;
     ssize_t bread;
@@ -1065,40 +2232,21 @@ static int run_loop(n2n_sn_t * sss) {
     FD_SET(sss->sock, &socket_mask);
     FD_SET(sss->mgmt_sock, &socket_mask);
 
-    wait_time.tv_sec = 10; wait_time.tv_usec = 0;
+    /* Sooner with workers, that retire memory the main loop reclaims */
+    wait_time.tv_sec = (sss->num_workers > 1) ? 1 : 10; wait_time.tv_usec = 0;
+
+    sn_offline(w);
     rc = select(max_sock+1, &socket_mask, NULL, NULL, &wait_time);
+    sn_quiescent(sss, w);
 
     now = time(NULL);
 
     if(rc > 0) {
       if(FD_ISSET(sss->sock, &socket_mask)) {
-	struct sockaddr_in  sender_sock;
-	socklen_t           i;
-
-	i = sizeof(sender_sock);
-	bread = recvfrom(sss->sock, pktbuf, N2N_SN_PKTBUF_SIZE, 0/*flags*/,
-			 (struct sockaddr *)&sender_sock, (socklen_t*)&i);
-
-	if((bread < 0)
-#ifdef WIN32
-	   && (WSAGetLastError() != WSAECONNRESET)
-#endif
-	) {
-	  /* For UDP bread of zero just means no data (unlike TCP). */
-	  /* The fd is no good now. Maybe we lost our interface. */
-	  traceEvent(TRACE_ERROR, "recvfrom() failed %d errno %d (%s)", bread, errno, strerror(errno));
-#ifdef WIN32
-	  traceEvent(TRACE_ERROR, "WSAGetLastError(): %u", WSAGetLastError());
-#endif
+	if(sn_recv(w, now) < 0) {
 	  keep_running=0;
 	  break;
 	}
-
-	/* We have a datagram to process */
-	if(bread > 0) {
-	  /* And the datagram has data (not just a header) */
-	  process_udp(sss, &sender_sock, pktbuf, bread, now);
-	}
       }
 
       if(FD_ISSET(sss->mgmt_sock, &socket_mask)) {
@@ -1122,18 +2270,21 @@ static int run_loop(n2n_sn_t * sss) {
       traceEvent(TRACE_DEBUG, "timeout");
     }
 
-    HASH_ITER(hh, sss->communities, comm, tmp) {
-      purge_expired_registrations( &comm->edges, &last_purge_edges );
-
-      if((comm->edges == NULL) && (!sss->lock_communities)) {
-	traceEvent(TRACE_INFO, "Purging idle community %s", comm->community);
-	HASH_DEL(sss->communities, comm);
-	free(comm);
-      }
+    if(now != last_purge) {
+      /* Each community is purged every PURGE_REGISTRATION_FREQUENCY */
+      sn_purge(sss, now);
+      last_purge = now;
     }
 
+    sn_quiescent(sss, w);
+    sn_reclaim(sss);
   } /* while */
 
+  keep_running = 0;
+#ifdef N2N_SN_HAVE_WORKERS
+  sn_join_workers(sss);
+#endif
+
   deinit_sn(sss);
 
   return 0;
@@ -0,0 +1,123 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Single producer, single consumer ring of pointers.
+ *
+ * head and tail are free running counters: the producer owns head, the
+ * consumer owns tail, and each only reads the index of the other side when
+ * its cached copy says the ring is full (producer) or empty (consumer). In
+ * the steady state the two threads thus touch each other's cache line once
+ * per burst rather than once per item. The release store of an index makes
+ * the slot written (or read) before it visible to the other side. */
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_PIPELINE
+
+/* ************************************** */
+
+/** Allocate a ring of size slots, rounded up to a power of 2.
+ *
+ *  @return 0 on success, -1 when out of memory
+ */
+int n2n_ring_init(n2n_ring_t *ring, uint32_t size) {
+  uint32_t n = 1;
+
+  while(n < size)
+    n <<= 1;
+
+  memset(ring, 0, sizeof(*ring));
+
+  if((ring->slots = calloc(n, sizeof(void*))) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot allocate a ring of %u slots", n);
+    return(-1);
+  }
+
+  ring->mask = n - 1;
+
+  return(0);
+}
+
+/* ************************************** */
+
+void n2n_ring_free(n2n_ring_t *ring) {
+  if(ring->slots)
+    free(ring->slots);
+
+  ring->slots = NULL;
+}
+
+/* ************************************** */
+
+/** Producer side.
+ *
+ *  @return 0 when the item was queued, -1 when the ring is full
+ */
+int n2n_ring_push(n2n_ring_t *ring, void *item) {
+  uint32_t head = ring->head;
+
+  if((head - ring->tail_cache) > ring->mask) {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if((head - ring->tail_cache) > ring->mask)
+      return(-1);
+  }
+
+  ring->slots[head & ring->mask] = item;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** Consumer side.
+ *
+ *  @return the oldest item, or NULL when the ring is empty
+ */
+void* n2n_ring_pop(n2n_ring_t *ring) {
+  uint32_t tail = ring->tail;
+  void *item;
+
+  if(tail == ring->head_cache) {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if(tail == ring->head_cache)
+      return(NULL);
+
+    /* What piled up while the consumer worked on the previous burst */
+    if((ring->head_cache - tail) > ring->hiwat)
+      ring->hiwat = ring->head_cache - tail;
+  }
+
+  item = ring->slots[tail & ring->mask];
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return(item);
+}
+
+/* ************************************** */
+
+/** @return the number of queued items, exact only on the consumer side */
+uint32_t n2n_ring_count(const n2n_ring_t *ring) {
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  return(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail);
+}
+
+#endif /* N2N_HAVE_PIPELINE */
@@ -0,0 +1,442 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Offloads of a TAP opened with IFF_VNET_HDR.
+ *
+ * TX: the kernel hands over frames with a partial checksum and TCP super
+ * frames up to 64 KB (TSO). They are completed and cut into MSS sized
+ * segments here, so that the peers always receive plain ethernet frames.
+ *
+ * RX: consecutive in-order segments of the same TCP flow are coalesced
+ * (GRO) into a single super frame written to the TAP with a GSO header,
+ * saving a write() and a trip through the stack per segment. The checksums
+ * of the segments are verified first, as the kernel only completes the
+ * checksum of the super frame: a corrupted segment is passed on alone, for
+ * the stack to drop it. */
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_TAP_OFFLOAD
+
+#include <sys/uio.h>
+
+#define ETH_HDR_LEN       14
+#define VLAN_HDR_LEN      4
+#define ETH_P_IPV4        0x0800
+#define ETH_P_IPV6        0x86DD
+#define ETH_P_8021Q       0x8100
+#define IP_MAX_LEN        65535
+#define IPV4_HDR_LEN      20
+#define IPV6_HDR_LEN      40
+#define TCP_HDR_MIN_LEN   20
+#define TCP_CSUM_OFFSET   16
+
+#define TCP_FLAG_FIN      0x01
+#define TCP_FLAG_SYN      0x02
+#define TCP_FLAG_RST      0x04
+#define TCP_FLAG_PSH      0x08
+#define TCP_FLAG_URG      0x20
+#define TCP_FLAG_CWR      0x80
+
+/* ************************************** */
+
+/* Internet checksum, summed in host order (RFC 1071 byte order independence)
+ * so that the result can be stored back without swapping. */
+static uint64_t csum_partial(const uint8_t *buf, size_t len, uint64_t sum) {
+  uint32_t w32;
+  uint16_t w16;
+
+  while(len >= 4) {
+    memcpy(&w32, buf, 4);
+    sum += w32;
+    buf += 4, len -= 4;
+  }
+
+  if(len >= 2) {
+    memcpy(&w16, buf, 2);
+    sum += w16;
+    buf += 2, len -= 2;
+  }
+
+  if(len) {
+    w16 = 0;
+    memcpy(&w16, buf, 1);
+    sum += w16;
+  }
+
+  return(sum);
+}
+
+static uint16_t csum_fold(uint64_t sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+
+  return((uint16_t)sum);
+}
+
+/* Sum of the TCP pseudo header */
+static uint64_t csum_pseudo(const uint8_t *l3, int ipv6, size_t l4_len) {
+  if(ipv6)
+    return(csum_partial(l3 + 8, 32, 0) + htonl(l4_len) + htonl(IPPROTO_TCP));
+
+  return(csum_partial(l3 + 12, 8, 0) + htons(l4_len) + htons(IPPROTO_TCP));
+}
+
+static void ipv4_set_csum(uint8_t *ip) {
+  uint16_t csum;
+
+  memset(ip + 10, 0, 2);
+  csum = ~csum_fold(csum_partial(ip, IPV4_HDR_LEN, 0));
+  memcpy(ip + 10, &csum, 2);
+}
+
+/* ************************************** */
+
+/* Locate the IP and TCP headers of an IPv4/IPv6 frame, untagged or with a
+ * single 802.1Q tag.
+ *
+ * @return the TCP payload offset or -1 when this is not a plain TCP frame */
+static int parse_tcp(const uint8_t *frame, size_t len, int *ipv6, size_t *l3_off,
+                     size_t *l4_off, size_t *ip_end) {
+  const uint8_t *ip;
+  uint16_t ethertype;
+  size_t thlen;
+
+  if(len < ETH_HDR_LEN + IPV4_HDR_LEN + TCP_HDR_MIN_LEN)
+    return(-1);
+
+  ethertype = (frame[12] << 8) | frame[13];
+  *l3_off = ETH_HDR_LEN;
+
+  if(ethertype == ETH_P_8021Q) {
+    if(len < ETH_HDR_LEN + VLAN_HDR_LEN + IPV4_HDR_LEN + TCP_HDR_MIN_LEN)
+      return(-1);
+
+    ethertype = (frame[16] << 8) | frame[17];
+    *l3_off += VLAN_HDR_LEN;
+  }
+
+  ip = frame + *l3_off;
+
+  if(ethertype == ETH_P_IPV4) {
+    if((ip[0] != 0x45) || (ip[9] != IPPROTO_TCP)
+       || ((((ip[6] << 8) | ip[7]) & 0x3fff) != 0) /* MF or fragment offset */)
+      return(-1);
+
+    *ipv6 = 0;
+    *l4_off = *l3_off + IPV4_HDR_LEN;
+    *ip_end = *l3_off + ((ip[2] << 8) | ip[3]);
+  } else if(ethertype == ETH_P_IPV6) {
+    /* Extension headers are not supported */
+    if((len < *l3_off + IPV6_HDR_LEN + TCP_HDR_MIN_LEN) || ((ip[0] >> 4) != 6) || (ip[6] != IPPROTO_TCP))
+      return(-1);
+
+    *ipv6 = 1;
+    *l4_off = *l3_off + IPV6_HDR_LEN;
+    *ip_end = *l3_off + IPV6_HDR_LEN + ((ip[4] << 8) | ip[5]);
+  } else
+    return(-1);
+
+  thlen = (frame[*l4_off + 12] >> 4) * 4;
+
+  if((thlen < TCP_HDR_MIN_LEN) || (*ip_end > len) || (*l4_off + thlen > *ip_end))
+    return(-1);
+
+  return(*l4_off + thlen);
+}
+
+/* ************************************** */
+
+/** Complete the checksum and cut the TSO super frames read from a TAP with
+ *  IFF_VNET_HDR, passing each resulting frame to cb.
+ *
+ *  @param vh       - the virtio header preceding the frame
+ *  @param seg_buf  - scratch buffer for the segments
+ *
+ *  @return the number of frames passed to cb or -1 if the frame was dropped
+ */
+int tap_offload_tx(const struct virtio_net_hdr *vh, uint8_t *frame, size_t len,
+                   uint8_t *seg_buf, size_t seg_buf_size, n2n_frame_cb_t cb, void *arg) {
+  uint8_t gso_type = vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+  size_t l3_off, l4_off, ip_end, hdr_len, off, mss;
+  uint32_t seq;
+  uint16_t ip_id = 0;
+  int ipv6, payload_off, num_segs = 0;
+
+  if(gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+    if(vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+      /* The field holds the pseudo header sum, which is part of the sum */
+      size_t start = vh->csum_start;
+      uint16_t csum;
+
+      if(start + vh->csum_offset + 2 > len)
+        return(-1);
+
+      csum = ~csum_fold(csum_partial(frame + start, len - start, 0));
+      memcpy(frame + start + vh->csum_offset, &csum, 2);
+    }
+
+    cb(arg, frame, len);
+    return(1);
+  }
+
+  if((gso_type != VIRTIO_NET_HDR_GSO_TCPV4) && (gso_type != VIRTIO_NET_HDR_GSO_TCPV6)) {
+    traceEvent(TRACE_WARNING, "Unsupported GSO type %u: frame dropped", gso_type);
+    return(-1);
+  }
+
+  if(((payload_off = parse_tcp(frame, len, &ipv6, &l3_off, &l4_off, &ip_end)) < 0) || (vh->gso_size == 0)) {
+    traceEvent(TRACE_WARNING, "Malformed GSO frame dropped");
+    return(-1);
+  }
+
+  hdr_len = payload_off;
+  mss = vh->gso_size;
+  memcpy(&seq, frame + l4_off + 4, 4);
+  seq = ntohl(seq);
+  if(!ipv6)
+    ip_id = (frame[l3_off + 4] << 8) | frame[l3_off + 5];
+
+  for(off = hdr_len; off < ip_end; off += mss) {
+    size_t chunk = min(mss, ip_end - off);
+    size_t seg_len = hdr_len + chunk;
+    uint8_t *ip = seg_buf + l3_off, *th = seg_buf + l4_off;
+    uint32_t seg_seq = htonl(seq + (off - hdr_len));
+    uint16_t csum;
+
+    if(seg_len > seg_buf_size) {
+      traceEvent(TRACE_WARNING, "GSO segment too large (%u bytes): frame dropped", (unsigned int)seg_len);
+      return(-1);
+    }
+
+    memcpy(seg_buf, frame, hdr_len);
+    memcpy(seg_buf + hdr_len, frame + off, chunk);
+
+    if(ipv6) {
+      ip[4] = (seg_len - l3_off - IPV6_HDR_LEN) >> 8;
+      ip[5] = (seg_len - l3_off - IPV6_HDR_LEN) & 0xff;
+    } else {
+      uint16_t id = ip_id + num_segs;
+
+      ip[2] = (seg_len - l3_off) >> 8;
+      ip[3] = (seg_len - l3_off) & 0xff;
+      ip[4] = id >> 8;
+      ip[5] = id & 0xff;
+      ipv4_set_csum(ip);
+    }
+
+    memcpy(th + 4, &seg_seq, 4);
+
+    /* FIN and PSH belong to the last segment, CWR to the first one */
+    if(off + chunk < ip_end)
+      th[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    if(num_segs > 0)
+      th[13] &= ~TCP_FLAG_CWR;
+
+    memset(th + TCP_CSUM_OFFSET, 0, 2);
+    csum = ~csum_fold(csum_partial(th, seg_len - l4_off, csum_pseudo(ip, ipv6, seg_len - l4_off)));
+    memcpy(th + TCP_CSUM_OFFSET, &csum, 2);
+
+    cb(arg, seg_buf, seg_len);
+    num_segs++;
+  }
+
+  return(num_segs);
+}
+
+/* ************************************** */
+
+static int tap_write_vnet(int fd, const struct virtio_net_hdr *vh, const uint8_t *frame, size_t len) {
+  struct iovec iov[2];
+
+  iov[0].iov_base = (void*)vh;
+  iov[0].iov_len = sizeof(*vh);
+  iov[1].iov_base = (void*)frame;
+  iov[1].iov_len = len;
+
+  return(writev(fd, iov, 2));
+}
+
+/** Write a frame with no offload to a TAP with IFF_VNET_HDR. */
+int tap_offload_write(int fd, const uint8_t *frame, size_t len) {
+  static const struct virtio_net_hdr no_offload = { 0 };
+  int rc = tap_write_vnet(fd, &no_offload, frame, len);
+
+  return((rc > 0) ? (rc - (int)sizeof(no_offload)) : rc);
+}
+
+/* ************************************** */
+
+/** Write the pending super frame, if any, to the TAP. */
+void gro_flush(n2n_gro_t *gro, int fd) {
+  struct virtio_net_hdr vh;
+  uint8_t *frame = gro->frame;
+
+  if(gro->len == 0)
+    return;
+
+  if(gro->segs == 1) {
+    /* Nothing was merged, the frame is still intact */
+    tap_offload_write(fd, frame, gro->len);
+  } else {
+    uint8_t *ip = frame + ETH_HDR_LEN;
+    size_t l4_len = gro->len - gro->l4_off;
+    uint16_t csum;
+
+    if(gro->ipv6) {
+      ip[4] = (gro->len - ETH_HDR_LEN - IPV6_HDR_LEN) >> 8;
+      ip[5] = (gro->len - ETH_HDR_LEN - IPV6_HDR_LEN) & 0xff;
+    } else {
+      ip[2] = (gro->len - ETH_HDR_LEN) >> 8;
+      ip[3] = (gro->len - ETH_HDR_LEN) & 0xff;
+      ipv4_set_csum(ip);
+    }
+
+    /* Leave a partial checksum for the kernel to complete */
+    csum = csum_fold(csum_pseudo(ip, gro->ipv6, l4_len));
+    memcpy(frame + gro->l4_off + TCP_CSUM_OFFSET, &csum, 2);
+
+    memset(&vh, 0, sizeof(vh));
+    vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vh.gso_type = gro->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+    vh.hdr_len = gro->hdr_len;
+    vh.gso_size = gro->mss;
+    vh.csum_start = gro->l4_off;
+    vh.csum_offset = TCP_CSUM_OFFSET;
+
+    if(tap_write_vnet(fd, &vh, frame, gro->len) < 0)
+      traceEvent(TRACE_WARNING, "GRO write failed [%d]: %s", errno, strerror(errno));
+    else {
+      gro->super_frames++;
+      gro->merged_segs += gro->segs;
+    }
+  }
+
+  gro->len = 0;
+  gro->segs = 0;
+}
+
+/* ************************************** */
+
+/* Whether the IPv4 header and TCP checksums of an untagged segment are right */
+static int gro_csum_ok(const uint8_t *frame, int ipv6, size_t l4_off, size_t ip_end) {
+  const uint8_t *ip = frame + ETH_HDR_LEN;
+  size_t l4_len = ip_end - l4_off;
+
+  if(!ipv6 && (csum_fold(csum_partial(ip, IPV4_HDR_LEN, 0)) != 0xffff))
+    return(0);
+
+  return(csum_fold(csum_partial(frame + l4_off, l4_len, csum_pseudo(ip, ipv6, l4_len))) == 0xffff);
+}
+
+/* Whether the TCP segment continues the pending super frame */
+static int gro_can_merge(const n2n_gro_t *gro, const uint8_t *frame, int ipv6,
+                         size_t l4_off, size_t hdr_len, size_t payload) {
+  const uint8_t *g = gro->frame, *ip = frame + ETH_HDR_LEN, *gip = g + ETH_HDR_LEN;
+  const uint8_t *th = frame + l4_off, *gth = g + l4_off;
+  uint32_t seq;
+
+  if((gro->len == 0) || (ipv6 != gro->ipv6) || (hdr_len != gro->hdr_len)
+     || (payload > gro->mss) || (gro->len + payload > ETH_HDR_LEN + IP_MAX_LEN))
+    return(0);
+
+  /* Same ethernet header, addresses, TOS/traffic class and TTL */
+  if(memcmp(frame, g, ETH_HDR_LEN))
+    return(0);
+
+  if(ipv6) {
+    if(memcmp(ip, gip, 4) || (ip[7] != gip[7]) || memcmp(ip + 8, gip + 8, 32))
+      return(0);
+  } else {
+    /* The kernel gives consecutive ids to the segments it cuts again */
+    if((ip[1] != gip[1]) || (ip[6] != gip[6]) || (ip[8] != gip[8]) || memcmp(ip + 12, gip + 12, 8)
+       || (((ip[4] << 8) | ip[5]) != gro->next_ip_id))
+      return(0);
+  }
+
+  memcpy(&seq, th + 4, 4);
+
+  /* Ports, ack, window and options must match, the flags too but PSH */
+  return(!memcmp(th, gth, 4) && (ntohl(seq) == gro->next_seq)
+         && !memcmp(th + 8, gth + 8, 5) && ((th[13] & ~TCP_FLAG_PSH) == (gth[13] & ~TCP_FLAG_PSH))
+         && !memcmp(th + 14, gth + 14, 2)
+         && !memcmp(th + TCP_HDR_MIN_LEN, gth + TCP_HDR_MIN_LEN, hdr_len - l4_off - TCP_HDR_MIN_LEN));
+}
+
+/** Queue a frame received from the tunnel for a TAP with IFF_VNET_HDR,
+ *  merging it with the previous ones when possible. The frames must
+ *  eventually be pushed out with gro_flush(). */
+void gro_receive(n2n_gro_t *gro, int fd, const uint8_t *frame, size_t len) {
+  size_t l3_off, l4_off, ip_end, hdr_len, payload;
+  int ipv6, payload_off;
+  uint8_t flags;
+  uint32_t seq;
+
+  /* VLAN tagged segments are not coalesced, nor the corrupted ones, which
+   * would get a valid checksum */
+  if(((payload_off = parse_tcp(frame, len, &ipv6, &l3_off, &l4_off, &ip_end)) < 0)
+     || (l3_off != ETH_HDR_LEN) || !gro_csum_ok(frame, ipv6, l4_off, ip_end)) {
+    gro_flush(gro, fd);
+    tap_offload_write(fd, frame, len);
+    return;
+  }
+
+  hdr_len = payload_off;
+  payload = ip_end - hdr_len;
+  flags = frame[l4_off + 13];
+  memcpy(&seq, frame + l4_off + 4, 4);
+
+  if(gro_can_merge(gro, frame, ipv6, l4_off, hdr_len, payload)) {
+    memcpy(gro->frame + gro->len, frame + hdr_len, payload);
+    gro->len += payload;
+    gro->next_seq += payload;
+    gro->next_ip_id++;
+    gro->segs++;
+    gro->frame[l4_off + 13] |= (flags & TCP_FLAG_PSH);
+
+    /* A short or pushed segment ends the train */
+    if((payload < gro->mss) || (flags & TCP_FLAG_PSH))
+      gro_flush(gro, fd);
+
+    return;
+  }
+
+  gro_flush(gro, fd);
+
+  if((payload == 0) || (flags & (TCP_FLAG_SYN | TCP_FLAG_FIN | TCP_FLAG_RST | TCP_FLAG_URG | TCP_FLAG_CWR))
+     || (flags & TCP_FLAG_PSH)) {
+    tap_offload_write(fd, frame, len);
+    return;
+  }
+
+  /* Start a new super frame, dropping any ethernet padding */
+  memcpy(gro->frame, frame, ip_end);
+  gro->len = ip_end;
+  gro->ipv6 = ipv6;
+  gro->l4_off = l4_off;
+  gro->hdr_len = hdr_len;
+  gro->mss = payload;
+  gro->next_seq = ntohl(seq) + payload;
+  if(!ipv6)
+    gro->next_ip_id = ((frame[ETH_HDR_LEN + 4] << 8) | frame[ETH_HDR_LEN + 5]) + 1;
+  gro->segs = 1;
+}
+
+#endif /* N2N_HAVE_TAP_OFFLOAD */
@@ -0,0 +1,162 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Hierarchical timer wheel.
+ *
+ * Level 0 has one slot per tick, every upper level has slots
+ * N2N_TW_LEVEL_SIZE times wider than the level below. A timer is stored in
+ * the lowest level able to hold its expiry; when the lower levels wrap, the
+ * matching slot of the level above is cascaded down. Adding and cancelling
+ * are O(1) and advancing costs O(1) per tick plus the timers moved. */
+
+#include "n2n.h"
+
+#define TW_MASK         (N2N_TW_LEVEL_SIZE - 1)
+#define TW_INDEX(t, l)  (((t) >> ((l) * N2N_TW_LEVEL_BITS)) & TW_MASK)
+
+/* ************************************** */
+
+void timer_init(n2n_timer_t *timer, n2n_timer_cb_t cb, void *data) {
+  memset(timer, 0, sizeof(*timer));
+  timer->cb = cb;
+  timer->data = data;
+}
+
+/* ************************************** */
+
+void timer_wheel_init(n2n_timer_wheel_t *tw, uint64_t now) {
+  memset(tw, 0, sizeof(*tw));
+  tw->now = now;
+}
+
+/* ************************************** */
+
+static void timer_link(n2n_timer_wheel_t *tw, n2n_timer_t *timer) {
+  uint64_t delta = timer->expires - tw->now;
+  n2n_timer_t **slot;
+  int level;
+
+  for(level = 0; level < N2N_TW_LEVELS - 1; level++) {
+    if(delta < ((uint64_t)1 << ((level + 1) * N2N_TW_LEVEL_BITS)))
+      break;
+  }
+
+  if(level == (N2N_TW_LEVELS - 1)) {
+    /* Clamp far away expiries to the reach of the wheel */
+    uint64_t max_delta = ((uint64_t)1 << (N2N_TW_LEVELS * N2N_TW_LEVEL_BITS)) - 1;
+
+    if(delta > max_delta)
+      timer->expires = tw->now + max_delta;
+  }
+
+  slot = &tw->slots[level][TW_INDEX(timer->expires, level)];
+
+  timer->next = *slot;
+  if(timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+/* ************************************** */
+
+/** Schedule the timer to fire after delay ticks (at least one).
+ *  A pending timer is rescheduled. */
+void timer_wheel_add(n2n_timer_wheel_t *tw, n2n_timer_t *timer, uint64_t delay) {
+  timer_wheel_cancel(timer);
+
+  timer->expires = tw->now + ((delay > 0) ? delay : 1);
+  timer_link(tw, timer);
+}
+
+/* ************************************** */
+
+void timer_wheel_cancel(n2n_timer_t *timer) {
+  if(!timer->pprev)
+    return;
+
+  *timer->pprev = timer->next;
+  if(timer->next)
+    timer->next->pprev = timer->pprev;
+
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/* ************************************** */
+
+int timer_is_pending(const n2n_timer_t *timer) {
+  return(timer->pprev != NULL);
+}
+
+/* ************************************** */
+
+/** Run the timers expired up to now (in ticks).
+ *
+ *  @return the number of timers fired
+ */
+size_t timer_wheel_advance(n2n_timer_wheel_t *tw, uint64_t now) {
+  size_t fired = 0;
+
+  while(tw->now < now) {
+    n2n_timer_t *head, *timer;
+    int level;
+
+    tw->now++;
+
+    /* Cascade the upper levels whose lower level just wrapped */
+    for(level = 1; level < N2N_TW_LEVELS; level++) {
+      n2n_timer_t **slot;
+
+      if(TW_INDEX(tw->now, level - 1) != 0)
+        break;
+
+      slot = &tw->slots[level][TW_INDEX(tw->now, level)];
+      head = *slot;
+      *slot = NULL;
+
+      while(head) {
+        timer = head;
+        head = timer->next;
+        timer_link(tw, timer);
+      }
+    }
+
+    /* Detach the slot so that the callbacks can freely add or cancel
+     * timers, including the ones still to be run */
+    head = tw->slots[0][TW_INDEX(tw->now, 0)];
+    tw->slots[0][TW_INDEX(tw->now, 0)] = NULL;
+    if(head)
+      head->pprev = &head;
+
+    while(head) {
+      timer = head;
+      head = timer->next;
+      if(head)
+        head->pprev = &head;
+
+      timer->next = NULL;
+      timer->pprev = NULL;
+
+      timer->cb(tw, timer);
+      fired++;
+    }
+  }
+
+  return(fired);
+}
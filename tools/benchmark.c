@@ -68,9 +68,28 @@ uint8_t PKT_CONTENT[]={
   0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
   0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15 };
 
+#define BATCH_SIZE      16      /* packets per fwd_batch/rev_batch call */
+
 /* Prototypes */
 static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c );
+static void print_crypto_selection(n2n_transform_t transform_id) {
+  const n2n_crypto_sel_t *sel = n2n_crypto_select(transform_id);
+  unsigned int i;
+
+  if(sel == NULL)
+    return;
+
+  for(i=0; i<sel->num_impls; i++) {
+    char impl[64];
+
+    printf("%-10s %c %s\n", (i == 0) ? sel->transform : "", (i == sel->selected) ? '*' : ' ',
+           n2n_crypto_bench_str(sel, i, impl, sizeof(impl)));
+  }
+}
+
 static void run_transop_benchmark(const char *op_name, n2n_trans_op_t *op_fn, n2n_edge_conf_t *conf, uint8_t *pktbuf);
+static void run_transop_batch_benchmark(const char *op_name, n2n_trans_op_t *op_fn);
+static void print_crypto_selection(n2n_transform_t transform_id);
 static int perform_decryption = 0;
 
 static void usage() {
@@ -93,14 +112,28 @@ static void parseArgs(int argc, char * argv[]) {
 
 int main(int argc, char * argv[]) {
   uint8_t pktbuf[N2N_PKT_BUF_SIZE];
-  n2n_trans_op_t transop_null, transop_twofish;
+  n2n_trans_op_t transop_null, transop_twofish, transop_cc20;
 #ifdef N2N_HAVE_AES
-  n2n_trans_op_t transop_aes_cbc;
+  n2n_trans_op_t transop_aes_cbc, transop_aes_gcm;
 #endif
   n2n_edge_conf_t conf;
 
   parseArgs(argc, argv);
 
+  /* The start up self-benchmark of edge, binding the kernels measured below */
+  {
+    char cpu[64];
+
+    printf("CPU features: %s\n", n2n_cpu_features_str(cpu, sizeof(cpu)));
+    print_crypto_selection(N2N_TRANSFORM_ID_TWOFISH);
+#ifdef N2N_HAVE_AES
+    print_crypto_selection(N2N_TRANSFORM_ID_AESCBC);
+    print_crypto_selection(N2N_TRANSFORM_ID_AESGCM);
+#endif
+    print_crypto_selection(N2N_TRANSFORM_ID_CHACHA20);
+    printf("\n");
+  }
+
   /* Init configuration */
   edge_init_conf_defaults(&conf);
   strncpy((char*)conf.community_name, "abc123def456", sizeof(conf.community_name));
@@ -109,8 +142,10 @@ int main(int argc, char * argv[]) {
   /* Init transopts */
   n2n_transop_null_init(&conf, &transop_null);
   n2n_transop_twofish_init(&conf, &transop_twofish);
+  n2n_transop_cc20_init(&conf, &transop_cc20);
 #ifdef N2N_HAVE_AES
   n2n_transop_aes_cbc_init(&conf, &transop_aes_cbc);
+  n2n_transop_aes_gcm_init(&conf, &transop_aes_gcm);
 #endif
 
   /* Run the tests */
@@ -118,13 +153,18 @@ int main(int argc, char * argv[]) {
   run_transop_benchmark("transop_twofish", &transop_twofish, &conf, pktbuf);
 #ifdef N2N_HAVE_AES
   run_transop_benchmark("transop_aes", &transop_aes_cbc, &conf, pktbuf);
+  run_transop_benchmark("transop_aes_gcm", &transop_aes_gcm, &conf, pktbuf);
 #endif
+  run_transop_benchmark("transop_cc20", &transop_cc20, &conf, pktbuf);
+  run_transop_batch_benchmark("transop_cc20", &transop_cc20);
 
   /* Cleanup */
   transop_null.deinit(&transop_null);
   transop_twofish.deinit(&transop_twofish);
+  transop_cc20.deinit(&transop_cc20);
 #ifdef N2N_HAVE_AES
   transop_aes_cbc.deinit(&transop_aes_cbc);
+  transop_aes_gcm.deinit(&transop_aes_gcm);
 #endif
 
   return 0;
@@ -184,6 +224,68 @@ static void run_transop_benchmark(const char *op_name, n2n_trans_op_t *op_fn, n2
 	   (unsigned int)num_packets, mpps * 1e3, mpps * sizeof(PKT_CONTENT));
 }
 
+/* Same as run_transop_benchmark, BATCH_SIZE packets at a time through the
+ * batch entry points, without the n2n header */
+static void run_transop_batch_benchmark(const char *op_name, n2n_trans_op_t *op_fn) {
+  n2n_buf_pool_t pool;
+  n2n_trans_pkt_t pkts[BATCH_SIZE];
+  const int target_sec = 3;
+  struct timeval t1;
+  struct timeval t2;
+  ssize_t target_usec = target_sec * 1e6;
+  ssize_t tdiff = 0; // microseconds
+  size_t num_packets = 0;
+  int i;
+
+  if((op_fn->fwd_batch == NULL) || (op_fn->rev_batch == NULL)
+     || (n2n_buf_pool_init(&pool, BATCH_SIZE, 0) < 0))
+    return;
+
+  printf("Run %s[%s] for %us (%u bytes, batch %u):   ", perform_decryption ? "enc/dec" : "enc",
+            op_name, target_sec, (unsigned int)sizeof(PKT_CONTENT), BATCH_SIZE);
+  fflush(stdout);
+
+  memset(pkts, 0, sizeof(pkts));
+  gettimeofday( &t1, NULL );
+
+  while(tdiff < target_usec) {
+    for(i=0; i<BATCH_SIZE; i++) {
+      pkts[i].buf = n2n_buf_alloc(&pool);
+      memcpy(n2n_buf_put(pkts[i].buf, sizeof(PKT_CONTENT)), PKT_CONTENT, sizeof(PKT_CONTENT));
+    }
+
+    op_fn->fwd_batch(op_fn, pkts, BATCH_SIZE);
+
+    if(perform_decryption) {
+      for(i=0; i<BATCH_SIZE; i++) {
+        pkts[i].data = pkts[i].buf->data;
+        pkts[i].len = pkts[i].buf->len;
+      }
+
+      op_fn->rev_batch(op_fn, pkts, BATCH_SIZE);
+
+      for(i=0; i<BATCH_SIZE; i++) {
+        if((pkts[i].len != sizeof(PKT_CONTENT)) || (memcmp(pkts[i].data, PKT_CONTENT, sizeof(PKT_CONTENT)) != 0))
+          fprintf(stderr, "Payload decryption failed!\n");
+      }
+    }
+
+    for(i=0; i<BATCH_SIZE; i++)
+      n2n_buf_release(pkts[i].buf);
+
+    gettimeofday( &t2, NULL );
+    tdiff = ((t2.tv_sec - t1.tv_sec) * 1000000) + (t2.tv_usec - t1.tv_usec);
+    num_packets += BATCH_SIZE;
+  }
+
+  n2n_buf_pool_free(&pool);
+
+  float mpps = num_packets / (tdiff / 1e6) / 1e6;
+
+  printf("\t%12u packets\t%8.1f Kpps\t%8.1f MB/s\n",
+	   (unsigned int)num_packets, mpps * 1e3, mpps * sizeof(PKT_CONTENT));
+}
+
 static ssize_t do_encode_packet( uint8_t * pktbuf, size_t bufsize, const n2n_community_t c )
 {
   n2n_mac_t destMac={0,1,2,3,4,5};
@@ -0,0 +1,178 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Train a compression dictionary for edge --compress-dict from captures of
+ * the traffic of the TAP interface, e.g. tcpdump -i edge0 -w edge0.pcap. The
+ * same file serves lz4 and zstd; the edges that are to use it need a copy. */
+
+#include <pcap.h>
+#include <zdict.h>
+#include "n2n.h"
+
+#define N2N_DICT_DEFAULT_SIZE   (32 * 1024)
+#define N2N_DICT_MAX_SAMPLES    (64 * 1024 * 1024)      /* bytes of frames */
+
+/* *************************************************** */
+
+static void help() {
+  fprintf(stderr, "n2n-dict -o <file> [-s <size>] [-v] <capture.pcap> [...]\n");
+  fprintf(stderr, "-o <file>                | Write the dictionary to file.\n");
+  fprintf(stderr, "-s <size>                | Dictionary size in bytes (default %u, max %u).\n",
+          N2N_DICT_DEFAULT_SIZE, N2N_COMPRESS_DICT_MAX);
+  fprintf(stderr, "-v                       | Increase verbosity level.\n");
+  fprintf(stderr, "\nThe captures must be of the TAP interface of an edge (ethernet frames).\n");
+
+  exit(0);
+}
+
+/* *************************************************** */
+
+typedef struct samples {
+  uint8_t *     buf;
+  size_t        len;
+  size_t *      sizes;
+  unsigned int  num;
+  unsigned int  max;
+} samples_t;
+
+/* Append the frames of the capture at fname to the samples.
+ * @return 0 on success */
+static int load_capture(samples_t *s, const char *fname) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *header;
+  const u_char *packet;
+  pcap_t *handle;
+  unsigned int added = 0;
+  int rc;
+
+  if((handle = pcap_open_offline(fname, errbuf)) == NULL) {
+    traceEvent(TRACE_ERROR, "Cannot open %s: %s", fname, errbuf);
+    return(-1);
+  }
+
+  if(pcap_datalink(handle) != DLT_EN10MB) {
+    traceEvent(TRACE_ERROR, "%s does not hold ethernet frames - not supported", fname);
+    pcap_close(handle);
+    return(-1);
+  }
+
+  while((rc = pcap_next_ex(handle, &header, &packet)) >= 0) {
+    size_t len = min(header->caplen, N2N_PKT_BUF_SIZE);
+
+    /* Shorter frames are not compressed anyway */
+    if((rc == 0) || (len < N2N_COMPRESS_MIN_LEN_DICT))
+      continue;
+
+    if(s->len + len > N2N_DICT_MAX_SAMPLES) {
+      traceEvent(TRACE_WARNING, "Enough samples, ignoring the rest of %s", fname);
+      break;
+    }
+
+    if(s->num == s->max) {
+      size_t *sizes = realloc(s->sizes, 2 * (s->max + 1024) * sizeof(size_t));
+
+      if(sizes == NULL)
+        break;
+
+      s->sizes = sizes;
+      s->max = 2 * (s->max + 1024);
+    }
+
+    memcpy(&s->buf[s->len], packet, len);
+    s->len += len;
+    s->sizes[s->num++] = len;
+    added++;
+  }
+
+  traceEvent(TRACE_NORMAL, "%s: %u frames", fname, added);
+  pcap_close(handle);
+
+  return(0);
+}
+
+/* *************************************************** */
+
+int main(int argc, char* argv[]) {
+  samples_t samples;
+  char *out_fname = NULL;
+  size_t dict_size = N2N_DICT_DEFAULT_SIZE, rc;
+  uint8_t *dict;
+  FILE *outf;
+  int c;
+
+  setTraceFile(stderr);
+  memset(&samples, 0, sizeof(samples));
+
+  while((c = getopt(argc, argv, "o:s:v")) != -1) {
+    switch(c) {
+    case 'o':
+      out_fname = optarg;
+      break;
+    case 's':
+      dict_size = strtoul(optarg, NULL, 0);
+      break;
+    case 'v': /* verbose */
+      setTraceLevel(getTraceLevel() + 1);
+      break;
+    default:
+      help();
+    }
+  }
+
+  if((out_fname == NULL) || (optind >= argc)
+     || (dict_size < 256) || (dict_size > N2N_COMPRESS_DICT_MAX))
+    help();
+
+  if(((samples.buf = malloc(N2N_DICT_MAX_SAMPLES)) == NULL)
+     || ((dict = malloc(dict_size)) == NULL)) {
+    traceEvent(TRACE_ERROR, "Out of memory");
+    return(1);
+  }
+
+  for(; optind < argc; optind++) {
+    if(load_capture(&samples, argv[optind]) != 0)
+      return(2);
+  }
+
+  if(samples.num < 16) {
+    traceEvent(TRACE_ERROR, "Too few frames to train on (%u)", samples.num);
+    return(3);
+  }
+
+  rc = ZDICT_trainFromBuffer(dict, dict_size, samples.buf, samples.sizes, samples.num);
+
+  if(ZDICT_isError(rc)) {
+    traceEvent(TRACE_ERROR, "Training failed: %s", ZDICT_getErrorName(rc));
+    return(3);
+  }
+
+  if(((outf = fopen(out_fname, "wb")) == NULL)
+     || (fwrite(dict, 1, rc, outf) != rc) || (fclose(outf) != 0)) {
+    traceEvent(TRACE_ERROR, "Cannot write %s: %s", out_fname, strerror(errno));
+    return(4);
+  }
+
+  traceEvent(TRACE_NORMAL, "Wrote %s: %u bytes from %u frames, id %08x", out_fname,
+             (unsigned int)rc, samples.num, n2n_compress_dict_id(dict, rc));
+
+  free(dict);
+  free(samples.sizes);
+  free(samples.buf);
+
+  return(0);
+}
@@ -22,6 +22,7 @@
 #ifdef N2N_HAVE_AES
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #define N2N_AES_TRANSFORM_VERSION       1  /* version of the transform encoding */
@@ -40,24 +41,54 @@
 
 typedef unsigned char n2n_aes_ivec_t[N2N_AES_IVEC_SIZE];
 
+/* The keys are scheduled once into EVP contexts, only the IV is reset per
+ * packet. Going through EVP rather than AES_cbc_encrypt() gets the
+ * AES-NI kernels of OpenSSL, which decrypt several CBC blocks at once. */
 typedef struct transop_aes {
-    AES_KEY             enc_key;        /* tx key */
-    AES_KEY             dec_key;        /* tx key */
-    AES_KEY             iv_enc_key;     /* key used to encrypt the IV */
+    EVP_CIPHER_CTX *    enc_ctx;        /* tx key */
+    EVP_CIPHER_CTX *    dec_ctx;        /* rx key */
+    EVP_CIPHER_CTX *    iv_ctx;         /* key used to encrypt the IV */
     uint8_t             iv_pad_val[TRANSOP_AES_IV_PADDING_SIZE]; /* key used to pad the random IV seed to full block size */
 } transop_aes_t;
 
+static void free_aes_ctx(transop_aes_t *priv) {
+    if(priv->enc_ctx) EVP_CIPHER_CTX_free(priv->enc_ctx);
+    if(priv->dec_ctx) EVP_CIPHER_CTX_free(priv->dec_ctx);
+    if(priv->iv_ctx) EVP_CIPHER_CTX_free(priv->iv_ctx);
+
+    priv->enc_ctx = priv->dec_ctx = priv->iv_ctx = NULL;
+}
+
 static int transop_deinit_aes(n2n_trans_op_t *arg) {
     transop_aes_t *priv = (transop_aes_t *)arg->priv;
 
-    if(priv)
+    if(priv) {
+        free_aes_ctx(priv);
         free(priv);
+    }
 
     return 0;
 }
 
+/* CBC en/decrypt len bytes (a multiple of AES_BLOCK_SIZE) with the key of
+ * ctx, in may be out. 0 on success, -1 on failure. */
+static int aes_cbc_crypt(EVP_CIPHER_CTX *ctx, const uint8_t *in, uint8_t *out, size_t len,
+                         const n2n_aes_ivec_t ivec) {
+    int outl;
+
+    if ( (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, ivec, -1) != 1)
+         || (EVP_CipherUpdate(ctx, out, &outl, in, len) != 1)
+         || (outl != (int)len) ) {
+        traceEvent(TRACE_ERROR, "AES-CBC %s failed", EVP_CIPHER_CTX_encrypting(ctx) ? "encryption" : "decryption");
+        return(-1);
+    }
+
+    return(0);
+}
+
 static void set_aes_cbc_iv(transop_aes_t *priv, n2n_aes_ivec_t ivec, uint64_t iv_seed) {
     uint8_t iv_full[N2N_AES_IVEC_SIZE];
+    int outl;
 
     /* Extend the seed to full block size with padding value */
     memcpy(iv_full, priv->iv_pad_val, TRANSOP_AES_IV_PADDING_SIZE);
@@ -69,7 +100,7 @@ static void set_aes_cbc_iv(transop_aes_t *priv, n2n_aes_ivec_t ivec, uint64_t iv
      * can be easily reconstructed from plaintext headers and used by an attacker
      * to perform differential analysis.
      */
-    AES_ecb_encrypt(iv_full, ivec, &priv->iv_enc_key, AES_ENCRYPT);
+    EVP_EncryptUpdate(priv->iv_ctx, ivec, &outl, iv_full, N2N_AES_IVEC_SIZE);
 }
 
 /** The aes packet format consists of:
@@ -105,11 +136,8 @@ static int transop_encode_aes( n2n_trans_op_t * arg,
             /* Encode the aes format version. */
             encode_uint8( outbuf, &idx, N2N_AES_TRANSFORM_VERSION);
 
-            /* Generate and encode the IV seed.
-             * Using two calls to rand() because RAND_MAX is usually < 64bit
-             * (e.g. linux) and sometimes < 32bit (e.g. Windows).
-             */
-            iv_seed = ((((uint64_t)rand() & 0xFFFFFFFF)) << 32) | rand();
+            /* Generate and encode the IV seed. */
+            iv_seed = n2n_rand64();
             encode_buf(outbuf, &idx, &iv_seed, TRANSOP_AES_IV_SEED_SIZE);
 
             /* Encrypt the assembly contents and write the ciphertext after the iv seed. */
@@ -129,10 +157,11 @@ static int transop_encode_aes( n2n_trans_op_t * arg,
 
             set_aes_cbc_iv(priv, enc_ivec, iv_seed);
 
-            AES_cbc_encrypt( assembly, /* source */
-                             outbuf + TRANSOP_AES_PREAMBLE_SIZE, /* dest */
-                             len2, /* enc size */
-                             &(priv->enc_key), enc_ivec, AES_ENCRYPT);
+            if ( aes_cbc_crypt( priv->enc_ctx, assembly, /* source */
+                                outbuf + TRANSOP_AES_PREAMBLE_SIZE, /* dest */
+                                len2, /* enc size */
+                                enc_ivec) != 0 )
+                return -1;
 
             len2 += TRANSOP_AES_PREAMBLE_SIZE; /* size of data carried in UDP. */
         } else
@@ -177,18 +206,20 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
             if ( 0 == (len % AES_BLOCK_SIZE)) {
                 uint8_t padding;
                 n2n_aes_ivec_t dec_ivec = {0};
+                /* Decrypt straight into outbuf when the padding fits */
+                uint8_t * plain = ((size_t)len <= out_len) ? outbuf : assembly;
 
                 set_aes_cbc_iv(priv, dec_ivec, iv_seed);
 
-                AES_cbc_encrypt( (inbuf + TRANSOP_AES_PREAMBLE_SIZE),
-                                 assembly, /* destination */
-                                 len, 
-                                 &(priv->dec_key),
-                                 dec_ivec, AES_DECRYPT);
+                if ( (len == 0)
+                     || (aes_cbc_crypt( priv->dec_ctx, (inbuf + TRANSOP_AES_PREAMBLE_SIZE),
+                                        plain, /* destination */
+                                        len, dec_ivec) != 0) )
+                    return 0;
 
                 /* last byte is how much was padding: max value should be
                  * AES_BLOCKSIZE-1 */
-                padding = assembly[ len-1 ] & 0xff; 
+                padding = plain[ len-1 ] & 0xff; 
 
                 if ( len >= padding)
                 {
@@ -198,11 +229,14 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
                     traceEvent(TRACE_DEBUG, "padding = %u", padding);
                     len -= padding;
 
-                    memcpy( outbuf, 
-                            assembly, 
-                            len);
-                } else
+                    if ( plain != outbuf )
+                        memcpy( outbuf, 
+                                assembly, 
+                                len);
+                } else {
                     traceEvent(TRACE_WARNING, "UDP payload decryption failed.");
+                    len = 0;
+                }
             } else {
                 traceEvent(TRACE_WARNING, "Encrypted length %d is not a multiple of AES_BLOCK_SIZE (%d)", len, AES_BLOCK_SIZE);
                 len = 0;
@@ -215,6 +249,111 @@ static int transop_decode_aes( n2n_trans_op_t * arg,
     return len;
 }
 
+/* In place variant of transop_encode_aes: the frame in buf is padded in the
+ * tailroom, encrypted where it is and the preamble pushed in front of it. */
+static int transop_encode_aes_inplace( n2n_trans_op_t * arg,
+                                       n2n_buf_t * buf,
+                                       const uint8_t * peer_mac)
+{
+    transop_aes_t * priv = (transop_aes_t *)arg->priv;
+    size_t len = buf->len;
+    size_t len2;
+    size_t idx=0;
+    uint64_t iv_seed = 0;
+    uint8_t padding;
+    uint8_t * preamble;
+    n2n_aes_ivec_t enc_ivec = {0};
+
+    /* Need at least one encrypted byte at the end for the padding. */
+    len2 = ( (len / AES_BLOCK_SIZE) + 1) * AES_BLOCK_SIZE;
+    padding = (len2-len);
+
+    if ( (n2n_buf_headroom(buf) < TRANSOP_AES_PREAMBLE_SIZE) || (n2n_buf_tailroom(buf) < padding) ) {
+        traceEvent(TRACE_ERROR, "encode_aes no room for preamble and padding.");
+        return -1;
+    }
+
+    traceEvent(TRACE_DEBUG, "encode_aes in place %lu", len);
+
+    memset( n2n_buf_put(buf, padding), 0, padding );
+    buf->data[len2 - 1] = padding;
+
+    iv_seed = n2n_rand64();
+    traceEvent(TRACE_DEBUG, "padding = %u, seed = %016llx", padding, iv_seed);
+
+    set_aes_cbc_iv(priv, enc_ivec, iv_seed);
+
+    if ( aes_cbc_crypt( priv->enc_ctx, buf->data, buf->data, len2, enc_ivec) != 0 ) {
+        buf->len = len;
+        return -1;
+    }
+
+    preamble = n2n_buf_push(buf, TRANSOP_AES_PREAMBLE_SIZE);
+    encode_uint8( preamble, &idx, N2N_AES_TRANSFORM_VERSION);
+    encode_buf( preamble, &idx, &iv_seed, TRANSOP_AES_IV_SEED_SIZE);
+
+    return 0;
+}
+
+/* In place variant of transop_decode_aes: the frame is decrypted over the
+ * ciphertext, right after the preamble. */
+static int transop_decode_aes_inplace( n2n_trans_op_t * arg,
+                                       uint8_t * buf,
+                                       size_t in_len,
+                                       uint8_t ** out,
+                                       const uint8_t * peer_mac)
+{
+    transop_aes_t * priv = (transop_aes_t *)arg->priv;
+    size_t rem=in_len;
+    size_t idx=0;
+    size_t len;
+    uint8_t aes_enc_ver=0;
+    uint64_t iv_seed=0;
+    uint8_t padding;
+    n2n_aes_ivec_t dec_ivec = {0};
+
+    if ( in_len < (TRANSOP_AES_PREAMBLE_SIZE + AES_BLOCK_SIZE) ) {
+        traceEvent(TRACE_ERROR, "decode_aes inbuf wrong size (%ul) to decrypt.", in_len);
+        return 0;
+    }
+
+    decode_uint8( &aes_enc_ver, buf, &rem, &idx );
+
+    if ( N2N_AES_TRANSFORM_VERSION != aes_enc_ver ) {
+        traceEvent(TRACE_ERROR, "decode_aes unsupported aes version %u.", aes_enc_ver);
+        return 0;
+    }
+
+    decode_buf((uint8_t *)&iv_seed, TRANSOP_AES_IV_SEED_SIZE, buf, &rem, &idx);
+
+    traceEvent(TRACE_DEBUG, "decode_aes in place %lu with seed %016llx", in_len, iv_seed);
+
+    len = (in_len - TRANSOP_AES_PREAMBLE_SIZE);
+
+    if ( 0 != (len % AES_BLOCK_SIZE) ) {
+        traceEvent(TRACE_WARNING, "Encrypted length %d is not a multiple of AES_BLOCK_SIZE (%d)", (int)len, AES_BLOCK_SIZE);
+        return 0;
+    }
+
+    set_aes_cbc_iv(priv, dec_ivec, iv_seed);
+
+    *out = buf + TRANSOP_AES_PREAMBLE_SIZE;
+
+    if ( aes_cbc_crypt( priv->dec_ctx, *out, *out, len, dec_ivec) != 0 )
+        return 0;
+
+    padding = (*out)[ len-1 ] & 0xff;
+
+    if ( len < padding ) {
+        traceEvent(TRACE_WARNING, "UDP payload decryption failed.");
+        return 0;
+    }
+
+    traceEvent(TRACE_DEBUG, "padding = %u", padding);
+
+    return (len - padding);
+}
+
 static int setup_aes_key(transop_aes_t *priv, const uint8_t *key, ssize_t key_size) {
     size_t aes_key_size_bytes;
     size_t aes_key_size_bits;
@@ -222,10 +361,10 @@ static int setup_aes_key(transop_aes_t *priv, const uint8_t *key, ssize_t key_si
     uint8_t key_mat_buf[SHA512_DIGEST_LENGTH + SHA256_DIGEST_LENGTH];
     size_t key_mat_buf_length;
 
+    const EVP_CIPHER *cipher;
+
     /* Clear out any old possibly longer key matter. */
-    memset( &(priv->enc_key), 0, sizeof(priv->enc_key) );
-    memset( &(priv->dec_key), 0, sizeof(priv->dec_key) );
-    memset( &(priv->iv_enc_key), 0, sizeof(priv->iv_enc_key) );
+    free_aes_ctx(priv);
     memset( &(priv->iv_pad_val), 0, sizeof(priv->iv_pad_val) );
 
     /* Let the user choose the degree of encryption:
@@ -246,12 +385,14 @@ static int setup_aes_key(transop_aes_t *priv, const uint8_t *key, ssize_t key_si
     if (key_size >= 65)
     {
         aes_key_size_bytes = AES256_KEY_BYTES;
+        cipher = EVP_aes_256_cbc();
         SHA512(key, key_size, key_mat_buf);
         key_mat_buf_length = SHA512_DIGEST_LENGTH;
     }
     else if (key_size >= 44)
     {
         aes_key_size_bytes = AES192_KEY_BYTES;
+        cipher = EVP_aes_192_cbc();
         SHA384(key, key_size, key_mat_buf);
 	/* append a hash of the first hash to create enough material for IV padding */
         SHA256(key_mat_buf, SHA384_DIGEST_LENGTH, key_mat_buf + SHA384_DIGEST_LENGTH);
@@ -260,6 +401,7 @@ static int setup_aes_key(transop_aes_t *priv, const uint8_t *key, ssize_t key_si
     else
     {
         aes_key_size_bytes = AES128_KEY_BYTES;
+        cipher = EVP_aes_128_cbc();
         SHA256(key, key_size, key_mat_buf);
 	/* append a hash of the first hash to create enough material for IV padding */
         SHA256(key_mat_buf, SHA256_DIGEST_LENGTH, key_mat_buf + SHA256_DIGEST_LENGTH);
@@ -275,13 +417,26 @@ static int setup_aes_key(transop_aes_t *priv, const uint8_t *key, ssize_t key_si
 	return(1);
     }
 
-    /* setup of enc_key/dec_key, used for the CBC encryption */
+    /* setup of enc_ctx/dec_ctx, used for the CBC encryption, and of iv_ctx
+     * (AES128 ECB) and iv_pad_val, used for generating the CBC IV. The
+     * packets carry their own padding. */
     aes_key_size_bits = 8 * aes_key_size_bytes;
-    AES_set_encrypt_key(key_mat_buf, aes_key_size_bits, &(priv->enc_key));
-    AES_set_decrypt_key(key_mat_buf, aes_key_size_bits, &(priv->dec_key));
 
-    /* setup of iv_enc_key (AES128 key) and iv_pad_val, used for generating the CBC IV */
-    AES_set_encrypt_key(key_mat_buf + aes_key_size_bytes, TRANSOP_AES_IV_KEY_BYTES * 8, &(priv->iv_enc_key));
+    if ( ((priv->enc_ctx = EVP_CIPHER_CTX_new()) == NULL)
+         || ((priv->dec_ctx = EVP_CIPHER_CTX_new()) == NULL)
+         || ((priv->iv_ctx = EVP_CIPHER_CTX_new()) == NULL)
+         || (EVP_EncryptInit_ex(priv->enc_ctx, cipher, NULL, key_mat_buf, NULL) != 1)
+         || (EVP_DecryptInit_ex(priv->dec_ctx, cipher, NULL, key_mat_buf, NULL) != 1)
+         || (EVP_EncryptInit_ex(priv->iv_ctx, EVP_aes_128_ecb(), NULL, key_mat_buf + aes_key_size_bytes, NULL) != 1) ) {
+        traceEvent( TRACE_ERROR, "AES %u bits setup failed", aes_key_size_bits );
+        free_aes_ctx(priv);
+        return(-1);
+    }
+
+    EVP_CIPHER_CTX_set_padding(priv->enc_ctx, 0);
+    EVP_CIPHER_CTX_set_padding(priv->dec_ctx, 0);
+    EVP_CIPHER_CTX_set_padding(priv->iv_ctx, 0);
+
     memcpy(priv->iv_pad_val, key_mat_buf + aes_key_size_bytes + TRANSOP_AES_IV_KEY_BYTES, TRANSOP_AES_IV_PADDING_SIZE);
 
     traceEvent(TRACE_DEBUG, "AES %u bits setup completed\n",
@@ -305,6 +460,8 @@ int n2n_transop_aes_cbc_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
   ttt->deinit = transop_deinit_aes;
   ttt->fwd = transop_encode_aes;
   ttt->rev = transop_decode_aes;
+  ttt->fwd_inplace = transop_encode_aes_inplace;
+  ttt->rev_inplace = transop_decode_aes_inplace;
 
   priv = (transop_aes_t*) calloc(1, sizeof(transop_aes_t));
   if(!priv) {
@@ -0,0 +1,340 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+
+#ifdef N2N_HAVE_AES
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define N2N_AES_GCM_TRANSFORM_VERSION   1  /* version of the transform encoding */
+
+/* AES-GCM plaintext preamble and trailer */
+#define TRANSOP_AES_GCM_VER_SIZE        1  /* Support minor variants in encoding in one module. */
+#define TRANSOP_AES_GCM_SALT_SIZE       4
+#define TRANSOP_AES_GCM_NONCE_SIZE      12 /* salt + 64-bit counter, the GCM standard IV size */
+#define TRANSOP_AES_GCM_PREAMBLE_SIZE   (TRANSOP_AES_GCM_VER_SIZE + TRANSOP_AES_GCM_NONCE_SIZE)
+#define TRANSOP_AES_GCM_TAG_SIZE        16
+
+/* Keeps the keys derived for AES-GCM apart from the ones of AES-CBC */
+#define TRANSOP_AES_GCM_KEY_LABEL       "n2n AES-GCM"
+
+typedef struct transop_aes_gcm {
+  EVP_CIPHER_CTX *    enc_ctx;        /* tx key schedule, set up once */
+  EVP_CIPHER_CTX *    dec_ctx;        /* rx key schedule, set up once */
+  uint8_t             salt[TRANSOP_AES_GCM_SALT_SIZE]; /* random, per instance */
+  uint64_t            nonce_ctr;      /* random start, incremented per packet */
+} transop_aes_gcm_t;
+
+static int transop_deinit_aes_gcm( n2n_trans_op_t * arg ) {
+  transop_aes_gcm_t *priv = (transop_aes_gcm_t *)arg->priv;
+
+  if(priv) {
+    if(priv->enc_ctx) EVP_CIPHER_CTX_free(priv->enc_ctx);
+    if(priv->dec_ctx) EVP_CIPHER_CTX_free(priv->dec_ctx);
+    free(priv);
+  }
+
+  return 0;
+}
+
+/** The aes-gcm packet format consists of:
+ *
+ *  - a 8-bit aes-gcm encoding version in clear text, authenticated
+ *  - a 96-bit nonce: a 32-bit random salt and a 64-bit counter
+ *  - the encrypted payload, as long as the plaintext
+ *  - a 128-bit authentication tag.
+ *
+ *  [V|NNNNNNNNNNNN|DDDDDDDDDDDDDDDDDDDDD|TTTTTTTTTTTTTTTT]
+ *                 |<---- encrypted ---->|
+ *
+ *  The nonce never repeats under a key: each transop instance picks its
+ *  own salt and counter start at random, as the edges of a community and
+ *  the workers of an edge all share the key.
+ */
+static void aes_gcm_next_nonce( transop_aes_gcm_t * priv, uint8_t * nonce ) {
+  uint64_t ctr = priv->nonce_ctr++;
+
+  memcpy( nonce, priv->salt, TRANSOP_AES_GCM_SALT_SIZE );
+  memcpy( nonce + TRANSOP_AES_GCM_SALT_SIZE, &ctr, sizeof(ctr) );
+}
+
+/* Encrypt len bytes from in to out (which may be the same) and write the tag.
+ * The preamble holds the version and the nonce. */
+static int aes_gcm_seal( transop_aes_gcm_t * priv, const uint8_t * preamble,
+                         const uint8_t * in, size_t len, uint8_t * out, uint8_t * tag ) {
+  int outl, finl;
+
+  if ( (EVP_EncryptInit_ex( priv->enc_ctx, NULL, NULL, NULL, preamble + TRANSOP_AES_GCM_VER_SIZE ) != 1)
+       || (EVP_EncryptUpdate( priv->enc_ctx, NULL, &outl, preamble, TRANSOP_AES_GCM_VER_SIZE ) != 1)
+       || (EVP_EncryptUpdate( priv->enc_ctx, out, &outl, in, len ) != 1)
+       || (EVP_EncryptFinal_ex( priv->enc_ctx, out + outl, &finl ) != 1)
+       || (EVP_CIPHER_CTX_ctrl( priv->enc_ctx, EVP_CTRL_GCM_GET_TAG, TRANSOP_AES_GCM_TAG_SIZE, tag ) != 1) )
+    return -1;
+
+  return 0;
+}
+
+/* Check the tag and decrypt len bytes from in to out (which may be the same).
+ * @return 0 on success, -1 when the packet does not authenticate */
+static int aes_gcm_open( transop_aes_gcm_t * priv, const uint8_t * preamble,
+                         const uint8_t * in, size_t len, uint8_t * out, const uint8_t * tag ) {
+  int outl, finl;
+
+  if ( (EVP_DecryptInit_ex( priv->dec_ctx, NULL, NULL, NULL, preamble + TRANSOP_AES_GCM_VER_SIZE ) != 1)
+       || (EVP_DecryptUpdate( priv->dec_ctx, NULL, &outl, preamble, TRANSOP_AES_GCM_VER_SIZE ) != 1)
+       || (EVP_DecryptUpdate( priv->dec_ctx, out, &outl, in, len ) != 1)
+       || (EVP_CIPHER_CTX_ctrl( priv->dec_ctx, EVP_CTRL_GCM_SET_TAG, TRANSOP_AES_GCM_TAG_SIZE, (void *)tag ) != 1)
+       || (EVP_DecryptFinal_ex( priv->dec_ctx, out + outl, &finl ) != 1) )
+    return -1;
+
+  return 0;
+}
+
+static int transop_encode_aes_gcm( n2n_trans_op_t * arg,
+                                   uint8_t * outbuf,
+                                   size_t out_len,
+                                   const uint8_t * inbuf,
+                                   size_t in_len,
+                                   const uint8_t * peer_mac)
+{
+  transop_aes_gcm_t * priv = (transop_aes_gcm_t *)arg->priv;
+  size_t idx=0;
+
+  if ( in_len > N2N_PKT_BUF_SIZE )
+    {
+      traceEvent( TRACE_ERROR, "encode_aes_gcm inbuf too big to encrypt." );
+      return -1;
+    }
+
+  if ( (in_len + TRANSOP_AES_GCM_PREAMBLE_SIZE + TRANSOP_AES_GCM_TAG_SIZE) > out_len )
+    {
+      traceEvent( TRACE_ERROR, "encode_aes_gcm outbuf too small." );
+      return -1;
+    }
+
+  traceEvent( TRACE_DEBUG, "encode_aes_gcm %lu", in_len );
+
+  encode_uint8( outbuf, &idx, N2N_AES_GCM_TRANSFORM_VERSION );
+  aes_gcm_next_nonce( priv, outbuf + idx );
+
+  if ( aes_gcm_seal( priv, outbuf, inbuf, in_len, outbuf + TRANSOP_AES_GCM_PREAMBLE_SIZE,
+                     outbuf + TRANSOP_AES_GCM_PREAMBLE_SIZE + in_len ) != 0 )
+    {
+      traceEvent( TRACE_ERROR, "encode_aes_gcm encryption failed." );
+      return -1;
+    }
+
+  return (in_len + TRANSOP_AES_GCM_PREAMBLE_SIZE + TRANSOP_AES_GCM_TAG_SIZE);
+}
+
+/* See transop_encode_aes_gcm for packet format */
+static int transop_decode_aes_gcm( n2n_trans_op_t * arg,
+                                   uint8_t * outbuf,
+                                   size_t out_len,
+                                   const uint8_t * inbuf,
+                                   size_t in_len,
+                                   const uint8_t * peer_mac)
+{
+  transop_aes_gcm_t * priv = (transop_aes_gcm_t *)arg->priv;
+  size_t len;
+
+  if ( in_len < (TRANSOP_AES_GCM_PREAMBLE_SIZE + TRANSOP_AES_GCM_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "decode_aes_gcm inbuf wrong size (%ul) to decrypt.", in_len );
+      return 0;
+    }
+
+  if ( N2N_AES_GCM_TRANSFORM_VERSION != inbuf[0] )
+    {
+      traceEvent( TRACE_ERROR, "decode_aes_gcm unsupported aes-gcm version %u.", inbuf[0] );
+      return 0;
+    }
+
+  len = in_len - TRANSOP_AES_GCM_PREAMBLE_SIZE - TRANSOP_AES_GCM_TAG_SIZE;
+
+  if ( len > out_len )
+    {
+      traceEvent( TRACE_ERROR, "decode_aes_gcm outbuf too small." );
+      return 0;
+    }
+
+  traceEvent( TRACE_DEBUG, "decode_aes_gcm %lu", in_len );
+
+  if ( aes_gcm_open( priv, inbuf, inbuf + TRANSOP_AES_GCM_PREAMBLE_SIZE, len, outbuf,
+                     inbuf + TRANSOP_AES_GCM_PREAMBLE_SIZE + len ) != 0 )
+    {
+      traceEvent( TRACE_WARNING, "UDP payload authentication failed." );
+      return 0;
+    }
+
+  return len;
+}
+
+/* In place variant of transop_encode_aes_gcm: the frame in buf is encrypted
+ * where it is, the tag put into the tailroom and the preamble pushed in front
+ * of it. */
+static int transop_encode_aes_gcm_inplace( n2n_trans_op_t * arg,
+                                           n2n_buf_t * buf,
+                                           const uint8_t * peer_mac)
+{
+  transop_aes_gcm_t * priv = (transop_aes_gcm_t *)arg->priv;
+  uint8_t preamble[TRANSOP_AES_GCM_PREAMBLE_SIZE];
+  size_t len = buf->len;
+  size_t idx=0;
+
+  if ( (n2n_buf_headroom(buf) < TRANSOP_AES_GCM_PREAMBLE_SIZE)
+       || (n2n_buf_tailroom(buf) < TRANSOP_AES_GCM_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "encode_aes_gcm no room for preamble and tag." );
+      return -1;
+    }
+
+  traceEvent( TRACE_DEBUG, "encode_aes_gcm in place %lu", len );
+
+  encode_uint8( preamble, &idx, N2N_AES_GCM_TRANSFORM_VERSION );
+  aes_gcm_next_nonce( priv, preamble + idx );
+
+  if ( aes_gcm_seal( priv, preamble, buf->data, len, buf->data, buf->data + len ) != 0 )
+    {
+      traceEvent( TRACE_ERROR, "encode_aes_gcm encryption failed." );
+      return -1;
+    }
+
+  n2n_buf_put( buf, TRANSOP_AES_GCM_TAG_SIZE );
+  memcpy( n2n_buf_push(buf, TRANSOP_AES_GCM_PREAMBLE_SIZE), preamble, TRANSOP_AES_GCM_PREAMBLE_SIZE );
+
+  return 0;
+}
+
+/* In place variant of transop_decode_aes_gcm: the frame is decrypted over the
+ * ciphertext, right after the preamble. */
+static int transop_decode_aes_gcm_inplace( n2n_trans_op_t * arg,
+                                           uint8_t * buf,
+                                           size_t in_len,
+                                           uint8_t ** out,
+                                           const uint8_t * peer_mac)
+{
+  transop_aes_gcm_t * priv = (transop_aes_gcm_t *)arg->priv;
+  size_t len;
+
+  if ( in_len < (TRANSOP_AES_GCM_PREAMBLE_SIZE + TRANSOP_AES_GCM_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "decode_aes_gcm inbuf wrong size (%ul) to decrypt.", in_len );
+      return 0;
+    }
+
+  if ( N2N_AES_GCM_TRANSFORM_VERSION != buf[0] )
+    {
+      traceEvent( TRACE_ERROR, "decode_aes_gcm unsupported aes-gcm version %u.", buf[0] );
+      return 0;
+    }
+
+  len = in_len - TRANSOP_AES_GCM_PREAMBLE_SIZE - TRANSOP_AES_GCM_TAG_SIZE;
+
+  traceEvent( TRACE_DEBUG, "decode_aes_gcm in place %lu", in_len );
+
+  *out = buf + TRANSOP_AES_GCM_PREAMBLE_SIZE;
+
+  if ( aes_gcm_open( priv, buf, *out, len, *out, *out + len ) != 0 )
+    {
+      traceEvent( TRACE_WARNING, "UDP payload authentication failed." );
+      return 0;
+    }
+
+  return len;
+}
+
+/* The key size follows the length of the user key, as for AES-CBC: long input
+ * keys pick AES192 or AES256. The key is hashed, together with a label, and
+ * the hash prefix used as the AES key. */
+static int setup_aes_gcm_key( transop_aes_gcm_t * priv, const uint8_t * key, size_t key_size ) {
+  const EVP_CIPHER *cipher;
+  const EVP_MD *md;
+  EVP_MD_CTX *md_ctx;
+  uint8_t key_mat[EVP_MAX_MD_SIZE];
+  int rc = -1;
+
+  if ( key_size >= 65 )
+    cipher = EVP_aes_256_gcm(), md = EVP_sha512();
+  else if ( key_size >= 44 )
+    cipher = EVP_aes_192_gcm(), md = EVP_sha384();
+  else
+    cipher = EVP_aes_128_gcm(), md = EVP_sha256();
+
+  if ( (md_ctx = EVP_MD_CTX_create()) == NULL )
+    return -1;
+
+  if ( (EVP_DigestInit_ex( md_ctx, md, NULL ) == 1)
+       && (EVP_DigestUpdate( md_ctx, TRANSOP_AES_GCM_KEY_LABEL, strlen(TRANSOP_AES_GCM_KEY_LABEL) ) == 1)
+       && (EVP_DigestUpdate( md_ctx, key, key_size ) == 1)
+       && (EVP_DigestFinal_ex( md_ctx, key_mat, NULL ) == 1)
+       /* The contexts keep the expanded key: a packet only sets its nonce */
+       && ((priv->enc_ctx = EVP_CIPHER_CTX_new()) != NULL)
+       && ((priv->dec_ctx = EVP_CIPHER_CTX_new()) != NULL)
+       && (EVP_EncryptInit_ex( priv->enc_ctx, cipher, NULL, key_mat, NULL ) == 1)
+       && (EVP_DecryptInit_ex( priv->dec_ctx, cipher, NULL, key_mat, NULL ) == 1) ) {
+    traceEvent( TRACE_DEBUG, "AES-GCM %u bits setup completed", EVP_CIPHER_key_length(cipher) * 8 );
+    rc = 0;
+  } else
+    traceEvent( TRACE_ERROR, "AES-GCM key setup failed" );
+
+  EVP_MD_CTX_destroy( md_ctx );
+  memset( key_mat, 0, sizeof(key_mat) );
+
+  return rc;
+}
+
+static void transop_tick_aes_gcm( n2n_trans_op_t * arg, time_t now ) {}
+
+/* AES-GCM initialization function */
+int n2n_transop_aes_gcm_init( const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt ) {
+  transop_aes_gcm_t *priv;
+  const u_char *encrypt_key = (const u_char *)conf->encrypt_key;
+  size_t encrypt_key_len = strlen(conf->encrypt_key);
+
+  memset(ttt, 0, sizeof(*ttt));
+  ttt->transform_id = N2N_TRANSFORM_ID_AESGCM;
+
+  ttt->tick = transop_tick_aes_gcm;
+  ttt->deinit = transop_deinit_aes_gcm;
+  ttt->fwd = transop_encode_aes_gcm;
+  ttt->rev = transop_decode_aes_gcm;
+  ttt->fwd_inplace = transop_encode_aes_gcm_inplace;
+  ttt->rev_inplace = transop_decode_aes_gcm_inplace;
+
+  priv = (transop_aes_gcm_t*) calloc(1, sizeof(transop_aes_gcm_t));
+  if(!priv) {
+    traceEvent(TRACE_ERROR, "cannot allocate transop_aes_gcm_t memory");
+    return(-1);
+  }
+  ttt->priv = priv;
+
+  if((RAND_bytes(priv->salt, sizeof(priv->salt)) != 1)
+     || (RAND_bytes((uint8_t *)&priv->nonce_ctr, sizeof(priv->nonce_ctr)) != 1)) {
+    traceEvent(TRACE_ERROR, "cannot generate the AES-GCM nonce salt");
+    return(-1);
+  }
+
+  /* Setup the key */
+  return(setup_aes_gcm_key(priv, encrypt_key, encrypt_key_len));
+}
+
+#endif /* N2N_HAVE_AES */
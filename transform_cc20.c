@@ -0,0 +1,492 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+#include "n2n.h"
+#include "n2n_transforms.h"
+#include "chacha20.h"
+
+#define N2N_CC20_TRANSFORM_VERSION      1  /* version of the transform encoding */
+
+/* ChaCha20-Poly1305 plaintext preamble and trailer */
+#define TRANSOP_CC20_VER_SIZE           1  /* Support minor variants in encoding in one module. */
+#define TRANSOP_CC20_SALT_SIZE          4
+#define TRANSOP_CC20_PREAMBLE_SIZE      (TRANSOP_CC20_VER_SIZE + CHACHA20_NONCE_SIZE)
+
+#define TRANSOP_CC20_BATCH              16 /* packets sealed or opened per chacha20 batch call */
+
+/* Hashed with the user key, so that the same key used with another cipher
+ * gives an unrelated ChaCha20 key */
+#define TRANSOP_CC20_KEY_LABEL          "n2n ChaCha20-Poly1305"
+
+typedef struct transop_cc20 {
+  chacha20_key_t      key;
+  uint8_t             salt[TRANSOP_CC20_SALT_SIZE]; /* random, per instance */
+  uint64_t            nonce_ctr;      /* random start, incremented per packet */
+} transop_cc20_t;
+
+static int transop_deinit_cc20( n2n_trans_op_t * arg ) {
+  transop_cc20_t *priv = (transop_cc20_t *)arg->priv;
+
+  if(priv) {
+    memset(priv, 0, sizeof(*priv));
+    free(priv);
+  }
+
+  return 0;
+}
+
+/** The chacha20-poly1305 packet format is the one of aes-gcm:
+ *
+ *  - a 8-bit encoding version in clear text, authenticated
+ *  - a 96-bit nonce: a 32-bit random salt and a 64-bit counter
+ *  - the encrypted payload, as long as the plaintext
+ *  - a 128-bit Poly1305 tag.
+ *
+ *  [V|NNNNNNNNNNNN|DDDDDDDDDDDDDDDDDDDDD|TTTTTTTTTTTTTTTT]
+ *                 |<---- encrypted ---->|
+ */
+static void cc20_next_preamble( transop_cc20_t * priv, uint8_t * preamble ) {
+  uint64_t ctr = priv->nonce_ctr++;
+  size_t idx=0;
+
+  encode_uint8( preamble, &idx, N2N_CC20_TRANSFORM_VERSION );
+  memcpy( preamble + idx, priv->salt, TRANSOP_CC20_SALT_SIZE );
+  memcpy( preamble + idx + TRANSOP_CC20_SALT_SIZE, &ctr, sizeof(ctr) );
+}
+
+static int transop_encode_cc20( n2n_trans_op_t * arg,
+                                uint8_t * outbuf,
+                                size_t out_len,
+                                const uint8_t * inbuf,
+                                size_t in_len,
+                                const uint8_t * peer_mac)
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+
+  if ( in_len > N2N_PKT_BUF_SIZE )
+    {
+      traceEvent( TRACE_ERROR, "encode_cc20 inbuf too big to encrypt." );
+      return -1;
+    }
+
+  if ( (in_len + TRANSOP_CC20_PREAMBLE_SIZE + POLY1305_TAG_SIZE) > out_len )
+    {
+      traceEvent( TRACE_ERROR, "encode_cc20 outbuf too small." );
+      return -1;
+    }
+
+  traceEvent( TRACE_DEBUG, "encode_cc20 %lu", in_len );
+
+  cc20_next_preamble( priv, outbuf );
+  chacha20_poly1305_seal( &priv->key, outbuf + TRANSOP_CC20_VER_SIZE, outbuf, TRANSOP_CC20_VER_SIZE,
+                          inbuf, in_len, outbuf + TRANSOP_CC20_PREAMBLE_SIZE,
+                          outbuf + TRANSOP_CC20_PREAMBLE_SIZE + in_len );
+
+  return (in_len + TRANSOP_CC20_PREAMBLE_SIZE + POLY1305_TAG_SIZE);
+}
+
+/* See transop_encode_cc20 for packet format */
+static int transop_decode_cc20( n2n_trans_op_t * arg,
+                                uint8_t * outbuf,
+                                size_t out_len,
+                                const uint8_t * inbuf,
+                                size_t in_len,
+                                const uint8_t * peer_mac)
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+  size_t len;
+
+  if ( in_len < (TRANSOP_CC20_PREAMBLE_SIZE + POLY1305_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "decode_cc20 inbuf wrong size (%ul) to decrypt.", in_len );
+      return 0;
+    }
+
+  if ( N2N_CC20_TRANSFORM_VERSION != inbuf[0] )
+    {
+      traceEvent( TRACE_ERROR, "decode_cc20 unsupported cc20 version %u.", inbuf[0] );
+      return 0;
+    }
+
+  len = in_len - TRANSOP_CC20_PREAMBLE_SIZE - POLY1305_TAG_SIZE;
+
+  if ( len > out_len )
+    {
+      traceEvent( TRACE_ERROR, "decode_cc20 outbuf too small." );
+      return 0;
+    }
+
+  traceEvent( TRACE_DEBUG, "decode_cc20 %lu", in_len );
+
+  if ( chacha20_poly1305_open( &priv->key, inbuf + TRANSOP_CC20_VER_SIZE, inbuf, TRANSOP_CC20_VER_SIZE,
+                               inbuf + TRANSOP_CC20_PREAMBLE_SIZE, len, outbuf,
+                               inbuf + TRANSOP_CC20_PREAMBLE_SIZE + len ) != 0 )
+    {
+      traceEvent( TRACE_WARNING, "UDP payload authentication failed." );
+      return 0;
+    }
+
+  return len;
+}
+
+/* In place variant of transop_encode_cc20: the frame in buf is encrypted
+ * where it is, the tag put into the tailroom and the preamble pushed in front
+ * of it. */
+static int transop_encode_cc20_inplace( n2n_trans_op_t * arg,
+                                        n2n_buf_t * buf,
+                                        const uint8_t * peer_mac)
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+  uint8_t preamble[TRANSOP_CC20_PREAMBLE_SIZE];
+  size_t len = buf->len;
+
+  if ( (n2n_buf_headroom(buf) < TRANSOP_CC20_PREAMBLE_SIZE)
+       || (n2n_buf_tailroom(buf) < POLY1305_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "encode_cc20 no room for preamble and tag." );
+      return -1;
+    }
+
+  traceEvent( TRACE_DEBUG, "encode_cc20 in place %lu", len );
+
+  cc20_next_preamble( priv, preamble );
+  chacha20_poly1305_seal( &priv->key, preamble + TRANSOP_CC20_VER_SIZE, preamble, TRANSOP_CC20_VER_SIZE,
+                          buf->data, len, buf->data, buf->data + len );
+
+  n2n_buf_put( buf, POLY1305_TAG_SIZE );
+  memcpy( n2n_buf_push(buf, TRANSOP_CC20_PREAMBLE_SIZE), preamble, TRANSOP_CC20_PREAMBLE_SIZE );
+
+  return 0;
+}
+
+/* In place variant of transop_decode_cc20: the frame is decrypted over the
+ * ciphertext, right after the preamble. */
+static int transop_decode_cc20_inplace( n2n_trans_op_t * arg,
+                                        uint8_t * buf,
+                                        size_t in_len,
+                                        uint8_t ** out,
+                                        const uint8_t * peer_mac)
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+  size_t len;
+
+  if ( in_len < (TRANSOP_CC20_PREAMBLE_SIZE + POLY1305_TAG_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "decode_cc20 inbuf wrong size (%ul) to decrypt.", in_len );
+      return 0;
+    }
+
+  if ( N2N_CC20_TRANSFORM_VERSION != buf[0] )
+    {
+      traceEvent( TRACE_ERROR, "decode_cc20 unsupported cc20 version %u.", buf[0] );
+      return 0;
+    }
+
+  len = in_len - TRANSOP_CC20_PREAMBLE_SIZE - POLY1305_TAG_SIZE;
+
+  traceEvent( TRACE_DEBUG, "decode_cc20 in place %lu", in_len );
+
+  *out = buf + TRANSOP_CC20_PREAMBLE_SIZE;
+
+  if ( chacha20_poly1305_open( &priv->key, buf + TRANSOP_CC20_VER_SIZE, buf, TRANSOP_CC20_VER_SIZE,
+                               *out, len, *out, *out + len ) != 0 )
+    {
+      traceEvent( TRACE_WARNING, "UDP payload authentication failed." );
+      return 0;
+    }
+
+  return len;
+}
+
+/* Batch variant of transop_encode_cc20_inplace: the key stream of up to
+ * TRANSOP_CC20_BATCH packets is computed together. */
+static void transop_encode_cc20_batch( n2n_trans_op_t * arg,
+                                       n2n_trans_pkt_t * pkts,
+                                       unsigned int num )
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+  chacha20_poly1305_job_t jobs[TRANSOP_CC20_BATCH];
+  unsigned int i, num_jobs = 0;
+
+  for ( i = 0; i < num; i++ )
+    {
+      n2n_buf_t * buf = pkts[i].buf;
+      chacha20_poly1305_job_t * job = &jobs[num_jobs];
+      uint8_t * preamble;
+
+      if ( (n2n_buf_headroom(buf) < TRANSOP_CC20_PREAMBLE_SIZE)
+           || (n2n_buf_tailroom(buf) < POLY1305_TAG_SIZE) )
+        {
+          traceEvent( TRACE_ERROR, "encode_cc20 no room for preamble and tag." );
+          pkts[i].rc = -1;
+          continue;
+        }
+
+      traceEvent( TRACE_DEBUG, "encode_cc20 batch %lu", buf->len );
+
+      job->in = job->out = buf->data;
+      job->len = buf->len;
+      job->tag = n2n_buf_put( buf, POLY1305_TAG_SIZE );
+
+      preamble = n2n_buf_push( buf, TRANSOP_CC20_PREAMBLE_SIZE );
+      cc20_next_preamble( priv, preamble );
+      job->nonce = preamble + TRANSOP_CC20_VER_SIZE;
+      job->aad = preamble;
+      job->aad_len = TRANSOP_CC20_VER_SIZE;
+
+      pkts[i].rc = 0;
+
+      if ( ++num_jobs == TRANSOP_CC20_BATCH )
+        {
+          chacha20_poly1305_seal_batch( &priv->key, jobs, num_jobs );
+          num_jobs = 0;
+        }
+    }
+
+  if ( num_jobs > 0 )
+    chacha20_poly1305_seal_batch( &priv->key, jobs, num_jobs );
+}
+
+/* Open the jobs of transop_decode_cc20_batch, clearing the length of the
+ * packets that do not authenticate */
+static void cc20_open_jobs( transop_cc20_t * priv, chacha20_poly1305_job_t * jobs,
+                            n2n_trans_pkt_t ** job_pkt, unsigned int num_jobs )
+{
+  unsigned int j;
+
+  if ( chacha20_poly1305_open_batch( &priv->key, jobs, num_jobs ) == 0 )
+    return;
+
+  for ( j = 0; j < num_jobs; j++ )
+    {
+      if ( jobs[j].rc != 0 )
+        {
+          traceEvent( TRACE_WARNING, "UDP payload authentication failed." );
+          job_pkt[j]->len = 0;
+        }
+    }
+}
+
+/* Batch variant of transop_decode_cc20_inplace */
+static void transop_decode_cc20_batch( n2n_trans_op_t * arg,
+                                       n2n_trans_pkt_t * pkts,
+                                       unsigned int num )
+{
+  transop_cc20_t * priv = (transop_cc20_t *)arg->priv;
+  chacha20_poly1305_job_t jobs[TRANSOP_CC20_BATCH];
+  n2n_trans_pkt_t * job_pkt[TRANSOP_CC20_BATCH];
+  unsigned int i, num_jobs = 0;
+
+  for ( i = 0; i < num; i++ )
+    {
+      n2n_trans_pkt_t * pkt = &pkts[i];
+      chacha20_poly1305_job_t * job = &jobs[num_jobs];
+
+      if ( pkt->len < (TRANSOP_CC20_PREAMBLE_SIZE + POLY1305_TAG_SIZE) )
+        {
+          traceEvent( TRACE_ERROR, "decode_cc20 inbuf wrong size (%ul) to decrypt.", pkt->len );
+          pkt->len = 0;
+          continue;
+        }
+
+      if ( N2N_CC20_TRANSFORM_VERSION != pkt->data[0] )
+        {
+          traceEvent( TRACE_ERROR, "decode_cc20 unsupported cc20 version %u.", pkt->data[0] );
+          pkt->len = 0;
+          continue;
+        }
+
+      traceEvent( TRACE_DEBUG, "decode_cc20 batch %lu", pkt->len );
+
+      job->nonce = pkt->data + TRANSOP_CC20_VER_SIZE;
+      job->aad = pkt->data;
+      job->aad_len = TRANSOP_CC20_VER_SIZE;
+      job->len = pkt->len - TRANSOP_CC20_PREAMBLE_SIZE - POLY1305_TAG_SIZE;
+      job->in = job->out = pkt->data + TRANSOP_CC20_PREAMBLE_SIZE;
+      job->tag = job->out + job->len;
+
+      pkt->data = job->out;
+      pkt->len = job->len;
+      job_pkt[num_jobs] = pkt;
+
+      if ( ++num_jobs == TRANSOP_CC20_BATCH )
+        {
+          cc20_open_jobs( priv, jobs, job_pkt, num_jobs );
+          num_jobs = 0;
+        }
+    }
+
+  if ( num_jobs > 0 )
+    cc20_open_jobs( priv, jobs, job_pkt, num_jobs );
+}
+
+/* ************************************** */
+
+/* SHA-256 (FIPS 180-4), to turn the pass phrase into a 256-bit key without
+ * depending on OpenSSL, which the small builds go without */
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n)       (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t h[8], const uint8_t *p) {
+  uint32_t w[64], a, b, c, d, e, f, g, hh;
+  int i;
+
+  for(i=0; i<16; i++)
+    w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) | ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+
+  for(i=16; i<64; i++) {
+    uint32_t s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+
+  a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+
+  for(i=0; i<64; i++) {
+    uint32_t t1 = hh + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25))
+      + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22))
+      + ((a & b) ^ (a & c) ^ (b & c));
+
+    hh = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+  }
+
+  h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+}
+
+typedef struct sha256 {
+  uint32_t      h[8];
+  uint8_t       block[64];
+  size_t        fill;
+  uint64_t      total;
+} sha256_t;
+
+static void sha256_init(sha256_t *st) {
+  static const uint32_t h0[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+  memcpy(st->h, h0, sizeof(h0));
+  st->fill = 0;
+  st->total = 0;
+}
+
+static void sha256_update(sha256_t *st, const uint8_t *data, size_t len) {
+  st->total += len;
+
+  while(len > 0) {
+    size_t n = sizeof(st->block) - st->fill;
+
+    if(n > len) n = len;
+
+    memcpy(st->block + st->fill, data, n);
+    st->fill += n, data += n, len -= n;
+
+    if(st->fill == sizeof(st->block)) {
+      sha256_block(st->h, st->block);
+      st->fill = 0;
+    }
+  }
+}
+
+static void sha256_final(sha256_t *st, uint8_t digest[32]) {
+  uint64_t bits = st->total * 8;
+  uint8_t pad = 0x80;
+  int i;
+
+  sha256_update(st, &pad, 1);
+
+  pad = 0;
+  while(st->fill != (sizeof(st->block) - 8))
+    sha256_update(st, &pad, 1);
+
+  for(i=7; i>=0; i--) {
+    uint8_t b = (uint8_t)(bits >> (8 * i));
+
+    sha256_update(st, &b, 1);
+  }
+
+  for(i=0; i<8; i++) {
+    digest[4*i]   = (uint8_t)(st->h[i] >> 24);
+    digest[4*i+1] = (uint8_t)(st->h[i] >> 16);
+    digest[4*i+2] = (uint8_t)(st->h[i] >> 8);
+    digest[4*i+3] = (uint8_t)st->h[i];
+  }
+
+  memset(st, 0, sizeof(*st));
+}
+
+/* key = SHA-256(label || pass phrase) */
+static void cc20_derive_key(const uint8_t *key, size_t key_len, uint8_t digest[CHACHA20_KEY_SIZE]) {
+  sha256_t st;
+
+  sha256_init(&st);
+  sha256_update(&st, (const uint8_t *)TRANSOP_CC20_KEY_LABEL, strlen(TRANSOP_CC20_KEY_LABEL));
+  sha256_update(&st, key, key_len);
+  sha256_final(&st, digest);
+}
+
+/* ************************************** */
+
+static void transop_tick_cc20( n2n_trans_op_t * arg, time_t now ) {}
+
+/* ChaCha20-Poly1305 initialization function */
+int n2n_transop_cc20_init( const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt ) {
+  transop_cc20_t *priv;
+  uint8_t key[CHACHA20_KEY_SIZE];
+
+  memset(ttt, 0, sizeof(*ttt));
+  ttt->transform_id = N2N_TRANSFORM_ID_CHACHA20;
+
+  ttt->tick = transop_tick_cc20;
+  ttt->deinit = transop_deinit_cc20;
+  ttt->fwd = transop_encode_cc20;
+  ttt->rev = transop_decode_cc20;
+  ttt->fwd_inplace = transop_encode_cc20_inplace;
+  ttt->rev_inplace = transop_decode_cc20_inplace;
+  ttt->fwd_batch = transop_encode_cc20_batch;
+  ttt->rev_batch = transop_decode_cc20_batch;
+
+  priv = (transop_cc20_t*) calloc(1, sizeof(transop_cc20_t));
+  if(!priv) {
+    traceEvent(TRACE_ERROR, "cannot allocate transop_cc20_t memory");
+    return(-1);
+  }
+  ttt->priv = priv;
+
+  cc20_derive_key((const uint8_t *)conf->encrypt_key, strlen(conf->encrypt_key), key);
+  chacha20_set_key(&priv->key, key);
+  memset(key, 0, sizeof(key));
+
+  n2n_rand_bytes(priv->salt, sizeof(priv->salt));
+  n2n_rand_bytes(&priv->nonce_ctr, sizeof(priv->nonce_ctr));
+
+  traceEvent(TRACE_DEBUG, "ChaCha20-Poly1305 setup completed, %s kernel", chacha20_impl_name());
+
+  return(0);
+}
@@ -71,6 +71,25 @@ static int transop_decode_null( n2n_trans_op_t * arg,
     return retval;
 }
 
+/* The payload is sent as it is */
+static int transop_encode_null_inplace( n2n_trans_op_t * arg,
+                                        n2n_buf_t * buf,
+                                        const uint8_t * peer_mac)
+{
+    return 0;
+}
+
+static int transop_decode_null_inplace( n2n_trans_op_t * arg,
+                                        uint8_t * buf,
+                                        size_t in_len,
+                                        uint8_t ** out,
+                                        const uint8_t * peer_mac)
+{
+    *out = buf;
+
+    return in_len;
+}
+
 static void transop_tick_null(n2n_trans_op_t * arg, time_t now) {}
 
 int n2n_transop_null_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
@@ -82,6 +101,8 @@ int n2n_transop_null_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
     ttt->tick    = transop_tick_null;
     ttt->fwd     = transop_encode_null;
     ttt->rev     = transop_decode_null;
+    ttt->fwd_inplace = transop_encode_null_inplace;
+    ttt->rev_inplace = transop_decode_null_inplace;
 
     return(0);
 }
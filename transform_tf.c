@@ -29,16 +29,14 @@
 #define N2N_TWOFISH_TRANSFORM_VERSION   1  /* version of the transform encoding */
 
 typedef struct transop_tf {
-  TWOFISH*           enc_tf; /* tx state */
-  TWOFISH*           dec_tf; /* rx state */
+  TWOFISH*           tf;     /* keyed tables, shared by tx and rx */
 } transop_tf_t;
 
 static int transop_deinit_twofish( n2n_trans_op_t * arg ) {
   transop_tf_t *priv = (transop_tf_t *)arg->priv;
 
   if(priv) {
-    TwoFishDestroy(priv->enc_tf); /* deallocate TWOFISH */
-    TwoFishDestroy(priv->dec_tf); /* deallocate TWOFISH */
+    TwoFishDestroy(priv->tf); /* deallocate TWOFISH */
     free(priv);
   }
 
@@ -89,14 +87,14 @@ static int transop_encode_twofish( n2n_trans_op_t * arg,
 	   * written in first followed by the packet payload. The whole
 	   * contents of assembly are encrypted. */
 	  pnonce = (uint32_t *)assembly;
-	  *pnonce = rand();
+	  *pnonce = n2n_rand32();
 	  memcpy( assembly + TRANSOP_TF_NONCE_SIZE, inbuf, in_len );
 
 	  /* Encrypt the assembly contents and write the ciphertext after the SA. */
 	  len = TwoFishEncryptRaw( assembly, /* source */
 				   outbuf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE, 
 				   in_len + TRANSOP_TF_NONCE_SIZE, /* enc size */
-				   priv->enc_tf);
+				   priv->tf);
 	  if ( len > 0 )
             {
 	      len += TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE; /* size of data carried in UDP. */
@@ -157,10 +155,10 @@ static int transop_decode_twofish( n2n_trans_op_t * arg,
 
 	  traceEvent(TRACE_DEBUG, "decode_twofish %lu", in_len);
 
-	  len = TwoFishDecryptRaw( (void *)(inbuf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE),
+	  len = TwoFishDecryptRaw( inbuf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE,
 				     assembly, /* destination */
 				     (in_len - (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE)), 
-				     priv->dec_tf);
+				     priv->tf);
 
 	  if(len > 0) {
 	    /* Step over 4-byte random nonce value */
@@ -179,6 +177,101 @@ static int transop_decode_twofish( n2n_trans_op_t * arg,
   return len;
 }
 
+/* In place variant of transop_encode_twofish: the nonce, SA and version are
+ * pushed into the headroom. Cipher block stealing may write up to a block
+ * past the payload, which has to fit in the tailroom. */
+static int transop_encode_twofish_inplace( n2n_trans_op_t * arg,
+                                           n2n_buf_t * buf,
+                                           const uint8_t * peer_mac)
+{
+  transop_tf_t * priv = (transop_tf_t *)arg->priv;
+  uint32_t nonce = n2n_rand32();
+  uint32_t sa_id=0; // Not used
+  uint8_t * hdr;
+  size_t idx=0;
+  int len;
+
+  if ( (n2n_buf_headroom(buf) < (TRANSOP_TF_NONCE_SIZE + TRANSOP_TF_SA_SIZE + TRANSOP_TF_VER_SIZE))
+       || (n2n_buf_tailroom(buf) < TwoFish_BLOCK_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "encode_twofish no room for nonce and header." );
+      return -1;
+    }
+
+  traceEvent(TRACE_DEBUG, "encode_twofish in place %lu", buf->len);
+
+  memcpy( n2n_buf_push(buf, TRANSOP_TF_NONCE_SIZE), &nonce, TRANSOP_TF_NONCE_SIZE );
+
+  len = TwoFishEncryptRaw( buf->data, buf->data, buf->len, priv->tf );
+
+  if ( len <= 0 )
+    {
+      traceEvent( TRACE_ERROR, "encode_twofish encryption failed." );
+      n2n_buf_pull(buf, TRANSOP_TF_NONCE_SIZE);
+      return -1;
+    }
+
+  /* A single block is padded */
+  if ( (size_t)len > buf->len )
+    n2n_buf_put(buf, len - buf->len);
+
+  hdr = n2n_buf_push(buf, TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE);
+  encode_uint8( hdr, &idx, N2N_TWOFISH_TRANSFORM_VERSION );
+  encode_uint32( hdr, &idx, sa_id );
+
+  return 0;
+}
+
+/* In place variant of transop_decode_twofish. */
+static int transop_decode_twofish_inplace( n2n_trans_op_t * arg,
+                                           uint8_t * buf,
+                                           size_t in_len,
+                                           uint8_t ** out,
+                                           const uint8_t * peer_mac)
+{
+  transop_tf_t * priv = (transop_tf_t *)arg->priv;
+  size_t rem=in_len;
+  size_t idx=0;
+  uint8_t tf_enc_ver=0;
+  uint32_t sa_rx=0; // Not used
+  uint8_t * ciphertext = buf + TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE;
+  int len;
+
+  /* A single block is decrypted as a whole block, so no shorter ciphertext */
+  if ( in_len < (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE + TwoFish_BLOCK_SIZE) )
+    {
+      traceEvent( TRACE_ERROR, "decode_twofish inbuf wrong size (%ul) to decrypt.", in_len );
+      return 0;
+    }
+
+  decode_uint8( &tf_enc_ver, buf, &rem, &idx );
+
+  if ( N2N_TWOFISH_TRANSFORM_VERSION != tf_enc_ver )
+    {
+      traceEvent( TRACE_ERROR, "decode_twofish unsupported twofish version %u.", tf_enc_ver );
+      return 0;
+    }
+
+  decode_uint32( &sa_rx, buf, &rem, &idx );
+
+  traceEvent(TRACE_DEBUG, "decode_twofish in place %lu", in_len);
+
+  len = TwoFishDecryptRaw( ciphertext, ciphertext,
+                           (in_len - (TRANSOP_TF_VER_SIZE + TRANSOP_TF_SA_SIZE)),
+                           priv->tf );
+
+  if ( len <= TRANSOP_TF_NONCE_SIZE )
+    {
+      traceEvent( TRACE_ERROR, "decode_twofish decryption failed" );
+      return 0;
+    }
+
+  /* Step over 4-byte random nonce value */
+  *out = ciphertext + TRANSOP_TF_NONCE_SIZE;
+
+  return (len - TRANSOP_TF_NONCE_SIZE);
+}
+
 static void transop_tick_twofish( n2n_trans_op_t * arg, time_t now ) {}
 
 /* Twofish initialization function */
@@ -194,6 +287,8 @@ int n2n_transop_twofish_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
   ttt->deinit = transop_deinit_twofish;
   ttt->fwd = transop_encode_twofish;
   ttt->rev = transop_decode_twofish;
+  ttt->fwd_inplace = transop_encode_twofish_inplace;
+  ttt->rev_inplace = transop_decode_twofish_inplace;
 
   priv = (transop_tf_t*) calloc(1, sizeof(transop_tf_t));
   if(!priv) {
@@ -202,13 +297,11 @@ int n2n_transop_twofish_init(const n2n_edge_conf_t *conf, n2n_trans_op_t *ttt) {
   }
   ttt->priv = priv;
 
-  /* This is a preshared key setup. Both Tx and Rx are using the same security association. */
-  priv->enc_tf = TwoFishInit(encrypt_key, encrypt_key_len);
-  priv->dec_tf = TwoFishInit(encrypt_key, encrypt_key_len);
+  /* This is a preshared key setup. Both Tx and Rx are using the same security
+   * association, and the raw TwoFish routines keep no state in it. */
+  priv->tf = TwoFishInit(encrypt_key, encrypt_key_len);
 
-  if((!priv->enc_tf) || (!priv->dec_tf)) {
-    if(priv->enc_tf) TwoFishDestroy(priv->enc_tf);
-    if(priv->dec_tf) TwoFishDestroy(priv->dec_tf);
+  if(!priv->tf) {
     free(priv);
     traceEvent(TRACE_ERROR, "TwoFishInit failed");
     return(-2);
@@ -108,7 +108,65 @@ int tuntap_open(tuntap_dev *device,
                 char *device_mask,
                 const char * device_mac,
 		int mtu) {
+  return(tuntap_open_mq(device, dev, address_mode, device_ip, device_mask, device_mac, mtu, 1, 0));
+}
+
+/* ********************************** */
+
+/** @brief  Open one more queue of a IFF_MULTI_QUEUE TAP device.
+ *
+ *  @return the queue file descriptor or -1 on error
+ */
+static int tuntap_open_queue(const char *ifname, short extra_flags) {
+  struct ifreq ifr;
+  int fd;
+
+  if((fd = open("/dev/net/tun", O_RDWR)) < 0) {
+    traceEvent(TRACE_ERROR, "tuntap open() error: %s[%d]", strerror(errno), errno);
+    return(-1);
+  }
+
+  memset(&ifr, 0, sizeof(ifr));
+  /* The feature flags must match the ones of the device */
+  ifr.ifr_flags = IFF_TAP|IFF_NO_PI|IFF_MULTI_QUEUE|extra_flags;
+  snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
+
+  if(ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
+    traceEvent(TRACE_ERROR, "tuntap ioctl(TUNSETIFF, IFF_MULTI_QUEUE) error: %s[%d]", strerror(errno), errno);
+    close(fd);
+    return(-1);
+  }
+
+  return(fd);
+}
+
+/* ********************************** */
+
+/** @brief  Like tuntap_open() but with num_queues independent queues.
+ *
+ *  When num_queues > 1 the device is created with IFF_MULTI_QUEUE and the
+ *  kernel spreads the frames sent by the host among the queue file
+ *  descriptors by flow. device->fd is the first queue and all of them are
+ *  stored in device->queue_fds.
+ *
+ *  With N2N_TUNTAP_F_OFFLOAD in flags the device is opened with
+ *  IFF_VNET_HDR and checksum/TSO offload: every frame read or written is
+ *  preceded by a struct virtio_net_hdr (see tap_offload.c).
+ *
+ *  @return - negative value on error
+ *          - non-negative file-descriptor of the first queue on success
+ */
+int tuntap_open_mq(tuntap_dev *device,
+                   char *dev, /* user-definable interface name, eg. edge0 */
+                   const char *address_mode, /* static or dhcp */
+                   char *device_ip,
+                   char *device_mask,
+                   const char * device_mac,
+                   int mtu,
+                   int num_queues,
+                   int flags) {
   char *tuntap_device = "/dev/net/tun";
+  short extra_flags = 0;
   int ioctl_fd;
   struct ifreq ifr;
   int rc;
@@ -125,8 +183,19 @@ int tuntap_open(tuntap_dev *device,
     return -1;
   }
 
+  if((num_queues < 1) || (num_queues > N2N_TUNTAP_MAX_QUEUES)) {
+    traceEvent(TRACE_ERROR, "Invalid number of TAP queues %d (1-%d)", num_queues, N2N_TUNTAP_MAX_QUEUES);
+    close(device->fd);
+    return -1;
+  }
+
+  if(flags & N2N_TUNTAP_F_OFFLOAD)
+    extra_flags |= IFF_VNET_HDR;
+
   memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_flags = IFF_TAP|IFF_NO_PI; /* Want a TAP device for layer 2 frames. */
+  ifr.ifr_flags = IFF_TAP|IFF_NO_PI|extra_flags; /* Want a TAP device for layer 2 frames. */
+  if(num_queues > 1)
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
   strncpy(ifr.ifr_name, dev, IFNAMSIZ-1);
   ifr.ifr_name[IFNAMSIZ-1] = '\0';
   rc = ioctl(device->fd, TUNSETIFF, (void *)&ifr);
@@ -140,6 +209,32 @@ int tuntap_open(tuntap_dev *device,
   /* Store the device name for later reuse */
   strncpy(device->dev_name, ifr.ifr_name, MIN(IFNAMSIZ, N2N_IFNAMSIZ) );
 
+  device->vnet_hdr = 0;
+  if(flags & N2N_TUNTAP_F_OFFLOAD) {
+    device->vnet_hdr = 1;
+
+    /* Without offloads the frames still carry an empty virtio header */
+    if(ioctl(device->fd, TUNSETOFFLOAD, TUN_F_CSUM|TUN_F_TSO4|TUN_F_TSO6) < 0)
+      traceEvent(TRACE_WARNING, "tuntap ioctl(TUNSETOFFLOAD) error: %s[%d]", strerror(errno), errno);
+    else
+      traceEvent(TRACE_NORMAL, "TAP checksum and TSO offload enabled");
+  }
+
+  device->queue_fds[0] = device->fd;
+  for(device->num_queues = 1; device->num_queues < num_queues; device->num_queues++) {
+    int fd = tuntap_open_queue(device->dev_name, extra_flags);
+
+    if(fd < 0) {
+      tuntap_close(device);
+      return -1;
+    }
+
+    device->queue_fds[device->num_queues] = fd;
+  }
+
+  if(num_queues > 1)
+    traceEvent(TRACE_NORMAL, "Opened %d TAP queues on %s", num_queues, device->dev_name);
+
   if(device_mac && device_mac[0]) {
     /* Use the user-provided MAC */
     str2mac(device->mac_addr, device_mac);
@@ -147,10 +242,7 @@ int tuntap_open(tuntap_dev *device,
     /* Set an explicit random MAC to know the exact MAC in use. Manually
      * reading the MAC address is not safe as it may change internally
      * also after the TAP interface UP status has been notified. */
-    int i;
-
-    for(i = 0; i < 6; i++)
-      device->mac_addr[i] = rand();
+    n2n_rand_bytes(device->mac_addr, 6);
 
     device->mac_addr[0] &= ~0x01; /* Clear multicast bit */
     device->mac_addr[0] |= 0x02;  /* Set locally-assigned bit */
@@ -190,7 +282,7 @@ int tuntap_open(tuntap_dev *device,
   if(setup_ifname(ioctl_fd, device->dev_name, device_ip, device_mask, device->mac_addr, mtu) < 0) {
     close(nl_fd);
     close(ioctl_fd);
-    close(device->fd);
+    tuntap_close(device);
     return -1;
   }
 
@@ -247,6 +339,12 @@ int tuntap_write(struct tuntap_dev *tuntap, unsigned char *buf, int len) {
 /* *************************************************** */
 
 void tuntap_close(struct tuntap_dev *tuntap) {
+  int i;
+
+  /* queue_fds[0] is tuntap->fd */
+  for(i = 1; i < tuntap->num_queues; i++)
+    close(tuntap->queue_fds[i]);
+
   close(tuntap->fd);
 }
 
@@ -109,10 +109,17 @@ static uint32_t TwoFish_MDS[4][256]; /* TwoFish_MDS matrix */
 
 /*#define	TwoFish__b(x,N)	(((uint8_t *)&x)[((N)&3)^TwoFish_ADDR_XOR])*/ /* pick bytes out of a dword */
 
-#define	TwoFish_b0(x)			TwoFish__b(x,0)		/* extract LSB of uint32_t  */
-#define	TwoFish_b1(x)			TwoFish__b(x,1)
-#define	TwoFish_b2(x)			TwoFish__b(x,2)
-#define	TwoFish_b3(x)			TwoFish__b(x,3)		/* extract MSB of uint32_t  */
+#define	TwoFish_b0(x)			((uint8_t)(x))		/* extract LSB of uint32_t  */
+#define	TwoFish_b1(x)			((uint8_t)((x) >> 8))
+#define	TwoFish_b2(x)			((uint8_t)((x) >> 16))
+#define	TwoFish_b3(x)			((uint8_t)((x) >> 24))	/* extract MSB of uint32_t  */
+
+#define	TwoFish_U8TO32(p)		((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+#define	TwoFish_U32TO8(p,v)		do { (p)[0]=(uint8_t)(v); (p)[1]=(uint8_t)((v)>>8); (p)[2]=(uint8_t)((v)>>16); (p)[3]=(uint8_t)((v)>>24); } while(0)
+
+/* The g function: one lookup per input byte into the fully keyed tables */
+#define	TwoFish_G0(s,x)			((s)[0][TwoFish_b0(x)] ^ (s)[1][TwoFish_b1(x)] ^ (s)[2][TwoFish_b2(x)] ^ (s)[3][TwoFish_b3(x)])
+#define	TwoFish_G1(s,x)			((s)[0][TwoFish_b3(x)] ^ (s)[1][TwoFish_b0(x)] ^ (s)[2][TwoFish_b1(x)] ^ (s)[3][TwoFish_b2(x)])
 
 uint8_t TwoFish__b(uint32_t x,int n)
 {	n&=3;
@@ -198,28 +205,6 @@ uint32_t _TwoFish_CryptRawCBC(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt
   return rl;
 }
 
-/* en/decryption on one block only */
-uint32_t _TwoFish_CryptRaw16(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata)
-{	/* qBlockPlain already zero'ed through ResetCBC  */
-  memcpy(tfdata->qBlockPlain,in,len);					/* toss the data into it. */
-  _TwoFish_BlockCrypt16(tfdata->qBlockPlain,tfdata->qBlockCrypt,decrypt,tfdata); /* encrypt just that block without CBC. */
-  memcpy(out,tfdata->qBlockCrypt,TwoFish_BLOCK_SIZE);				/* and return what we got */
-  return TwoFish_BLOCK_SIZE;
-}
-
-/* en/decryption without reset of CBC and output assignment */
-uint32_t _TwoFish_CryptRaw(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata)
-{
-  if(in!=NULL && out!=NULL && len>0 && tfdata!=NULL)		/* if we have valid data, then... */
-    {	if(len>TwoFish_BLOCK_SIZE)							/* ...check if we have more than one block. */
-	return _TwoFish_CryptRawCBC(in,out,len,decrypt,tfdata); /* if so, use the CBC routines... */
-      else
-	return _TwoFish_CryptRaw16(in,out,len,decrypt,tfdata); /* ...otherwise just do one block. */
-    }
-  return 0;
-}
-
-
 /*	TwoFish Raw Encryption
  *
  *	Does not use header, but does use CBC (if more than one block has to be encrypted).
@@ -232,13 +217,49 @@ uint32_t _TwoFish_CryptRaw(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TW
  *	Output:	The amount of bytes encrypted if successful, otherwise 0.
  */
 
-uint32_t TwoFishEncryptRaw(uint8_t *in,
+uint32_t TwoFishEncryptRaw(const uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
-			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,FALSE,tfdata);	/* and go for it. */
+			    const TWOFISH *tfdata)
+{	uint8_t chain[TwoFish_BLOCK_SIZE];	/* previous cipher block, the IV is zero */
+  uint8_t blk[TwoFish_BLOCK_SIZE];
+  uint32_t i,n,tail;
+
+  if(in==NULL || out==NULL || len==0 || tfdata==NULL)
+    return 0;
+
+  if(len<=TwoFish_BLOCK_SIZE)			/* a single block goes without CBC, zero padded */
+    {	memset(blk,0,TwoFish_BLOCK_SIZE);
+      memcpy(blk,in,len);
+      _TwoFish_EncryptBlock(blk,out,tfdata);
+      return TwoFish_BLOCK_SIZE;
+    }
+
+  tail=len%TwoFish_BLOCK_SIZE;
+  n=len/TwoFish_BLOCK_SIZE;			/* full blocks */
+  memset(chain,0,TwoFish_BLOCK_SIZE);
+
+  for(;n>0;n--,in+=TwoFish_BLOCK_SIZE,out+=TwoFish_BLOCK_SIZE)
+    {	for(i=0;i<TwoFish_BLOCK_SIZE;i++)
+	blk[i]=in[i]^chain[i];
+      _TwoFish_EncryptBlock(blk,chain,tfdata);
+      if(n>1 || tail==0)			/* the last full block is stolen below */
+	memcpy(out,chain,TwoFish_BLOCK_SIZE);
+    }
+
+  if(tail>0)
+    {	/* Ciphertext stealing: the last full block slot gets the encrypted,
+	 * zero padded partial block chained to Cn-1, the partial slot the
+	 * head of Cn-1. */
+      memset(blk,0,TwoFish_BLOCK_SIZE);
+      memcpy(blk,in,tail);
+      for(i=0;i<TwoFish_BLOCK_SIZE;i++)
+	blk[i]^=chain[i];
+      _TwoFish_EncryptBlock(blk,out-TwoFish_BLOCK_SIZE,tfdata);
+      memcpy(out,chain,tail);
+    }
+
+  return len;
 }
 
 /*	TwoFish Raw Decryption
@@ -253,13 +274,54 @@ uint32_t TwoFishEncryptRaw(uint8_t *in,
  *	Output:	The amount of bytes decrypted if successful, otherwise 0.
  */
 
-uint32_t TwoFishDecryptRaw(uint8_t *in,
+uint32_t TwoFishDecryptRaw(const uint8_t *in,
 			    uint8_t *out,
 			    uint32_t len,
-			    TWOFISH *tfdata)
-{	_TwoFish_ResetCBC(tfdata);							/* reset CBC flag. */
-  tfdata->output=out;							/* output straight into output buffer. */
-  return _TwoFish_CryptRaw(in,out,len,TRUE,tfdata);	/* and go for it. */
+			    const TWOFISH *tfdata)
+{	uint8_t chain[TwoFish_BLOCK_SIZE];	/* previous cipher block, the IV is zero */
+  uint8_t blk[TwoFish_BLOCK_SIZE];
+  uint8_t cur[TwoFish_BLOCK_SIZE];		/* in may be out */
+  uint32_t i,n,tail;
+
+  if(in==NULL || out==NULL || len==0 || tfdata==NULL)
+    return 0;
+
+  if(len<=TwoFish_BLOCK_SIZE)			/* a single block goes without CBC */
+    {	memset(blk,0,TwoFish_BLOCK_SIZE);
+      memcpy(blk,in,len);
+      _TwoFish_DecryptBlock(blk,out,tfdata);
+      return TwoFish_BLOCK_SIZE;
+    }
+
+  tail=len%TwoFish_BLOCK_SIZE;
+  n=len/TwoFish_BLOCK_SIZE;
+  if(tail>0)
+    n--;					/* the last full block slot is stolen */
+  memset(chain,0,TwoFish_BLOCK_SIZE);
+
+  for(;n>0;n--,in+=TwoFish_BLOCK_SIZE,out+=TwoFish_BLOCK_SIZE)
+    {	memcpy(cur,in,TwoFish_BLOCK_SIZE);
+      _TwoFish_DecryptBlock(cur,blk,tfdata);
+      for(i=0;i<TwoFish_BLOCK_SIZE;i++)
+	out[i]=blk[i]^chain[i];
+      memcpy(chain,cur,TwoFish_BLOCK_SIZE);
+    }
+
+  if(tail>0)
+    {	/* Undo the stealing: the stolen slot decrypts to the padded partial
+	 * block xor Cn-1, whose head is in the partial slot and whose tail
+	 * thus is the tail of that decryption. */
+      _TwoFish_DecryptBlock(in,blk,tfdata);
+      memcpy(cur,in+TwoFish_BLOCK_SIZE,tail);
+      memcpy(cur+tail,blk+tail,TwoFish_BLOCK_SIZE-tail);
+      for(i=0;i<tail;i++)
+	out[TwoFish_BLOCK_SIZE+i]=cur[i]^blk[i];
+      _TwoFish_DecryptBlock(cur,blk,tfdata);
+      for(i=0;i<TwoFish_BLOCK_SIZE;i++)
+	out[i]=blk[i]^chain[i];
+    }
+
+  return len;
 }
 
 /*	TwoFish Free
@@ -596,10 +658,10 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
     {   b0 = b1 = b2 = b3 = i;
       switch (k64Cnt & 3)
         {	case 1: /* 64-bit keys */
-	    tfdata->sBox[      2*i  ] = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
-	    tfdata->sBox[      2*i+1] = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
-	    tfdata->sBox[0x200+2*i  ] = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
-	    tfdata->sBox[0x200+2*i+1] = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
+	    tfdata->sBox[0][i] = TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][b0]) ^ TwoFish_b0(k0)];
+	    tfdata->sBox[1][i] = TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][b1]) ^ TwoFish_b1(k0)];
+	    tfdata->sBox[2][i] = TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][b2]) ^ TwoFish_b2(k0)];
+	    tfdata->sBox[3][i] = TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][b3]) ^ TwoFish_b3(k0)];
 	    break;
 	case 0: /* 256-bit keys (same as 4) */
 	  b0 = (TwoFish_P[TwoFish_P_04][b0]) ^ TwoFish_b0(k3);
@@ -612,19 +674,19 @@ void _TwoFish_MakeSubKeys(TWOFISH *tfdata)	/* Expand a user-supplied key materia
 	  b2 = (TwoFish_P[TwoFish_P_23][b2]) ^ TwoFish_b2(k2);
 	  b3 = (TwoFish_P[TwoFish_P_33][b3]) ^ TwoFish_b3(k2);
 	case 2: /* 128-bit keys */
-	  tfdata->sBox[      2*i  ]=
+	  tfdata->sBox[0][i]=
 	    TwoFish_MDS[0][(TwoFish_P[TwoFish_P_01][(TwoFish_P[TwoFish_P_02][b0]) ^
 						    TwoFish_b0(k1)]) ^ TwoFish_b0(k0)];
 
-	  tfdata->sBox[      2*i+1]=
+	  tfdata->sBox[1][i]=
 	    TwoFish_MDS[1][(TwoFish_P[TwoFish_P_11][(TwoFish_P[TwoFish_P_12][b1]) ^
 						    TwoFish_b1(k1)]) ^ TwoFish_b1(k0)];
 
-	  tfdata->sBox[0x200+2*i  ]=
+	  tfdata->sBox[2][i]=
 	    TwoFish_MDS[2][(TwoFish_P[TwoFish_P_21][(TwoFish_P[TwoFish_P_22][b2]) ^
 						    TwoFish_b2(k1)]) ^ TwoFish_b2(k0)];
 
-	  tfdata->sBox[0x200+2*i+1]=
+	  tfdata->sBox[3][i]=
 	    TwoFish_MDS[3][(TwoFish_P[TwoFish_P_31][(TwoFish_P[TwoFish_P_32][b3]) ^
 						    TwoFish_b3(k1)]) ^ TwoFish_b3(k0)];
 	}
@@ -702,19 +764,20 @@ void _TwoFish_BlockCrypt(uint8_t *in,uint8_t *out,uint32_t size,int decrypt,TWOF
 	  _TwoFish_qBlockPop(CnMinusOne,PnMinusOne,tfdata);
 	  _TwoFish_BlockCrypt16(CnMinusOne,CBCplusCprime,decrypt,tfdata);
 
-	  /* we then xor the first few bytes with the "in" bytes (Cn) */
-	  /* to recover Pn, which we put in out */
-	  for(p=in,pout=out,i=0;i<size;i++,p++,pout++)
-	    *pout=*p ^ CBCplusCprime[i];
-
 	  /* We now recover the original CnMinusOne, which consists of */
 	  /* the first "size" bytes of "in" data, followed by the */
-	  /* "Cprime" portion of CBCplusCprime */
+	  /* "Cprime" portion of CBCplusCprime. This is done before */
+	  /* writing out, which may be the same buffer as in */
 	  for(p=in,i=0;i<size;i++,p++)
 	    CnMinusOne[i]=*p;
 	  for(;i<TwoFish_BLOCK_SIZE;i++)
 	    CnMinusOne[i]=CBCplusCprime[i];
 
+	  /* we then xor the first few bytes with the "in" bytes (Cn) */
+	  /* to recover Pn, which we put in out */
+	  for(pout=out,i=0;i<size;i++,pout++)
+	    *pout=CnMinusOne[i] ^ CBCplusCprime[i];
+
 	  /* we now decrypt CnMinusOne to get PnMinusOne xored with Cn-2 */
 	  _TwoFish_BlockCrypt16(CnMinusOne,PnMinusOne,decrypt,tfdata);
 
@@ -770,104 +833,86 @@ void _TwoFish_FlushOutput(uint8_t *b,uint32_t len,TWOFISH *tfdata)
   tfdata->dontflush=FALSE;
 }
 
-void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata)
-{	uint32_t x0,x1,x2,x3;
-  uint32_t k,t0,t1,R;
-
-
-  x0=*in++;
-  x0|=(*in++ << 8 );
-  x0|=(*in++ << 16);
-  x0|=(*in++ << 24);
-  x1=*in++;
-  x1|=(*in++ << 8 );
-  x1|=(*in++ << 16);
-  x1|=(*in++ << 24);
-  x2=*in++;
-  x2|=(*in++ << 8 );
-  x2|=(*in++ << 16);
-  x2|=(*in++ << 24);
-  x3=*in++;
-  x3|=(*in++ << 8 );
-  x3|=(*in++ << 16);
-  x3|=(*in++ << 24);
-
-  if(decrypt)
-    {	x0 ^= tfdata->subKeys[4];	/* swap input and output whitening keys when decrypting */
-      x1 ^= tfdata->subKeys[5];
-      x2 ^= tfdata->subKeys[6];
-      x3 ^= tfdata->subKeys[7];
-
-      k = 7+(TwoFish_ROUNDS*2);
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-	{   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x3  = x3 >> 1 | x3 << 31;
-	  x2  = x2 << 1 | x2 >> 31;
-	  x2 ^= t0 + t1 + tfdata->subKeys[k--];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k--];
-	  x1  = x1 >> 1 | x1 << 31;
-	  x0  = x0 << 1 | x0 >> 31;
-	  x0 ^= t0 + t1 + tfdata->subKeys[k--];
-        }
-
-      x2 ^= tfdata->subKeys[0];
-      x3 ^= tfdata->subKeys[1];
-      x0 ^= tfdata->subKeys[2];
-      x1 ^= tfdata->subKeys[3];
+/* One block with the keyed tables, two rounds per loop. in may be out. */
+void _TwoFish_EncryptBlock(const uint8_t *in,uint8_t *out,const TWOFISH *tfdata)
+{	const uint32_t *k=tfdata->subKeys;
+  uint32_t x0,x1,x2,x3,t0,t1;
+  int R;
+
+  x0=TwoFish_U8TO32(in   )^k[0];
+  x1=TwoFish_U8TO32(in+ 4)^k[1];
+  x2=TwoFish_U8TO32(in+ 8)^k[2];
+  x3=TwoFish_U8TO32(in+12)^k[3];
+  k+=8;
+
+  for(R=0;R<TwoFish_ROUNDS;R+=2,k+=4)
+    {	t0=TwoFish_G0(tfdata->sBox,x0);
+      t1=TwoFish_G1(tfdata->sBox,x1);
+      x2^=t0+t1+k[0];
+      x2 =x2>>1 | x2<<31;
+      x3 =x3<<1 | x3>>31;
+      x3^=t0+(t1<<1)+k[1];
+      t0=TwoFish_G0(tfdata->sBox,x2);
+      t1=TwoFish_G1(tfdata->sBox,x3);
+      x0^=t0+t1+k[2];
+      x0 =x0>>1 | x0<<31;
+      x1 =x1<<1 | x1>>31;
+      x1^=t0+(t1<<1)+k[3];
     }
-  else
-    {	x0 ^= tfdata->subKeys[0];
-      x1 ^= tfdata->subKeys[1];
-      x2 ^= tfdata->subKeys[2];
-      x3 ^= tfdata->subKeys[3];
-
-      k = 8;
-      for (R = 0; R < TwoFish_ROUNDS; R += 2)
-        {   t0 = _TwoFish_Fe320( tfdata->sBox, x0);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x1);
-	  x2 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x2  = x2 >> 1 | x2 << 31;
-	  x3  = x3 << 1 | x3 >> 31;
-	  x3 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-
-	  t0 = _TwoFish_Fe320( tfdata->sBox, x2);
-	  t1 = _TwoFish_Fe323( tfdata->sBox, x3);
-	  x0 ^= t0 + t1 + tfdata->subKeys[k++];
-	  x0  = x0 >> 1 | x0 << 31;
-	  x1  = x1 << 1 | x1 >> 31;
-	  x1 ^= t0 + (t1<<1) + tfdata->subKeys[k++];
-        }
 
-      x2 ^= tfdata->subKeys[4];
-      x3 ^= tfdata->subKeys[5];
-      x0 ^= tfdata->subKeys[6];
-      x1 ^= tfdata->subKeys[7];
+  k=tfdata->subKeys;
+  x2^=k[4];
+  x3^=k[5];
+  x0^=k[6];
+  x1^=k[7];
+  TwoFish_U32TO8(out   ,x2);
+  TwoFish_U32TO8(out+ 4,x3);
+  TwoFish_U32TO8(out+ 8,x0);
+  TwoFish_U32TO8(out+12,x1);
+}
+
+void _TwoFish_DecryptBlock(const uint8_t *in,uint8_t *out,const TWOFISH *tfdata)
+{	const uint32_t *k=tfdata->subKeys;
+  uint32_t x0,x1,x2,x3,t0,t1;
+  int R;
+
+  x0=TwoFish_U8TO32(in   )^k[4];	/* swap input and output whitening keys when decrypting */
+  x1=TwoFish_U8TO32(in+ 4)^k[5];
+  x2=TwoFish_U8TO32(in+ 8)^k[6];
+  x3=TwoFish_U8TO32(in+12)^k[7];
+  k+=4+(TwoFish_ROUNDS*2);
+
+  for(R=0;R<TwoFish_ROUNDS;R+=2,k-=4)
+    {	t0=TwoFish_G0(tfdata->sBox,x0);
+      t1=TwoFish_G1(tfdata->sBox,x1);
+      x3^=t0+(t1<<1)+k[3];
+      x3 =x3>>1 | x3<<31;
+      x2 =x2<<1 | x2>>31;
+      x2^=t0+t1+k[2];
+      t0=TwoFish_G0(tfdata->sBox,x2);
+      t1=TwoFish_G1(tfdata->sBox,x3);
+      x1^=t0+(t1<<1)+k[1];
+      x1 =x1>>1 | x1<<31;
+      x0 =x0<<1 | x0>>31;
+      x0^=t0+t1+k[0];
     }
 
-  *out++ = (uint8_t)(x2      );
-  *out++ = (uint8_t)(x2 >>  8);
-  *out++ = (uint8_t)(x2 >> 16);
-  *out++ = (uint8_t)(x2 >> 24);
-
-  *out++ = (uint8_t)(x3      );
-  *out++ = (uint8_t)(x3 >>  8);
-  *out++ = (uint8_t)(x3 >> 16);
-  *out++ = (uint8_t)(x3 >> 24);
-
-  *out++ = (uint8_t)(x0      );
-  *out++ = (uint8_t)(x0 >>  8);
-  *out++ = (uint8_t)(x0 >> 16);
-  *out++ = (uint8_t)(x0 >> 24);
-
-  *out++ = (uint8_t)(x1      );
-  *out++ = (uint8_t)(x1 >>  8);
-  *out++ = (uint8_t)(x1 >> 16);
-  *out++ = (uint8_t)(x1 >> 24);
+  k=tfdata->subKeys;
+  x2^=k[0];
+  x3^=k[1];
+  x0^=k[2];
+  x1^=k[3];
+  TwoFish_U32TO8(out   ,x2);
+  TwoFish_U32TO8(out+ 4,x3);
+  TwoFish_U32TO8(out+ 8,x0);
+  TwoFish_U32TO8(out+12,x1);
+}
+
+void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata)
+{	if(decrypt)
+    _TwoFish_DecryptBlock(in,out,tfdata);
+  else
+    _TwoFish_EncryptBlock(in,out,tfdata);
 }
 
 /**
@@ -933,28 +978,6 @@ uint32_t _TwoFish_F32(uint32_t k64Cnt,uint32_t x,uint32_t *k32)
   return result;
 }
 
-uint32_t _TwoFish_Fe320(uint32_t *lsBox,uint32_t x)
-{   return lsBox[        TwoFish_b0(x)<<1    ]^
-    lsBox[      ((TwoFish_b1(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b2(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b3(x)<<1)|1)];
-}
-
-uint32_t _TwoFish_Fe323(uint32_t *lsBox,uint32_t x)
-{   return lsBox[       (TwoFish_b3(x)<<1)   ]^
-    lsBox[      ((TwoFish_b0(x)<<1)|1)]^
-    lsBox[0x200+ (TwoFish_b1(x)<<1)   ]^
-    lsBox[0x200+((TwoFish_b2(x)<<1)|1)];
-}
-
-uint32_t _TwoFish_Fe32(uint32_t *lsBox,uint32_t x,uint32_t R)
-{   return lsBox[      2*TwoFish__b(x,R  )  ]^
-    lsBox[      2*TwoFish__b(x,R+1)+1]^
-    lsBox[0x200+2*TwoFish__b(x,R+2)  ]^
-    lsBox[0x200+2*TwoFish__b(x,R+3)+1];
-}
-
-
 #endif
 
 /* ******************************************* */
@@ -110,9 +110,11 @@ enum
 
 typedef struct    
 {
-    uint32_t sBox[4 * 256];                    /* Key dependent S-box */
+    uint32_t sBox[4][256];                     /* Key dependent S-boxes merged with the MDS matrix, one per input byte */
     uint32_t subKeys[TwoFish_TOTAL_SUBKEYS];   /* Subkeys  */
     uint8_t key[TwoFish_KEY_LENGTH];           /* Encryption Key */
+    /* The rest is the state of TwoFishEncrypt()/TwoFishDecrypt(), the raw
+     * routines do not touch it */
     uint8_t *output;                           /* Pointer to output buffer */
     uint8_t qBlockPlain[TwoFish_BLOCK_SIZE];   /* Used by CBC */
     uint8_t qBlockCrypt[TwoFish_BLOCK_SIZE];
@@ -192,6 +194,8 @@ void TwoFishSetOutput(uint8_t *outp,TWOFISH *tfdata);
 /*	TwoFish Raw Encryption
  *	
  *	Does not use header, but does use CBC (if more than one block has to be encrypted).
+ *	Keeps the chaining state on the stack and does not modify tfdata, so several
+ *	threads can use the same TWOFISH structure at once. in may be out.
  *
  *	Input:	Pointer to the buffer of the plaintext to be encrypted.
  *			Pointer to the buffer receiving the ciphertext.
@@ -200,11 +204,12 @@ void TwoFishSetOutput(uint8_t *outp,TWOFISH *tfdata);
  *
  *	Output:	The amount of bytes encrypted if successful, otherwise 0.
  */
-uint32_t TwoFishEncryptRaw(uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata);
+uint32_t TwoFishEncryptRaw(const uint8_t *in,uint8_t *out,uint32_t len,const TWOFISH *tfdata);
 
 /*	TwoFish Raw Decryption 
  *	
  *	Does not use header, but does use CBC (if more than one block has to be decrypted).
+ *	Reentrant like TwoFishEncryptRaw(). in may be out.
  *
  *	Input:	Pointer to the buffer of the ciphertext to be decrypted.
  *			Pointer to the buffer receiving the plaintext.
@@ -213,7 +218,7 @@ uint32_t TwoFishEncryptRaw(uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata
  *
  *	Output:	The amount of bytes decrypted if successful, otherwise 0.
  */
-uint32_t TwoFishDecryptRaw(uint8_t *in,uint8_t *out,uint32_t len,TWOFISH *tfdata);
+uint32_t TwoFishDecryptRaw(const uint8_t *in,uint8_t *out,uint32_t len,const TWOFISH *tfdata);
 
 
 /*	TwoFish Encryption 
@@ -265,8 +270,6 @@ uint32_t TwoFishDecrypt(uint8_t *in,uint8_t **out,signed long len,bool binhex,TW
 uint8_t TwoFish__b(uint32_t x,int n);
 void _TwoFish_BinHex(uint8_t *buf,uint32_t len,bool bintohex);
 uint32_t _TwoFish_CryptRawCBC(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
-uint32_t _TwoFish_CryptRaw16(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
-uint32_t _TwoFish_CryptRaw(uint8_t *in,uint8_t *out,uint32_t len,bool decrypt,TWOFISH *tfdata);
 void _TwoFish_PrecomputeMDSmatrix(void);	
 void _TwoFish_MakeSubKeys(TWOFISH *tfdata);	
 void _TwoFish_qBlockPush(uint8_t *p,uint8_t *c,TWOFISH *tfdata);
@@ -275,11 +278,10 @@ void _TwoFish_ResetCBC(TWOFISH *tfdata);
 void _TwoFish_FlushOutput(uint8_t *b,uint32_t len,TWOFISH *tfdata);
 void _TwoFish_BlockCrypt(uint8_t *in,uint8_t *out,uint32_t size,int decrypt,TWOFISH *tfdata);
 void _TwoFish_BlockCrypt16(uint8_t *in,uint8_t *out,bool decrypt,TWOFISH *tfdata);
+void _TwoFish_EncryptBlock(const uint8_t *in,uint8_t *out,const TWOFISH *tfdata);
+void _TwoFish_DecryptBlock(const uint8_t *in,uint8_t *out,const TWOFISH *tfdata);
 uint32_t _TwoFish_RS_MDS_Encode(uint32_t k0,uint32_t k1);
 uint32_t _TwoFish_F32(uint32_t k64Cnt,uint32_t x,uint32_t *k32);
-uint32_t _TwoFish_Fe320(uint32_t *lsBox,uint32_t x);
-uint32_t _TwoFish_Fe323(uint32_t *lsBox,uint32_t x);
-uint32_t _TwoFish_Fe32(uint32_t *lsBox,uint32_t x,uint32_t R);
 
 
 #endif
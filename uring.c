@@ -0,0 +1,325 @@
+/**
+ * (C) 2007-18 - ntop.org and contributors
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not see see <http://www.gnu.org/licenses/>
+ *
+ */
+
+/* Minimal io_uring support on top of the raw system calls, so that no
+ * liburing is needed.
+ *
+ * A ring is owned by a single thread: SQEs are filled with uring_get_sqe()
+ * and handed to the kernel, together with the wait for completions, by a
+ * single uring_submit(). Receive buffers are provided through buffer rings
+ * (Linux 5.19+), so that multishot requests can stay posted. */
+
+#include "n2n.h"
+
+#ifdef N2N_HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_LOAD_ACQUIRE(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE_RELEASE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* ************************************** */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return((int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+  return((int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/* ************************************** */
+
+/** Create a ring with room for entries SQEs and cq_entries CQEs.
+ *
+ *  @return 0 on success, -1 when io_uring is not available
+ */
+int uring_init(n2n_uring_t *ring, unsigned entries, unsigned cq_entries) {
+  struct io_uring_params p;
+  uint8_t *sq_ptr, *cq_ptr;
+  unsigned i;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = cq_entries;
+
+  if((ring->fd = sys_io_uring_setup(entries, &p)) < 0) {
+    traceEvent(TRACE_WARNING, "io_uring_setup failed [%d]: %s", errno, strerror(errno));
+    return(-1);
+  }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  /* Since 5.4 both rings live in a single mapping */
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->sq_ring_size = ring->cq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if(ring->sq_ring == MAP_FAILED)
+    goto uring_init_error;
+
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if(ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto uring_init_error;
+    }
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto uring_init_error;
+  }
+
+  sq_ptr = (uint8_t*)ring->sq_ring;
+  ring->sq_entries = p.sq_entries;
+  ring->sq_head = (unsigned*)(sq_ptr + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq_ptr + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq_ptr + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq_ptr + p.sq_off.array);
+
+  cq_ptr = (uint8_t*)ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq_ptr + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq_ptr + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq_ptr + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq_ptr + p.cq_off.cqes);
+
+  /* SQEs are always used in ring order */
+  for(i=0; i<ring->sq_entries; i++)
+    ring->sq_array[i] = i;
+
+  ring->sqe_tail = ring->sqe_submitted = *ring->sq_tail;
+
+  return(0);
+
+ uring_init_error:
+  traceEvent(TRACE_WARNING, "io_uring mmap failed [%d]: %s", errno, strerror(errno));
+  if(ring->sq_ring == MAP_FAILED)
+    ring->sq_ring = NULL;
+  uring_exit(ring);
+  return(-1);
+}
+
+/* ************************************** */
+
+/** Tear down the ring. The kernel cancels whatever is still in flight, but
+ *  the memory used by those requests must only be released once their
+ *  completions have been reaped. */
+void uring_exit(n2n_uring_t *ring) {
+  if(ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_ring && (ring->cq_ring != ring->sq_ring))
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if(ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if(ring->fd >= 0)
+    close(ring->fd);
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/* ************************************** */
+
+/** Register fds as fixed files, used with IOSQE_FIXED_FILE and their index. */
+int uring_register_files(n2n_uring_t *ring, const int *fds, unsigned num) {
+  if(sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, num) < 0) {
+    traceEvent(TRACE_WARNING, "io_uring file registration failed [%d]: %s", errno, strerror(errno));
+    return(-1);
+  }
+
+  return(0);
+}
+
+/* ************************************** */
+
+/** @return 1 when the kernel knows the opcode op, 0 otherwise */
+int uring_op_supported(n2n_uring_t *ring, unsigned op) {
+  size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  int rc = 0;
+
+  if(probe == NULL)
+    return(0);
+
+  if((sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+     && (op <= probe->last_op))
+    rc = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) ? 1 : 0;
+
+  free(probe);
+  return(rc);
+}
+
+/* ************************************** */
+
+/** @return a zeroed SQE, or NULL when the submission queue is full */
+struct io_uring_sqe* uring_get_sqe(n2n_uring_t *ring) {
+  struct io_uring_sqe *sqe;
+
+  if((ring->sqe_tail - URING_LOAD_ACQUIRE(ring->sq_head)) >= ring->sq_entries)
+    return(NULL);
+
+  sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+
+  return(sqe);
+}
+
+/* ************************************** */
+
+/** Hand the new SQEs to the kernel and wait for at least wait_nr completions
+ *  with the same system call.
+ *
+ *  @return the number of SQEs consumed, or -1 with errno set
+ */
+int uring_submit(n2n_uring_t *ring, unsigned wait_nr) {
+  unsigned to_submit = ring->sqe_tail - ring->sqe_submitted;
+  int rc;
+
+  URING_STORE_RELEASE(ring->sq_tail, ring->sqe_tail);
+
+  if((to_submit == 0) && (wait_nr == 0))
+    return(0);
+
+  rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+
+  if(rc > 0)
+    ring->sqe_submitted += rc;
+
+  return(rc);
+}
+
+/* ************************************** */
+
+/** @return the oldest completion not yet seen, or NULL */
+struct io_uring_cqe* uring_peek_cqe(n2n_uring_t *ring) {
+  unsigned head = *ring->cq_head;
+
+  if(head == URING_LOAD_ACQUIRE(ring->cq_tail))
+    return(NULL);
+
+  return(&ring->cqes[head & *ring->cq_mask]);
+}
+
+/** Give the completion returned by uring_peek_cqe() back to the kernel. */
+void uring_cqe_seen(n2n_uring_t *ring) {
+  URING_STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+/* ************************************** */
+
+/** Allocate entries buffers of buf_size bytes and provide them all to the
+ *  kernel as buffer group bgid. */
+int uring_bufs_init(n2n_uring_t *ring, n2n_uring_bufs_t *bufs, uint16_t bgid,
+                    unsigned entries, size_t buf_size) {
+  struct io_uring_buf_reg reg;
+  size_t ring_size = entries * sizeof(struct io_uring_buf);
+  unsigned i;
+
+  memset(bufs, 0, sizeof(*bufs));
+  bufs->entries = entries;
+  bufs->buf_size = buf_size;
+  bufs->bgid = bgid;
+
+  /* The buffer ring must be page aligned */
+  bufs->br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(bufs->br == MAP_FAILED) {
+    bufs->br = NULL;
+    return(-1);
+  }
+
+  if((bufs->mem = malloc(entries * buf_size)) == NULL) {
+    munmap(bufs->br, ring_size);
+    bufs->br = NULL;
+    return(-1);
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)bufs->br;
+  reg.ring_entries = entries;
+  reg.bgid = bgid;
+
+  if(sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    traceEvent(TRACE_WARNING, "io_uring buffer ring registration failed [%d]: %s", errno, strerror(errno));
+    free(bufs->mem);
+    munmap(bufs->br, ring_size);
+    memset(bufs, 0, sizeof(*bufs));
+    return(-1);
+  }
+
+  for(i=0; i<entries; i++) {
+    struct io_uring_buf *buf = &bufs->br->bufs[i];
+
+    buf->addr = (unsigned long)uring_buf(bufs, i);
+    buf->len = buf_size;
+    buf->bid = i;
+  }
+  URING_STORE_RELEASE(&bufs->br->tail, (uint16_t)entries);
+
+  return(0);
+}
+
+/* ************************************** */
+
+void uring_bufs_free(n2n_uring_t *ring, n2n_uring_bufs_t *bufs) {
+  struct io_uring_buf_reg reg;
+
+  if(bufs->br == NULL)
+    return;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = bufs->bgid;
+
+  if(ring->fd >= 0)
+    sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+  munmap(bufs->br, bufs->entries * sizeof(struct io_uring_buf));
+  free(bufs->mem);
+  memset(bufs, 0, sizeof(*bufs));
+}
+
+/* ************************************** */
+
+/** Provide again the buffer bid, once its completion has been processed. */
+void uring_bufs_recycle(n2n_uring_bufs_t *bufs, uint16_t bid) {
+  uint16_t tail = bufs->br->tail;
+  struct io_uring_buf *buf = &bufs->br->bufs[tail & (bufs->entries - 1)];
+
+  buf->addr = (unsigned long)uring_buf(bufs, bid);
+  buf->len = bufs->buf_size;
+  buf->bid = bid;
+
+  URING_STORE_RELEASE(&bufs->br->tail, (uint16_t)(tail + 1));
+}
+
+#endif /* N2N_HAVE_IO_URING */
@@ -266,6 +266,18 @@ int encode_REGISTER( uint8_t * base,
         retval += encode_sock( base, idx, &(reg->sock) );
     }
 
+    /* Optional trailer, ignored by the older edges and carried over by the
+     * older supernodes along with the rest of the payload */
+    if ( (0 != reg->dict_id) || (0 != reg->caps) )
+    {
+        retval += encode_uint32( base, idx, reg->dict_id );
+    }
+
+    if ( 0 != reg->caps )
+    {
+        retval += encode_uint16( base, idx, reg->caps );
+    }
+
     return retval;
 }
 
@@ -286,6 +298,16 @@ int decode_REGISTER( n2n_REGISTER_t * reg,
         retval += decode_sock( &(reg->sock), base, rem, idx );
     }
 
+    if ( *rem >= sizeof(reg->dict_id) )
+    {
+        retval += decode_uint32( &(reg->dict_id), base, rem, idx );
+    }
+
+    if ( *rem >= sizeof(reg->caps) )
+    {
+        retval += decode_uint16( &(reg->caps), base, rem, idx );
+    }
+
     return retval;
 }
 
@@ -339,6 +361,17 @@ int encode_REGISTER_ACK( uint8_t * base,
         retval += encode_sock( base, idx, &(reg->sock) );
     }
 
+    /* Optional trailer, see encode_REGISTER() */
+    if ( (0 != reg->dict_id) || (0 != reg->caps) )
+    {
+        retval += encode_uint32( base, idx, reg->dict_id );
+    }
+
+    if ( 0 != reg->caps )
+    {
+        retval += encode_uint16( base, idx, reg->caps );
+    }
+
     return retval;
 }
 
@@ -362,6 +395,16 @@ int decode_REGISTER_ACK( n2n_REGISTER_ACK_t * reg,
         retval += decode_sock( &(reg->sock), base, rem, idx );
     }
 
+    if ( *rem >= sizeof(reg->dict_id) )
+    {
+        retval += decode_uint32( &(reg->dict_id), base, rem, idx );
+    }
+
+    if ( *rem >= sizeof(reg->caps) )
+    {
+        retval += decode_uint16( &(reg->caps), base, rem, idx );
+    }
+
     return retval;
 }
 
@@ -448,7 +491,8 @@ int encode_PACKET( uint8_t * base,
     {
         retval += encode_sock( base, idx, &(pkt->sock) );
     }
-    retval += encode_uint16( base, idx, pkt->transform );
+    retval += encode_uint16( base, idx, (uint16_t)((pkt->transform & N2N_TRANSFORM_ID_MASK)
+                                                   | (pkt->compression << N2N_COMPRESSION_ID_SHIFT)) );
 
     return retval;
 }
@@ -471,10 +515,118 @@ int decode_PACKET( n2n_PACKET_t * pkt,
     }
 
     retval += decode_uint16( &(pkt->transform), base, rem, idx );
+    pkt->compression = (uint8_t)(pkt->transform >> N2N_COMPRESSION_ID_SHIFT);
+    pkt->transform &= N2N_TRANSFORM_ID_MASK;
 
     return retval;
 }
 
+/* Fast path of the PACKETs, the bulk of the traffic. The generic codec
+ * above copies the header a field at a time; here its fixed layout is
+ * checked at once and read in place, and the header of the PACKETs sent is
+ * encoded once per edge and stamped on the frames. */
+
+#define N2N_PACKET_SRCMAC_OFFSET        N2N_COMMON_SIZE
+#define N2N_PACKET_DSTMAC_OFFSET        (N2N_COMMON_SIZE + N2N_MAC_SIZE)
+
+/** Decode the common and PACKET headers of the datagram of len bytes at
+ *  base, which must stay around as long as pkt is used.
+ *
+ *  @return the header length, the payload following it, or -1 when the
+ *          datagram is not a PACKET or is too short for its header
+ */
+int decode_PACKET_fast( n2n_PACKET_view_t * pkt,
+                        const uint8_t * base,
+                        size_t len )
+{
+    size_t idx = N2N_PACKET_SOCK_OFFSET;
+    uint16_t flags, transform;
+
+    if ( (len < N2N_PACKET_HDR_SIZE) || (base[0] != N2N_PKT_VERSION) )
+    {
+        return -1;
+    }
+
+    flags = (base[2] << 8) | base[3];
+
+    if ( (flags & N2N_FLAGS_TYPE_MASK) != n2n_packet )
+    {
+        return -1;
+    }
+
+    pkt->ttl = base[1];
+    pkt->flags = flags & N2N_FLAGS_BITS_MASK;
+    pkt->community = &base[4];
+    pkt->srcMac = &base[N2N_PACKET_SRCMAC_OFFSET];
+    pkt->dstMac = &base[N2N_PACKET_DSTMAC_OFFSET];
+    pkt->sock.family = 0;
+
+    if ( flags & N2N_FLAGS_SOCKET )
+    {
+        /* Family, port and address, the top bit of the family for IPv6 */
+        size_t socklen = 4 + ((base[idx] & 0x80) ? IPV6_SIZE : IPV4_SIZE);
+        size_t rem = socklen;
+
+        if ( len < N2N_PACKET_HDR_SIZE + socklen )
+        {
+            return -1;
+        }
+
+        decode_sock( &(pkt->sock), base, &rem, &idx );
+    }
+
+    transform = (base[idx] << 8) | base[idx + 1];
+    pkt->transform = transform & N2N_TRANSFORM_ID_MASK;
+    pkt->compression = (uint8_t)(transform >> N2N_COMPRESSION_ID_SHIFT);
+
+    return (int)(idx + 2);
+}
+
+/** Encode the header of the PACKETs from srcMac in community with
+ *  transform, sent without a socket, into tmpl. */
+void encode_PACKET_tmpl( n2n_PACKET_tmpl_t * tmpl,
+                         const n2n_community_t community,
+                         const n2n_mac_t srcMac,
+                         uint16_t transform )
+{
+    n2n_common_t cmn;
+    n2n_PACKET_t pkt;
+    size_t idx=0;
+
+    memset( &cmn, 0, sizeof(cmn) );
+    cmn.ttl = N2N_DEFAULT_TTL;
+    cmn.pc = n2n_packet;
+    memcpy( cmn.community, community, N2N_COMMUNITY_SIZE );
+
+    memset( &pkt, 0, sizeof(pkt) );
+    memcpy( pkt.srcMac, srcMac, N2N_MAC_SIZE );
+    pkt.transform = transform;
+
+    encode_PACKET( tmpl->hdr, &idx, &cmn, &pkt );
+}
+
+/** Write the header of tmpl towards dstMac, with the N2N_FLAGS_* flags and
+ *  the N2N_COMPRESSION_ID_* compression, at base.
+ *
+ *  @return N2N_PACKET_HDR_SIZE, the bytes written
+ */
+size_t stamp_PACKET( uint8_t * base,
+                     const n2n_PACKET_tmpl_t * tmpl,
+                     const n2n_mac_t dstMac,
+                     uint16_t flags,
+                     uint8_t compression )
+{
+    flags = (flags & N2N_FLAGS_BITS_MASK) | n2n_packet;
+
+    memcpy( base, tmpl->hdr, N2N_PACKET_HDR_SIZE );
+    base[2] = (uint8_t)(flags >> 8);
+    base[3] = (uint8_t)flags;
+    memcpy( &base[N2N_PACKET_DSTMAC_OFFSET], dstMac, N2N_MAC_SIZE );
+    base[N2N_PACKET_SOCK_OFFSET] |= (uint8_t)(compression << (N2N_COMPRESSION_ID_SHIFT - 8));
+
+    return N2N_PACKET_HDR_SIZE;
+}
+
 int encode_PEER_INFO( uint8_t * base,
                       size_t * idx,
                       const n2n_common_t * common,